@@ -0,0 +1,10 @@
+#version 330 core
+in vec2 uv;
+out vec4 FragColor;
+
+uniform sampler2D image;
+
+void main()
+{
+    FragColor = vec4(texture(image, uv).rgb, 1.0);
+}
@@ -0,0 +1,13 @@
+#version 330 core
+uniform vec2 scale; // part of the texture the canvas covers
+
+out vec2 uv;
+
+void main()
+{
+    // one triangle covering the viewport, no vertex buffer needed
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+    // canvas rows run top to bottom
+    uv = vec2(p.x, 1.0 - p.y) * scale;
+}
@@ -3,5 +3,22 @@
 set -xe
 
 mkdir -p ./dist
-gcc --std=c17 -ggdb -Wall -Werror -mavx2 -o ./dist/drawing ./src/main.c -lglfw -lm
-# gcc -O3 -Wall -Werror -mavx2 -o ./dist/drawing ./src/main.c -lglfw -lm
+gcc --std=c17 -ggdb -Wall -Werror -mavx2 -pthread -o ./dist/drawing ./src/main.c -lglfw -lm
+# gcc -O3 -Wall -Werror -mavx2 -pthread -o ./dist/drawing ./src/main.c -lglfw -lm
+
+gcc --std=c17 -ggdb -Wall -Werror -mavx2 -pthread -o ./dist/tests ./tests.c -lm
+./dist/tests
+
+# replaying the same recording has to leave the same canvas every time
+rec=./dist/replay-check.rec
+{
+  printf 'DRWREC\x03\x00' # magic, version 3
+  printf '\x01\x00\x00\x00\x00\x00\x00\x00' # seed 1, default modes
+  printf '\x80\x07\x00\x00\x38\x04\x00\x00' # 1920x1080
+  for i in $(seq 120); do
+    printf '\x11\x11\x11\x11\x11\x11\x91\x3f\x00\x00' # 1/60 s, no input
+  done
+} >$rec
+first=$(./dist/drawing --replay $rec 2>&1 | grep 'canvas hash')
+second=$(./dist/drawing --replay $rec 2>&1 | grep 'canvas hash')
+[ -n "$first" ] && [ "$first" = "$second" ]
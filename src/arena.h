@@ -9,11 +9,6 @@
 #define ARENA_MALLOC(size) malloc((size))
 #endif
 
-#ifndef ARENA_REALLOC
-#include <stdlib.h>
-#define ARENA_REALLOC(ptr, size) realloc((ptr), (size))
-#endif
-
 #define WORD_SIZE sizeof(intptr_t)
 
 typedef struct {
@@ -29,7 +24,8 @@ void arena_free(arena *a);
 
 #endif
 
-#ifdef ARENA_IMPLEMENTATION
+#if defined(ARENA_IMPLEMENTATION) && !defined(INCLUDE_ARENA_IMPL)
+#define INCLUDE_ARENA_IMPL
 
 void *init_arena(arena *a, size_t s) {
   size_t aligned_size = (s + WORD_SIZE - 1) & ~(WORD_SIZE - 1);
@@ -42,20 +38,14 @@ void *init_arena(arena *a, size_t s) {
   return data;
 }
 
+// Returns NULL once the arena is full. It never grows: moving the block
+// would leave every pointer handed out so far dangling.
 void *arena_alloc(arena *a, size_t s) {
   size_t aligned_size = (s + WORD_SIZE - 1) & ~(WORD_SIZE - 1);
-  size_t new_size = aligned_size + a->size;
-
-  if (new_size >= a->capacity) {
-    size_t new_capacity = a->capacity * 2;
-    new_capacity = (new_capacity + WORD_SIZE - 1) & ~(WORD_SIZE - 1);
-    void *new_data = ARENA_REALLOC(a->data, new_capacity);
-    if (new_data == NULL) {
-      return NULL;
-    }
-    a->capacity = new_capacity;
-    a->data = new_data;
+  if (aligned_size < s || aligned_size > a->capacity - a->size) {
+    return NULL;
   }
+  size_t new_size = aligned_size + a->size;
 
   void *new_data = &((char *)a->data)[a->size];
   a->size = new_size;
@@ -0,0 +1,223 @@
+#ifndef INCLUDE_BLIT_H
+#define INCLUDE_BLIT_H
+
+#include <stddef.h>
+
+#include "draw.h"
+
+// Sprites. A sprite copies a rectangle of a source canvas, usually an atlas
+// holding many images side by side, into a rectangle of another canvas. When
+// the two sizes differ it is scaled nearest neighbor: every pixel takes the
+// source pixel under its center, computed exactly in integers.
+//
+// The destination rectangle is clipped to the canvas, which may be in any
+// format and layout. The source has to be a linear canvas of 32 bit pixels
+// not overlapping the destination, and the source rectangle has to lie
+// inside it; sprites whose source rectangle does not are skipped.
+//
+// Rows are drawn eight pixels at a time, with masked loads when the width is
+// not scaled and gathers when it is. Large copies of unscaled rows into a
+// linear RGBA canvas use streaming stores, which leave the cache to what is
+// drawn next. A batch checks the mode and formats once for all of its sprites.
+typedef enum {
+  BLIT_COPY, // source pixels replace the destination
+  BLIT_KEY,  // as BLIT_COPY, except source pixels equal to the key
+  BLIT_OVER, // premultiplied source blended over the destination
+} blit_mode;
+
+typedef struct {
+  Rectangle src; // in the source canvas
+  Rectangle dst;
+} sprite;
+
+void blit(canvas dst, canvas src, const sprite *s, blit_mode mode,
+          color key);
+void blit_sprites(canvas dst, canvas atlas, const sprite *sprites, size_t n,
+                  blit_mode mode, color key);
+
+#endif
+
+#if defined(BLIT_IMPLEMENTATION) && !defined(INCLUDE_BLIT_IMPL)
+#define INCLUDE_BLIT_IMPL
+
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+// Copies larger than this are streamed, about a quarter of a typical L2.
+#define BLIT_STREAM_PIXELS (1 << 16)
+
+typedef struct {
+  canvas dst;
+  canvas src;
+  blit_mode mode;
+  __m256i key;
+  bool direct; // dst is linear with 32 bit pixels
+} blitter;
+
+// Source columns of eight pixels as quotient and remainder of the pixel
+// centers mapped to the source, (2 * i + 1) * src.w / (2 * dst.w) for pixel
+// i of the sprite, stepped a group of eight at a time.
+typedef struct {
+  __m256i q, r;
+  __m256i dq, dr;
+  __m256i den;
+} blit_columns;
+
+static inline int floor_div(int64_t n, int64_t d) {
+  int64_t q = n / d;
+  return q - (n % d != 0 && n < 0);
+}
+
+// Source offset of pixel i of a run of dst_n pixels showing src_n.
+static inline int blit_map(int i, int src_n, int dst_n) {
+  return floor_div((2 * (int64_t)i + 1) * src_n, 2 * (int64_t)dst_n);
+}
+
+static blit_columns blit_columns_init(int i, int src_n, int dst_n) {
+  int64_t den = 2 * (int64_t)dst_n;
+  int q[8], r[8];
+  for (int l = 0; l < 8; ++l) {
+    int64_t n = (2 * (int64_t)(i + l) + 1) * src_n;
+    q[l] = floor_div(n, den);
+    r[l] = n - q[l] * den;
+  }
+  int64_t step = 16 * (int64_t)src_n;
+  return (blit_columns){
+      .q = _mm256_loadu_si256((const __m256i *)q),
+      .r = _mm256_loadu_si256((const __m256i *)r),
+      .dq = _mm256_set1_epi32(step / den),
+      .dr = _mm256_set1_epi32(step % den),
+      .den = _mm256_set1_epi32(den),
+  };
+}
+
+static inline void blit_columns_step(blit_columns *c) {
+  c->q = _mm256_add_epi32(c->q, c->dq);
+  c->r = _mm256_add_epi32(c->r, c->dr);
+  __m256i carry = _mm256_cmpgt_epi32(c->den, c->r);
+  carry = _mm256_xor_si256(carry, _mm256_set1_epi32(-1)); // r >= den
+  c->q = _mm256_sub_epi32(c->q, carry);
+  c->r = _mm256_sub_epi32(c->r, _mm256_and_si256(carry, c->den));
+}
+
+// memcpy is as fast as anything for rows that stay in cache; streamed rows
+// need 32 byte alignment.
+static void blit_copy_run(color *d, const color *s, size_t n,
+                          bool streaming) {
+  if (!streaming) {
+    memcpy(d, s, n * sizeof(color));
+    return;
+  }
+  for (; n > 0 && ((uintptr_t)d & 31); --n) {
+    *d++ = *s++;
+  }
+  for (; n >= 8; n -= 8, d += 8, s += 8) {
+    _mm256_stream_si256((__m256i *)d,
+                        _mm256_loadu_si256((const __m256i *)s));
+  }
+  for (; n > 0; --n) {
+    *d++ = *s++;
+  }
+}
+
+static void blit_sprite(const blitter *b, const sprite *s) {
+  canvas dst = b->dst, src = b->src;
+  Rectangle from = s->src, to = s->dst;
+  if (from.x < 0 || from.y < 0 || from.w <= 0 || from.h <= 0 ||
+      from.w > src.w - from.x || from.h > src.h - from.y) {
+    return;
+  }
+  int x0 = to.x < 0 ? 0 : to.x;
+  int y0 = to.y < 0 ? 0 : to.y;
+  int x1 = to.x + to.w > dst.w ? dst.w : to.x + to.w;
+  int y1 = to.y + to.h > dst.h ? dst.h : to.y + to.h;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  touch_tiles(dst, x0, y0, x1, y1);
+
+  bool scaled = from.w != to.w;
+  if (!scaled && b->mode == BLIT_COPY && b->direct) {
+    bool streaming = (size_t)(x1 - x0) * (y1 - y0) > BLIT_STREAM_PIXELS;
+    for (int y = y0; y < y1; ++y) {
+      int sy = from.y + blit_map(y - to.y, from.h, to.h);
+      const color *row = &src.pixels[(size_t)sy * src.stride + from.x];
+      blit_copy_run(&dst.pixels[(size_t)y * dst.stride + x0],
+                    &row[x0 - to.x], x1 - x0, streaming);
+    }
+    if (streaming) {
+      _mm_sfence();
+    }
+    return;
+  }
+
+  // groups start on a block boundary, which a tiled canvas needs
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i first = _mm256_set1_epi32(x0 - 1);
+  const __m256i end = _mm256_set1_epi32(x1);
+  int xa = x0 & ~(BLOCK_W - 1);
+  blit_columns start = {0};
+  if (scaled) {
+    start = blit_columns_init(xa - to.x, from.w, to.w);
+  }
+  for (int y = y0; y < y1; ++y) {
+    const color *row =
+        &src.pixels[(size_t)(from.y + blit_map(y - to.y, from.h, to.h)) *
+                    src.stride];
+    blit_columns c = start;
+    for (int x = xa; x < x1; x += 8) {
+      __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x), lanes);
+      __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(xs, first),
+                                      _mm256_cmpgt_epi32(end, xs));
+      __m256i p;
+      if (scaled) {
+        p = _mm256_mask_i32gather_epi32(
+            _mm256_setzero_si256(), (const int *)&row[from.x], c.q, mask, 4);
+        blit_columns_step(&c);
+      } else {
+        // lanes before x0 are masked off, and so never read
+        p = _mm256_maskload_epi32((const int *)&row[from.x + x - to.x],
+                                  mask);
+      }
+      if (b->mode == BLIT_KEY) {
+        mask = _mm256_andnot_si256(_mm256_cmpeq_epi32(p, b->key), mask);
+        if (_mm256_testz_si256(mask, mask)) {
+          continue;
+        }
+      } else if (b->mode == BLIT_OVER) {
+        if (_mm256_testz_si256(p, mask)) {
+          continue; // transparent
+        }
+        p = blend_over8(p, canvas_load8(dst, x, y, mask));
+      }
+      canvas_store8(dst, x, y, mask, p);
+    }
+  }
+}
+
+void blit(canvas dst, canvas src, const sprite *s, blit_mode mode,
+          color key) {
+  blit_sprites(dst, src, s, 1, mode, key);
+}
+
+void blit_sprites(canvas dst, canvas atlas, const sprite *sprites, size_t n,
+                  blit_mode mode, color key) {
+  TRACE_ZONE("blit_sprites");
+  blitter b = {
+      .dst = dst,
+      .src = atlas,
+      .mode = mode,
+      .key = _mm256_set1_epi32(key),
+      .direct = dst.layout == CANVAS_LINEAR &&
+                pixel_size(dst.format) == sizeof(color),
+  };
+  for (size_t i = 0; i < n; ++i) {
+    blit_sprite(&b, &sprites[i]);
+  }
+}
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef INCLUDE_BVH_H
+#define INCLUDE_BVH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "scene.h"
+
+// Bounding volume hierarchy over boxes of items, for picking and region
+// queries. Every node has four children whose bounds it stores as separate
+// arrays per coordinate, so a query tests all four with one comparison per
+// coordinate. Children are other nodes or single items; nodes come after
+// their parent in the array.
+//
+// Building sorts the items along a Morton curve through their centers and
+// cuts the order into runs of whole subtrees down to the leaves. Refitting
+// recomputes the bounds bottom up for boxes that moved, keeping the tree,
+// which loosens as items stray from where they were at the build; rebuild
+// once bvh_degraded says so. Boxes are closed, like aabb_overlaps.
+#define BVH_WIDTH 4
+#define BVH_LEAF 0x80000000u // child is the item child & ~BVH_LEAF
+#define BVH_EMPTY UINT32_MAX // child slot not used
+#define BVH_NONE UINT32_MAX  // no item hit
+#define BVH_REBUILD_RATIO 2.f
+
+typedef struct {
+  float x0[BVH_WIDTH];
+  float y0[BVH_WIDTH];
+  float x1[BVH_WIDTH];
+  float y1[BVH_WIDTH];
+  uint32_t child[BVH_WIDTH];
+} bvh_node;
+
+typedef struct {
+  bvh_node *nodes;
+  uint64_t *keys; // Morton code << 32 | item, build scratch
+  uint64_t *swap;
+  uint32_t num_nodes;
+  uint32_t num_items;
+  uint32_t max_items;
+  float built_cost; // summed half perimeters of the nodes after the build
+  float cost;       // and after the last refit
+} bvh;
+
+size_t bvh_size(uint32_t max_items);
+int bvh_init(bvh *b, arena *a, uint32_t max_items);
+int bvh_build(bvh *b, const aabb *boxes, uint32_t num_items);
+void bvh_refit(bvh *b, const aabb *boxes);
+bool bvh_degraded(const bvh *b);
+
+uint32_t bvh_query_point(const bvh *b, float x, float y, uint32_t *items,
+                         uint32_t max_items);
+uint32_t bvh_query_rect(const bvh *b, aabb rect, uint32_t *items,
+                        uint32_t max_items);
+uint32_t bvh_raycast(const bvh *b, float x, float y, float dx, float dy,
+                     float max_t, float *t);
+
+#endif
+
+#if defined(BVH_IMPLEMENTATION) && !defined(INCLUDE_BVH_IMPL)
+#define INCLUDE_BVH_IMPL
+
+#include <math.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+// Deep enough for 2^32 items: every level leaves at most three siblings on
+// the stack.
+#define BVH_STACK 64
+
+// A tree of n items has fewer than n nodes, since each has two children or
+// more, or just the root.
+static inline uint32_t bvh_max_nodes(uint32_t max_items) {
+  return max_items > 1 ? max_items : 1;
+}
+
+// Arena bytes bvh_init takes.
+size_t bvh_size(uint32_t max_items) {
+  return sizeof(bvh_node) * bvh_max_nodes(max_items) +
+         2 * sizeof(uint64_t) * (size_t)max_items + 3 * WORD_SIZE;
+}
+
+int bvh_init(bvh *b, arena *a, uint32_t max_items) {
+  *b = (bvh){
+      .nodes = arena_alloc(a, sizeof(bvh_node) * bvh_max_nodes(max_items)),
+      .keys = arena_alloc(a, sizeof(uint64_t) * max_items),
+      .swap = arena_alloc(a, sizeof(uint64_t) * max_items),
+      .max_items = max_items,
+  };
+  if (b->nodes == NULL || b->keys == NULL || b->swap == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+// Spreads the low 16 bits of v to the even bits.
+static inline uint32_t bvh_spread(uint32_t v) {
+  v &= 0xffff;
+  v = (v | v << 8) & 0x00ff00ff;
+  v = (v | v << 4) & 0x0f0f0f0f;
+  v = (v | v << 2) & 0x33333333;
+  v = (v | v << 1) & 0x55555555;
+  return v;
+}
+
+// Least significant digit radix sort on the codes in the high half.
+static void bvh_sort(bvh *b, uint32_t n) {
+  uint64_t *src = b->keys;
+  uint64_t *dst = b->swap;
+  for (int shift = 32; shift < 64; shift += 8) {
+    uint32_t offsets[256] = {0};
+    for (uint32_t i = 0; i < n; ++i) {
+      offsets[(src[i] >> shift) & 0xff]++;
+    }
+    uint32_t sum = 0;
+    for (int d = 0; d < 256; ++d) {
+      uint32_t count = offsets[d];
+      offsets[d] = sum;
+      sum += count;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+      dst[offsets[(src[i] >> shift) & 0xff]++] = src[i];
+    }
+    uint64_t *t = src;
+    src = dst;
+    dst = t;
+  }
+  // an even number of passes ends back in keys
+}
+
+static uint32_t bvh_build_node(bvh *b, uint32_t begin, uint32_t end) {
+  uint32_t index = b->num_nodes++;
+  bvh_node *node = &b->nodes[index];
+  uint32_t n = end - begin;
+  for (int k = 0; k < BVH_WIDTH; ++k) {
+    node->child[k] = BVH_EMPTY;
+  }
+  if (n <= BVH_WIDTH) {
+    for (uint32_t k = 0; k < n; ++k) {
+      node->child[k] = (uint32_t)b->keys[begin + k] | BVH_LEAF;
+    }
+    return index;
+  }
+  // full subtrees first, so nodes are only left part empty at the end
+  uint64_t full = BVH_WIDTH;
+  while (full * BVH_WIDTH < n) {
+    full *= BVH_WIDTH;
+  }
+  for (uint32_t k = 0; k < BVH_WIDTH && begin + k * full < end; ++k) {
+    uint32_t lo = begin + k * full;
+    uint32_t hi = end - lo > full ? lo + full : end;
+    uint32_t child = hi - lo == 1 ? (uint32_t)b->keys[lo] | BVH_LEAF
+                                  : bvh_build_node(b, lo, hi);
+    node->child[k] = child;
+  }
+  return index;
+}
+
+// Builds the tree over boxes[0, num_items), replacing the last one.
+int bvh_build(bvh *b, const aabb *boxes, uint32_t num_items) {
+  TRACE_ZONE("bvh_build");
+  if (num_items > b->max_items || num_items > BVH_LEAF) {
+    return -1;
+  }
+  b->num_items = num_items;
+  b->num_nodes = 0;
+  if (num_items == 0) {
+    b->built_cost = b->cost = 0;
+    return 0;
+  }
+
+  float cx0 = INFINITY, cy0 = INFINITY, cx1 = -INFINITY, cy1 = -INFINITY;
+  for (uint32_t i = 0; i < num_items; ++i) {
+    float cx = boxes[i].x0 + boxes[i].x1;
+    float cy = boxes[i].y0 + boxes[i].y1;
+    cx0 = cx < cx0 ? cx : cx0;
+    cy0 = cy < cy0 ? cy : cy0;
+    cx1 = cx > cx1 ? cx : cx1;
+    cy1 = cy > cy1 ? cy : cy1;
+  }
+  float sx = cx1 > cx0 ? 65535.f / (cx1 - cx0) : 0;
+  float sy = cy1 > cy0 ? 65535.f / (cy1 - cy0) : 0;
+  for (uint32_t i = 0; i < num_items; ++i) {
+    uint32_t qx = ((boxes[i].x0 + boxes[i].x1) - cx0) * sx;
+    uint32_t qy = ((boxes[i].y0 + boxes[i].y1) - cy0) * sy;
+    uint64_t code = bvh_spread(qx) | bvh_spread(qy) << 1;
+    b->keys[i] = code << 32 | i;
+  }
+  bvh_sort(b, num_items);
+
+  bvh_build_node(b, 0, num_items);
+  bvh_refit(b, boxes);
+  b->built_cost = b->cost;
+  return 0;
+}
+
+// Smallest and largest of four children's coordinates. Empty children hold
+// infinities, never NaN.
+static inline float bvh_min4(const float *v) {
+  __m128 m = _mm_loadu_ps(v);
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(_mm_min_ps(m, _mm_movehl_ps(m, m)));
+}
+
+static inline float bvh_max4(const float *v) {
+  __m128 m = _mm_loadu_ps(v);
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(_mm_max_ps(m, _mm_movehl_ps(m, m)));
+}
+
+// Recomputes every node's bounds from the boxes of the items it was built
+// over, children before parents.
+void bvh_refit(bvh *b, const aabb *boxes) {
+  TRACE_ZONE("bvh_refit");
+  float cost = 0;
+  for (uint32_t i = b->num_nodes; i-- > 0;) {
+    bvh_node *node = &b->nodes[i];
+    for (int k = 0; k < BVH_WIDTH; ++k) {
+      uint32_t c = node->child[k];
+      aabb box = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+      if (c == BVH_EMPTY) {
+        // stays empty, never overlaps anything
+      } else if (c & BVH_LEAF) {
+        box = boxes[c & ~BVH_LEAF];
+      } else {
+        const bvh_node *child = &b->nodes[c];
+        box = (aabb){bvh_min4(child->x0), bvh_min4(child->y0),
+                     bvh_max4(child->x1), bvh_max4(child->y1)};
+        cost += (box.x1 - box.x0) + (box.y1 - box.y0);
+      }
+      node->x0[k] = box.x0;
+      node->y0[k] = box.y0;
+      node->x1[k] = box.x1;
+      node->y1[k] = box.y1;
+    }
+  }
+  b->cost = cost;
+}
+
+// Whether queries have become slow enough, compared to right after the
+// build, to be worth a rebuild.
+bool bvh_degraded(const bvh *b) {
+  return b->cost > BVH_REBUILD_RATIO * b->built_cost;
+}
+
+// Reports the items of the children in mask, and pushes the nodes.
+static inline void bvh_visit(const bvh_node *node, int mask, uint32_t *stack,
+                             int *top, uint32_t *items, uint32_t max_items,
+                             uint32_t *count) {
+  while (mask != 0) {
+    uint32_t c = node->child[__builtin_ctz(mask)];
+    mask &= mask - 1;
+    if (c & BVH_LEAF) {
+      if (*count < max_items) {
+        items[*count] = c & ~BVH_LEAF;
+      }
+      ++*count;
+    } else {
+      stack[(*top)++] = c;
+    }
+  }
+}
+
+// Items whose box contains (x, y). Writes at most max_items of them and
+// returns how many there are, in no particular order.
+uint32_t bvh_query_point(const bvh *b, float x, float y, uint32_t *items,
+                         uint32_t max_items) {
+  uint32_t stack[BVH_STACK];
+  int top = 0;
+  uint32_t count = 0;
+  if (b->num_nodes > 0) {
+    stack[top++] = 0;
+  }
+  const __m128 px = _mm_set1_ps(x);
+  const __m128 py = _mm_set1_ps(y);
+  while (top > 0) {
+    const bvh_node *node = &b->nodes[stack[--top]];
+    __m128 in = _mm_and_ps(
+        _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(node->x0), px),
+                   _mm_cmple_ps(px, _mm_loadu_ps(node->x1))),
+        _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(node->y0), py),
+                   _mm_cmple_ps(py, _mm_loadu_ps(node->y1))));
+    bvh_visit(node, _mm_movemask_ps(in), stack, &top, items, max_items,
+              &count);
+  }
+  return count;
+}
+
+// Items whose box overlaps rect, like bvh_query_point.
+uint32_t bvh_query_rect(const bvh *b, aabb rect, uint32_t *items,
+                        uint32_t max_items) {
+  uint32_t stack[BVH_STACK];
+  int top = 0;
+  uint32_t count = 0;
+  if (b->num_nodes > 0) {
+    stack[top++] = 0;
+  }
+  const __m128 rx0 = _mm_set1_ps(rect.x0);
+  const __m128 ry0 = _mm_set1_ps(rect.y0);
+  const __m128 rx1 = _mm_set1_ps(rect.x1);
+  const __m128 ry1 = _mm_set1_ps(rect.y1);
+  while (top > 0) {
+    const bvh_node *node = &b->nodes[stack[--top]];
+    __m128 in = _mm_and_ps(
+        _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(node->x0), rx1),
+                   _mm_cmple_ps(rx0, _mm_loadu_ps(node->x1))),
+        _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(node->y0), ry1),
+                   _mm_cmple_ps(ry0, _mm_loadu_ps(node->y1))));
+    bvh_visit(node, _mm_movemask_ps(in), stack, &top, items, max_items,
+              &count);
+  }
+  return count;
+}
+
+// First item whose box the ray from (x, y) along (dx, dy) enters within
+// [0, max_t], in units of (dx, dy), or BVH_NONE. Boxes around the origin
+// are entered at 0. *t is set to where the box is entered on a hit.
+uint32_t bvh_raycast(const bvh *b, float x, float y, float dx, float dy,
+                     float max_t, float *t) {
+  // a tiny direction instead of zero keeps 0 * inf out of the slabs
+  float ix = 1.f / (fabsf(dx) > 1e-30f ? dx : copysignf(1e-30f, dx));
+  float iy = 1.f / (fabsf(dy) > 1e-30f ? dy : copysignf(1e-30f, dy));
+  const __m128 ox = _mm_set1_ps(x);
+  const __m128 oy = _mm_set1_ps(y);
+  const __m128 vix = _mm_set1_ps(ix);
+  const __m128 viy = _mm_set1_ps(iy);
+  const __m128 zero = _mm_setzero_ps();
+
+  uint32_t stack[BVH_STACK];
+  float entry[BVH_STACK];
+  int top = 0;
+  if (b->num_nodes > 0) {
+    stack[top] = 0;
+    entry[top++] = 0;
+  }
+  uint32_t hit = BVH_NONE;
+  float best = max_t;
+  while (top > 0) {
+    --top;
+    if (entry[top] > best) {
+      continue; // something nearer was found since it was pushed
+    }
+    const bvh_node *node = &b->nodes[stack[top]];
+    __m128 x0 = _mm_loadu_ps(node->x0);
+    __m128 y0 = _mm_loadu_ps(node->y0);
+    __m128 x1 = _mm_loadu_ps(node->x1);
+    __m128 y1 = _mm_loadu_ps(node->y1);
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(x0, ox), vix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(x1, ox), vix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(y0, oy), viy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(y1, oy), viy);
+    __m128 near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), zero),
+                             _mm_min_ps(ty0, ty1));
+    __m128 far = _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1));
+    __m128 in = _mm_and_ps(
+        _mm_and_ps(_mm_cmple_ps(near, far),
+                   _mm_cmple_ps(near, _mm_set1_ps(best))),
+        _mm_and_ps(_mm_cmple_ps(x0, x1), _mm_cmple_ps(y0, y1)));
+    int mask = _mm_movemask_ps(in);
+    float t_near[BVH_WIDTH];
+    _mm_storeu_ps(t_near, near);
+
+    // nodes are pushed farthest first, so the nearest is searched first
+    uint32_t next[BVH_WIDTH];
+    float next_t[BVH_WIDTH];
+    int num_next = 0;
+    while (mask != 0) {
+      int k = __builtin_ctz(mask);
+      mask &= mask - 1;
+      uint32_t c = node->child[k];
+      if (c & BVH_LEAF) {
+        if (t_near[k] < best || hit == BVH_NONE) {
+          best = t_near[k];
+          hit = c & ~BVH_LEAF;
+        }
+        continue;
+      }
+      int j = num_next++;
+      for (; j > 0 && next_t[j - 1] < t_near[k]; --j) {
+        next[j] = next[j - 1];
+        next_t[j] = next_t[j - 1];
+      }
+      next[j] = c;
+      next_t[j] = t_near[k];
+    }
+    for (int j = 0; j < num_next; ++j) {
+      stack[top] = next[j];
+      entry[top++] = next_t[j];
+    }
+  }
+  if (hit != BVH_NONE) {
+    *t = best;
+  }
+  return hit;
+}
+
+#endif
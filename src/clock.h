@@ -0,0 +1,18 @@
+#ifndef INCLUDE_CLOCK_H
+#define INCLUDE_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000ull
+#define NS_PER_MS 1000000.0
+
+// Monotonic timestamp in nanoseconds. Needs _POSIX_C_SOURCE for
+// clock_gettime under --std=c17.
+static inline uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+#endif
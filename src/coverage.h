@@ -0,0 +1,212 @@
+#ifndef INCLUDE_COVERAGE_H
+#define INCLUDE_COVERAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "draw.h"
+#include "path.h"
+
+// Front-to-back rendering of opaque geometry. Every pixel gets one coverage
+// bit, packed into 64-pixel words per row. Opaque shapes only write the
+// pixels no nearer shape has claimed yet, whole covered words are skipped
+// without touching the canvas, and the clear only fills what is left.
+//
+// Anti-aliased lines can't be resolved front to back, so they are recorded
+// as blends against the pixels still uncovered when they are reached and
+// applied in painter's order once everything behind them is in place. A
+// frame with more line pixels than max_blends sets overflowed and can't be
+// completed this way, it has to be drawn again in painter's order.
+
+typedef struct {
+  uint32_t offset; // pixel index into the canvas
+  color color;
+  float alpha;
+} deferred_blend;
+
+typedef struct {
+  uint64_t *bits;
+  int w;
+  int h;
+  int words; // per row
+  deferred_blend *blends;
+  size_t num_blends;
+  size_t max_blends;
+  bool overflowed; // line pixels were dropped since coverage_begin
+} coverage;
+
+int coverage_init(coverage *cov, arena *a, int w, int h, size_t max_blends);
+void coverage_begin(coverage *cov);
+
+void coverage_rect(coverage *cov, canvas canvas, const Rectangle *rect);
+void coverage_triangle(coverage *cov, canvas canvas, Vector2 p0, Vector2 p1,
+                       Vector2 p2);
+int coverage_path(coverage *cov, canvas canvas, path_raster *r,
+                  const path *p, const float m[6]);
+void coverage_line(coverage *cov, canvas canvas, Vector2 p0, Vector2 p1);
+
+void coverage_clear(coverage *cov, canvas canvas, color color);
+void coverage_flush(coverage *cov, canvas canvas);
+
+#endif
+
+#if defined(COVERAGE_IMPLEMENTATION) && !defined(INCLUDE_COVERAGE_IMPL)
+#define INCLUDE_COVERAGE_IMPL
+
+#include <string.h>
+
+#include "trace.h"
+
+_Static_assert(TILE_W == 64, "coverage words must line up with tile columns");
+
+int coverage_init(coverage *cov, arena *a, int w, int h, size_t max_blends) {
+  int words = (w + 63) / 64;
+  *cov = (coverage){
+      .bits = arena_alloc(a, sizeof(uint64_t) * words * h),
+      .w = w,
+      .h = h,
+      .words = words,
+      .blends = arena_alloc(a, sizeof(deferred_blend) * max_blends),
+      .max_blends = max_blends,
+  };
+  if (cov->bits == NULL || cov->blends == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+void coverage_begin(coverage *cov) {
+  memset(cov->bits, 0, sizeof(uint64_t) * cov->words * cov->h);
+  cov->num_blends = 0;
+  cov->overflowed = false;
+}
+
+// Fills the runs of set bits in todo, bit 0 being pixel i of the canvas.
+static inline void coverage_fill_runs(canvas canvas, size_t i, uint64_t todo,
+                                      color c) {
+  while (todo) {
+    int start = __builtin_ctzll(todo);
+    uint64_t run = todo >> start;
+    int len = run == ~0ull ? 64 : __builtin_ctzll(~run);
+    canvas_fill(canvas, i + start, len, c);
+    // clear the lowest run of ones
+    todo &= todo + (todo & -todo);
+  }
+}
+
+static void coverage_span(void *ctx, canvas canvas, int y, int x0, int x1) {
+  coverage *cov = ctx;
+  // coverage_clear fills whatever this leaves uncovered in the tile
+  if (canvas.tiles != NULL) {
+    claim_tiles(canvas, x0, y, x1, y + 1, false);
+  }
+  uint64_t *bits = &cov->bits[(size_t)y * cov->words];
+  size_t row = (size_t)y * canvas.stride;
+
+  for (int x = x0; x < x1;) {
+    int bit = x & 63;
+    int n = x1 - x < 64 - bit ? x1 - x : 64 - bit;
+    uint64_t want = (n == 64 ? ~0ull : (1ull << n) - 1) << bit;
+    uint64_t *word = &bits[x >> 6];
+    uint64_t todo = want & ~*word;
+    *word |= want;
+    if (todo != 0) {
+      coverage_fill_runs(canvas, row + (x & ~63), todo, canvas.color);
+    }
+    x += n;
+  }
+}
+
+void coverage_rect(coverage *cov, canvas canvas, const Rectangle *rect) {
+  int x0 = rect->x < 0 ? 0 : rect->x;
+  int y0 = rect->y < 0 ? 0 : rect->y;
+  int x1 = rect->x + rect->w > canvas.w ? canvas.w : rect->x + rect->w;
+  int y1 = rect->y + rect->h > canvas.h ? canvas.h : rect->y + rect->h;
+
+  for (int y = y0; y < y1 && x0 < x1; ++y) {
+    coverage_span(cov, canvas, y, x0, x1);
+  }
+}
+
+void coverage_triangle(coverage *cov, canvas canvas, Vector2 p0, Vector2 p1,
+                       Vector2 p2) {
+  triangle_spans(canvas, p0, p1, p2, coverage_span, cov);
+}
+
+int coverage_path(coverage *cov, canvas canvas, path_raster *r,
+                  const path *p, const float m[6]) {
+  return path_spans(r, canvas, p, m, coverage_span, cov);
+}
+
+static void coverage_plot(void *ctx, canvas canvas, int x, int y,
+                          float alpha) {
+  coverage *cov = ctx;
+  if ((cov->bits[(size_t)y * cov->words + (x >> 6)] >> (x & 63)) & 1) {
+    return; // hidden behind something nearer
+  }
+  if (cov->num_blends == cov->max_blends) {
+    cov->overflowed = true;
+    return;
+  }
+  cov->blends[cov->num_blends++] = (deferred_blend){
+      .offset = y * canvas.stride + x,
+      .color = canvas.color,
+      .alpha = alpha,
+  };
+}
+
+void coverage_line(coverage *cov, canvas canvas, Vector2 p0, Vector2 p1) {
+  size_t start = cov->num_blends;
+  line_pixels(canvas, p0, p1, coverage_plot, cov);
+
+  // flush walks the list backwards, reverse each line so its own pixels
+  // still land in the order draw_line would write them
+  for (size_t i = start, j = cov->num_blends; i + 1 < j; ++i, --j) {
+    deferred_blend tmp = cov->blends[i];
+    cov->blends[i] = cov->blends[j - 1];
+    cov->blends[j - 1] = tmp;
+  }
+}
+
+// Fills every pixel nothing opaque was drawn to. On a fast cleared canvas
+// tiles nothing was drawn to are still pending their clear and are skipped.
+void coverage_clear(coverage *cov, canvas canvas, color color) {
+  TRACE_ZONE("coverage_clear");
+  canvas_tiles *t = canvas.tiles;
+  int words = (canvas.w + 63) / 64;
+  for (int y = 0; y < canvas.h; ++y) {
+    uint64_t *bits = &cov->bits[(size_t)y * cov->words];
+    // a word spans exactly one tile column
+    uint8_t *state = t ? &t->state[(y >> TILE_SHIFT_Y) * t->cols] : NULL;
+    for (int w = 0; w < words; ++w) {
+      if (state != NULL && state[w] != TILE_DRAWN) {
+        continue;
+      }
+      uint64_t todo = ~bits[w];
+      int left = canvas.w - w * 64;
+      if (left < 64) {
+        todo &= (1ull << left) - 1;
+      }
+      coverage_fill_runs(canvas, (size_t)y * canvas.stride + w * 64, todo,
+                         color);
+    }
+  }
+}
+
+// Applies the recorded line blends, back to front.
+void coverage_flush(coverage *cov, canvas canvas) {
+  for (size_t i = cov->num_blends; i > 0; --i) {
+    deferred_blend *b = &cov->blends[i - 1];
+    if (canvas.tiles != NULL) {
+      int x = b->offset % canvas.stride, y = b->offset / canvas.stride;
+      claim_tiles(canvas, x, y, x + 1, y + 1, true);
+    }
+    color bg = canvas_load(canvas, b->offset);
+    canvas_store(canvas, b->offset, alpha_composite(b->color, bg, b->alpha));
+  }
+  cov->num_blends = 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef INCLUDE_DEPTH_H
+#define INCLUDE_DEPTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "arena.h"
+#include "draw.h"
+
+// Depth buffer with hierarchical Z, attached to a canvas through its depth
+// field. Depths are floats, smaller is nearer, and a pixel is drawn when it
+// is nearer than the depth held for it, which it then replaces.
+//
+// Depths are kept in 8x8 blocks laid out like a tiled canvas, whatever the
+// canvas layout, and every block also keeps the nearest and farthest depth
+// in it. Eight pixels behind the farthest are rejected without reading the
+// block and eight in front of the nearest pass without a per pixel test.
+// Writes only ever bring depths nearer, so the farthest stays a bound while
+// the block changes; the nearest is only trusted once depth_refresh has
+// recomputed both.
+//
+// Clears are lazy like the fast clear: a cleared block only records that
+// it is, and is filled when something is first drawn into it.
+enum {
+  DEPTH_CLEAR, // every depth is the clear value, memory is stale
+  DEPTH_STALE, // drawn into since the bounds were computed
+  DEPTH_EXACT, // near and far are the bounds of the block
+};
+
+typedef struct depth_buffer {
+  float *z;
+  float *near; // per block
+  float *far;
+  uint8_t *state;
+  int cols; // blocks
+  int rows;
+  float clear;
+} depth_buffer;
+
+int depth_init(depth_buffer *d, arena *a, int w, int h);
+void depth_clear(depth_buffer *d, float z);
+void depth_refresh(depth_buffer *d, int by, int bx0, int bx1);
+float depth_at(const depth_buffer *d, int x, int y);
+
+static inline void depth_fill_block(depth_buffer *d, int b) {
+  __m256 z = _mm256_set1_ps(d->clear);
+  float *block = &d->z[(size_t)b << 2 * BLOCK_SHIFT];
+  for (int i = 0; i < BLOCK_W * BLOCK_W; i += 8) {
+    _mm256_storeu_ps(&block[i], z);
+  }
+}
+
+// Tests the depths z of the block row at x, y, x a multiple of BLOCK_W, for
+// the lanes in mask, and writes the ones that pass. Returns those lanes.
+static inline __m256i depth_test8(depth_buffer *d, int x, int y, __m256 z,
+                                  __m256i mask) {
+  int b = (y >> BLOCK_SHIFT) * d->cols + (x >> BLOCK_SHIFT);
+  int state = d->state[b];
+  float far = state == DEPTH_CLEAR ? d->clear : d->far[b];
+  __m256i pass = _mm256_and_si256(
+      mask, _mm256_castps_si256(
+                _mm256_cmp_ps(z, _mm256_set1_ps(far), _CMP_LT_OQ)));
+  if (_mm256_testz_si256(pass, pass)) {
+    return pass; // behind all of the block
+  }
+
+  float *row = &d->z[(size_t)b << 2 * BLOCK_SHIFT |
+                     (y & (BLOCK_W - 1)) << BLOCK_SHIFT];
+  if (state == DEPTH_CLEAR) {
+    depth_fill_block(d, b);
+    d->far[b] = far;
+  } else {
+    __m256i near = _mm256_castps_si256(
+        _mm256_cmp_ps(z, _mm256_set1_ps(d->near[b]), _CMP_LT_OQ));
+    if (state == DEPTH_STALE || !_mm256_testc_si256(near, pass)) {
+      __m256 held = _mm256_loadu_ps(row);
+      pass = _mm256_and_si256(
+          pass, _mm256_castps_si256(_mm256_cmp_ps(z, held, _CMP_LT_OQ)));
+      if (_mm256_testz_si256(pass, pass)) {
+        return pass;
+      }
+    }
+  }
+  d->state[b] = DEPTH_STALE;
+  _mm256_maskstore_ps(row, pass, z);
+  return pass;
+}
+
+#endif
+
+#if defined(DEPTH_IMPLEMENTATION) && !defined(INCLUDE_DEPTH_IMPL)
+#define INCLUDE_DEPTH_IMPL
+
+// Sized for a canvas of up to w x h pixels and cleared to 1.
+int depth_init(depth_buffer *d, arena *a, int w, int h) {
+  *d = (depth_buffer){
+      .cols = block_align(w) >> BLOCK_SHIFT,
+      .rows = block_align(h) >> BLOCK_SHIFT,
+  };
+  size_t blocks = (size_t)d->cols * d->rows;
+  d->z = arena_alloc(a, sizeof(float) * blocks * BLOCK_W * BLOCK_W);
+  d->near = arena_alloc(a, sizeof(float) * blocks);
+  d->far = arena_alloc(a, sizeof(float) * blocks);
+  d->state = arena_alloc(a, blocks);
+  if (d->z == NULL || d->near == NULL || d->far == NULL ||
+      d->state == NULL) {
+    return -1;
+  }
+  depth_clear(d, 1.f);
+  return 0;
+}
+
+void depth_clear(depth_buffer *d, float z) {
+  d->clear = z;
+  memset(d->state, DEPTH_CLEAR, (size_t)d->cols * d->rows);
+}
+
+// Recomputes the bounds of the blocks drawn into in [bx0, bx1) of band by.
+void depth_refresh(depth_buffer *d, int by, int bx0, int bx1) {
+  for (int b = by * d->cols + bx0; b < by * d->cols + bx1; ++b) {
+    if (d->state[b] != DEPTH_STALE) {
+      continue;
+    }
+    const float *block = &d->z[(size_t)b << 2 * BLOCK_SHIFT];
+    __m256 lo = _mm256_loadu_ps(block), hi = lo;
+    for (int i = 8; i < BLOCK_W * BLOCK_W; i += 8) {
+      __m256 z = _mm256_loadu_ps(&block[i]);
+      lo = _mm256_min_ps(lo, z);
+      hi = _mm256_max_ps(hi, z);
+    }
+    float l[8], h[8];
+    _mm256_storeu_ps(l, lo);
+    _mm256_storeu_ps(h, hi);
+    for (int i = 1; i < 8; ++i) {
+      l[0] = l[i] < l[0] ? l[i] : l[0];
+      h[0] = h[i] > h[0] ? h[i] : h[0];
+    }
+    d->near[b] = l[0];
+    d->far[b] = h[0];
+    d->state[b] = DEPTH_EXACT;
+  }
+}
+
+float depth_at(const depth_buffer *d, int x, int y) {
+  int b = (y >> BLOCK_SHIFT) * d->cols + (x >> BLOCK_SHIFT);
+  if (d->state[b] == DEPTH_CLEAR) {
+    return d->clear;
+  }
+  return d->z[(size_t)b << 2 * BLOCK_SHIFT |
+              (y & (BLOCK_W - 1)) << BLOCK_SHIFT | (x & (BLOCK_W - 1))];
+}
+
+#endif
@@ -3,11 +3,17 @@
 
 #include <limits.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <immintrin.h>
 
+#include "arena.h"
 #include "third_party/stb/stb_image_write.h"
+#include "trace.h"
+#include "workers.h"
 
 #define COMP_Y 1
 #define COMP_YA 2
@@ -23,12 +29,72 @@
 
 typedef unsigned int color;
 
+// Lazy fast clear. Instead of writing every pixel, a clear marks each tile
+// as cleared to a color; a tile is only filled when something first draws
+// into it, or when the canvas is resolved for upload or save. Tiles whose
+// memory already holds the clear color are not written at all.
+//
+// The canvas may shrink to its top left corner between frames, keeping the
+// stride, for dynamic resolution. Pixels outside it are left undefined.
+#define TILE_SHIFT_X 6
+#define TILE_SHIFT_Y 4
+#define TILE_W (1 << TILE_SHIFT_X)
+#define TILE_H (1 << TILE_SHIFT_Y)
+
+enum {
+  TILE_DRAWN,    // memory holds what was drawn
+  TILE_CLEAR,    // cleared, memory is stale
+  TILE_RESOLVED, // cleared, memory already holds the color
+};
+
+typedef struct {
+  uint8_t *state;
+  int cols;
+  int rows;
+  color color;
+  int w; // canvas size at the last clear
+  int h;
+} canvas_tiles;
+
+// How a canvas stores its pixels. Drawing still takes a color, which is
+// packed on the way in and unpacked again wherever a blend has to read.
+typedef enum {
+  PIXEL_RGBA8888,
+  PIXEL_RGBA8888_PREMUL, // alpha premultiplied, what layers hold
+  PIXEL_RGB565,
+  PIXEL_GRAY8, // BT.601 luma, opaque
+  NUM_PIXEL_FORMATS,
+} pixel_format;
+
+// Tiled layout. A CANVAS_TILED canvas stores its pixels in 8x8 blocks, one
+// band of blocks after the other from the top and each block row by row, so
+// a vertical run stays within a few cache lines instead of touching one per
+// row. The stride must be a multiple of BLOCK_W and the memory hold
+// block_align(h) rows. Only the primitives here and detile_canvas, which
+// turns it back into rows for upload or save, know about it; everything
+// else wants CANVAS_LINEAR.
+#define BLOCK_SHIFT 3
+#define BLOCK_W (1 << BLOCK_SHIFT)
+
+typedef enum {
+  CANVAS_LINEAR,
+  CANVAS_TILED,
+} canvas_layout;
+
 typedef struct {
-  color *pixels;
+  union {
+    color *pixels;      // PIXEL_RGBA8888, PIXEL_RGBA8888_PREMUL
+    uint16_t *pixels16; // PIXEL_RGB565
+    uint8_t *pixels8;   // PIXEL_GRAY8
+  };
   int w;
   int h;
-  int stride;
+  int stride; // in pixels
   color color;
+  canvas_tiles *tiles; // NULL unless fast clear is enabled
+  pixel_format format;
+  canvas_layout layout;
+  struct depth_buffer *depth; // NULL unless depth tested, see depth.h
 } canvas;
 
 typedef struct {
@@ -48,47 +114,651 @@ typedef struct {
   int h;
 } Rectangle;
 
+// Rasterizer callbacks, called with coordinates already clipped to the
+// canvas. Spans cover [x0, x1) of row y.
+typedef void (*span_func)(void *ctx, canvas canvas, int y, int x0, int x1);
+typedef void (*plot_func)(void *ctx, canvas canvas, int x, int y, float alpha);
+
+static inline void fill_span(color *dst, size_t n, color c) {
+  // Broadcast the integer value across all lanes of the 256-bit register
+  __m256i group = _mm256_set1_epi32(c);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)&dst[i], group);
+  }
+  for (; i < n; ++i) {
+    dst[i] = c;
+  }
+}
+
+static inline void fill_span16(uint16_t *dst, size_t n, uint16_t v) {
+  __m256i group = _mm256_set1_epi16(v);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256((__m256i *)&dst[i], group);
+  }
+  for (; i < n; ++i) {
+    dst[i] = v;
+  }
+}
+
+static inline int pixel_size(pixel_format format) {
+  switch (format) {
+  case PIXEL_RGB565:
+    return 2;
+  case PIXEL_GRAY8:
+    return 1;
+  default:
+    return 4;
+  }
+}
+
+static inline uint32_t pack_pixel(pixel_format format, color c) {
+  uint32_t r = c & 0xff, g = (c >> 8) & 0xff, b = (c >> 16) & 0xff;
+  switch (format) {
+  case PIXEL_RGB565:
+    return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+  case PIXEL_GRAY8:
+    return (77 * r + 150 * g + 29 * b + 128) >> 8;
+  default:
+    return c;
+  }
+}
+
+static inline color unpack_pixel(pixel_format format, uint32_t p) {
+  switch (format) {
+  case PIXEL_RGB565: {
+    // replicate the top bits so 0x1f and 0x3f widen to 0xff
+    uint32_t r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+    r = r << 3 | r >> 2;
+    g = g << 2 | g >> 4;
+    b = b << 3 | b >> 2;
+    return 0xff000000 | b << 16 | g << 8 | r;
+  }
+  case PIXEL_GRAY8:
+    return 0xff000000 | (p & 0xff) * 0x010101;
+  default:
+    return p;
+  }
+}
+
+static inline int block_align(int n) {
+  return (n + BLOCK_W - 1) & ~(BLOCK_W - 1);
+}
+
+// Where pixel (x, y) lives in the canvas memory, y * stride + x unless the
+// canvas is tiled.
+static inline size_t canvas_index(canvas canvas, int x, int y) {
+  if (canvas.layout == CANVAS_LINEAR) {
+    return (size_t)y * canvas.stride + x;
+  }
+  size_t band = (size_t)(y >> BLOCK_SHIFT) * canvas.stride;
+  return (band + (x & ~(BLOCK_W - 1)) + (y & (BLOCK_W - 1))) << BLOCK_SHIFT |
+         (x & (BLOCK_W - 1));
+}
+
+// Pixel i of the canvas memory, see canvas_index.
+static inline color canvas_load(canvas canvas, size_t i) {
+  switch (canvas.format) {
+  case PIXEL_RGB565:
+    return unpack_pixel(PIXEL_RGB565, canvas.pixels16[i]);
+  case PIXEL_GRAY8:
+    return unpack_pixel(PIXEL_GRAY8, canvas.pixels8[i]);
+  default:
+    return canvas.pixels[i];
+  }
+}
+
+static inline void canvas_store(canvas canvas, size_t i, color c) {
+  switch (canvas.format) {
+  case PIXEL_RGB565:
+    canvas.pixels16[i] = pack_pixel(PIXEL_RGB565, c);
+    break;
+  case PIXEL_GRAY8:
+    canvas.pixels8[i] = pack_pixel(PIXEL_GRAY8, c);
+    break;
+  default:
+    canvas.pixels[i] = c;
+    break;
+  }
+}
+
+// Fills n pixels starting at pixel i, packing c once.
+static inline void canvas_fill(canvas canvas, size_t i, size_t n, color c) {
+  switch (canvas.format) {
+  case PIXEL_RGB565:
+    fill_span16(&canvas.pixels16[i], n, pack_pixel(PIXEL_RGB565, c));
+    break;
+  case PIXEL_GRAY8:
+    memset(&canvas.pixels8[i], pack_pixel(PIXEL_GRAY8, c), n);
+    break;
+  default:
+    fill_span(&canvas.pixels[i], n, c);
+    break;
+  }
+}
+
+// Fills n pixels of row y starting at x, a block at a time when tiled.
+static inline void canvas_fill_row(canvas canvas, int x, int y, int n,
+                                   color c) {
+  if (canvas.layout == CANVAS_LINEAR) {
+    canvas_fill(canvas, (size_t)y * canvas.stride + x, n, c);
+    return;
+  }
+  for (int end = x + n; x < end;) {
+    int next = (x | (BLOCK_W - 1)) + 1;
+    next = next > end ? end : next;
+    canvas_fill(canvas, canvas_index(canvas, x, y), next - x, c);
+    x = next;
+  }
+}
+
+// Eight pixels from x on in row y, only the lanes in mask. A tiled canvas
+// keeps them together only within a block, so x must be a multiple of
+// BLOCK_W there.
+static inline __m256i canvas_load8(canvas canvas, int x, int y,
+                                   __m256i mask) {
+  if (pixel_size(canvas.format) == 4) {
+    return _mm256_maskload_epi32(
+        (const int *)&canvas.pixels[canvas_index(canvas, x, y)], mask);
+  }
+  uint32_t c[8], m[8];
+  _mm256_storeu_si256((__m256i *)m, mask);
+  for (int l = 0; l < 8; ++l) {
+    c[l] = m[l] ? canvas_load(canvas, canvas_index(canvas, x + l, y)) : 0;
+  }
+  return _mm256_loadu_si256((__m256i *)c);
+}
+
+// Writes the lanes in mask of the eight pixels canvas_load8 reads.
+static inline void canvas_store8(canvas canvas, int x, int y, __m256i mask,
+                                 __m256i colors) {
+  if (pixel_size(canvas.format) == 4) {
+    _mm256_maskstore_epi32((int *)&canvas.pixels[canvas_index(canvas, x, y)],
+                           mask, colors);
+    return;
+  }
+  uint32_t c[8], m[8];
+  _mm256_storeu_si256((__m256i *)c, colors);
+  _mm256_storeu_si256((__m256i *)m, mask);
+  for (int l = 0; l < 8; ++l) {
+    if (m[l]) {
+      canvas_store(canvas, canvas_index(canvas, x + l, y), c[l]);
+    }
+  }
+}
+
+#define LERP_WEIGHT_BITS 7 // so a lerp of one channel fits 16 bits
+
+// a + (b - a) * w per channel of eight colors, w from 0 to
+// 1 << LERP_WEIGHT_BITS.
+static inline __m256i lerp_colors8(__m256i a, __m256i b, __m256i w) {
+  __m256i m = _mm256_set1_epi32(0x00ff00ff);
+  w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+  __m256i out = _mm256_setzero_si256();
+  for (int shift = 0; shift < 16; shift += 8) {
+    __m256i ca = _mm256_and_si256(_mm256_srli_epi32(a, shift), m);
+    __m256i cb = _mm256_and_si256(_mm256_srli_epi32(b, shift), m);
+    __m256i d = _mm256_mullo_epi16(_mm256_sub_epi16(cb, ca), w);
+    __m256i c = _mm256_add_epi16(ca, _mm256_srai_epi16(d, LERP_WEIGHT_BITS));
+    out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_and_si256(c, m),
+                                                 shift));
+  }
+  return out;
+}
+
+// s over d, both premultiplied: s + d * (255 - s.a) / 255 per channel.
+static inline color blend_over(color s, color d) {
+  uint32_t inv = 255 - (s >> 24);
+  color out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t x = ((d >> shift) & 0xff) * inv + 128;
+    uint32_t v = ((s >> shift) & 0xff) + ((x + (x >> 8)) >> 8);
+    out |= (v > 255 ? 255 : v) << shift;
+  }
+  return out;
+}
+
+// blend_over of eight colors.
+static inline __m256i blend_over8(__m256i s, __m256i d) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi16(128);
+  const __m256i alpha_bytes = _mm256_setr_epi8(
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15, //
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+  __m256i inv = _mm256_xor_si256(_mm256_shuffle_epi8(s, alpha_bytes),
+                                 _mm256_set1_epi8(-1)); // 255 - a
+  __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+                                  _mm256_unpacklo_epi8(inv, zero));
+  __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+                                  _mm256_unpackhi_epi8(inv, zero));
+  // x / 255 rounded, exact for every product of two bytes
+  lo = _mm256_add_epi16(lo, round);
+  hi = _mm256_add_epi16(hi, round);
+  lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+  hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+  return _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+}
+
+int parse_pixel_format(const char *name, pixel_format *format);
+
+int canvas_tiles_init(canvas_tiles *tiles, arena *a, int w, int h);
+void claim_tiles(canvas canvas, int x0, int y0, int x1, int y1, bool fill);
+void fast_clear_canvas(canvas canvas, color color);
+void resolve_canvas(canvas canvas);
+void parallel_resolve_canvas(worker_pool *pool, canvas canvas);
+
+// Call before writing pixels in [x0, x1) x [y0, y1).
+static inline void touch_tiles(canvas canvas, int x0, int y0, int x1,
+                               int y1) {
+  if (canvas.tiles != NULL) {
+    claim_tiles(canvas, x0, y0, x1, y1, true);
+  }
+}
+
 int lerp(int v0, int v1, float t);
 
 int save_canvas(const char *filename, canvas canvas);
 void draw_triangle(canvas canvas, Vector2 p1, Vector2 p2, Vector2 p3);
 void draw_line(canvas canvas, Vector2 p1, Vector2 p2);
 void clear_canvas(canvas canvas, color color);
+void parallel_clear_canvas(worker_pool *pool, canvas canvas, color color);
 void draw_rectangle(canvas canvas, const Rectangle *rect);
+void detile_canvas(canvas dst, canvas src);
+void parallel_detile_canvas(worker_pool *pool, canvas dst, canvas src);
+void flip_image(unsigned int *image, int width, int height);
+void parallel_flip_image(worker_pool *pool, unsigned int *image, int width,
+                         int height);
+
+void triangle_spans(canvas canvas, Vector2 p0, Vector2 p1, Vector2 p2,
+                    span_func span, void *ctx);
+void fill_canvas_span(void *ctx, canvas canvas, int y, int x0, int x1);
+void line_pixels(canvas canvas, Vector2 p0, Vector2 p1, plot_func plot,
+                 void *ctx);
 #endif
 
-#ifdef DRAW_IMPLEMENTATION
+#if defined(DRAW_IMPLEMENTATION) && !defined(INCLUDE_DRAW_IMPL)
+#define INCLUDE_DRAW_IMPL
 
-void draw_rectangle(canvas canvas, const Rectangle *rect) {
-  size_t rem = rect->w % 8;
-
-  __m256i color_group = _mm256_set1_epi32(canvas.color);
-  for (size_t j = rect->y; j < rect->y + rect->h; ++j) {
-    size_t offset = j * canvas.stride + rect->x;
-    size_t scan_width = rect->w - rem;
-    for (size_t i = 0; i < scan_width; i += 8) {
-      _mm256_storeu_si256((__m256i *)&canvas.pixels[offset + i], color_group);
+#include <stdlib.h>
+
+static const char *pixel_format_names[NUM_PIXEL_FORMATS] = {
+    "rgba",
+    "rgba-premul",
+    "rgb565",
+    "gray",
+};
+
+int parse_pixel_format(const char *name, pixel_format *format) {
+  for (int f = 0; f < NUM_PIXEL_FORMATS; ++f) {
+    if (strcmp(name, pixel_format_names[f]) == 0) {
+      *format = f;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int canvas_tiles_init(canvas_tiles *tiles, arena *a, int w, int h) {
+  *tiles = (canvas_tiles){
+      .cols = (w + TILE_W - 1) >> TILE_SHIFT_X,
+      .rows = (h + TILE_H - 1) >> TILE_SHIFT_Y,
+  };
+  tiles->state = arena_alloc(a, tiles->cols * tiles->rows);
+  if (tiles->state == NULL) {
+    return -1;
+  }
+  memset(tiles->state, TILE_DRAWN, tiles->cols * tiles->rows);
+  return 0;
+}
+
+static void fill_run(canvas canvas, size_t i, size_t n, bool streaming) {
+  color c = canvas.tiles->color;
+  if (!streaming) {
+    canvas_fill(canvas, i, n, c);
+    return;
+  }
+  // streaming stores skip the read for ownership and leave the cache to
+  // the frame being drawn, but need 32 byte alignment
+  int size = pixel_size(canvas.format);
+  uint32_t v = pack_pixel(canvas.format, c);
+  __m256i group = size == 4   ? _mm256_set1_epi32(v)
+                  : size == 2 ? _mm256_set1_epi16(v)
+                              : _mm256_set1_epi8(v);
+  uint8_t *p = canvas.pixels8 + i * size;
+  uint8_t *end = p + n * size;
+  for (; p < end && ((uintptr_t)p & 31); p += size) {
+    memcpy(p, &v, size);
+  }
+  for (; p + 32 <= end; p += 32) {
+    _mm256_stream_si256((__m256i *)p, group);
+  }
+  for (; p < end; p += size) {
+    memcpy(p, &v, size);
+  }
+}
+
+static void fill_tile_rows(canvas canvas, int tx0, int tx1, int ty,
+                           bool streaming) {
+  int x0 = tx0 << TILE_SHIFT_X;
+  int x1 = tx1 << TILE_SHIFT_X;
+  int y0 = ty << TILE_SHIFT_Y;
+  int y1 = y0 + TILE_H;
+  x1 = x1 > canvas.w ? canvas.w : x1;
+  y1 = y1 > canvas.h ? canvas.h : y1;
+  if (x0 >= x1) {
+    return;
+  }
+
+  if (canvas.layout == CANVAS_LINEAR) {
+    for (int y = y0; y < y1; ++y) {
+      fill_run(canvas, (size_t)y * canvas.stride + x0, x1 - x0, streaming);
+    }
+    return;
+  }
+  // the blocks of a band sit next to each other, so each band is one run
+  // taking in the padding up to the next block
+  size_t run = (size_t)(block_align(x1) - x0) << BLOCK_SHIFT;
+  for (int y = y0; y < y1; y += BLOCK_W) {
+    fill_run(canvas, canvas_index(canvas, x0, y), run, streaming);
+  }
+}
+
+// Marks the tiles under [x0, x1) x [y0, y1) as drawn. With fill, tiles still
+// holding a pending clear are filled first; without, the caller promises to
+// write every pixel of them itself.
+void claim_tiles(canvas canvas, int x0, int y0, int x1, int y1, bool fill) {
+  canvas_tiles *t = canvas.tiles;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  int tx0 = x0 >> TILE_SHIFT_X, tx1 = (x1 - 1) >> TILE_SHIFT_X;
+  int ty0 = y0 >> TILE_SHIFT_Y, ty1 = (y1 - 1) >> TILE_SHIFT_Y;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    uint8_t *state = &t->state[ty * t->cols];
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      if (state[tx] == TILE_CLEAR && fill) {
+        fill_tile_rows(canvas, tx, tx + 1, ty, false);
+      }
+      state[tx] = TILE_DRAWN;
+    }
+  }
+}
+
+void fast_clear_canvas(canvas canvas, color color) {
+  canvas_tiles *t = canvas.tiles;
+  if (t == NULL) {
+    clear_canvas(canvas, color);
+    return;
+  }
+
+  TRACE_ZONE("fast_clear_canvas");
+  // edge tiles are only resolved up to the canvas size they were cleared at
+  bool same = t->color == color && t->w == canvas.w && t->h == canvas.h;
+  t->color = color;
+  t->w = canvas.w;
+  t->h = canvas.h;
+  int cols = (canvas.w + TILE_W - 1) >> TILE_SHIFT_X;
+  int rows = (canvas.h + TILE_H - 1) >> TILE_SHIFT_Y;
+  for (int ty = 0; ty < rows; ++ty) {
+    uint8_t *state = &t->state[ty * t->cols];
+    for (int tx = 0; tx < cols; ++tx) {
+      if (!(same && state[tx] == TILE_RESOLVED)) {
+        state[tx] = TILE_CLEAR;
+      }
     }
-    offset += scan_width;
-    for (size_t i = 0; i < rem; ++i) {
-      canvas.pixels[offset + i] = canvas.color;
+  }
+}
+
+static void resolve_tile_rows(canvas canvas, int ty0, int ty1) {
+  canvas_tiles *t = canvas.tiles;
+  int cols = (canvas.w + TILE_W - 1) >> TILE_SHIFT_X;
+  for (int ty = ty0; ty < ty1; ++ty) {
+    uint8_t *state = &t->state[ty * t->cols];
+    // runs of pending tiles are filled as one span per row
+    for (int tx = 0; tx < cols;) {
+      if (state[tx] != TILE_CLEAR) {
+        tx++;
+        continue;
+      }
+      int run = tx;
+      while (run < cols && state[run] == TILE_CLEAR) {
+        state[run++] = TILE_RESOLVED;
+      }
+      fill_tile_rows(canvas, tx, run, ty, true);
+      tx = run;
     }
   }
+  _mm_sfence();
+}
+
+// Fills every tile still pending a clear, so memory matches the canvas.
+void resolve_canvas(canvas canvas) {
+  if (canvas.tiles == NULL) {
+    return;
+  }
+  TRACE_ZONE("resolve_canvas");
+  resolve_tile_rows(canvas, 0, (canvas.h + TILE_H - 1) >> TILE_SHIFT_Y);
+}
+
+static void resolve_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  resolve_tile_rows(*(canvas *)ctx, begin, end);
+}
+
+// resolve_canvas spread over the pool, a few rows of tiles at a time.
+void parallel_resolve_canvas(worker_pool *pool, canvas canvas) {
+  if (canvas.tiles == NULL) {
+    return;
+  }
+  TRACE_ZONE("resolve_canvas");
+  parallel_for(pool, 0, (canvas.h + TILE_H - 1) >> TILE_SHIFT_Y, 2,
+               resolve_range, &canvas);
+}
+
+// Anything outside the canvas is clipped away.
+void draw_rectangle(canvas canvas, const Rectangle *rect) {
+  int x0 = rect->x < 0 ? 0 : rect->x;
+  int y0 = rect->y < 0 ? 0 : rect->y;
+  int x1 = rect->x + rect->w > canvas.w ? canvas.w : rect->x + rect->w;
+  int y1 = rect->y + rect->h > canvas.h ? canvas.h : rect->y + rect->h;
+
+  touch_tiles(canvas, x0, y0, x1, y1);
+  for (int y = y0; y < y1 && x0 < x1; ++y) {
+    canvas_fill_row(canvas, x0, y, x1 - x0, canvas.color);
+  }
 }
 
 void clear_canvas(canvas canvas, color color) {
-  int num_pixels = canvas.w * canvas.h;
+  TRACE_ZONE("clear_canvas");
+  if (canvas.tiles != NULL) {
+    claim_tiles(canvas, 0, 0, canvas.w, canvas.h, false);
+  }
+  // contiguous canvases are cleared as one long span, tiled ones always are
+  size_t span = canvas.w;
+  size_t rows = canvas.h;
+  if (canvas.layout == CANVAS_TILED) {
+    span = (size_t)canvas.stride * block_align(canvas.h);
+    rows = 1;
+  } else if (canvas.stride == canvas.w) {
+    span *= rows;
+    rows = 1;
+  }
 
-  // Broadcast the integer value across all lanes of the 256-bit register
-  __m256i broadcasted_value = _mm256_set1_epi32(color);
+  for (size_t y = 0; y < rows; ++y) {
+    canvas_fill(canvas, y * canvas.stride, span, color);
+  }
+}
+
+// Rows of a linear canvas, bands of blocks of a tiled one.
+static void clear_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  canvas *c = ctx;
+  if (c->layout == CANVAS_TILED) {
+    size_t band = (size_t)c->stride << BLOCK_SHIFT;
+    canvas_fill(*c, begin * band, (end - begin) * band, c->color);
+    return;
+  }
+  for (int y = begin; y < end; ++y) {
+    canvas_fill(*c, (size_t)y * c->stride, c->w, c->color);
+  }
+}
+
+// clear_canvas spread over the pool, a tile high band at a time.
+void parallel_clear_canvas(worker_pool *pool, canvas canvas, color color) {
+  TRACE_ZONE("clear_canvas");
+  if (canvas.tiles != NULL) {
+    claim_tiles(canvas, 0, 0, canvas.w, canvas.h, false);
+  }
+  canvas.color = color;
+  if (canvas.layout == CANVAS_TILED) {
+    parallel_for(pool, 0, block_align(canvas.h) >> BLOCK_SHIFT,
+                 TILE_H >> BLOCK_SHIFT, clear_range, &canvas);
+    return;
+  }
+  parallel_for(pool, 0, canvas.h, TILE_H, clear_range, &canvas);
+}
+
+// Copies the rows [y0, y1) of block column x0 of a band, cols pixels wide.
+static inline void detile_block(canvas dst, canvas src, int x0, int y0,
+                                int y1, int cols) {
+  int size = pixel_size(src.format);
+  const uint8_t *s = src.pixels8 + canvas_index(src, x0, y0) * size;
+  uint8_t *d = dst.pixels8 + ((size_t)y0 * dst.stride + x0) * size;
+  size_t pitch = (size_t)dst.stride * size;
+  if (cols < BLOCK_W) {
+    for (int y = y0; y < y1; ++y, s += BLOCK_W * size, d += pitch) {
+      memcpy(d, s, cols * size);
+    }
+    return;
+  }
+  for (int y = y0; y < y1; ++y, s += BLOCK_W * size, d += pitch) {
+    switch (size) {
+    case 4:
+      _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((__m256i *)s));
+      break;
+    case 2:
+      _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
+      break;
+    default:
+      memcpy(d, s, BLOCK_W);
+      break;
+    }
+  }
+}
+
+// Walks src by fast clear tiles, so tiles still pending a clear are filled
+// in dst without reading src at all.
+static void detile_tile_rows(canvas dst, canvas src, int ty0, int ty1) {
+  const canvas_tiles *t = src.tiles;
+  for (int ty = ty0; ty < ty1; ++ty) {
+    int y0 = ty << TILE_SHIFT_Y;
+    int y1 = y0 + TILE_H > src.h ? src.h : y0 + TILE_H;
+    const uint8_t *state = t != NULL ? &t->state[ty * t->cols] : NULL;
+    for (int x0 = 0; x0 < src.w; x0 += TILE_W) {
+      int x1 = x0 + TILE_W > src.w ? src.w : x0 + TILE_W;
+      if (state != NULL && state[x0 >> TILE_SHIFT_X] != TILE_DRAWN) {
+        for (int y = y0; y < y1; ++y) {
+          canvas_fill(dst, (size_t)y * dst.stride + x0, x1 - x0, t->color);
+        }
+        continue;
+      }
+      for (int by = y0; by < y1; by += BLOCK_W) {
+        int by1 = by + BLOCK_W > y1 ? y1 : by + BLOCK_W;
+        for (int bx = x0; bx < x1; bx += BLOCK_W) {
+          int cols = x1 - bx < BLOCK_W ? x1 - bx : BLOCK_W;
+          detile_block(dst, src, bx, by, by1, cols);
+        }
+      }
+    }
+  }
+}
+
+// Copies the tiled canvas src into the linear canvas dst, which needs the
+// same format and at least its size.
+void detile_canvas(canvas dst, canvas src) {
+  TRACE_ZONE("detile_canvas");
+  if (dst.tiles != NULL) {
+    claim_tiles(dst, 0, 0, src.w, src.h, false);
+  }
+  detile_tile_rows(dst, src, 0, (src.h + TILE_H - 1) >> TILE_SHIFT_Y);
+}
+
+typedef struct {
+  canvas dst;
+  canvas src;
+} detile_job;
+
+static void detile_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  detile_job *job = ctx;
+  detile_tile_rows(job->dst, job->src, begin, end);
+}
+
+// detile_canvas spread over the pool, a few rows of tiles at a time.
+void parallel_detile_canvas(worker_pool *pool, canvas dst, canvas src) {
+  TRACE_ZONE("detile_canvas");
+  if (dst.tiles != NULL) {
+    claim_tiles(dst, 0, 0, src.w, src.h, false);
+  }
+  detile_job job = {.dst = dst, .src = src};
+  parallel_for(pool, 0, (src.h + TILE_H - 1) >> TILE_SHIFT_Y, 2,
+               detile_range, &job);
+}
+
+static void flip_rows(unsigned int *image, int width, int height, int row0,
+                      int row1) {
+  __m256i temp1, temp2;
+
+  for (int row = row0; row < row1; ++row) {
+    unsigned int *topRow = image + row * width;
+    unsigned int *bottomRow = image + (height - row - 1) * width;
+
+    // Process 8 elements at a time using AVX2 intrinsics
+    int col = 0;
+    for (; col + 8 <= width; col += 8) {
+      // Load two 256-bit registers with top and bottom rows
+      temp1 = _mm256_loadu_si256((__m256i *)(topRow + col));
+      temp2 = _mm256_loadu_si256((__m256i *)(bottomRow + col));
 
-  for (int x = 0; x < num_pixels; x += 8) {
-    // Store the broadcasted value into the output array
-    _mm256_storeu_si256((__m256i *)&canvas.pixels[x], broadcasted_value);
-    // canvas.pixels[x] = color;
+      // Swap or copy elements using AVX2 instructions
+      _mm256_storeu_si256((__m256i *)(topRow + col), temp2);
+      _mm256_storeu_si256((__m256i *)(bottomRow + col), temp1);
+    }
+    for (; col < width; ++col) {
+      unsigned int tmp = topRow[col];
+      topRow[col] = bottomRow[col];
+      bottomRow[col] = tmp;
+    }
   }
 }
 
+void flip_image(unsigned int *image, int width, int height) {
+  TRACE_ZONE("flip_image");
+  flip_rows(image, width, height, 0, height / 2);
+}
+
+typedef struct {
+  unsigned int *image;
+  int width;
+  int height;
+} flip_job;
+
+static void flip_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  flip_job *job = ctx;
+  flip_rows(job->image, job->width, job->height, begin, end);
+}
+
+// flip_image spread over the pool, in pairs of bands from the top and the
+// bottom.
+void parallel_flip_image(worker_pool *pool, unsigned int *image, int width,
+                         int height) {
+  TRACE_ZONE("flip_image");
+  flip_job job = {.image = image, .width = width, .height = height};
+  parallel_for(pool, 0, height / 2, TILE_H, flip_range, &job);
+}
+
 int lerp(int v0, int v1, float t) { return (1 - t) * v0 + t * v1; }
 
 void interpolate(float *ds, float i0, float d0, float i1, float d1) {
@@ -126,7 +796,10 @@ static inline color alpha_composite(color c, color bg, float alpha) {
   r = (int)new_r;
   g = (int)new_g;
   b = (int)new_b;
-  c = 0xff000000 | (b << 16) | (g << 8) | r;
+  // coverage accumulates in alpha, so lines drawn on a transparent layer
+  // come out premultiplied; an opaque background stays opaque
+  int a = 255 - (int)((255 - (bg >> 24)) * alpha);
+  c = ((color)a << 24) | (b << 16) | (g << 8) | r;
   // printf("r: %02x, b: %02x, g: %02x = %08x\n", r, g, b, c);
   return c;
 }
@@ -178,7 +851,24 @@ float f_part(float a) {
   return a - ((int)a + 1);
 }
 
-void draw_line(canvas canvas, Vector2 p0, Vector2 p1) {
+static void blend_pixel(void *ctx, canvas canvas, int x, int y, float alpha) {
+  (void)ctx;
+  touch_tiles(canvas, x, y, x + 1, y + 1);
+  size_t i = canvas_index(canvas, x, y);
+  canvas_store(canvas, i,
+               alpha_composite(canvas.color, canvas_load(canvas, i), alpha));
+}
+
+static inline void plot_clipped(canvas canvas, int x, int y, float alpha,
+                                plot_func plot, void *ctx) {
+  if (x >= 0 && x < canvas.w && y >= 0 && y < canvas.h) {
+    plot(ctx, canvas, x, y, alpha);
+  }
+}
+
+// Anti-aliased across two pixels, only the part on the canvas is visited.
+void line_pixels(canvas canvas, Vector2 p0, Vector2 p1, plot_func plot,
+                 void *ctx) {
   if (abs(p1.x - p0.x) > abs(p1.y - p0.y)) {
     // Line is horizontal-ish
     // Make sure x0 < x1
@@ -186,25 +876,17 @@ void draw_line(canvas canvas, Vector2 p0, Vector2 p1) {
       swap(&p0.x, &p1.x);
       swap(&p0.y, &p1.y);
     }
-    const int length = p1.x - p0.x + 1;
-    float ys[length];
-    interpolate(&ys[0], p0.x, p0.y, p1.x, p1.y);
-    for (int x = p0.x; x <= p1.x; ++x) {
-      float y = ys[x - p0.x];
+    float slope = (float)(p1.y - p0.y) / (float)(p1.x - p0.x);
+    int start = p0.x < 0 ? 0 : p0.x;
+    int end = p1.x >= canvas.w ? canvas.w - 1 : p1.x;
+    for (int x = start; x <= end; ++x) {
+      float y = p0.y + slope * (x - p0.x);
 
       float fpart = f_part(y);
       float rpart = 1.f - fpart;
 
-      size_t p1 = (size_t)y * canvas.stride + x;
-      size_t p2 = ((size_t)y - 1) * canvas.stride + x;
-
-      color c1 = alpha_composite(canvas.color, canvas.pixels[p1], rpart);
-      color c2 = alpha_composite(canvas.color, canvas.pixels[p2], fpart);
-
-      canvas.pixels[p1] = c1;
-      canvas.pixels[p2] = c2;
-
-      // canvas.pixels[(int) * canvas.stride + x] = canvas.color;
+      plot_clipped(canvas, x, (int)y, rpart, plot, ctx);
+      plot_clipped(canvas, x, (int)y - 1, fpart, plot, ctx);
     }
   } else {
     // Line is vertical-ish
@@ -213,28 +895,36 @@ void draw_line(canvas canvas, Vector2 p0, Vector2 p1) {
       swap(&p0.x, &p1.x);
       swap(&p0.y, &p1.y);
     }
-    const int length = p1.y - p0.y + 1;
-    float xs[length];
-    interpolate(&xs[0], p0.y, p0.x, p1.y, p1.x);
-    for (int y = p0.y; y <= p1.y; ++y) {
-      float x = xs[y - p0.y];
+    float slope =
+        p1.y > p0.y ? (float)(p1.x - p0.x) / (float)(p1.y - p0.y) : 0.f;
+    int start = p0.y < 0 ? 0 : p0.y;
+    int end = p1.y >= canvas.h ? canvas.h - 1 : p1.y;
+    for (int y = start; y <= end; ++y) {
+      float x = p0.x + slope * (y - p0.y);
 
       float fpart = f_part(x);
       float rpart = 1.f - fpart;
 
-      size_t p1 = y * canvas.stride + (size_t)x;
-      size_t p2 = y * canvas.stride + (size_t)x - 1;
+      plot_clipped(canvas, (int)x, y, rpart, plot, ctx);
+      plot_clipped(canvas, (int)x - 1, y, fpart, plot, ctx);
+    }
+  }
+}
 
-      color c1 = alpha_composite(canvas.color, canvas.pixels[p1], rpart);
-      color c2 = alpha_composite(canvas.color, canvas.pixels[p2], fpart);
+void draw_line(canvas canvas, Vector2 p0, Vector2 p1) {
+  line_pixels(canvas, p0, p1, blend_pixel, NULL);
+}
 
-      canvas.pixels[p1] = c1;
-      canvas.pixels[p2] = c2;
-    }
+// x where the edge from a to b crosses row y
+static inline float edge_x(Vector2 a, Vector2 b, int y) {
+  if (a.y == b.y) {
+    return a.x;
   }
+  return a.x + (float)(b.x - a.x) * (float)(y - a.y) / (float)(b.y - a.y);
 }
 
-void draw_triangle(canvas canvas, Vector2 p0, Vector2 p1, Vector2 p2) {
+void triangle_spans(canvas canvas, Vector2 p0, Vector2 p1, Vector2 p2,
+                    span_func span, void *ctx) {
   if (p1.y < p0.y) {
     swap(&p1.x, &p0.x);
     swap(&p1.y, &p0.y);
@@ -248,42 +938,102 @@ void draw_triangle(canvas canvas, Vector2 p0, Vector2 p1, Vector2 p2) {
     swap(&p2.y, &p1.y);
   }
 
-  const int length = p2.y - p0.y + 1;
-  float xs1[length];
-  float xs2[length];
-  interpolate(&xs1[0], p0.y, p0.x, p1.y, p1.x);
-  interpolate(&xs1[p1.y - p0.y], p1.y, p1.x, p2.y, p2.x);
-  interpolate(&xs2[0], p0.y, p0.x, p2.y, p2.x);
-
-  size_t m = length / 2;
-  float *left = &xs1[0];
-  float *right = &xs2[0];
-  if (xs2[m] < xs1[m]) {
-    left = &xs2[0];
-    right = &xs1[0];
+  // only the rows and columns on the canvas are walked
+  int y_start = p0.y < 0 ? 0 : p0.y;
+  int y_end = p2.y >= canvas.h ? canvas.h - 1 : p2.y;
+  for (int y = y_start; y <= y_end; ++y) {
+    float a = edge_x(p0, p2, y);
+    float b = y < p1.y ? edge_x(p0, p1, y) : edge_x(p1, p2, y);
+    // clamp before converting so far off-canvas edges can't overflow
+    int start = fmaxf(fminf(fminf(a, b), canvas.w), -1.f);
+    int end = fmaxf(fminf(fmaxf(a, b), canvas.w), -1.f);
+    start = start < 0 ? 0 : start;
+    end = end >= canvas.w ? canvas.w - 1 : end;
+    if (start <= end) {
+      span(ctx, canvas, y, start, end + 1);
+    }
   }
+}
 
-  for (int y = p0.y; y <= p2.y; ++y) {
-    int start = left[y - p0.y];
-    int end = right[y - p0.y];
-    int yoffset = y * canvas.stride;
-    for (int x = start; x <= end; ++x) {
-      canvas.pixels[yoffset + x] = canvas.color;
-    }
+// span_func filling with canvas.color.
+void fill_canvas_span(void *ctx, canvas canvas, int y, int x0, int x1) {
+  (void)ctx;
+  touch_tiles(canvas, x0, y, x1, y + 1);
+  canvas_fill_row(canvas, x0, y, x1 - x0, canvas.color);
+}
+
+void draw_triangle(canvas canvas, Vector2 p0, Vector2 p1, Vector2 p2) {
+  TRACE_ZONE("draw_triangle");
+  triangle_spans(canvas, p0, p1, p2, fill_canvas_span, NULL);
+}
+
+static inline color unpremultiply(color c) {
+  uint32_t a = c >> 24;
+  if (a == 0) {
+    return 0;
   }
+  color out = c & 0xff000000;
+  for (int shift = 0; shift < 24; shift += 8) {
+    uint32_t v = (((c >> shift) & 0xff) * 255 + a / 2) / a;
+    out |= (v > 255 ? 255 : v) << shift;
+  }
+  return out;
+}
 
-  //  canvas.color = BLUE;
-  // draw_line(canvas, p0, p1);
-  // canvas.color = GREEN;
-  // draw_line(canvas, p1, p2);
-  // canvas.color = RED;
-  // draw_line(canvas, p0, p2);
+// Detiled into a temporary canvas first.
+static int save_tiled_canvas(const char *filename, canvas tiled) {
+  canvas rows = {
+      .pixels8 = malloc((size_t)pixel_size(tiled.format) * tiled.w * tiled.h),
+      .w = tiled.w,
+      .h = tiled.h,
+      .stride = tiled.w,
+      .format = tiled.format,
+  };
+  if (rows.pixels8 == NULL) {
+    return 0;
+  }
+  detile_canvas(rows, tiled);
+  int ok = save_canvas(filename, rows);
+  free(rows.pixels8);
+  return ok;
 }
 
 int save_canvas(const char *filename, canvas canvas) {
-  stbi_flip_vertically_on_write(1);
-  return stbi_write_png(filename, canvas.w, canvas.h, COMP_RGBA, canvas.pixels,
-                        sizeof(color) * canvas.stride);
+  TRACE_ZONE("save_canvas");
+  if (canvas.layout == CANVAS_TILED) {
+    return save_tiled_canvas(filename, canvas);
+  }
+  resolve_canvas(canvas);
+  stbi_flip_vertically_on_write(0);
+  switch (canvas.format) {
+  case PIXEL_RGBA8888:
+    return stbi_write_png(filename, canvas.w, canvas.h, COMP_RGBA,
+                          canvas.pixels, sizeof(color) * canvas.stride);
+  case PIXEL_GRAY8:
+    return stbi_write_png(filename, canvas.w, canvas.h, COMP_Y, canvas.pixels8,
+                          canvas.stride);
+  default:
+    break;
+  }
+
+  // everything else goes through straight RGBA
+  color *rgba = malloc(sizeof(color) * canvas.w * canvas.h);
+  if (rgba == NULL) {
+    return 0;
+  }
+  for (int y = 0; y < canvas.h; ++y) {
+    for (int x = 0; x < canvas.w; ++x) {
+      color c = canvas_load(canvas, (size_t)y * canvas.stride + x);
+      if (canvas.format == PIXEL_RGBA8888_PREMUL) {
+        c = unpremultiply(c);
+      }
+      rgba[(size_t)y * canvas.w + x] = c;
+    }
+  }
+  int ok = stbi_write_png(filename, canvas.w, canvas.h, COMP_RGBA, rgba,
+                          sizeof(color) * canvas.w);
+  free(rgba);
+  return ok;
 }
 
 #endif
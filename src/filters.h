@@ -0,0 +1,412 @@
+#ifndef INCLUDE_FILTERS_H
+#define INCLUDE_FILTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "draw.h"
+#include "workers.h"
+
+// Post-processing over whole canvases. Filters read src and write dst,
+// which must not overlap, and both have to hold 32 bit pixels; channels are
+// filtered independently, so premultiplied canvases work as well. Rows are
+// split into bands run across the pool. A blur runs both of its passes on
+// one band before the next, so the rows between them stay in cache.
+//
+// Weights are 8.8 fixed point and every pass rounds to 8 bits, so results
+// are exact and the same on any number of threads.
+#define FILTER_BAND 64 // rows
+#define FILTER_MAX_RADIUS 16
+
+typedef struct {
+  int radius;
+  uint16_t weights[2 * FILTER_MAX_RADIUS + 1]; // symmetric, sum to 256
+} filter_kernel;
+
+typedef struct {
+  worker_pool *pool;
+  int max_w;      // widest canvas, src or dst
+  uint8_t *slots; // scratch, one slot per thread of the pool
+  size_t slot_size;
+  int32_t *xs; // resize: left source column and weight per dst column
+  int32_t *fx;
+} filters;
+
+int filters_init(filters *f, arena *a, worker_pool *pool, int max_w);
+void box_kernel(filter_kernel *k, int radius);
+void gaussian_kernel(filter_kernel *k, float sigma);
+
+int blur_canvas(filters *f, canvas dst, canvas src, const filter_kernel *k);
+int downsample_canvas(filters *f, canvas dst, canvas src);
+int resize_canvas(filters *f, canvas dst, canvas src);
+
+#endif
+
+#if defined(FILTERS_IMPLEMENTATION) && !defined(INCLUDE_FILTERS_IMPL)
+#define INCLUDE_FILTERS_IMPL
+
+#include <math.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+// padded line plus the rows of a band and its apron, in colors
+#define FILTER_LINE(w) ((((w) + 2 * FILTER_MAX_RADIUS + 1) + 7) & ~7)
+#define FILTER_ROWS (FILTER_BAND + 2 * FILTER_MAX_RADIUS)
+
+int filters_init(filters *f, arena *a, worker_pool *pool, int max_w) {
+  size_t line = FILTER_LINE(max_w);
+  *f = (filters){
+      .pool = pool,
+      .max_w = max_w,
+      .slot_size = sizeof(color) * (line + (size_t)FILTER_ROWS * max_w),
+  };
+  f->slots = arena_alloc(a, f->slot_size * pool_size(pool));
+  f->xs = arena_alloc(a, sizeof(int32_t) * max_w);
+  f->fx = arena_alloc(a, sizeof(int32_t) * max_w);
+  if (f->slots == NULL || f->xs == NULL || f->fx == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+static color *filter_slot(filters *f, int worker) {
+  return (color *)(f->slots + f->slot_size * worker);
+}
+
+// Rounding is pushed into the center tap so the weights sum to exactly 256.
+static void normalize_kernel(filter_kernel *k, const float *w) {
+  float sum = 0;
+  for (int i = 0; i <= 2 * k->radius; ++i) {
+    sum += w[i];
+  }
+  int total = 0;
+  for (int i = 0; i <= 2 * k->radius; ++i) {
+    k->weights[i] = w[i] / sum * 256.f;
+    total += k->weights[i];
+  }
+  k->weights[k->radius] += 256 - total;
+}
+
+void box_kernel(filter_kernel *k, int radius) {
+  float w[2 * FILTER_MAX_RADIUS + 1];
+  k->radius = radius > FILTER_MAX_RADIUS ? FILTER_MAX_RADIUS : radius;
+  for (int i = 0; i <= 2 * k->radius; ++i) {
+    w[i] = 1.f;
+  }
+  normalize_kernel(k, w);
+}
+
+// Cut off at three sigma.
+void gaussian_kernel(filter_kernel *k, float sigma) {
+  float w[2 * FILTER_MAX_RADIUS + 1];
+  int radius = ceilf(3.f * sigma);
+  k->radius = radius > FILTER_MAX_RADIUS ? FILTER_MAX_RADIUS : radius;
+  for (int i = -k->radius; i <= k->radius; ++i) {
+    w[i + k->radius] = expf(-(i * i) / (2.f * sigma * sigma));
+  }
+  normalize_kernel(k, w);
+}
+
+static inline bool filter_format(canvas g) {
+  return pixel_size(g.format) == sizeof(color);
+}
+
+// (sum of w * p + 128) >> 8 over taps whose pixels are step colors apart.
+// Products are 16 bit: with the weights summing to 256 the total can't
+// pass 255 * 256. Kernels are symmetric, so taps at the same distance
+// from the center are added before their one multiply.
+static void convolve_row(color *dst, const color *src, size_t step, int w,
+                         const filter_kernel *k) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi16(128);
+  int r = k->radius;
+  int taps = 2 * r + 1;
+  int x = 0;
+  for (; x + 8 <= w; x += 8) {
+    const color *c = &src[x + r * step];
+    __m256i v = _mm256_loadu_si256((const __m256i *)c);
+    __m256i wt = _mm256_set1_epi16(k->weights[r]);
+    __m256i lo = _mm256_add_epi16(
+        round, _mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), wt));
+    __m256i hi = _mm256_add_epi16(
+        round, _mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), wt));
+    for (int t = 1; t <= r; ++t) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(c - t * step));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(c + t * step));
+      wt = _mm256_set1_epi16(k->weights[r + t]);
+      __m256i pair_lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                         _mm256_unpacklo_epi8(b, zero));
+      __m256i pair_hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                         _mm256_unpackhi_epi8(b, zero));
+      lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(pair_lo, wt));
+      hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(pair_hi, wt));
+    }
+    lo = _mm256_srli_epi16(lo, 8);
+    hi = _mm256_srli_epi16(hi, 8);
+    _mm256_storeu_si256((__m256i *)&dst[x], _mm256_packus_epi16(lo, hi));
+  }
+  for (; x < w; ++x) {
+    color out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t sum = 128;
+      for (int t = 0; t < taps; ++t) {
+        sum += ((src[x + t * step] >> shift) & 0xff) * k->weights[t];
+      }
+      out |= (sum >> 8) << shift;
+    }
+    dst[x] = out;
+  }
+}
+
+typedef struct {
+  filters *f;
+  canvas dst;
+  canvas src;
+  const filter_kernel *k;
+} blur_job;
+
+static void blur_band(void *ctx, int band, int worker) {
+  TRACE_ZONE("blur_band");
+  blur_job *job = ctx;
+  canvas src = job->src, dst = job->dst;
+  int r = job->k->radius;
+  int y0 = band * FILTER_BAND;
+  int y1 = y0 + FILTER_BAND > dst.h ? dst.h : y0 + FILTER_BAND;
+
+  // horizontal pass into the band rows, through a line clamped at the edges
+  color *line = filter_slot(job->f, worker);
+  color *rows = line + FILTER_LINE(job->f->max_w);
+  for (int j = 0; j < y1 - y0 + 2 * r; ++j) {
+    int sy = y0 - r + j;
+    sy = sy < 0 ? 0 : sy >= src.h ? src.h - 1 : sy;
+    const color *row = &src.pixels[(size_t)sy * src.stride];
+    for (int i = 0; i < r; ++i) {
+      line[i] = row[0];
+      line[r + src.w + i] = row[src.w - 1];
+    }
+    memcpy(&line[r], row, sizeof(color) * src.w);
+    convolve_row(&rows[(size_t)j * src.w], line, 1, src.w, job->k);
+  }
+
+  // vertical pass straight out of them
+  for (int y = y0; y < y1; ++y) {
+    convolve_row(&dst.pixels[(size_t)y * dst.stride],
+                 &rows[(size_t)(y - y0) * src.w], src.w, dst.w, job->k);
+  }
+}
+
+// dst is blurred src, over the part of dst src covers.
+int blur_canvas(filters *f, canvas dst, canvas src, const filter_kernel *k) {
+  if (!filter_format(dst) || !filter_format(src) || src.w > f->max_w ||
+      k->radius > FILTER_MAX_RADIUS) {
+    return -1;
+  }
+  TRACE_ZONE("blur_canvas");
+  dst.w = dst.w < src.w ? dst.w : src.w;
+  dst.h = dst.h < src.h ? dst.h : src.h;
+  if (dst.w <= 0 || dst.h <= 0) {
+    return 0;
+  }
+  resolve_canvas(src);
+  touch_tiles(dst, 0, 0, dst.w, dst.h);
+  blur_job job = {.f = f, .dst = dst, .src = src, .k = k};
+  pool_run(f->pool, blur_band, &job, (dst.h + FILTER_BAND - 1) / FILTER_BAND);
+  return 0;
+}
+
+typedef struct {
+  canvas dst;
+  canvas src;
+} scale_job;
+
+static void downsample_band(void *ctx, int band, int worker) {
+  (void)worker;
+  TRACE_ZONE("downsample_band");
+  scale_job *job = ctx;
+  canvas src = job->src, dst = job->dst;
+  int y0 = band * FILTER_BAND;
+  int y1 = y0 + FILTER_BAND > dst.h ? dst.h : y0 + FILTER_BAND;
+  for (int y = y0; y < y1; ++y) {
+    const color *a = &src.pixels[(size_t)(2 * y) * src.stride];
+    const color *b = a + src.stride;
+    color *d = &dst.pixels[(size_t)y * dst.stride];
+    int x = 0;
+    for (; x + 8 <= dst.w; x += 8) {
+      __m256i v0 = _mm256_avg_epu8(
+          _mm256_loadu_si256((const __m256i *)&a[2 * x]),
+          _mm256_loadu_si256((const __m256i *)&b[2 * x]));
+      __m256i v1 = _mm256_avg_epu8(
+          _mm256_loadu_si256((const __m256i *)&a[2 * x + 8]),
+          _mm256_loadu_si256((const __m256i *)&b[2 * x + 8]));
+      // even and odd columns, as outputs 0 1 4 5 | 2 3 6 7
+      __m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(v0),
+                                      _mm256_castsi256_ps(v1),
+                                      _MM_SHUFFLE(2, 0, 2, 0));
+      __m256 odd = _mm256_shuffle_ps(_mm256_castsi256_ps(v0),
+                                     _mm256_castsi256_ps(v1),
+                                     _MM_SHUFFLE(3, 1, 3, 1));
+      __m256i out = _mm256_avg_epu8(_mm256_castps_si256(even),
+                                    _mm256_castps_si256(odd));
+      out = _mm256_permute4x64_epi64(out, _MM_SHUFFLE(3, 1, 2, 0));
+      _mm256_storeu_si256((__m256i *)&d[x], out);
+    }
+    for (; x < dst.w; ++x) {
+      color out = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t l = (((a[2 * x] >> shift) & 0xff) +
+                      ((b[2 * x] >> shift) & 0xff) + 1) >> 1;
+        uint32_t r = (((a[2 * x + 1] >> shift) & 0xff) +
+                      ((b[2 * x + 1] >> shift) & 0xff) + 1) >> 1;
+        out |= ((l + r + 1) >> 1) << shift;
+      }
+      d[x] = out;
+    }
+  }
+}
+
+// Halves src into dst by averaging 2x2 blocks, the rows of a block first.
+// Only the part of dst half of src covers is written.
+int downsample_canvas(filters *f, canvas dst, canvas src) {
+  if (!filter_format(dst) || !filter_format(src)) {
+    return -1;
+  }
+  TRACE_ZONE("downsample_canvas");
+  dst.w = dst.w < src.w / 2 ? dst.w : src.w / 2;
+  dst.h = dst.h < src.h / 2 ? dst.h : src.h / 2;
+  if (dst.w <= 0 || dst.h <= 0) {
+    return 0;
+  }
+  resolve_canvas(src);
+  touch_tiles(dst, 0, 0, dst.w, dst.h);
+  scale_job job = {.dst = dst, .src = src};
+  pool_run(f->pool, downsample_band, &job,
+           (dst.h + FILTER_BAND - 1) / FILTER_BAND);
+  return 0;
+}
+
+// Sample centers of dst mapped onto src, as a source index and the 8 bit
+// weight of the next one.
+static inline void resize_sample(int i, int dst_n, int src_n, int32_t *s,
+                                 int32_t *f) {
+  int64_t pos = ((2 * (int64_t)i + 1) * src_n * 256) / (2 * dst_n) - 128;
+  pos = pos < 0 ? 0 : pos;
+  *s = pos >> 8;
+  *f = pos & 255;
+  if (*s >= src_n - 1) {
+    *s = src_n - 1;
+    *f = 0;
+  }
+}
+
+// (a * (256 - f) + b * f + 128) >> 8 per byte, f as 16 bit lanes.
+static inline __m256i lerp_bytes(__m256i a, __m256i b, __m256i f_lo,
+                                 __m256i f_hi) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi16(256);
+  const __m256i round = _mm256_set1_epi16(128);
+  __m256i lo = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero),
+                         _mm256_sub_epi16(one, f_lo)),
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), f_lo));
+  __m256i hi = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero),
+                         _mm256_sub_epi16(one, f_hi)),
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), f_hi));
+  lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+  hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+  return _mm256_packus_epi16(lo, hi);
+}
+
+static inline color lerp_color(color a, color b, uint32_t f) {
+  color out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t v = ((a >> shift) & 0xff) * (256 - f) +
+                 ((b >> shift) & 0xff) * f + 128;
+    out |= (v >> 8) << shift;
+  }
+  return out;
+}
+
+typedef struct {
+  filters *f;
+  canvas dst;
+  canvas src;
+} resize_job;
+
+static void resize_band(void *ctx, int band, int worker) {
+  TRACE_ZONE("resize_band");
+  resize_job *job = ctx;
+  canvas src = job->src, dst = job->dst;
+  const int32_t *xs = job->f->xs, *fx = job->f->fx;
+  // one source row blended vertically, plus a copy of its last pixel so
+  // the right neighbour of every column exists
+  color *row = filter_slot(job->f, worker);
+  int y0 = band * FILTER_BAND;
+  int y1 = y0 + FILTER_BAND > dst.h ? dst.h : y0 + FILTER_BAND;
+  // the 16 bit weight of pixel i of each half, see unpacklo and unpackhi
+  const __m256i pick_lo = _mm256_setr_epi8(
+      0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5, //
+      0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5);
+  const __m256i pick_hi = _mm256_setr_epi8(
+      8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13, //
+      8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13);
+
+  for (int y = y0; y < y1; ++y) {
+    int32_t sy, fy;
+    resize_sample(y, dst.h, src.h, &sy, &fy);
+    const color *a = &src.pixels[(size_t)sy * src.stride];
+    const color *b = sy + 1 < src.h ? a + src.stride : a;
+    __m256i f = _mm256_set1_epi16(fy);
+    int x = 0;
+    for (; x + 8 <= src.w; x += 8) {
+      __m256i v = lerp_bytes(_mm256_loadu_si256((const __m256i *)&a[x]),
+                             _mm256_loadu_si256((const __m256i *)&b[x]), f,
+                             f);
+      _mm256_storeu_si256((__m256i *)&row[x], v);
+    }
+    for (; x < src.w; ++x) {
+      row[x] = lerp_color(a[x], b[x], fy);
+    }
+    row[src.w] = row[src.w - 1];
+
+    color *d = &dst.pixels[(size_t)y * dst.stride];
+    for (x = 0; x + 8 <= dst.w; x += 8) {
+      __m256i idx = _mm256_loadu_si256((const __m256i *)&xs[x]);
+      __m256i w = _mm256_loadu_si256((const __m256i *)&fx[x]);
+      __m256i p0 = _mm256_i32gather_epi32((const int *)row, idx, 4);
+      __m256i p1 = _mm256_i32gather_epi32((const int *)row + 1, idx, 4);
+      __m256i v = lerp_bytes(p0, p1, _mm256_shuffle_epi8(w, pick_lo),
+                             _mm256_shuffle_epi8(w, pick_hi));
+      _mm256_storeu_si256((__m256i *)&d[x], v);
+    }
+    for (; x < dst.w; ++x) {
+      d[x] = lerp_color(row[xs[x]], row[xs[x] + 1], fx[x]);
+    }
+  }
+}
+
+// Bilinear resize of all of src onto all of dst, sample centers aligned.
+int resize_canvas(filters *f, canvas dst, canvas src) {
+  if (!filter_format(dst) || !filter_format(src) || src.w > f->max_w ||
+      dst.w > f->max_w) {
+    return -1;
+  }
+  if (src.w <= 0 || src.h <= 0 || dst.w <= 0 || dst.h <= 0) {
+    return 0;
+  }
+  TRACE_ZONE("resize_canvas");
+  for (int x = 0; x < dst.w; ++x) {
+    resize_sample(x, dst.w, src.w, &f->xs[x], &f->fx[x]);
+  }
+  resolve_canvas(src);
+  touch_tiles(dst, 0, 0, dst.w, dst.h);
+  resize_job job = {.f = f, .dst = dst, .src = src};
+  pool_run(f->pool, resize_band, &job,
+           (dst.h + FILTER_BAND - 1) / FILTER_BAND);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef INCLUDE_FRAMERING_H
+#define INCLUDE_FRAMERING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "draw.h"
+
+// Shared memory frame ring. The renderer draws straight into the slots of a
+// POSIX shared memory object and other local processes map the same object
+// to read finished frames in place, without a copy or a syscall per frame.
+//
+// Layout, native endianness, every part aligned to FRAME_RING_ALIGN:
+//   frame_ring_header
+//   slots times: frame_slot, then the pixels, rows stride bytes apart
+//
+// Each slot is a seqlock. Frame n goes to slot n % slots, whose seq is
+// 2n + 1 while it is being drawn and 2n + 2 once published, after which
+// head becomes n + 1. A reader checks seq before and after using the
+// pixels; a mismatch means the writer has lapped it and the frame is gone.
+// There are no locks, so a slow reader never stalls the renderer.
+
+#define FRAME_RING_MAGIC 0x474e495254415246ull // "FRATRING"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_ALIGN 4096
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint64_t slot_size;      // bytes, slot header included
+  uint64_t pixel_capacity; // bytes of pixels a slot can hold
+  _Atomic uint64_t head;   // frames published so far
+} frame_ring_header;
+
+typedef struct {
+  _Atomic uint64_t seq;
+  uint64_t frame;
+  uint64_t timestamp; // ns, CLOCK_MONOTONIC when the frame was published
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride; // bytes
+  uint32_t format; // pixel_format
+  uint64_t size;   // bytes, stride * (height - 1) + the last row
+} frame_slot;
+
+typedef struct {
+  frame_ring_header *header;
+  size_t size; // of the mapping
+  bool writer;
+  char name[64];
+  uint64_t next; // frame being drawn, writer only
+} frame_ring;
+
+// A published frame, valid until frame_ring_check says otherwise.
+typedef struct {
+  uint64_t frame;
+  uint64_t timestamp;
+  int width;
+  int height;
+  int stride; // bytes
+  pixel_format format;
+  const void *pixels;
+  const frame_slot *slot;
+} frame_view;
+
+int frame_ring_create(frame_ring *r, const char *name, int slots,
+                      size_t pixel_capacity);
+int frame_ring_open(frame_ring *r, const char *name);
+void frame_ring_close(frame_ring *r);
+
+void *frame_ring_begin(frame_ring *r);
+int frame_ring_publish(frame_ring *r, canvas c, uint64_t timestamp);
+
+uint64_t frame_ring_head(const frame_ring *r);
+int frame_ring_acquire(const frame_ring *r, uint64_t frame, frame_view *v);
+bool frame_ring_check(const frame_view *v);
+
+#endif
+
+#if defined(FRAMERING_IMPLEMENTATION) && !defined(INCLUDE_FRAMERING_IMPL)
+#define INCLUDE_FRAMERING_IMPL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline size_t frame_ring_round(size_t n) {
+  return (n + FRAME_RING_ALIGN - 1) & ~(size_t)(FRAME_RING_ALIGN - 1);
+}
+
+static inline frame_slot *frame_ring_slot(const frame_ring *r, uint64_t n) {
+  const frame_ring_header *h = r->header;
+  return (frame_slot *)((char *)h + frame_ring_round(sizeof(*h)) +
+                        (n % h->slots) * h->slot_size);
+}
+
+static inline void *frame_slot_pixels(const frame_slot *s) {
+  return (char *)s + frame_ring_round(sizeof(*s));
+}
+
+static int frame_ring_name(frame_ring *r, const char *name) {
+  size_t n = strlen(name);
+  if (n == 0 || n >= sizeof(r->name)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(r->name, name, n + 1);
+  return 0;
+}
+
+// Creates, or replaces, the shared memory object name ("/name") with room
+// for slots frames of up to pixel_capacity bytes each.
+int frame_ring_create(frame_ring *r, const char *name, int slots,
+                      size_t pixel_capacity) {
+  *r = (frame_ring){.writer = true};
+  if (slots < 2) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (frame_ring_name(r, name) != 0) {
+    return -1;
+  }
+
+  size_t slot_size =
+      frame_ring_round(sizeof(frame_slot)) + frame_ring_round(pixel_capacity);
+  r->size = frame_ring_round(sizeof(frame_ring_header)) + slots * slot_size;
+
+  shm_unlink(name); // a stale ring may have another size
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, r->size) != 0) {
+    int e = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = e;
+    return -1;
+  }
+  void *p = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    int e = errno;
+    shm_unlink(name);
+    errno = e;
+    return -1;
+  }
+
+  // the object starts zeroed, so every slot reads as never published
+  r->header = p;
+  r->header->slots = slots;
+  r->header->slot_size = slot_size;
+  r->header->pixel_capacity = frame_ring_round(pixel_capacity);
+  r->header->version = FRAME_RING_VERSION;
+  atomic_store_explicit(&r->header->head, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  r->header->magic = FRAME_RING_MAGIC;
+  return 0;
+}
+
+// Maps an existing ring read only, for a consumer.
+int frame_ring_open(frame_ring *r, const char *name) {
+  *r = (frame_ring){0};
+  if (frame_ring_name(r, name) != 0) {
+    return -1;
+  }
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(frame_ring_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+
+  r->header = p;
+  r->size = st.st_size;
+  const frame_ring_header *h = r->header;
+  if (h->magic != FRAME_RING_MAGIC || h->version != FRAME_RING_VERSION ||
+      h->slots < 2 ||
+      frame_ring_round(sizeof(*h)) + h->slots * h->slot_size > r->size) {
+    frame_ring_close(r);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+// Unmaps the ring. The writer also removes the name; consumers that still
+// have it mapped keep reading until they close.
+void frame_ring_close(frame_ring *r) {
+  if (r->header == NULL) {
+    return;
+  }
+  munmap(r->header, r->size);
+  if (r->writer) {
+    shm_unlink(r->name);
+  }
+  r->header = NULL;
+}
+
+// Claims the slot of the next frame and returns its pixels to draw into,
+// pixel_capacity bytes aligned to FRAME_RING_ALIGN. Readers stop seeing
+// the frame it used to hold.
+void *frame_ring_begin(frame_ring *r) {
+  frame_slot *s = frame_ring_slot(r, r->next);
+  atomic_store_explicit(&s->seq, 2 * r->next + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  return frame_slot_pixels(s);
+}
+
+// Publishes the frame claimed by frame_ring_begin. The canvas normally
+// draws into the slot already; anything else, such as a post-processed
+// copy, is copied in first. The canvas must be resolved.
+int frame_ring_publish(frame_ring *r, canvas c, uint64_t timestamp) {
+  frame_slot *s = frame_ring_slot(r, r->next);
+  size_t row = (size_t)c.w * pixel_size(c.format);
+  size_t stride = (size_t)c.stride * pixel_size(c.format);
+  size_t size = c.h > 0 ? stride * (c.h - 1) + row : 0;
+  if (size > r->header->pixel_capacity) {
+    return -1;
+  }
+
+  uint8_t *dst = frame_slot_pixels(s);
+  if (c.pixels8 != dst) {
+    for (int y = 0; y < c.h; ++y) {
+      memcpy(dst + y * stride, c.pixels8 + y * stride, row);
+    }
+  }
+
+  s->frame = r->next;
+  s->timestamp = timestamp;
+  s->width = c.w;
+  s->height = c.h;
+  s->stride = stride;
+  s->format = c.format;
+  s->size = size;
+  atomic_store_explicit(&s->seq, 2 * r->next + 2, memory_order_release);
+  atomic_store_explicit(&r->header->head, ++r->next, memory_order_release);
+  return 0;
+}
+
+// Frames published so far; the newest is head - 1.
+uint64_t frame_ring_head(const frame_ring *r) {
+  return atomic_load_explicit(&r->header->head, memory_order_acquire);
+}
+
+// Points v at frame n in place. Fails when n has not been published yet or
+// was already overwritten. Call frame_ring_check once done with the pixels.
+int frame_ring_acquire(const frame_ring *r, uint64_t frame, frame_view *v) {
+  const frame_slot *s = frame_ring_slot(r, frame);
+  uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+  if (seq != 2 * frame + 2) {
+    return -1;
+  }
+  *v = (frame_view){
+      .frame = s->frame,
+      .timestamp = s->timestamp,
+      .width = s->width,
+      .height = s->height,
+      .stride = s->stride,
+      .format = s->format,
+      .pixels = frame_slot_pixels(s),
+      .slot = s,
+  };
+  if (v->frame != frame || s->size > r->header->pixel_capacity ||
+      !frame_ring_check(v)) {
+    return -1;
+  }
+  return 0;
+}
+
+// Whether everything read through v since frame_ring_acquire belongs to
+// its frame, i.e. the writer has not started reusing the slot.
+bool frame_ring_check(const frame_view *v) {
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t seq = atomic_load_explicit(&v->slot->seq, memory_order_relaxed);
+  return seq == 2 * v->frame + 2;
+}
+
+#endif
@@ -10,7 +10,12 @@
 #include <GLFW/glfw3.h>
 
 #include "arena.h"
+#include "draw.h"
 #include "io-utils.h"
+#include "pacing.h"
+#include "profiler.h"
+#include "replay.h"
+#include "trace.h"
 
 typedef void *(*init_func)(int width, int height);
 typedef void (*update_func)(void *ctx, int width, int height, double dt);
@@ -18,27 +23,64 @@ typedef float *(*vertex_provider)(void *ctx, size_t *num_elements);
 typedef unsigned int *(*index_provider)(void *ctx, size_t *num_elements);
 
 GLFWwindow *init_window(int w, int h);
-GLuint init_texture(int width, int height);
+GLuint init_texture(int width, int height, pixel_format format);
 GLuint init_framebuffer(GLuint texture);
 GLuint init_shader(arena *a, const char *vert_shader, const char *frag_shader);
 GLuint init_indexed_vertex_buffer(void *ctx, vertex_provider vertex_func,
                                   index_provider index_func);
 void render_fb(GLuint fb, int width, int height, int img_width, int img_height);
-void flip_image(unsigned int *image, int width, int height);
-void render_texture(GLuint texture, int w, int h, void *pixels);
-void *run(int width, int height, init_func init_func, update_func update_func);
+void render_texture(GLuint texture, canvas canvas);
+void render_quad(GLuint program, GLuint texture, int width, int height,
+                 float u, float v);
+
+typedef struct {
+  input_func input_func;
+  recording *rec; // NULL unless recording
+  pacing_mode pacing;
+  double fps; // target for PACE_LIMIT and PACE_LATE_LATCH
+} run_options;
+
+void *run(int width, int height, init_func init_func, update_func update_func,
+          const run_options *opts);
 
 #endif
 
-#ifdef GRAPHICS_IMPLEMENTATION
+#if defined(GRAPHICS_IMPLEMENTATION) && !defined(INCLUDE_GRAPHICS_IMPL)
+#define INCLUDE_GRAPHICS_IMPL
+static input_event pending_events[MAX_FRAME_EVENTS];
+static uint16_t num_pending_events;
+
+// Delivered with the next frame so recordings see them in frame order.
+static void push_event(GLFWwindow *window, int key, int action, int mods) {
+  if (num_pending_events == MAX_FRAME_EVENTS) {
+    return;
+  }
+  double x, y;
+  int w, h;
+  glfwGetCursorPos(window, &x, &y);
+  glfwGetWindowSize(window, &w, &h);
+  pending_events[num_pending_events++] = (input_event){
+      .key = key,
+      .action = action,
+      .mods = mods,
+      .x = w > 0 ? x / w : 0,
+      .y = h > 0 ? y / h : 0,
+  };
+}
+
 static void key_callback(GLFWwindow *window, int key, int scancode, int action,
                          int mods) {
   (void)scancode;
-  (void)action;
-  (void)mods;
 
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
     glfwSetWindowShouldClose(window, GLFW_TRUE);
+
+  push_event(window, key, action, mods);
+}
+
+static void mouse_callback(GLFWwindow *window, int button, int action,
+                           int mods) {
+  push_event(window, INPUT_MOUSE_BUTTON + button, action, mods);
 }
 
 GLFWwindow *init_window(int w, int h) {
@@ -57,9 +99,9 @@ GLFWwindow *init_window(int w, int h) {
   }
 
   glfwSetKeyCallback(window, key_callback);
+  glfwSetMouseButtonCallback(window, mouse_callback);
   glfwMakeContextCurrent(window);
   gladLoadGL(glfwGetProcAddress);
-  glfwSwapInterval(1);
 
   return window;
 }
@@ -75,7 +117,10 @@ void update_fps_counter(GLFWwindow *window, double current_seconds) {
     previous_seconds = current_seconds;
 
     float fps = (float)frame_count / elapsed_seconds;
-    sprintf(tmp, "opengl @ fps: %.2f", fps);
+    stage_stats frame;
+    prof_stats(STAGE_FRAME, &frame);
+    sprintf(tmp, "opengl @ fps: %.2f p99: %.2fms max: %.2fms", fps, frame.p99,
+            frame.max);
     glfwSetWindowTitle(window, tmp);
     frame_count = 0;
   }
@@ -165,19 +210,36 @@ GLuint init_indexed_vertex_buffer(void *ctx, vertex_provider vertex_func,
   return vbo;
 }
 
-GLuint init_texture(int width, int height) {
+// Texture formats matching each canvas format, so the upload is a plain
+// copy. Premultiplied canvases upload as is.
+static const struct {
+  GLenum internal;
+  GLenum format;
+  GLenum type;
+} gl_formats[NUM_PIXEL_FORMATS] = {
+    [PIXEL_RGBA8888] = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE},
+    [PIXEL_RGBA8888_PREMUL] = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE},
+    [PIXEL_RGB565] = {GL_RGB565, GL_RGB, GL_UNSIGNED_SHORT_5_6_5},
+    [PIXEL_GRAY8] = {GL_R8, GL_RED, GL_UNSIGNED_BYTE},
+};
+
+GLuint init_texture(int width, int height, pixel_format format) {
   unsigned int texture;
   glGenTextures(1, &texture);
   glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, NULL);
-  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA, width, height);
+  glTexImage2D(GL_TEXTURE_2D, 0, gl_formats[format].internal, width, height,
+               0, gl_formats[format].format, gl_formats[format].type, NULL);
 
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                  GL_LINEAR_MIPMAP_LINEAR);
+  // there are no mipmaps, sampling with a mipmap filter reads black
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  if (format == PIXEL_GRAY8) {
+    // sample as gray instead of red
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+  }
 
   glBindTexture(GL_TEXTURE_2D, 0);
   return texture;
@@ -197,76 +259,127 @@ GLuint init_framebuffer(GLuint texture) {
   return fb;
 }
 
-void flip_image(unsigned int *image, int width, int height) {
-  __m256i temp1, temp2;
-
-  for (int row = 0; row < height / 2; ++row) {
-    unsigned int *topRow = image + row * width;
-    unsigned int *bottomRow = image + (height - row - 1) * width;
-
-    // Process 8 elements at a time using AVX2 intrinsics
-    for (int col = 0; col < width; col += 8) {
-      // Load two 256-bit registers with top and bottom rows
-      temp1 = _mm256_loadu_si256((__m256i *)(topRow + col));
-      temp2 = _mm256_loadu_si256((__m256i *)(bottomRow + col));
-
-      // Swap or copy elements using AVX2 instructions
-      _mm256_storeu_si256((__m256i *)(topRow + col), temp2);
-      _mm256_storeu_si256((__m256i *)(bottomRow + col), temp1);
-    }
-  }
-}
+// The canvas is uploaded top row first, render_fb flips it back while it
+// blits, so the CPU never has to.
+void render_texture(GLuint texture, canvas canvas) {
+  prof_begin(STAGE_RESOLVE);
+  resolve_canvas(canvas);
+  prof_end(STAGE_RESOLVE);
 
-void render_texture(GLuint texture, int w, int h, void *pixels) {
-  flip_image(pixels, w, h);
+  prof_begin(STAGE_UPLOAD);
+  TRACE_BEGIN("upload");
   glBindTexture(GL_TEXTURE_2D, texture);
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE,
-                  pixels);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas.stride);
+  // compact rows are not padded to 4 bytes
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, canvas.w, canvas.h,
+                  gl_formats[canvas.format].format,
+                  gl_formats[canvas.format].type, canvas.pixels);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
   glBindTexture(GL_TEXTURE_2D, 0);
+  TRACE_END();
+  prof_end(STAGE_UPLOAD);
 }
 
 void render_fb(GLuint fb, int width, int height, int img_width,
                int img_height) {
+  prof_begin(STAGE_BLIT);
+  TRACE_ZONE("render_fb");
   glBindFramebuffer(GL_READ_FRAMEBUFFER, fb);
   glViewport(0, 0, width, height);
   glReadBuffer(GL_COLOR_ATTACHMENT0);
 
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-  glBlitFramebuffer(0, 0, img_width, img_height, 0, 0, width, height,
+  // canvas rows run top to bottom, GL's bottom to top
+  glBlitFramebuffer(0, 0, img_width, img_height, 0, height, width, 0,
                     GL_COLOR_BUFFER_BIT, GL_LINEAR);
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  prof_end(STAGE_BLIT);
 }
 
-void *run(int width, int height, init_func init_func, update_func update_func) {
+// Draws [0, u) x [0, v) of the texture over the viewport, flipped like
+// render_fb. Blits can't swizzle or convert formats, this can. Needs a
+// vertex array bound.
+void render_quad(GLuint program, GLuint texture, int width, int height,
+                 float u, float v) {
+  prof_begin(STAGE_BLIT);
+  TRACE_ZONE("render_quad");
+  glViewport(0, 0, width, height);
+  glUseProgram(program);
+  glUniform2f(glGetUniformLocation(program, "scale"), u, v);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glUseProgram(0);
+  prof_end(STAGE_BLIT);
+}
+
+void *run(int width, int height, init_func init_func, update_func update_func,
+          const run_options *opts) {
   GLFWwindow *window = init_window(width, height);
 
+  pacer pacer;
+  pacer_init(&pacer, opts->pacing, opts->fps);
+  glfwSwapInterval(pacer.mode == PACE_VSYNC ? 1 : 0);
+
+  recording *rec = opts->rec;
+
+  TRACE_THREAD_NAME("main");
   void *ctx = init_func(width, height);
 
   double currentFrame = glfwGetTime();
   double lastFrame = currentFrame - 1e-3;
   double deltaTime;
-  //  struct timespec rem = {0};
 
   while (!glfwWindowShouldClose(window)) {
-    currentFrame = glfwGetTime();
-    deltaTime = currentFrame - lastFrame;
+    TRACE_ZONE("frame");
+    prof_begin_frame();
 
-    /* if (deltaTime < .04167) { */
-    /*   struct timespec req = {0, (.04167 - deltaTime) * 1e9}; */
-    /*   nanosleep(&req, &rem); */
-    /*   currentFrame = glfwGetTime(); */
-    /*   deltaTime = currentFrame - lastFrame; */
-    /* } */
+    prof_begin(STAGE_PACE);
+    TRACE_BEGIN("pace");
+    pacer_wait(&pacer);
+    TRACE_END();
+    prof_end(STAGE_PACE);
 
+    // input is sampled right before the simulation that consumes it
+    TRACE_BEGIN("poll_events");
+    glfwPollEvents();
+    TRACE_END();
+    uint64_t input_time = clock_ns();
+
+    currentFrame = glfwGetTime();
+    deltaTime = currentFrame - lastFrame;
     lastFrame = currentFrame;
     glfwGetFramebufferSize(window, &width, &height);
     glViewport(0, 0, width, height);
     update_fps_counter(window, currentFrame);
 
+    if (rec != NULL &&
+        record_frame(rec, deltaTime, pending_events, num_pending_events) != 0) {
+      fprintf(stderr, "Error recording frame:\n%d: %s\n", errno,
+              strerror(errno));
+      rec = NULL;
+    }
+    for (uint16_t i = 0; i < num_pending_events; ++i) {
+      opts->input_func(ctx, &pending_events[i]);
+    }
+    num_pending_events = 0;
+
     update_func(ctx, width, height, deltaTime);
 
+    prof_begin(STAGE_SWAP);
+    TRACE_BEGIN("swap");
     glfwSwapBuffers(window);
-    glfwPollEvents();
+    TRACE_END();
+    prof_end(STAGE_SWAP);
+
+    // swap returning is as close to photons as we can observe from here
+    uint64_t latency = clock_ns() - input_time;
+    prof_set(STAGE_LATENCY, latency);
+    prof_end_frame();
+    pacer_frame_done(&pacer, latency);
   }
 
   glfwDestroyWindow(window);
@@ -0,0 +1,416 @@
+#ifndef INCLUDE_HUD_H
+#define INCLUDE_HUD_H
+
+#include <stddef.h>
+
+#include <immintrin.h>
+
+#include "blit.h"
+#include "draw.h"
+#include "profiler.h"
+
+#define HUD_SCALE 2
+#define HUD_GLYPH_W 5
+#define HUD_GLYPH_H 7
+#define HUD_GLYPHS 64 // ASCII 32..95, lowercase is drawn as uppercase
+#define HUD_BATCH 64  // glyphs per blit
+
+#define HUD_ADVANCE ((HUD_GLYPH_W + 1) * HUD_SCALE)
+#define HUD_LINE_H ((HUD_GLYPH_H + 2) * HUD_SCALE)
+#define HUD_CELL_W (((HUD_GLYPH_W * HUD_SCALE) + 7) & ~7)
+#define HUD_CELL_H (HUD_GLYPH_H * HUD_SCALE)
+
+#define HUD_GRAPH_FRAMES 128
+#define HUD_TEXT_COLOR 0xffe0e0e0
+#define HUD_BUDGET_MS 16.667f
+
+// Glyphs pre-rasterized at HUD_SCALE into rows of whole AVX registers, one
+// above the other so the font doubles as an atlas. Transparent pixels are 0,
+// so each pixel is its own store mask, and the color key when blitted.
+typedef struct {
+  color cells[HUD_GLYPHS][HUD_CELL_H][HUD_CELL_W];
+} hud_font;
+
+void hud_font_init(hud_font *font, color fg);
+int hud_text(canvas canvas, const hud_font *font, int x, int y,
+             const char *text);
+void hud_panel(canvas canvas, const Rectangle *rect);
+void hud_graph(canvas canvas, const Rectangle *rect, const float *values,
+               size_t n, float max_value);
+void draw_perf_hud(canvas canvas, const hud_font *font, size_t num_objects);
+
+#endif
+
+#if defined(HUD_IMPLEMENTATION) && !defined(INCLUDE_HUD_IMPL)
+#define INCLUDE_HUD_IMPL
+
+#include <stdio.h>
+#include <string.h>
+
+// 5x7 glyphs, one byte per row, bit 4 is the leftmost column
+static const unsigned char hud_font_5x7[HUD_GLYPHS][HUD_GLYPH_H] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // !
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // #
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // $
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // %
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // &
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, // (
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, // )
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // *
+    {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08}, // ,
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, // .
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // /
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, // 0
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, // 1
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, // 2
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, // 3
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, // 4
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, // 5
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, // 6
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // 7
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, // 8
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, // 9
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, // :
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ;
+    {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, // <
+    {0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00}, // =
+    {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, // >
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ?
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // @
+    {0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // A
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, // B
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, // C
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, // D
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, // E
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, // F
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, // G
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // H
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, // I
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, // J
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // K
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, // L
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, // M
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // N
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // O
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, // P
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, // Q
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, // R
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, // S
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // T
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // U
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, // V
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, // W
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, // X
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, // Y
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, // Z
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // [
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // backslash
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ]
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ^
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f}, // _
+};
+
+void hud_font_init(hud_font *font, color fg) {
+  for (int g = 0; g < HUD_GLYPHS; ++g) {
+    for (int y = 0; y < HUD_CELL_H; ++y) {
+      unsigned char bits = hud_font_5x7[g][y / HUD_SCALE];
+      for (int x = 0; x < HUD_CELL_W; ++x) {
+        int col = x / HUD_SCALE;
+        bool on = col < HUD_GLYPH_W && (bits >> (HUD_GLYPH_W - 1 - col)) & 1;
+        font->cells[g][y][x] = on ? fg : 0;
+      }
+    }
+  }
+}
+
+static inline int hud_glyph_index(char c) {
+  if (c >= 'a' && c <= 'z') {
+    c -= 'a' - 'A';
+  }
+  if (c < 32 || c >= 32 + HUD_GLYPHS) {
+    return 0;
+  }
+  return c - 32;
+}
+
+static inline canvas hud_atlas(const hud_font *font) {
+  return (canvas){
+      .pixels = (color *)font->cells,
+      .w = HUD_CELL_W,
+      .h = HUD_GLYPHS * HUD_CELL_H,
+      .stride = HUD_CELL_W,
+  };
+}
+
+// Compact formats and tiled layouts, through the blitter.
+static int hud_text_blit(canvas canvas, const hud_font *font, int x, int y,
+                         const char *text) {
+  sprite glyphs[HUD_BATCH];
+  size_t n = 0;
+  for (; *text; ++text, x += HUD_ADVANCE) {
+    if (*text == ' ' || x < 0 || x + HUD_GLYPH_W * HUD_SCALE > canvas.w) {
+      continue;
+    }
+    int g = hud_glyph_index(*text);
+    glyphs[n++] = (sprite){
+        .src = {0, g * HUD_CELL_H, HUD_GLYPH_W * HUD_SCALE, HUD_CELL_H},
+        .dst = {x, y, HUD_GLYPH_W * HUD_SCALE, HUD_CELL_H},
+    };
+    if (n == HUD_BATCH) {
+      blit_sprites(canvas, hud_atlas(font), glyphs, n, BLIT_KEY, 0);
+      n = 0;
+    }
+  }
+  blit_sprites(canvas, hud_atlas(font), glyphs, n, BLIT_KEY, 0);
+  return x;
+}
+
+// Returns the x coordinate after the last glyph. Glyphs that would not fit
+// on the canvas are skipped.
+int hud_text(canvas canvas, const hud_font *font, int x, int y,
+             const char *text) {
+  if (y < 0 || y + HUD_CELL_H > canvas.h) {
+    return x + HUD_ADVANCE * (int)strlen(text);
+  }
+  if (canvas.layout != CANVAS_LINEAR ||
+      pixel_size(canvas.format) != sizeof(color)) {
+    return hud_text_blit(canvas, font, x, y, text);
+  }
+
+  // RGBA rows store whole cells, cheaper than clipping and keying every
+  // glyph as a sprite
+  for (; *text; ++text, x += HUD_ADVANCE) {
+    if (*text == ' ' || x < 0 || x + HUD_GLYPH_W * HUD_SCALE > canvas.w) {
+      continue;
+    }
+    const color(*cell)[HUD_CELL_W] = font->cells[hud_glyph_index(*text)];
+    touch_tiles(canvas, x, y, x + HUD_GLYPH_W * HUD_SCALE, y + HUD_CELL_H);
+    color *dst = &canvas.pixels[(size_t)y * canvas.stride + x];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    for (int row = 0; row < HUD_CELL_H; ++row, dst += canvas.stride) {
+      for (int i = 0; i < HUD_CELL_W; i += 8) {
+        __m256i src = _mm256_loadu_si256((const __m256i *)&cell[row][i]);
+        // the cell is keyed on zero like the blit path, whatever fg's alpha;
+        // lanes past the glyph, and so past the canvas edge, are zero too
+        __m256i on = _mm256_xor_si256(_mm256_cmpeq_epi32(src, zero), ones);
+        _mm256_maskstore_epi32((int *)&dst[i], on, src);
+      }
+    }
+  }
+  return x;
+}
+
+// Halves the brightness of the area so text stays readable over the scene.
+// Halving each field drops its low bit, the mask keeps the top bit of one
+// field from landing in the next.
+static void hud_panel565(canvas canvas, int x0, int y0, int x1, int y1) {
+  const __m256i half = _mm256_set1_epi16(0x7bef);
+  for (int y = y0; y < y1; ++y) {
+    uint16_t *row = &canvas.pixels16[(size_t)y * canvas.stride];
+    int x = x0;
+    for (; x + 16 <= x1; x += 16) {
+      __m256i v = _mm256_loadu_si256((__m256i *)&row[x]);
+      v = _mm256_and_si256(_mm256_srli_epi16(v, 1), half);
+      _mm256_storeu_si256((__m256i *)&row[x], v);
+    }
+    for (; x < x1; ++x) {
+      row[x] = (row[x] >> 1) & 0x7bef;
+    }
+  }
+}
+
+static void hud_panel_gray(canvas canvas, int x0, int y0, int x1, int y1) {
+  const __m256i half = _mm256_set1_epi8(0x7f);
+  for (int y = y0; y < y1; ++y) {
+    uint8_t *row = &canvas.pixels8[(size_t)y * canvas.stride];
+    int x = x0;
+    for (; x + 32 <= x1; x += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *)&row[x]);
+      v = _mm256_and_si256(_mm256_srli_epi16(v, 1), half);
+      _mm256_storeu_si256((__m256i *)&row[x], v);
+    }
+    for (; x < x1; ++x) {
+      row[x] >>= 1;
+    }
+  }
+}
+
+static void hud_panel_rgba(canvas canvas, int x0, int y0, int x1, int y1) {
+  const __m256i half = _mm256_set1_epi32(0x007f7f7f);
+  const __m256i alpha = _mm256_set1_epi32(0xff000000);
+  for (int y = y0; y < y1; ++y) {
+    color *row = &canvas.pixels[(size_t)y * canvas.stride];
+    int x = x0;
+    for (; x + 8 <= x1; x += 8) {
+      __m256i v = _mm256_loadu_si256((__m256i *)&row[x]);
+      v = _mm256_and_si256(_mm256_srli_epi32(v, 1), half);
+      _mm256_storeu_si256((__m256i *)&row[x], _mm256_or_si256(v, alpha));
+    }
+    for (; x < x1; ++x) {
+      row[x] = ((row[x] >> 1) & 0x007f7f7f) | 0xff000000;
+    }
+  }
+}
+
+static void hud_panel_pixels(canvas canvas, int x0, int y0, int x1, int y1) {
+  if (canvas.format == PIXEL_RGB565) {
+    hud_panel565(canvas, x0, y0, x1, y1);
+  } else if (canvas.format == PIXEL_GRAY8) {
+    hud_panel_gray(canvas, x0, y0, x1, y1);
+  } else {
+    hud_panel_rgba(canvas, x0, y0, x1, y1);
+  }
+}
+
+// What the panel turns c into, halved in the canvas format like the pixels.
+static color hud_panel_color(pixel_format format, color c) {
+  uint32_t p = pack_pixel(format, c);
+  if (format == PIXEL_RGB565) {
+    p = (p >> 1) & 0x7bef;
+  } else if (format == PIXEL_GRAY8) {
+    p >>= 1;
+  } else {
+    p = ((p >> 1) & 0x007f7f7f) | 0xff000000;
+  }
+  return unpack_pixel(format, p);
+}
+
+// Tiles still pending their clear are written once, with the halved clear
+// color under the panel, instead of being filled and then read back.
+void hud_panel(canvas canvas, const Rectangle *rect) {
+  int x0 = rect->x < 0 ? 0 : rect->x;
+  int y0 = rect->y < 0 ? 0 : rect->y;
+  int x1 = rect->x + rect->w > canvas.w ? canvas.w : rect->x + rect->w;
+  int y1 = rect->y + rect->h > canvas.h ? canvas.h : rect->y + rect->h;
+  canvas_tiles *t = canvas.tiles;
+  if (t == NULL || x0 >= x1 || y0 >= y1) {
+    hud_panel_pixels(canvas, x0, y0, x1, y1);
+    return;
+  }
+
+  color dark = hud_panel_color(canvas.format, t->color);
+  for (int ty = y0 >> TILE_SHIFT_Y; ty <= (y1 - 1) >> TILE_SHIFT_Y; ++ty) {
+    int top = ty << TILE_SHIFT_Y;
+    int bottom = top + TILE_H > canvas.h ? canvas.h : top + TILE_H;
+    int py0 = y0 > top ? y0 : top;
+    int py1 = y1 < bottom ? y1 : bottom;
+    const uint8_t *state = &t->state[ty * t->cols];
+    int last = (x1 - 1) >> TILE_SHIFT_X;
+    // runs of tiles that are all pending their clear, or all not
+    for (int tx = x0 >> TILE_SHIFT_X; tx <= last;) {
+      bool clear = state[tx] == TILE_CLEAR;
+      int end = tx + 1;
+      while (end <= last && (state[end] == TILE_CLEAR) == clear) {
+        ++end;
+      }
+      int left = tx << TILE_SHIFT_X;
+      int right = end << TILE_SHIFT_X;
+      right = right > canvas.w ? canvas.w : right;
+      int px0 = x0 > left ? x0 : left;
+      int px1 = x1 < right ? x1 : right;
+      tx = end;
+      if (!clear) {
+        claim_tiles(canvas, left, top, right, bottom, true);
+        hud_panel_pixels(canvas, px0, py0, px1, py1);
+        continue;
+      }
+      claim_tiles(canvas, left, top, right, bottom, false);
+      for (int y = top; y < bottom; ++y) {
+        if (y < py0 || y >= py1) {
+          canvas_fill_row(canvas, left, y, right - left, t->color);
+          continue;
+        }
+        canvas_fill_row(canvas, left, y, px0 - left, t->color);
+        canvas_fill_row(canvas, px0, y, px1 - px0, dark);
+        canvas_fill_row(canvas, px1, y, right - px1, t->color);
+      }
+    }
+  }
+}
+
+// Bar graph of values, newest on the right. Bars over the budget are red.
+void hud_graph(canvas canvas, const Rectangle *rect, const float *values,
+               size_t n, float max_value) {
+  int bar_w = n > 0 ? rect->w / (int)n : 0;
+  if (bar_w == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    float t = values[i] / max_value;
+    t = t > 1.f ? 1.f : t;
+    int h = t * rect->h;
+    if (h == 0) {
+      continue;
+    }
+    canvas.color = values[i] > HUD_BUDGET_MS ? RED : GREEN;
+    draw_rectangle(canvas, &(Rectangle){rect->x + (int)i * bar_w,
+                                        rect->y + rect->h - h, bar_w - 1, h});
+  }
+
+  int budget_y = rect->y + rect->h - (int)(HUD_BUDGET_MS / max_value * rect->h);
+  if (budget_y >= rect->y) {
+    canvas.color = CYAN;
+    draw_rectangle(canvas, &(Rectangle){rect->x, budget_y, rect->w, 1});
+  }
+}
+
+void draw_perf_hud(canvas canvas, const hud_font *font, size_t num_objects) {
+  static frame_record records[HUD_GRAPH_FRAMES];
+  static char lines[NUM_STAGES + 2][40];
+  static uint64_t last_refresh;
+  float frame_ms[HUD_GRAPH_FRAMES];
+
+  size_t n = prof_snapshot(records, HUD_GRAPH_FRAMES);
+  for (size_t i = 0; i < n; ++i) {
+    frame_ms[i] = records[i].durations[STAGE_FRAME] / NS_PER_MS;
+  }
+
+  // text only changes as often as the window title does
+  uint64_t now = clock_ns();
+  if (now - last_refresh > NS_PER_SEC / 4) {
+    last_refresh = now;
+    double total_ms = 0;
+    for (size_t i = 0; i < n; ++i) {
+      total_ms += frame_ms[i];
+    }
+    snprintf(lines[0], sizeof(lines[0]), "FPS %6.1f  OBJECTS %zu",
+             total_ms > 0 ? 1000.0 * n / total_ms : 0.0, num_objects);
+    snprintf(lines[1], sizeof(lines[1]), "STAGE (MS)  P50   P99   MAX");
+    for (int s = 0; s < NUM_STAGES; ++s) {
+      stage_stats stats;
+      prof_stats(s, &stats);
+      snprintf(lines[s + 2], sizeof(lines[s + 2]), "%-10s%6.2f%6.2f%6.2f",
+               stage_name(s), stats.p50, stats.p99, stats.max);
+    }
+  }
+
+  const int pad = 4 * HUD_SCALE;
+  const int graph_h = 32 * HUD_SCALE;
+  const int num_lines = sizeof(lines) / sizeof(lines[0]);
+  Rectangle panel = {
+      .x = pad,
+      .y = pad,
+      .w = 2 * pad + 28 * HUD_ADVANCE,
+      .h = 2 * pad + num_lines * HUD_LINE_H + HUD_LINE_H / 2 + graph_h,
+  };
+  hud_panel(canvas, &panel);
+
+  int x = panel.x + pad;
+  int y = panel.y + pad;
+  for (int i = 0; i < num_lines; ++i, y += HUD_LINE_H) {
+    hud_text(canvas, font, x, y, lines[i]);
+  }
+
+  y += HUD_LINE_H / 2;
+  hud_graph(canvas, &(Rectangle){x, y, panel.w - 2 * pad, graph_h}, frame_ms,
+            n, 2 * HUD_BUDGET_MS);
+}
+
+#endif
@@ -10,7 +10,8 @@ const char *read_entire_file(arena *a, const char *filename);
 
 #endif
 
-#ifdef IOUTILS_IMPLEMENTATION
+#if defined(IOUTILS_IMPLEMENTATION) && !defined(INCLUDE_IOUTILS_IMPL)
+#define INCLUDE_IOUTILS_IMPL
 
 const char *read_entire_file(arena *a, const char *filename) {
   FILE *fp = fopen(filename, "r");
@@ -0,0 +1,167 @@
+#ifndef INCLUDE_LAYERS_H
+#define INCLUDE_LAYERS_H
+
+#include <stdbool.h>
+
+#include "arena.h"
+#include "draw.h"
+
+// Cached layers. A layer is a transparent canvas the size of the frame that
+// is only rasterized again after layer_invalidate or a change of size, and
+// is blended over the frame every frame in between. Pixels are
+// premultiplied, which is what drawing onto a transparent canvas gives; the
+// frame may be in any format.
+//
+// Layers are fast cleared, so the tiles left TILE_DRAWN after a redraw are
+// exactly the ones holding anything and the composite skips the rest.
+
+typedef void (*layer_draw_func)(void *ctx, canvas canvas);
+
+typedef struct {
+  canvas canvas;
+  bool valid;
+  layer_draw_func draw;
+  void *ctx;
+} layer;
+
+int layer_init(layer *l, arena *a, int w, int h, layer_draw_func draw,
+               void *ctx);
+void layer_invalidate(layer *l);
+void layer_composite(layer *l, canvas dst);
+
+void composite_over(canvas dst, canvas src);
+
+#endif
+
+#if defined(LAYERS_IMPLEMENTATION) && !defined(INCLUDE_LAYERS_IMPL)
+#define INCLUDE_LAYERS_IMPL
+
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+int layer_init(layer *l, arena *a, int w, int h, layer_draw_func draw,
+               void *ctx) {
+  color *pixels = arena_alloc(a, sizeof(color) * w * h);
+  canvas_tiles *tiles = arena_alloc(a, sizeof(canvas_tiles));
+  if (pixels == NULL || tiles == NULL ||
+      canvas_tiles_init(tiles, a, w, h) != 0) {
+    return -1;
+  }
+  *l = (layer){
+      .canvas = {.pixels = pixels,
+                 .w = w,
+                 .h = h,
+                 .stride = w,
+                 .tiles = tiles,
+                 .format = PIXEL_RGBA8888_PREMUL},
+      .draw = draw,
+      .ctx = ctx,
+  };
+  return 0;
+}
+
+void layer_invalidate(layer *l) { l->valid = false; }
+
+// Compact destinations are read and written a pixel at a time; the packed
+// result drops the alpha a transparent frame would otherwise keep.
+static void composite_rect_packed(canvas dst, canvas src, int x0, int y0,
+                                  int x1, int y1) {
+  for (int y = y0; y < y1; ++y) {
+    const color *s = &src.pixels[(size_t)y * src.stride];
+    size_t i = (size_t)y * dst.stride;
+    for (int x = x0; x < x1; ++x) {
+      if (s[x] != 0) {
+        canvas_store(dst, i + x, blend_over(s[x], canvas_load(dst, i + x)));
+      }
+    }
+  }
+}
+
+static void composite_rect(canvas dst, canvas src, int x0, int y0, int x1,
+                           int y1) {
+  if (pixel_size(dst.format) != sizeof(color)) {
+    composite_rect_packed(dst, src, x0, y0, x1, y1);
+    return;
+  }
+  const __m256i ones = _mm256_set1_epi8(-1);
+  const __m256i alpha_bytes = _mm256_setr_epi8(
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15, //
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+
+  for (int y = y0; y < y1; ++y) {
+    const color *s = &src.pixels[(size_t)y * src.stride];
+    color *d = &dst.pixels[(size_t)y * dst.stride];
+    int x = x0;
+    for (; x + 8 <= x1; x += 8) {
+      __m256i sv = _mm256_loadu_si256((const __m256i *)&s[x]);
+      if (_mm256_testz_si256(sv, sv)) {
+        continue; // transparent
+      }
+      __m256i a = _mm256_shuffle_epi8(sv, alpha_bytes);
+      if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, ones)) == -1) {
+        _mm256_storeu_si256((__m256i *)&d[x], sv); // opaque
+        continue;
+      }
+      __m256i dv = _mm256_loadu_si256((const __m256i *)&d[x]);
+      _mm256_storeu_si256((__m256i *)&d[x], blend_over8(sv, dv));
+    }
+    for (; x < x1; ++x) {
+      d[x] = blend_over(s[x], d[x]);
+    }
+  }
+}
+
+// Blends src over the part of dst both canvases cover.
+void composite_over(canvas dst, canvas src) {
+  int w = dst.w < src.w ? dst.w : src.w;
+  int h = dst.h < src.h ? dst.h : src.h;
+  touch_tiles(dst, 0, 0, w, h);
+  composite_rect(dst, src, 0, 0, w, h);
+}
+
+static void layer_redraw(layer *l, int w, int h) {
+  TRACE_ZONE("layer_redraw");
+  l->canvas.w = w;
+  l->canvas.h = h;
+  fast_clear_canvas(l->canvas, 0);
+  l->draw(l->ctx, l->canvas);
+  l->valid = true;
+}
+
+// Redraws the layer if needed, then blends the tiles holding anything over
+// dst, which has to be the same size or smaller than the layer's canvas.
+void layer_composite(layer *l, canvas dst) {
+  if (!l->valid || l->canvas.w != dst.w || l->canvas.h != dst.h) {
+    layer_redraw(l, dst.w, dst.h);
+  }
+
+  TRACE_ZONE("layer_composite");
+  canvas_tiles *t = l->canvas.tiles;
+  int cols = (dst.w + TILE_W - 1) >> TILE_SHIFT_X;
+  int rows = (dst.h + TILE_H - 1) >> TILE_SHIFT_Y;
+  for (int ty = 0; ty < rows; ++ty) {
+    const uint8_t *state = &t->state[ty * t->cols];
+    int y0 = ty << TILE_SHIFT_Y;
+    int y1 = y0 + TILE_H > dst.h ? dst.h : y0 + TILE_H;
+    for (int tx = 0; tx < cols;) {
+      if (state[tx] != TILE_DRAWN) {
+        tx++;
+        continue;
+      }
+      int run = tx;
+      while (run < cols && state[run] == TILE_DRAWN) {
+        run++;
+      }
+      int x0 = tx << TILE_SHIFT_X;
+      int x1 = run << TILE_SHIFT_X > dst.w ? dst.w : run << TILE_SHIFT_X;
+      touch_tiles(dst, x0, y0, x1, y1);
+      composite_rect(dst, l->canvas, x0, y0, x1, y1);
+      tx = run;
+    }
+  }
+}
+
+#endif
@@ -37,7 +37,8 @@ static inline void mat4x4_dup(mat4 M, mat4 const N) {
 
 #endif
 
-#ifdef LINMATH_IMPLEMENTATION
+#if defined(LINMATH_IMPLEMENTATION) && !defined(INCLUDE_LINMATH_IMPL)
+#define INCLUDE_LINMATH_IMPL
 
 void matrix_multiply_4x4(mat4 R, const mat4 A, const mat4 B) {
   __m128 a_row1 = _mm_loadu_ps(&B[0]);
@@ -101,12 +102,9 @@ void mat4_scale(mat4 r, mat4 a, float s) {
 
 void normalize_vec4(vec4 dest, vec4 src) {
   __m128 a = _mm_loadu_ps(&src[0]);
-  __m128 b = _mm_loadu_ps(&src[0]);
-  __m128 c = _mm_dp_ps(a, b, 0xF1);
-
-  _mm_storeu_ps(&dest[0], c);
-  b = _mm_set_ps1(1 / sqrt(dest[0]));
-  _mm_storeu_ps(&dest[0], _mm_mul_ps(a, b));
+  // dot product broadcast to every lane, no round trip through dest
+  __m128 len = _mm_sqrt_ps(_mm_dp_ps(a, a, 0xFF));
+  _mm_storeu_ps(&dest[0], _mm_div_ps(a, len));
 }
 
 void mat4_from_vec4_mul_outer(mat4 M, vec4 const a, vec4 const b) {
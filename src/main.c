@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,6 +12,18 @@
 #define IOUTILS_IMPLEMENTATION
 #include "io-utils.h"
 
+#define PROFILER_IMPLEMENTATION
+#include "profiler.h"
+
+#define TRACE_IMPLEMENTATION
+#include "trace.h"
+
+#define PACING_IMPLEMENTATION
+#include "pacing.h"
+
+#define RESOLUTION_IMPLEMENTATION
+#include "resolution.h"
+
 #define OBJECTS_IMPLEMENTATION
 #include "objects.h"
 
@@ -20,18 +34,68 @@
 #include "third_party/GLAD/gl.h"
 #include <GLFW/glfw3.h>
 
+#define REPLAY_IMPLEMENTATION
+#include "replay.h"
+
 #define DRAW_IMPLEMENTATION
 #include "draw.h"
 
+#define BLIT_IMPLEMENTATION
+#include "blit.h"
+
+#define HUD_IMPLEMENTATION
+#include "hud.h"
+
+#define PATH_IMPLEMENTATION
+#include "path.h"
+
+#define COVERAGE_IMPLEMENTATION
+#include "coverage.h"
+
+#define MSAA_IMPLEMENTATION
+#include "msaa.h"
+
+#define SCENE_IMPLEMENTATION
+#include "scene.h"
+
+#define LAYERS_IMPLEMENTATION
+#include "layers.h"
+
+#define WORKERS_IMPLEMENTATION
+#include "workers.h"
+
+#define PARTICLES_IMPLEMENTATION
+#include "particles.h"
+
+#define FILTERS_IMPLEMENTATION
+#include "filters.h"
+
+#define FRAMERING_IMPLEMENTATION
+#include "framering.h"
+
+#define BVH_IMPLEMENTATION
+#include "bvh.h"
+
+#define DEPTH_IMPLEMENTATION
+#include "depth.h"
+
+#define SHADE_IMPLEMENTATION
+#include "shade.h"
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "third_party/stb/stb_image_write.h"
 
 #define LINMATH_IMPLEMENTATION
 #include "linmath.h"
 
-#define ARENA_SIZE 10485760 // 10MB
+#define ARENA_SIZE 16777216 // 16MB, besides the buffers the size of the canvas
+#define ARENA_PIXEL_SIZE 24 // bytes of those buffers per canvas pixel
 
 #define NUM_OBJECTS 20
+#define MAX_NODES 64
+#define NUM_PATHS 4
+#define MAX_PATH_VERBS 32
+#define MAX_BLENDS 65536 // deferred line pixels per frame
 
 #define CANVAS_FACTOR 120
 #define CANVAS_WIDTH CANVAS_FACTOR * 16
@@ -39,6 +103,59 @@
 
 #define PI 3.1415926535
 
+#define DEFAULT_SEED 1 // what rand() uses when never seeded
+#define DEFAULT_FPS 60
+#define MIN_RESOLUTION 0.25f // of the full canvas, per axis
+#define BLUR_SIGMA 2.f
+#define DEFAULT_PARTICLES 65536
+#define PARTICLE_LIFETIME 2.f // seconds, on average
+#define PARTICLE_GRAVITY 500.f
+#define PARTICLE_SIZE 2
+#define INSET_MARGIN 16
+#define EXPORT_SLOTS 4
+#define ANIMATE_GRAIN 256 // objects per job
+#define PICK_SLOP 4          // pixels a click may drag and still pick
+#define SELECTION_COLOR 0xff00ffff
+// A recording's modes are these flags, the --msaa samples in bits 8-15 and
+// the --format in bits 16-23.
+#define MODE_FIXED 0x1
+#define MODE_TILED 0x2
+
+static double raster_budget; // ms, 0 keeps the full resolution
+static pixel_format canvas_format = PIXEL_RGBA8888;
+static uint32_t max_particles = DEFAULT_PARTICLES;
+static const char *export_name; // shared memory frame ring, NULL for none
+static const char *resume_file; // snapshot to start from, NULL for none
+static snapshot_info world;     // saved along with the motion tables
+static bool fixed_mode;         // objects stepped by step_fixed
+static bool tiled_mode;         // scene rasterized into 8x8 pixel blocks
+static int msaa_samples;        // per pixel for scene shapes, 0 for aliased
+static bool replaying;          // headless, the canvas is hashed at the end
+
+// The modes that change what a replay draws, as its header stores them.
+static uint32_t get_modes(void) {
+  return (fixed_mode ? MODE_FIXED : 0) | (tiled_mode ? MODE_TILED : 0) |
+         (uint32_t)msaa_samples << 8 | (uint32_t)canvas_format << 16;
+}
+
+// Refuses, with errno set to EINVAL, modes the command line would not take.
+static int set_modes(uint32_t modes) {
+  int samples = modes >> 8 & 0xff;
+  pixel_format format = modes >> 16 & 0xff;
+  if ((modes & ~(MODE_FIXED | MODE_TILED | 0xffff00)) != 0 ||
+      (samples != 0 && samples != 4 && samples != 8) ||
+      (format != PIXEL_RGBA8888 && format != PIXEL_RGB565 &&
+       format != PIXEL_GRAY8)) {
+    errno = EINVAL;
+    return -1;
+  }
+  fixed_mode = modes & MODE_FIXED;
+  tiled_mode = modes & MODE_TILED;
+  msaa_samples = samples;
+  canvas_format = format;
+  return 0;
+}
+
 float randf(float min, float max) {
   float num = rand() / (float)RAND_MAX;
   return lerp(min, max, num);
@@ -80,76 +197,218 @@ void animate(objid id, double dt, Rectangle *rect, int bound_width,
   rect->h = floor(values[13]);
 }
 
-void rotate_triangle(Vector2 *p0, Vector2 *p1, Vector2 *p2, double dt) {
-  float r1[2], r2[2], r3[2];
-
-  vec2_rotate(r1, (float[2]){p0->x - p2->x, p0->y - p2->y}, dt);
-  vec2_rotate(r2, (float[2]){p1->x - p2->x, p1->y - p2->y}, dt);
-  vec2_rotate(r3, (float[2]){p2->x - p2->x, p2->y - p2->y}, dt);
-
-  p0->x = r1[0] + p2->x;
-  p0->y = r1[1] + p2->y;
-  p1->x = r2[0] + p2->x;
-  p1->y = r2[1] + p2->y;
-  p2->x = r3[0] + p2->x;
-  p2->y = r3[1] + p2->y;
-}
-
-void draw(canvas g, objid num_items, double dt) {
-
-  // clear_canvas(g, 0xFFFFFFFF);
-  clear_canvas(g, DARK_GRAY);
-
-  Rectangle rect = {0};
-  for (objid x = 0; x < num_items; x++) {
-
-    animate(x, dt, &rect, g.w, g.h);
-
-    g.color = RED;
-    draw_rectangle(g, &rect);
-  }
-
-  g.color = CYAN;
-  draw_line(g, (Vector2){50, 50}, (Vector2){300, 333});
-  g.color = RED;
-  draw_line(g, (Vector2){100, 400}, (Vector2){500, 400});
-  draw_line(g, (Vector2){100, 400}, (Vector2){100, 600});
-  g.color = CYAN;
-  draw_line(g, (Vector2){50, 50}, (Vector2){15, 333});
-  g.color = GREEN;
-  draw_line(g, (Vector2){300, 40}, (Vector2){600, 60});
-  g.color = CYAN;
-  draw_line(g, (Vector2){300, 60}, (Vector2){600, 40});
-
-  Vector2 p0 = {500, 150};
-  Vector2 p1 = {505, 200};
-  Vector2 p2 = {600, 160};
-  static double angle = 0;
-  angle += PI * dt;
-  rotate_triangle(&p0, &p1, &p2, angle);
-  g.color = GREEN;
-  draw_triangle(g, p0, p1, p2);
-
-  g.color = PURPLE;
-  draw_triangle(g, (Vector2){150, 50}, (Vector2){175, 75}, (Vector2){200, 50});
-
-  g.color = CYAN;
-  draw_triangle(g, (Vector2){150, 100}, (Vector2){175, 75},
-                (Vector2){200, 100});
-}
+typedef enum {
+  POST_NONE,
+  POST_BLUR,
+  POST_INSET, // a quarter size copy of the frame in its top right corner
+  NUM_POST_EFFECTS,
+} post_effect;
 
 typedef struct {
   arena *arena;
   canvas *g;
+  canvas frame; // top left corner of *g drawn at the current resolution
+  canvas shown; // frame, or post once an effect has been applied
+  canvas post;  // same size as *g, always RGBA
+  canvas tiled; // with --tiled, what the scene is rasterized into
   GLuint fb;
   GLuint texture;
   GLuint vao;
   GLuint vbo;
   GLuint shader;
+  GLuint present; // 0 when the texture can be blitted as is
   GLint mvp_location;
   objid num_items;
+  scene *scene;
+  node_id *boxes;   // one per object
+  Rectangle *rects; // one per object, where animate moved it this frame
+  aabb *bounds;     // one per object, rects as world boxes
+  bvh *picker;      // over bounds, brought up to date by queries
+  bool picker_stale;
+  uint32_t *selection; // objects clicked or dragged over, num_items slots
+  uint32_t num_selected;
+  float drag_x, drag_y; // world point the left button went down at
+  node_id spinner;
+  node_id flower;
+  path *paths; // NUM_PATHS
+  node_id dynamic_group;
+  node_id static_group; // drawn over the dynamic group
+  layer *static_layer;
+  bool cache_layers;
+  coverage *coverage;
+  bool front_to_back;
+  hud_font *font;
+  bool paused;
+  bool show_hud;
+  bool dynamic_resolution;
+  resolution_scaler resolution;
+  uint64_t raster_time; // ns, clear and rasterize of the last frame
+  worker_pool *pool;
+  filters *filters;
+  filter_kernel blur;
+  post_effect effect;
+  particles *sparks;
+  float spark_debt;           // particles owed from earlier frames
+  double tick_debt;           // seconds not stepped yet in fixed mode
+  uint32_t spark_rng;         // xorshift32 state
+  frame_ring *exporter;       // NULL unless frames are exported
+  canvas_tiles *export_tiles; // EXPORT_SLOTS, what each slot's memory holds
 } Ctx;
 
+static float spark_randf(Ctx *ctx, float min, float max) {
+  uint32_t x = ctx->spark_rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ctx->spark_rng = x;
+  return min + (max - min) * (x >> 8) / 16777216.f;
+}
+
+// A fountain at the bottom of the canvas, emitting fast enough to keep the
+// ring full.
+void emit_sparks(Ctx *ctx, double dt) {
+  particles *ps = ctx->sparks;
+  ctx->spark_debt += ps->capacity / PARTICLE_LIFETIME * dt;
+  int n = ctx->spark_debt;
+  ctx->spark_debt -= n;
+  for (int i = 0; i < n; ++i) {
+    float angle = spark_randf(ctx, -0.25f, 0.25f) - PI / 2;
+    float speed = spark_randf(ctx, 500.f, 800.f);
+    color c = 0xff000000 | (int)spark_randf(ctx, 0, 16) << 16 |
+              (int)spark_randf(ctx, 16, 48) << 8 |
+              (int)spark_randf(ctx, 48, 96);
+    particles_emit(ps, ctx->g->w / 2.f, ctx->g->h - 10.f,
+                   speed * cosf(angle), speed * sinf(angle),
+                   spark_randf(ctx, 0.75f, 1.25f) * PARTICLE_LIFETIME, c);
+  }
+}
+
+typedef struct {
+  Ctx *ctx;
+  double dt;
+  int ticks; // fixed mode steps
+} animate_job;
+
+// Objects only touch their own rows of the motion tables.
+void animate_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  animate_job *job = ctx;
+  Ctx *_ctx = job->ctx;
+  // the world keeps the full canvas size whatever the resolution
+  if (fixed_mode) {
+    step_fixed(begin, end, job->ticks, _ctx->g->w << FIXED_SHIFT,
+               _ctx->g->h << FIXED_SHIFT);
+  }
+  for (int x = begin; x < end; ++x) {
+    Rectangle *r = &_ctx->rects[x];
+    if (fixed_mode) {
+      int32_t v[4];
+      fixed_rect(x, v);
+      *r = (Rectangle){v[0], v[1], v[2], v[3]};
+    } else {
+      animate(x, job->dt, r, _ctx->g->w, _ctx->g->h);
+    }
+    _ctx->bounds[x] = (aabb){r->x, r->y, r->x + r->w, r->y + r->h};
+  }
+}
+
+void draw(Ctx *ctx, double dt) {
+  canvas g = ctx->frame;
+  // the scene goes to blocks and is detiled into the frame, where particles,
+  // layers and the HUD draw in rows
+  canvas r = g;
+  if (tiled_mode) {
+    r = ctx->tiled;
+    r.w = g.w;
+    r.h = g.h;
+  }
+  scene *s = ctx->scene;
+
+  prof_begin(STAGE_SIMULATE);
+  TRACE_BEGIN("simulate");
+  animate_job job = {.ctx = ctx, .dt = dt};
+  if (fixed_mode) {
+    ctx->tick_debt += dt * FIXED_TICK_HZ;
+    job.ticks = ctx->tick_debt;
+    ctx->tick_debt -= job.ticks;
+  }
+  parallel_for(ctx->pool, 0, ctx->num_items, ANIMATE_GRAIN, animate_range,
+               &job);
+  ctx->picker_stale = true;
+  for (objid x = 0; x < ctx->num_items; x++) {
+    scene_set_position(s, ctx->boxes[x], ctx->rects[x].x, ctx->rects[x].y);
+  }
+  static double angle = 0;
+  angle += PI * dt;
+  scene_set_rotation(s, ctx->spinner, angle);
+  scene_set_rotation(s, ctx->flower, -angle / 4);
+  scene_update(s);
+  emit_sparks(ctx, dt);
+  particles_update(ctx->sparks, dt);
+  TRACE_END();
+  prof_end(STAGE_SIMULATE);
+
+  uint64_t raster_start = clock_ns();
+
+  // only marks the tiles, memory is written when they are first drawn to
+  prof_begin(STAGE_CLEAR);
+  fast_clear_canvas(r, DARK_GRAY);
+  prof_end(STAGE_CLEAR);
+
+  // the coverage mask addresses pixels in rows and can't blend edges
+  bool painter =
+      !ctx->front_to_back || r.layout != CANVAS_LINEAR || s->samples != 0;
+  if (!painter) {
+    // opaque shapes first, the clear then only fills what they left
+    prof_begin(STAGE_RASTERIZE);
+    TRACE_BEGIN("rasterize");
+    int err = scene_draw_front_to_back(s, g, ctx->coverage, ctx->dynamic_group);
+    TRACE_END();
+    prof_end(STAGE_RASTERIZE);
+
+    if (err != 0) {
+      // more line pixels than the deferred blends hold, start over
+      prof_count(COUNTER_FALLBACK);
+      prof_begin(STAGE_CLEAR);
+      fast_clear_canvas(r, DARK_GRAY);
+      prof_end(STAGE_CLEAR);
+      painter = true;
+    } else {
+      prof_begin(STAGE_CLEAR);
+      coverage_clear(ctx->coverage, g, DARK_GRAY);
+      prof_end(STAGE_CLEAR);
+
+      prof_begin(STAGE_RASTERIZE);
+      coverage_flush(ctx->coverage, g);
+      prof_end(STAGE_RASTERIZE);
+    }
+  }
+  if (painter) {
+    prof_begin(STAGE_RASTERIZE);
+    TRACE_BEGIN("rasterize");
+    scene_draw(s, r, ctx->dynamic_group);
+    if (tiled_mode) {
+      parallel_detile_canvas(ctx->pool, g, r);
+    }
+    TRACE_END();
+    prof_end(STAGE_RASTERIZE);
+  }
+
+  prof_begin(STAGE_PARTICLES);
+  particles_draw(ctx->sparks, g, s->view_x, s->view_y, s->zoom);
+  prof_end(STAGE_PARTICLES);
+
+  prof_begin(STAGE_COMPOSITE);
+  if (ctx->cache_layers) {
+    layer_composite(ctx->static_layer, g);
+  } else {
+    scene_draw(s, g, ctx->static_group);
+  }
+  prof_end(STAGE_COMPOSITE);
+
+  ctx->raster_time = clock_ns() - raster_start;
+}
+
 float *get_verts(void *ctx, size_t *num_elements) {
   (void)ctx;
   static float vertices[] = {
@@ -173,71 +432,488 @@ unsigned int *get_indices(void *ctx, size_t *num_elements) {
   return indices;
 }
 
-void *init(int width, int height) {
+// Five-pointed star through every second point, so the fill rule decides
+// whether the pentagon in the middle is inside.
+void star_path(path *p, float r, fill_rule rule) {
+  path_reset(p);
+  p->rule = rule;
+  for (int i = 0; i < 5; ++i) {
+    float a = -PI / 2 + i * 4 * PI / 5;
+    if (i == 0) {
+      path_move_to(p, r * cosf(a), r * sinf(a));
+    } else {
+      path_line_to(p, r * cosf(a), r * sinf(a));
+    }
+  }
+  path_close(p);
+}
+
+// One cubic loop out of the center per petal.
+void flower_path(path *p, float r, int petals) {
+  path_reset(p);
+  float spread = PI / petals;
+  for (int i = 0; i < petals; ++i) {
+    float a = 2 * PI * i / petals;
+    path_move_to(p, 0, 0);
+    path_cubic_to(p, 1.3f * r * cosf(a - spread), 1.3f * r * sinf(a - spread),
+                  1.3f * r * cosf(a + spread), 1.3f * r * sinf(a + spread), 0,
+                  0);
+  }
+}
+
+void rounded_rect_path(path *p, float w, float h, float r) {
+  path_reset(p);
+  path_move_to(p, r, 0);
+  path_line_to(p, w - r, 0);
+  path_quad_to(p, w, 0, w, r);
+  path_line_to(p, w, h - r);
+  path_quad_to(p, w, h, w - r, h);
+  path_line_to(p, r, h);
+  path_quad_to(p, 0, h, 0, h - r);
+  path_line_to(p, 0, r);
+  path_quad_to(p, 0, 0, r, 0);
+  path_close(p);
+}
+
+// The boxes follow the motion tables and the triangle and the flower spin,
+// everything in the static group stays put and is drawn from a cached layer.
+void build_scene(Ctx *ctx) {
+  scene *s = ctx->scene;
+  node_id group = scene_add(s, SCENE_ROOT, NODE_GROUP, NULL, 0);
+  for (objid x = 0; x < ctx->num_items; x++) {
+    float values[15] = {0};
+    calc_next_pos(x, 0, values);
+    float w = floor(values[12]);
+    float h = floor(values[13]);
+    ctx->boxes[x] =
+        scene_add(s, group, NODE_RECT, (float[4]){0, 0, w, h}, RED);
+    // pickable before the first frame moves them
+    float x0 = floor(values[6]);
+    float y0 = floor(values[7]);
+    ctx->bounds[x] = (aabb){x0, y0, x0 + w, y0 + h};
+  }
+  ctx->picker_stale = true;
+
+  // rotates about its last corner
+  ctx->spinner = scene_add(s, group, NODE_TRIANGLE,
+                           (float[6]){-100, -10, -95, 40, 0, 0}, GREEN);
+  scene_set_position(s, ctx->spinner, 600, 160);
+
+  flower_path(&ctx->paths[0], 90, 6);
+  ctx->flower = scene_add(s, group, NODE_PATH, NULL, PURPLE);
+  scene_set_path(s, ctx->flower, &ctx->paths[0]);
+  scene_set_position(s, ctx->flower, 400, 800);
+  ctx->dynamic_group = group;
+
+  group = scene_add(s, SCENE_ROOT, NODE_GROUP, NULL, 0);
+  scene_add(s, group, NODE_LINE, (float[4]){50, 50, 300, 333}, CYAN);
+  scene_add(s, group, NODE_LINE, (float[4]){100, 400, 500, 400}, RED);
+  scene_add(s, group, NODE_LINE, (float[4]){100, 400, 100, 600}, RED);
+  scene_add(s, group, NODE_LINE, (float[4]){50, 50, 15, 333}, CYAN);
+  scene_add(s, group, NODE_LINE, (float[4]){300, 40, 600, 60}, GREEN);
+  scene_add(s, group, NODE_LINE, (float[4]){300, 60, 600, 40}, CYAN);
+  scene_add(s, group, NODE_TRIANGLE, (float[6]){150, 50, 175, 75, 200, 50},
+            PURPLE);
+  scene_add(s, group, NODE_TRIANGLE, (float[6]){150, 100, 175, 75, 200, 100},
+            CYAN);
+
+  star_path(&ctx->paths[1], 70, FILL_EVEN_ODD);
+  star_path(&ctx->paths[2], 70, FILL_NONZERO);
+  rounded_rect_path(&ctx->paths[3], 200, 140, 30);
+  const float path_pos[][2] = {{820, 150}, {980, 150}, {1100, 80}};
+  for (int i = 1; i < NUM_PATHS; ++i) {
+    node_id id = scene_add(s, group, NODE_PATH, NULL, i < 3 ? CYAN : BLUE);
+    scene_set_path(s, id, &ctx->paths[i]);
+    scene_set_position(s, id, path_pos[i - 1][0], path_pos[i - 1][1]);
+  }
+  ctx->static_group = group;
+}
+
+// Brings the picking tree up to date with the objects last drawn. Refits
+// are cheap; the tree is only rebuilt once they have loosened it too far.
+void update_picker(Ctx *ctx) {
+  if (!ctx->picker_stale) {
+    return;
+  }
+  bvh *b = ctx->picker;
+  bvh_refit(b, ctx->bounds);
+  if (b->num_items != ctx->num_items || bvh_degraded(b)) {
+    bvh_build(b, ctx->bounds, ctx->num_items);
+  }
+  ctx->picker_stale = false;
+}
+
+// World point under the cursor of an input event.
+void event_position(Ctx *ctx, const input_event *event, float *x, float *y) {
+  scene *s = ctx->scene;
+  *x = s->view_x + event->x * ctx->frame.w / s->zoom;
+  *y = s->view_y + event->y * ctx->frame.h / s->zoom;
+}
+
+// A click selects the object on top under it, the one drawn last, and a
+// drag every object the box from (x0, y0) to (x1, y1) touches.
+void select_objects(Ctx *ctx, float x0, float y0, float x1, float y1) {
+  TRACE_ZONE("select");
+  update_picker(ctx);
+  float slop = PICK_SLOP / ctx->scene->zoom;
+  if (fabsf(x1 - x0) <= slop && fabsf(y1 - y0) <= slop) {
+    uint32_t n = bvh_query_point(ctx->picker, x1, y1, ctx->selection,
+                                 ctx->num_items);
+    for (uint32_t i = 1; i < n; ++i) {
+      if (ctx->selection[i] > ctx->selection[0]) {
+        ctx->selection[0] = ctx->selection[i];
+      }
+    }
+    ctx->num_selected = n > 0;
+  } else {
+    aabb box = {fminf(x0, x1), fminf(y0, y1), fmaxf(x0, x1), fmaxf(y0, y1)};
+    ctx->num_selected =
+        bvh_query_rect(ctx->picker, box, ctx->selection, ctx->num_items);
+  }
+}
+
+static inline int selection_coord(float v) {
+  return floorf(fmaxf(-SCENE_COORD_LIMIT, fminf(v, SCENE_COORD_LIMIT)));
+}
+
+// Outlines the selected objects where they are now.
+void draw_selection(Ctx *ctx, canvas g) {
+  scene *s = ctx->scene;
+  g.color = SELECTION_COLOR;
+  for (uint32_t i = 0; i < ctx->num_selected; ++i) {
+    const Rectangle *r = &ctx->rects[ctx->selection[i]];
+    int x0 = selection_coord((r->x - s->view_x) * s->zoom);
+    int y0 = selection_coord((r->y - s->view_y) * s->zoom);
+    int x1 = selection_coord((r->x + r->w - s->view_x) * s->zoom);
+    int y1 = selection_coord((r->y + r->h - s->view_y) * s->zoom);
+    draw_rectangle(g, &(Rectangle){x0, y0, x1 - x0, 1});
+    draw_rectangle(g, &(Rectangle){x0, y1 - 1, x1 - x0, 1});
+    draw_rectangle(g, &(Rectangle){x0, y0, 1, y1 - y0});
+    draw_rectangle(g, &(Rectangle){x1 - 1, y0, 1, y1 - y0});
+  }
+}
+
+void draw_static_layer(void *ctx, canvas canvas) {
+  Ctx *_ctx = (Ctx *)ctx;
+  scene_draw(_ctx->scene, canvas, _ctx->static_group);
+}
+
+// Zooms about the middle of the canvas.
+void zoom_view(scene *s, canvas g, float factor) {
+  float cx = s->view_x + g.w / (2.f * s->zoom);
+  float cy = s->view_y + g.h / (2.f * s->zoom);
+  float zoom = s->zoom * factor;
+  scene_set_view(s, cx - g.w / (2.f * zoom), cy - g.h / (2.f * zoom), zoom);
+}
+
+void pan_view(scene *s, canvas g, float dx, float dy) {
+  scene_set_view(s, s->view_x + dx * g.w / s->zoom,
+                 s->view_y + dy * g.h / s->zoom, s->zoom);
+}
+
+// Draws to the top left corner of the canvas at scale times its size. The
+// zoom follows, so the same part of the world stays on screen.
+// Runs after the scene is drawn and before the HUD, which stays sharp.
+// Effects fail on compact canvas formats, which then show the plain frame.
+void post_process(Ctx *ctx) {
+  canvas frame = ctx->frame;
+  canvas post = ctx->post;
+  post.w = frame.w;
+  post.h = frame.h;
+
+  switch (ctx->effect) {
+  case POST_BLUR:
+    if (blur_canvas(ctx->filters, post, frame, &ctx->blur) == 0) {
+      ctx->shown = post;
+    }
+    break;
+  case POST_INSET: {
+    // halved into post, then scaled again into the corner of the frame
+    canvas half = post;
+    half.w = frame.w / 2;
+    half.h = frame.h / 2;
+    Rectangle r = {frame.w - frame.w / 4 - INSET_MARGIN, INSET_MARGIN,
+                   frame.w / 4, frame.h / 4};
+    if (r.x < 0 || r.y + r.h > frame.h ||
+        downsample_canvas(ctx->filters, half, frame) != 0) {
+      break;
+    }
+    // a corner can't carry the frame's tiles, claim them here instead
+    touch_tiles(frame, r.x, r.y, r.x + r.w, r.y + r.h);
+    canvas inset = frame;
+    inset.pixels += (size_t)r.y * frame.stride + r.x;
+    inset.w = r.w;
+    inset.h = r.h;
+    inset.tiles = NULL;
+    resize_canvas(ctx->filters, inset, half);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void set_resolution(Ctx *ctx, float scale) {
+  int w = ctx->g->w * scale + 0.5f;
+  int h = ctx->g->h * scale + 0.5f;
+  w = w < 1 ? 1 : w;
+  h = h < 1 ? 1 : h;
+  if (w == ctx->frame.w && h == ctx->frame.h) {
+    return;
+  }
+  scene *s = ctx->scene;
+  scene_set_view(s, s->view_x, s->view_y, s->zoom * w / ctx->frame.w);
+  ctx->frame.w = w;
+  ctx->frame.h = h;
+}
+
+void *init_scene(int width, int height) {
   arena *_arena = malloc(sizeof(arena));
-  if (init_arena(_arena, ARENA_SIZE) == NULL) {
+  size_t arena_size = ARENA_SIZE + (size_t)ARENA_PIXEL_SIZE * width * height +
+                      particles_size(max_particles) + bvh_size(NUM_OBJECTS);
+  if (init_arena(_arena, arena_size) == NULL) {
     fprintf(stderr, "Error allocating arena\n");
     exit(EXIT_FAILURE);
     return NULL;
   }
 
-  init_motion_tables(_arena, NUM_OBJECTS);
-
   objid num_items = 0;
-  for (int x = 0; x < NUM_OBJECTS; x++) {
-    float size = randf(15.f, 30.f);
-    num_items = new_object((float[12]){
-        randf(-500.f, 500.f), randf(-500.f, 500.f), 0.f, // acceleration
-        randf(-250.f, 250.f), randf(-250.f, 250.f), 0.f, // velocity
-        randf(0.f, CANVAS_WIDTH - size), randf(0.f, CANVAS_HEIGHT - size),
-        0.f,             // position
-        size, size, 0.f, // dimensions
-    });
+  if (resume_file != NULL) {
+    if (map_snapshot(resume_file, &world) != 0) {
+      fprintf(stderr, "Error reading snapshot %s:\n%d: %s\n", resume_file,
+              errno, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (world.num_objects > NUM_OBJECTS) {
+      fprintf(stderr, "Snapshot %s has %lu objects, the scene holds %d\n",
+              resume_file, (unsigned long)world.num_objects, NUM_OBJECTS);
+      exit(EXIT_FAILURE);
+    }
+    num_items = world.num_objects;
+  } else {
+    init_motion_tables(_arena, NUM_OBJECTS);
+    for (int x = 0; x < NUM_OBJECTS; x++) {
+      float size = randf(15.f, 30.f);
+      num_items = new_object((float[12]){
+          randf(-500.f, 500.f), randf(-500.f, 500.f), 0.f, // acceleration
+          randf(-250.f, 250.f), randf(-250.f, 250.f), 0.f, // velocity
+          randf(0.f, CANVAS_WIDTH - size), randf(0.f, CANVAS_HEIGHT - size),
+          0.f,             // position
+          size, size, 0.f, // dimensions
+      });
+    }
+  }
+  if (fixed_mode) {
+    init_fixed_tables(_arena, num_items);
+    load_fixed_tables();
   }
 
   Ctx *ctx = arena_alloc(_arena, sizeof(Ctx));
+  scene *_scene = arena_alloc(_arena, sizeof(scene));
+  node_id *boxes = arena_alloc(_arena, sizeof(node_id) * num_items);
+  Rectangle *rects = arena_alloc(_arena, sizeof(Rectangle) * num_items);
+  aabb *bounds = arena_alloc(_arena, sizeof(aabb) * num_items);
+  uint32_t *selection = arena_alloc(_arena, sizeof(uint32_t) * num_items);
+  bvh *picker = arena_alloc(_arena, sizeof(bvh));
+  if (bounds == NULL || selection == NULL || picker == NULL ||
+      bvh_init(picker, _arena, num_items) != 0) {
+    fprintf(stderr, "Error allocating picking tree\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ctx == NULL || _scene == NULL || boxes == NULL || rects == NULL ||
+      scene_init(_scene, _arena, MAX_NODES) != 0) {
+    fprintf(stderr, "Error allocating scene\n");
+    exit(EXIT_FAILURE);
+  }
+  _scene->samples = msaa_samples;
 
-  color *pixels = arena_alloc(_arena, sizeof(color) * width * height);
+  void *pixels =
+      arena_alloc(_arena, pixel_size(canvas_format) * width * height);
   canvas *g = arena_alloc(_arena, sizeof(canvas));
+  canvas_tiles *tiles = arena_alloc(_arena, sizeof(canvas_tiles));
+  if (pixels == NULL || g == NULL || tiles == NULL ||
+      canvas_tiles_init(tiles, _arena, width, height) != 0) {
+    fprintf(stderr, "Error allocating canvas tiles\n");
+    exit(EXIT_FAILURE);
+  }
 
-  GLuint vao = 0, vbo = 0, texture = 0, fb = 0, program;
+  canvas tiled = {0};
+  if (tiled_mode) {
+    int stride = block_align(width);
+    void *blocks = arena_alloc(_arena, (size_t)pixel_size(canvas_format) *
+                                           stride * block_align(height));
+    canvas_tiles *block_tiles = arena_alloc(_arena, sizeof(canvas_tiles));
+    if (blocks == NULL || block_tiles == NULL ||
+        canvas_tiles_init(block_tiles, _arena, width, height) != 0) {
+      fprintf(stderr, "Error allocating tiled canvas\n");
+      exit(EXIT_FAILURE);
+    }
+    tiled = (canvas){
+        .pixels = blocks,
+        .w = width,
+        .h = height,
+        .stride = stride,
+        .tiles = block_tiles,
+        .format = canvas_format,
+        .layout = CANVAS_TILED,
+    };
+  }
 
-  texture = init_texture(width, height);
-  fb = init_framebuffer(texture);
+  coverage *_coverage = arena_alloc(_arena, sizeof(coverage));
+  if (coverage_init(_coverage, _arena, width, height, MAX_BLENDS) != 0) {
+    fprintf(stderr, "Error allocating coverage mask\n");
+    exit(EXIT_FAILURE);
+  }
 
-  program = init_shader(_arena, "assets/shaders/tutorial1/vertex.glsl",
-                        "assets/shaders/tutorial1/frag.glsl");
-  if (program == 0) {
+  layer *static_layer = arena_alloc(_arena, sizeof(layer));
+  if (static_layer == NULL ||
+      layer_init(static_layer, _arena, width, height, draw_static_layer,
+                 ctx) != 0) {
+    fprintf(stderr, "Error allocating static layer\n");
     exit(EXIT_FAILURE);
   }
 
-  const GLint mvp_location = glGetUniformLocation(program, "mvp");
+  worker_pool *pool = arena_alloc(_arena, sizeof(worker_pool));
+  filters *_filters = arena_alloc(_arena, sizeof(filters));
+  color *post = arena_alloc(_arena, sizeof(color) * width * height);
+  if (pool == NULL || pool_init(pool, pool_default_threads()) != 0 ||
+      _filters == NULL || filters_init(_filters, _arena, pool, width) != 0 ||
+      post == NULL) {
+    fprintf(stderr, "Error allocating post-processing\n");
+    exit(EXIT_FAILURE);
+  }
 
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
+  path *paths = arena_alloc(_arena, sizeof(path) * NUM_PATHS);
+  for (int i = 0; i < NUM_PATHS; ++i) {
+    if (paths == NULL ||
+        path_init(&paths[i], _arena, MAX_PATH_VERBS, 2 * MAX_PATH_VERBS) != 0) {
+      fprintf(stderr, "Error allocating paths\n");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  vbo = init_indexed_vertex_buffer(ctx, get_verts, get_indices);
+  particles *sparks = arena_alloc(_arena, sizeof(particles));
+  if (sparks == NULL || particles_init(sparks, _arena, max_particles) != 0) {
+    fprintf(stderr, "Error allocating particles\n");
+    exit(EXIT_FAILURE);
+  }
+  sparks->gravity = PARTICLE_GRAVITY;
+  sparks->size = PARTICLE_SIZE;
 
-  glBindVertexArray(0);
+  hud_font *font = arena_alloc(_arena, sizeof(hud_font));
+  if (font == NULL) {
+    fprintf(stderr, "Error allocating HUD font\n");
+    exit(EXIT_FAILURE);
+  }
+  hud_font_init(font, HUD_TEXT_COLOR);
+
+  frame_ring *exporter = NULL;
+  canvas_tiles *export_tiles = NULL;
+  if (export_name != NULL) {
+    exporter = arena_alloc(_arena, sizeof(frame_ring));
+    export_tiles = arena_alloc(_arena, sizeof(canvas_tiles) * EXPORT_SLOTS);
+    size_t size = (size_t)pixel_size(canvas_format) * width * height;
+    if (exporter == NULL || export_tiles == NULL ||
+        frame_ring_create(exporter, export_name, EXPORT_SLOTS, size) != 0) {
+      fprintf(stderr, "Error creating frame ring %s:\n%d: %s\n", export_name,
+              errno, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < EXPORT_SLOTS; ++i) {
+      if (canvas_tiles_init(&export_tiles[i], _arena, width, height) != 0) {
+        fprintf(stderr, "Error allocating canvas tiles\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
 
   *g = (canvas){
       .pixels = pixels,
       .w = width,
       .h = height,
       .stride = width,
+      .tiles = tiles,
+      .format = canvas_format,
   };
 
   *ctx = (Ctx){
       .arena = _arena,
       .g = g,
-      .fb = fb,
-      .texture = texture,
-      .vao = vao,
-      .vbo = vbo,
-      .shader = program,
-      .mvp_location = mvp_location,
+      .frame = *g,
+      .shown = *g,
+      .post = {.pixels = post, .w = width, .h = height, .stride = width},
+      .tiled = tiled,
       .num_items = num_items,
+      .scene = _scene,
+      .boxes = boxes,
+      .rects = rects,
+      .bounds = bounds,
+      .picker = picker,
+      .selection = selection,
+      .paths = paths,
+      .static_layer = static_layer,
+      .cache_layers = true,
+      .coverage = _coverage,
+      .front_to_back = true,
+      .font = font,
+      .show_hud = true,
+      .pool = pool,
+      .filters = _filters,
+      .sparks = sparks,
+      .spark_rng = 0x9e3779b9,
+      .exporter = exporter,
+      .export_tiles = export_tiles,
   };
+  gaussian_kernel(&ctx->blur, BLUR_SIGMA);
+  build_scene(ctx);
+
+  return ctx;
+}
+
+void *init(int width, int height) {
+  Ctx *ctx = init_scene(width, height);
+
+  GLuint vao = 0, vbo = 0, texture = 0, fb = 0, program;
+
+  texture = init_texture(width, height, ctx->g->format);
+  fb = init_framebuffer(texture);
+
+  program = init_shader(ctx->arena, "assets/shaders/tutorial1/vertex.glsl",
+                        "assets/shaders/tutorial1/frag.glsl");
+  if (program == 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  // a blit can only copy RGBA to the window
+  if (ctx->g->format != PIXEL_RGBA8888) {
+    ctx->present = init_shader(ctx->arena, "assets/shaders/present/vertex.glsl",
+                               "assets/shaders/present/frag.glsl");
+    if (ctx->present == 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const GLint mvp_location = glGetUniformLocation(program, "mvp");
+
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  vbo = init_indexed_vertex_buffer(ctx, get_verts, get_indices);
+
+  glBindVertexArray(0);
+
+  ctx->fb = fb;
+  ctx->texture = texture;
+  ctx->vao = vao;
+  ctx->vbo = vbo;
+  ctx->shader = program;
+  ctx->mvp_location = mvp_location;
+
+  // only in the window, replays have to stay deterministic
+  if (raster_budget > 0) {
+    resolution_init(&ctx->resolution, raster_budget, MIN_RESOLUTION);
+    ctx->dynamic_resolution = true;
+  }
 
   return ctx;
 };
@@ -247,8 +923,16 @@ void render(Ctx *ctx, int width, int height) {
   glClear(GL_COLOR_BUFFER_BIT);
 
   glUseProgram(0);
-  render_texture(ctx->texture, ctx->g->w, ctx->g->h, ctx->g->pixels);
-  render_fb(ctx->fb, width, height, ctx->g->w, ctx->g->h);
+  render_texture(ctx->texture, ctx->shown);
+  if (ctx->present != 0) {
+    glBindVertexArray(ctx->vao);
+    render_quad(ctx->present, ctx->texture, width, height,
+                ctx->shown.w / (float)ctx->g->w,
+                ctx->shown.h / (float)ctx->g->h);
+    glBindVertexArray(0);
+  } else {
+    render_fb(ctx->fb, width, height, ctx->shown.w, ctx->shown.h);
+  }
 
   const float ratio = width / (float)height;
   mat4 m, p, mvp;
@@ -264,19 +948,338 @@ void render(Ctx *ctx, int width, int height) {
   glBindVertexArray(0);
 }
 
-void update(void *ctx, int width, int height, double dt) {
+void on_input(void *ctx, const input_event *event) {
+  Ctx *_ctx = (Ctx *)ctx;
+  if (event->key == INPUT_MOUSE_BUTTON + GLFW_MOUSE_BUTTON_LEFT) {
+    float x, y;
+    event_position(_ctx, event, &x, &y);
+    if (event->action == GLFW_PRESS) {
+      _ctx->drag_x = x;
+      _ctx->drag_y = y;
+    } else if (event->action == GLFW_RELEASE) {
+      select_objects(_ctx, _ctx->drag_x, _ctx->drag_y, x, y);
+    }
+    return;
+  }
+  if (event->action != GLFW_PRESS) {
+    return;
+  }
+
+  switch (event->key) {
+  case GLFW_KEY_SPACE:
+    _ctx->paused = !_ctx->paused;
+    break;
+  case GLFW_KEY_H:
+    _ctx->show_hud = !_ctx->show_hud;
+    break;
+  case GLFW_KEY_O:
+    _ctx->front_to_back = !_ctx->front_to_back;
+    break;
+  case GLFW_KEY_L:
+    _ctx->cache_layers = !_ctx->cache_layers;
+    break;
+  case GLFW_KEY_P:
+    _ctx->effect = (_ctx->effect + 1) % NUM_POST_EFFECTS;
+    break;
+  case GLFW_KEY_EQUAL:
+    zoom_view(_ctx->scene, _ctx->frame, 1.25f);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  case GLFW_KEY_MINUS:
+    zoom_view(_ctx->scene, _ctx->frame, 0.8f);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  case GLFW_KEY_LEFT:
+    pan_view(_ctx->scene, _ctx->frame, -0.1f, 0);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  case GLFW_KEY_RIGHT:
+    pan_view(_ctx->scene, _ctx->frame, 0.1f, 0);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  case GLFW_KEY_UP:
+    pan_view(_ctx->scene, _ctx->frame, 0, -0.1f);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  case GLFW_KEY_DOWN:
+    pan_view(_ctx->scene, _ctx->frame, 0, 0.1f);
+    layer_invalidate(_ctx->static_layer);
+    break;
+  }
+}
+
+// Points the canvas at the next slot of the export ring. Each slot keeps
+// its own tiles, since which of them already hold the clear color differs
+// from slot to slot.
+void export_begin(Ctx *ctx) {
+  frame_ring *r = ctx->exporter;
+  ctx->g->pixels = frame_ring_begin(r);
+  ctx->g->tiles = &ctx->export_tiles[r->next % EXPORT_SLOTS];
+  ctx->frame.pixels = ctx->g->pixels;
+  ctx->frame.tiles = ctx->g->tiles;
+}
+
+// Publishes the finished frame, which is only copied when an effect moved
+// it out of the slot.
+void export_end(Ctx *ctx) {
+  prof_begin(STAGE_EXPORT);
+  TRACE_BEGIN("export");
+  frame_ring_publish(ctx->exporter, ctx->shown, clock_ns());
+  TRACE_END();
+  prof_end(STAGE_EXPORT);
+}
+
+// Simulation and rasterization only, shared by the window and headless
+// replay.
+void step(void *ctx, int width, int height, double dt) {
+  (void)width;
+  (void)height;
   Ctx *_ctx = (Ctx *)ctx;
 
-  draw(*_ctx->g, _ctx->num_items, dt);
-  render(_ctx, width, height);
+  if (_ctx->exporter != NULL) {
+    export_begin(_ctx);
+  }
+
+  if (_ctx->dynamic_resolution) {
+    set_resolution(_ctx,
+                   resolution_update(&_ctx->resolution, _ctx->raster_time));
+  }
+
+  draw(_ctx, _ctx->paused ? 0 : dt);
+
+  _ctx->shown = _ctx->frame;
+  if (_ctx->effect != POST_NONE) {
+    prof_begin(STAGE_POST);
+    TRACE_BEGIN("post");
+    post_process(_ctx);
+    TRACE_END();
+    prof_end(STAGE_POST);
+  }
+
+  prof_begin(STAGE_HUD);
+  TRACE_BEGIN("hud");
+  draw_selection(_ctx, _ctx->shown);
+  // the HUD prints wall-clock timings, a replay has to hash the same canvas
+  if (_ctx->show_hud && !replaying) {
+    draw_perf_hud(_ctx->shown, _ctx->font, _ctx->num_items);
+  }
+  TRACE_END();
+  prof_end(STAGE_HUD);
+
+  // leaves nothing for the upload to resolve
+  prof_begin(STAGE_RESOLVE);
+  parallel_resolve_canvas(_ctx->pool, _ctx->shown);
+  prof_end(STAGE_RESOLVE);
+
+  if (_ctx->exporter != NULL) {
+    export_end(_ctx);
+  }
 }
 
-int main(void) {
-  Ctx *_ctx = run(CANVAS_WIDTH, CANVAS_HEIGHT, init, update);
+void update(void *ctx, int width, int height, double dt) {
+  TRACE_ZONE("update");
+  step(ctx, width, height, dt);
+  render((Ctx *)ctx, width, height);
+}
+
+uint64_t canvas_hash(canvas g) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int y = 0; y < g.h; ++y) {
+    for (int x = 0; x < g.w; ++x) {
+      hash = (hash ^ canvas_load(g, canvas_index(g, x, y))) * 0x100000001b3;
+    }
+  }
+  return hash;
+}
+
+void save_frame(void *ctx, int begin, int end, int worker) {
+  (void)begin;
+  (void)end;
+  (void)worker;
+  save_canvas("dist/canvas.png", ((Ctx *)ctx)->shown);
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [--seed N] [--record FILE | --replay FILE]\n"
+          "          [--pacing MODE] [--fps N] [--dynres MS]\n"
+          "          [--format FMT] [--particles N] [--export NAME]\n"
+          "          [--save FILE] [--resume FILE] [--fixed] [--tiled]\n"
+          "          [--msaa N]\n"
+          "  --seed N       seed for the initial scene (default %u)\n"
+          "  --record FILE  log the seed, the modes, every frame dt and input\n"
+          "                 to FILE\n"
+          "  --replay FILE  rerun a recording headless, as fast as possible,\n"
+          "                 in the modes it was recorded in\n"
+          "  --pacing MODE  vsync, uncapped, limit or late-latch (default "
+          "vsync)\n"
+          "  --fps N        frame rate for limit and late-latch (default %d)\n"
+          "  --dynres MS    lower the resolution to keep clearing and\n"
+          "                 rasterizing under MS per frame\n"
+          "  --format FMT   canvas pixels, rgba, rgb565 or gray (default "
+          "rgba)\n"
+          "  --particles N  particles alive at once, a power of two of at\n"
+          "                 least 8 (default %d)\n"
+          "  --export NAME  draw into a ring of %d frames in the shared\n"
+          "                 memory object NAME (e.g. /drawing) for other\n"
+          "                 processes to read\n"
+          "  --save FILE    snapshot the objects to FILE on exit\n"
+          "  --resume FILE  start from the objects saved in FILE instead of\n"
+          "                 --seed, not with --record or --replay\n"
+          "  --fixed        step the objects in fixed point at %d Hz, the\n"
+          "                 same on every host\n"
+          "  --tiled        rasterize the scene into 8x8 pixel blocks, in\n"
+          "                 painter's order\n"
+          "  --msaa N       anti-alias the scene's rectangles and triangles\n"
+          "                 with 4 or 8 samples per pixel, in painter's\n"
+          "                 order\n",
+          program, DEFAULT_SEED, DEFAULT_FPS, DEFAULT_PARTICLES,
+          EXPORT_SLOTS, FIXED_TICK_HZ);
+}
+
+int main(int argc, char **argv) {
+  const char *record_file = NULL;
+  const char *replay_file = NULL;
+  const char *snapshot_file = NULL;
+  uint32_t seed = DEFAULT_SEED;
+  run_options opts = {
+      .input_func = on_input,
+      .pacing = PACE_VSYNC,
+      .fps = DEFAULT_FPS,
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_file = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_file = argv[++i];
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+      if (parse_pacing_mode(argv[++i], &opts.pacing) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      opts.fps = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--dynres") == 0 && i + 1 < argc) {
+      raster_budget = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      if (parse_pixel_format(argv[++i], &canvas_format) != 0 ||
+          canvas_format == PIXEL_RGBA8888_PREMUL) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc) {
+      max_particles = strtoul(argv[++i], NULL, 10);
+      if (max_particles < PARTICLE_LANES ||
+          (max_particles & (max_particles - 1)) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+      export_name = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      snapshot_file = argv[++i];
+    } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      resume_file = argv[++i];
+    } else if (strcmp(argv[i], "--fixed") == 0) {
+      fixed_mode = true;
+    } else if (strcmp(argv[i], "--tiled") == 0) {
+      tiled_mode = true;
+    } else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+      msaa_samples = strtol(argv[++i], NULL, 10);
+      if (msaa_samples != 4 && msaa_samples != 8) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  // a recording only holds the seed, not the objects
+  if ((record_file != NULL) + (replay_file != NULL) + (resume_file != NULL) >
+      1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
 
-  char const *filename = "dist/canvas.png";
-  save_canvas(filename, *_ctx->g);
+  recording rec;
+  Ctx *_ctx;
+  world = (snapshot_info){
+      .seed = seed,
+      .width = CANVAS_WIDTH,
+      .height = CANVAS_HEIGHT,
+  };
+  if (replay_file != NULL) {
+    // replays run in the recorded modes, any given here have to match them
+    uint32_t modes = get_modes();
+    int err = replay_open(&rec, replay_file, CANVAS_WIDTH, CANVAS_HEIGHT);
+    if (err == 0 && ((modes != 0 && modes != rec.modes) ||
+                     set_modes(rec.modes) != 0)) {
+      recording_close(&rec);
+      errno = EINVAL;
+      err = -1;
+    }
+    if (err != 0) {
+      fprintf(stderr, "Error reading recording %s:\n%d: %s\n", replay_file,
+              errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    srand(rec.seed);
+    world.seed = rec.seed;
+    replaying = true;
+    _ctx = replay(&rec, init_scene, step, on_input);
+    recording_close(&rec);
+    resolve_canvas(_ctx->shown);
+    fprintf(stderr, "replay: canvas hash %016lx\n",
+            (unsigned long)canvas_hash(_ctx->shown));
+  } else {
+    if (record_file != NULL &&
+        record_open(&rec, record_file, seed, get_modes(), CANVAS_WIDTH,
+                    CANVAS_HEIGHT) != 0) {
+      fprintf(stderr, "Error creating recording %s:\n%d: %s\n", record_file,
+              errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    srand(seed);
+    opts.rec = record_file != NULL ? &rec : NULL;
+    _ctx = run(CANVAS_WIDTH, CANVAS_HEIGHT, init, update, &opts);
+    if (record_file != NULL && recording_close(&rec) != 0) {
+      fprintf(stderr, "Error writing recording %s:\n%d: %s\n", record_file,
+              errno, strerror(errno));
+    }
+  }
+
+  // the PNG encoder is serial, it runs beside the other files instead
+  pool_group saving;
+  pool_spawn(_ctx->pool, &saving, 0, 1, 1, save_frame, _ctx);
 
+  if (fixed_mode) {
+    store_fixed_tables();
+  }
+  if (snapshot_file != NULL && save_snapshot(snapshot_file, &world) != 0) {
+    fprintf(stderr, "Error writing snapshot %s:\n%d: %s\n", snapshot_file,
+            errno, strerror(errno));
+  }
+
+  prof_report(stderr);
+  if (prof_dump_csv("dist/profile.csv") != 0) {
+    fprintf(stderr, "Error writing dist/profile.csv:\n%d: %s\n", errno,
+            strerror(errno));
+  }
+  pool_wait(_ctx->pool, &saving);
+  if (trace_write_json("dist/trace.json") != 0) {
+    fprintf(stderr, "Error writing dist/trace.json:\n%d: %s\n", errno,
+            strerror(errno));
+  }
+
+  pool_destroy(_ctx->pool);
+  unmap_snapshot();
+  if (_ctx->exporter != NULL) {
+    frame_ring_close(_ctx->exporter);
+  }
   arena *a = _ctx->arena;
   arena_free(a);
   free(a);
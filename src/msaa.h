@@ -0,0 +1,267 @@
+#ifndef INCLUDE_MSAA_H
+#define INCLUDE_MSAA_H
+
+#include "draw.h"
+
+// Anti-aliased triangles and rectangles by sample coverage. Every pixel is
+// tested at 4 or 8 points, the usual sample patterns for those counts, and
+// moves from what it held towards canvas.color by the share of them inside.
+// Each row is split into the run of pixels with every sample inside, filled
+// like draw_triangle fills, and the few pixels at either end, whose coverage
+// is counted and blended eight at a time. Nothing is kept per sample, so
+// the cost stays close to aliased drawing.
+//
+// Positions are float pixels and a sample is inside by the pixel center
+// rule of shade.h, so shapes sharing an edge split its samples. Their
+// coverage is still blended one shape at a time, which lets the background
+// show through such an edge faintly; draw_quad_msaa draws two triangles as
+// one shape for that reason.
+//
+// samples is 4 or 8; anything else samples pixel centers only, aliased.
+
+void draw_triangle_msaa(canvas canvas, Vector2d p0, Vector2d p1, Vector2d p2,
+                        int samples);
+void draw_quad_msaa(canvas canvas, const Vector2d p[4], int samples);
+void draw_rectangle_msaa(canvas canvas, Vector2d p0, Vector2d p1,
+                         int samples);
+
+#endif
+
+#if defined(MSAA_IMPLEMENTATION) && !defined(INCLUDE_MSAA_IMPL)
+#define INCLUDE_MSAA_IMPL
+
+#include <math.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+typedef struct {
+  int samples;
+  int shift; // samples inside << shift is the lerp weight
+  __m256 ox; // offsets from the pixel center, one sample per lane
+  __m256 oy;
+} msaa_pattern;
+
+// x, y in sixteenths of a pixel.
+static const int8_t msaa_offsets4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int8_t msaa_offsets8[8][2] = {{1, -3},  {-1, 3}, {5, 1},
+                                           {-3, -5}, {-5, 5}, {-7, -1},
+                                           {3, 7},   {7, -7}};
+
+static msaa_pattern msaa_pattern_for(int samples) {
+  float ox[8] = {0}, oy[8] = {0};
+  msaa_pattern p = {.samples = 1, .shift = LERP_WEIGHT_BITS};
+  if (samples == 4 || samples == 8) {
+    p.samples = samples;
+    p.shift = LERP_WEIGHT_BITS - (samples == 4 ? 2 : 3);
+    const int8_t(*o)[2] = samples == 4 ? msaa_offsets4 : msaa_offsets8;
+    for (int s = 0; s < samples; ++s) {
+      ox[s] = o[s][0] / 16.f;
+      oy[s] = o[s][1] / 16.f;
+    }
+  }
+  p.ox = _mm256_loadu_ps(ox);
+  p.oy = _mm256_loadu_ps(oy);
+  return p;
+}
+
+// Blends the pixels of [x0, x1) in row y towards c, by how many samples s
+// fall in [a[s], b[s]).
+static void msaa_blend(canvas canvas, const msaa_pattern *p, int y, int x0,
+                       int x1, const int *a, const int *b) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i c = _mm256_set1_epi32(canvas.color);
+  __m256i first = _mm256_set1_epi32(x0 - 1), end = _mm256_set1_epi32(x1);
+  // groups start on a block, so tiled canvases get whole block rows
+  for (int gx = x0 & ~(BLOCK_W - 1); gx < x1; gx += 8) {
+    __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(gx), lanes);
+    __m256i count = _mm256_setzero_si256();
+    for (int s = 0; s < p->samples; ++s) {
+      __m256i in = _mm256_and_si256(
+          _mm256_cmpgt_epi32(xs, _mm256_set1_epi32(a[s] - 1)),
+          _mm256_cmpgt_epi32(_mm256_set1_epi32(b[s]), xs));
+      count = _mm256_sub_epi32(count, in);
+    }
+    __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(xs, first),
+                                    _mm256_cmpgt_epi32(end, xs));
+    mask = _mm256_and_si256(
+        mask, _mm256_cmpgt_epi32(count, _mm256_setzero_si256()));
+    if (_mm256_testz_si256(mask, mask)) {
+      continue;
+    }
+    __m256i bg = canvas_load8(canvas, gx, y, mask);
+    __m256i w = _mm256_slli_epi32(count, p->shift);
+    canvas_store8(canvas, gx, y, mask, lerp_colors8(bg, c, w));
+  }
+}
+
+// Draws row y, where sample s of pixel x is inside for
+// l[s] <= x + 0.5 + ox[s] < r[s] on the sample rows in inside.
+static void msaa_row(canvas canvas, const msaa_pattern *p, int y, __m256 l,
+                     __m256 r, __m256 inside) {
+  // the pixels each sample is inside for, clamped to the canvas
+  __m256 zero = _mm256_setzero_ps(), w = _mm256_set1_ps(canvas.w);
+  __m256 shift = _mm256_add_ps(_mm256_set1_ps(0.5f), p->ox);
+  l = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(l, shift), zero), w);
+  r = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(r, shift), zero), w);
+  // rows that miss cover nothing
+  l = _mm256_blendv_ps(w, l, inside);
+  r = _mm256_blendv_ps(zero, r, inside);
+  int a[8], b[8];
+  _mm256_storeu_si256((__m256i *)a, _mm256_cvttps_epi32(_mm256_ceil_ps(l)));
+  _mm256_storeu_si256((__m256i *)b, _mm256_cvttps_epi32(_mm256_ceil_ps(r)));
+
+  // [x0, x1) has any sample inside, [full0, full1) all of them
+  int x0 = a[0], x1 = b[0], full0 = a[0], full1 = b[0];
+  for (int s = 1; s < p->samples; ++s) {
+    x0 = a[s] < x0 ? a[s] : x0;
+    x1 = b[s] > x1 ? b[s] : x1;
+    full0 = a[s] > full0 ? a[s] : full0;
+    full1 = b[s] < full1 ? b[s] : full1;
+  }
+  if (x0 >= x1) {
+    return;
+  }
+  touch_tiles(canvas, x0, y, x1, y + 1);
+  if (full0 >= full1) {
+    msaa_blend(canvas, p, y, x0, x1, a, b);
+    return;
+  }
+  msaa_blend(canvas, p, y, x0, full0, a, b);
+  canvas_fill_row(canvas, full0, y, full1 - full0, canvas.color);
+  msaa_blend(canvas, p, y, full1, x1, a, b);
+}
+
+typedef struct {
+  float top_x, top_y, mid_x, mid_y, bot_y;
+  // dx / dy of the edges from top to bottom, top to mid and mid to bottom
+  float dx_long, dx_upper, dx_lower;
+} msaa_triangle;
+
+static inline bool msaa_above(Vector2d a, Vector2d b) {
+  return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+static inline float msaa_slope(Vector2d a, Vector2d b) {
+  return a.y == b.y ? 0.f : ((float)b.x - (float)a.x) /
+                                ((float)b.y - (float)a.y);
+}
+
+// Sorted top to bottom, so the edges are the same whichever triangle they
+// belong to.
+static msaa_triangle msaa_triangle_init(Vector2d p0, Vector2d p1,
+                                        Vector2d p2) {
+  Vector2d t;
+  if (msaa_above(p1, p0)) {
+    t = p0, p0 = p1, p1 = t;
+  }
+  if (msaa_above(p2, p0)) {
+    t = p0, p0 = p2, p2 = t;
+  }
+  if (msaa_above(p2, p1)) {
+    t = p1, p1 = p2, p2 = t;
+  }
+  return (msaa_triangle){
+      .top_x = p0.x,
+      .top_y = p0.y,
+      .mid_x = p1.x,
+      .mid_y = p1.y,
+      .bot_y = p2.y,
+      .dx_long = msaa_slope(p0, p2),
+      .dx_upper = msaa_slope(p0, p1),
+      .dx_lower = msaa_slope(p1, p2),
+  };
+}
+
+// Where the sample rows at sy enter and leave t, inside cleared for the
+// ones that miss it.
+static void msaa_triangle_rows(const msaa_triangle *t, __m256 sy, __m256 *l,
+                               __m256 *r, __m256 *inside) {
+  __m256 top_x = _mm256_set1_ps(t->top_x), top_y = _mm256_set1_ps(t->top_y);
+  __m256 mid_y = _mm256_set1_ps(t->mid_y);
+  __m256 from_top = _mm256_sub_ps(sy, top_y);
+  __m256 a = _mm256_add_ps(
+      top_x, _mm256_mul_ps(from_top, _mm256_set1_ps(t->dx_long)));
+  __m256 upper = _mm256_add_ps(
+      top_x, _mm256_mul_ps(from_top, _mm256_set1_ps(t->dx_upper)));
+  __m256 lower = _mm256_add_ps(
+      _mm256_set1_ps(t->mid_x),
+      _mm256_mul_ps(_mm256_sub_ps(sy, mid_y), _mm256_set1_ps(t->dx_lower)));
+  __m256 b = _mm256_blendv_ps(lower, upper,
+                              _mm256_cmp_ps(sy, mid_y, _CMP_LT_OQ));
+  *l = _mm256_min_ps(a, b);
+  *r = _mm256_max_ps(a, b);
+  *inside = _mm256_and_ps(
+      _mm256_cmp_ps(sy, top_y, _CMP_GE_OQ),
+      _mm256_cmp_ps(sy, _mm256_set1_ps(t->bot_y), _CMP_LT_OQ));
+}
+
+// Rows of the canvas with a sample in [y0, y1).
+static inline void msaa_rows(canvas canvas, float y0, float y1, int *first,
+                             int *end) {
+  *first = fmaxf(fminf(floorf(y0), canvas.h), 0.f);
+  *end = fmaxf(fminf(ceilf(y1), canvas.h), 0.f);
+}
+
+void draw_triangle_msaa(canvas canvas, Vector2d p0, Vector2d p1, Vector2d p2,
+                        int samples) {
+  TRACE_ZONE("draw_triangle_msaa");
+  msaa_pattern p = msaa_pattern_for(samples);
+  msaa_triangle t = msaa_triangle_init(p0, p1, p2);
+  int y0, y1;
+  msaa_rows(canvas, t.top_y, t.bot_y, &y0, &y1);
+  for (int y = y0; y < y1; ++y) {
+    __m256 sy = _mm256_add_ps(_mm256_set1_ps(y + 0.5f), p.oy);
+    __m256 l, r, inside;
+    msaa_triangle_rows(&t, sy, &l, &r, &inside);
+    msaa_row(canvas, &p, y, l, r, inside);
+  }
+}
+
+// A convex quad, p in order around it, such as a rotated rectangle. It is
+// split into two triangles along the diagonal from p[0] to p[2], whose
+// sample rows meet there and are drawn joined.
+void draw_quad_msaa(canvas canvas, const Vector2d p[4], int samples) {
+  TRACE_ZONE("draw_quad_msaa");
+  msaa_pattern pat = msaa_pattern_for(samples);
+  msaa_triangle t[2] = {msaa_triangle_init(p[0], p[1], p[2]),
+                        msaa_triangle_init(p[0], p[2], p[3])};
+  int y0, y1;
+  msaa_rows(canvas, fminf(t[0].top_y, t[1].top_y),
+            fmaxf(t[0].bot_y, t[1].bot_y), &y0, &y1);
+  for (int y = y0; y < y1; ++y) {
+    __m256 sy = _mm256_add_ps(_mm256_set1_ps(y + 0.5f), pat.oy);
+    __m256 l[2], r[2], inside[2];
+    msaa_triangle_rows(&t[0], sy, &l[0], &r[0], &inside[0]);
+    msaa_triangle_rows(&t[1], sy, &l[1], &r[1], &inside[1]);
+    // a row in only one of them is just that part
+    __m256 lo = _mm256_blendv_ps(l[1], l[0], inside[0]);
+    __m256 hi = _mm256_blendv_ps(r[1], r[0], inside[0]);
+    __m256 both = _mm256_and_ps(inside[0], inside[1]);
+    lo = _mm256_blendv_ps(lo, _mm256_min_ps(l[0], l[1]), both);
+    hi = _mm256_blendv_ps(hi, _mm256_max_ps(r[0], r[1]), both);
+    msaa_row(canvas, &pat, y, lo, hi, _mm256_or_ps(inside[0], inside[1]));
+  }
+}
+
+// Axis aligned, corners p0 and p1.
+void draw_rectangle_msaa(canvas canvas, Vector2d p0, Vector2d p1,
+                         int samples) {
+  TRACE_ZONE("draw_rectangle_msaa");
+  msaa_pattern p = msaa_pattern_for(samples);
+  float x0 = fmin(p0.x, p1.x), x1 = fmax(p0.x, p1.x);
+  float top = fmin(p0.y, p1.y), bottom = fmax(p0.y, p1.y);
+  __m256 l = _mm256_set1_ps(x0), r = _mm256_set1_ps(x1);
+  int y0, y1;
+  msaa_rows(canvas, top, bottom, &y0, &y1);
+  for (int y = y0; y < y1; ++y) {
+    __m256 sy = _mm256_add_ps(_mm256_set1_ps(y + 0.5f), p.oy);
+    __m256 inside =
+        _mm256_and_ps(_mm256_cmp_ps(sy, _mm256_set1_ps(top), _CMP_GE_OQ),
+                      _mm256_cmp_ps(sy, _mm256_set1_ps(bottom), _CMP_LT_OQ));
+    msaa_row(canvas, &p, y, l, r, inside);
+  }
+}
+
+#endif
@@ -2,13 +2,35 @@
 #define INCLUDE_OBJECTS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "arena.h"
 
 typedef unsigned int objid;
 
+// Snapshots of the motion tables. The file is laid out so it can be mapped
+// and used as the tables in place, native endianness:
+//   header, padded to SNAPSHOT_ALIGN
+//   acceleration, velocity, position, dimension tables: num_objects * 3
+//   floats each, every one padded to SNAPSHOT_ALIGN
+#define SNAPSHOT_MAGIC "DRWSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 4096
+
+typedef struct {
+  uint64_t num_objects;
+  uint32_t seed; // of the scene the objects were created for
+  int32_t width; // bounds they move in
+  int32_t height;
+} snapshot_info;
+
 void init_motion_tables(arena *a, size_t max_objects);
 objid new_object(float initial[12]);
+size_t num_objects(void);
+
+int save_snapshot(const char *filename, const snapshot_info *info);
+int map_snapshot(const char *filename, snapshot_info *info);
+void unmap_snapshot(void);
 
 void calc_next_pos(size_t id, float dt, float values[15]);
 
@@ -16,18 +38,54 @@ void update_acceleration(objid id, float vel[3]);
 void update_velocity(objid id, float vel[3]);
 void update_position(objid id, float vel[3]);
 
+// Fixed point mode. A copy of the x and y motion in Q16.16, one array per
+// coordinate, stepped at a fixed rate with integer arithmetic only, so a run
+// gives the same bits on every host, compiler and thread count. z is not
+// kept, nothing in the scene moves along it.
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_TICK_SHIFT 8 // steps of 1 / 256 s
+#define FIXED_TICK_HZ (1 << FIXED_TICK_SHIFT)
+
+typedef int32_t fixed;
+
+void init_fixed_tables(arena *a, size_t max_objects);
+void load_fixed_tables(void);
+void store_fixed_tables(void);
+void step_fixed(size_t begin, size_t end, int ticks, fixed width,
+                fixed height);
+void fixed_rect(size_t id, int32_t rect[4]);
+
 #endif
 
-#ifdef OBJECTS_IMPLEMENTATION
+#if defined(OBJECTS_IMPLEMENTATION) && !defined(INCLUDE_OBJECTS_IMPL)
+#define INCLUDE_OBJECTS_IMPL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <immintrin.h>
 
 static float *acceleration_table;
 static float *velocity_table;
 static float *position_table;
 static float *dimension_table;
+static size_t next_id;
 
-objid new_object(float initial[12]) {
-  static size_t next_id = 0;
+static void *snapshot_map; // NULL unless the tables live in a snapshot
+static size_t snapshot_size;
 
+// Q16.16 pixels per second squared, pixels per second and pixels
+enum { FX_AX, FX_AY, FX_VX, FX_VY, FX_PX, FX_PY, FX_W, FX_H, NUM_FX };
+static fixed *fixed_tables[NUM_FX];
+
+objid new_object(float initial[12]) {
   size_t offset = next_id * 3;
 
   acceleration_table[offset + 0] = initial[0];
@@ -50,13 +108,17 @@ objid new_object(float initial[12]) {
 }
 
 void init_motion_tables(arena *a, size_t max_objects) {
+  unmap_snapshot();
   size_t num_bytes = max_objects * 3 * sizeof(float);
   acceleration_table = arena_alloc(a, num_bytes);
   velocity_table = arena_alloc(a, num_bytes);
   position_table = arena_alloc(a, num_bytes);
   dimension_table = arena_alloc(a, num_bytes);
+  next_id = 0;
 }
 
+size_t num_objects(void) { return next_id; }
+
 void calc_next_pos(size_t id, float dt, float values[15]) {
 
   size_t offset = id * 3;
@@ -112,4 +174,261 @@ void update_position(objid id, float pos[3]) {
   current_pos[2] = pos[2];
 }
 
+void init_fixed_tables(arena *a, size_t max_objects) {
+  for (int i = 0; i < NUM_FX; ++i) {
+    fixed_tables[i] = arena_alloc(a, max_objects * sizeof(fixed));
+  }
+}
+
+static inline fixed to_fixed(float v) { return lrintf(v * FIXED_ONE); }
+
+// Converts the float tables of every object, after which only
+// step_fixed moves them.
+void load_fixed_tables(void) {
+  for (size_t id = 0; id < next_id; ++id) {
+    size_t offset = id * 3;
+    fixed_tables[FX_AX][id] = to_fixed(acceleration_table[offset + 0]);
+    fixed_tables[FX_AY][id] = to_fixed(acceleration_table[offset + 1]);
+    fixed_tables[FX_VX][id] = to_fixed(velocity_table[offset + 0]);
+    fixed_tables[FX_VY][id] = to_fixed(velocity_table[offset + 1]);
+    fixed_tables[FX_PX][id] = to_fixed(position_table[offset + 0]);
+    fixed_tables[FX_PY][id] = to_fixed(position_table[offset + 1]);
+    fixed_tables[FX_W][id] = to_fixed(dimension_table[offset + 0]);
+    fixed_tables[FX_H][id] = to_fixed(dimension_table[offset + 1]);
+  }
+}
+
+// Writes velocities and positions back, for snapshots.
+void store_fixed_tables(void) {
+  for (size_t id = 0; id < next_id; ++id) {
+    size_t offset = id * 3;
+    velocity_table[offset + 0] = fixed_tables[FX_VX][id] / (float)FIXED_ONE;
+    velocity_table[offset + 1] = fixed_tables[FX_VY][id] / (float)FIXED_ONE;
+    position_table[offset + 0] = fixed_tables[FX_PX][id] / (float)FIXED_ONE;
+    position_table[offset + 1] = fixed_tables[FX_PY][id] / (float)FIXED_ONE;
+  }
+}
+
+// One tick of calc_next_pos and the bounce off the bounds that follows it:
+// a coordinate that would leave [0, bound - size] keeps its position and
+// reverses its velocity. Rounds half up, the same way in both paths.
+static inline void step_fixed_one(fixed a, fixed *v, fixed *p, fixed size,
+                                  fixed bound) {
+  const fixed half = 1 << (FIXED_TICK_SHIFT - 1);
+  fixed nv = *v + ((a + half) >> FIXED_TICK_SHIFT);
+  fixed np = *p + ((nv + half) >> FIXED_TICK_SHIFT);
+  if (np < 0 || np + size > bound) {
+    *v = -nv;
+  } else {
+    *v = nv;
+    *p = np;
+  }
+}
+
+static inline void step_fixed_lanes(__m256i a, __m256i *v, __m256i *p,
+                                    __m256i size, __m256i bound) {
+  const __m256i half = _mm256_set1_epi32(1 << (FIXED_TICK_SHIFT - 1));
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i nv = _mm256_add_epi32(
+      *v, _mm256_srai_epi32(_mm256_add_epi32(a, half), FIXED_TICK_SHIFT));
+  __m256i np = _mm256_add_epi32(
+      *p, _mm256_srai_epi32(_mm256_add_epi32(nv, half), FIXED_TICK_SHIFT));
+  __m256i out = _mm256_or_si256(
+      _mm256_cmpgt_epi32(zero, np),
+      _mm256_cmpgt_epi32(_mm256_add_epi32(np, size), bound));
+  *v = _mm256_blendv_epi8(nv, _mm256_sub_epi32(zero, nv), out);
+  *p = _mm256_blendv_epi8(np, *p, out);
+}
+
+// Advances objects [begin, end) by ticks steps inside a width x height
+// world. Objects are independent, so ranges can be stepped on any thread
+// in any order with the same result.
+void step_fixed(size_t begin, size_t end, int ticks, fixed width,
+                fixed height) {
+  fixed *const *t = fixed_tables;
+  size_t id = begin;
+
+  // eight objects at a time, kept in registers across the ticks
+  const __m256i w = _mm256_set1_epi32(width);
+  const __m256i h = _mm256_set1_epi32(height);
+  for (; id + 8 <= end; id += 8) {
+    __m256i ax = _mm256_loadu_si256((const __m256i *)&t[FX_AX][id]);
+    __m256i ay = _mm256_loadu_si256((const __m256i *)&t[FX_AY][id]);
+    __m256i vx = _mm256_loadu_si256((const __m256i *)&t[FX_VX][id]);
+    __m256i vy = _mm256_loadu_si256((const __m256i *)&t[FX_VY][id]);
+    __m256i px = _mm256_loadu_si256((const __m256i *)&t[FX_PX][id]);
+    __m256i py = _mm256_loadu_si256((const __m256i *)&t[FX_PY][id]);
+    __m256i sx = _mm256_loadu_si256((const __m256i *)&t[FX_W][id]);
+    __m256i sy = _mm256_loadu_si256((const __m256i *)&t[FX_H][id]);
+    for (int i = 0; i < ticks; ++i) {
+      step_fixed_lanes(ax, &vx, &px, sx, w);
+      step_fixed_lanes(ay, &vy, &py, sy, h);
+    }
+    _mm256_storeu_si256((__m256i *)&t[FX_VX][id], vx);
+    _mm256_storeu_si256((__m256i *)&t[FX_VY][id], vy);
+    _mm256_storeu_si256((__m256i *)&t[FX_PX][id], px);
+    _mm256_storeu_si256((__m256i *)&t[FX_PY][id], py);
+  }
+
+  for (; id < end; ++id) {
+    for (int i = 0; i < ticks; ++i) {
+      step_fixed_one(t[FX_AX][id], &t[FX_VX][id], &t[FX_PX][id],
+                     t[FX_W][id], width);
+      step_fixed_one(t[FX_AY][id], &t[FX_VY][id], &t[FX_PY][id],
+                     t[FX_H][id], height);
+    }
+  }
+}
+
+// x, y, width and height in whole pixels, rounded down like animate does.
+void fixed_rect(size_t id, int32_t rect[4]) {
+  rect[0] = fixed_tables[FX_PX][id] >> FIXED_SHIFT;
+  rect[1] = fixed_tables[FX_PY][id] >> FIXED_SHIFT;
+  rect[2] = fixed_tables[FX_W][id] >> FIXED_SHIFT;
+  rect[3] = fixed_tables[FX_H][id] >> FIXED_SHIFT;
+}
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t components; // floats per object in each table
+  uint64_t num_objects;
+  uint64_t table_size; // bytes between the starts of two tables
+  uint32_t seed;
+  int32_t width;
+  int32_t height;
+  uint32_t reserved; // zero, keeps the header free of padding
+} snapshot_header;
+
+static inline size_t snapshot_round(size_t n) {
+  return (n + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static int snapshot_write(FILE *fp, const void *data, size_t size) {
+  static const char zeros[SNAPSHOT_ALIGN];
+  size_t pad = snapshot_round(size) - size;
+  if (fwrite(data, 1, size, fp) != size ||
+      fwrite(zeros, 1, pad, fp) != pad) {
+    return -1;
+  }
+  return 0;
+}
+
+// Writes the tables to a temporary file next to filename and renames it
+// over filename once it is on disk, so readers only ever see a complete
+// snapshot.
+int save_snapshot(const char *filename, const snapshot_info *info) {
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  size_t bytes = next_id * 3 * sizeof(float);
+  snapshot_header h = {
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .components = 3,
+      .num_objects = next_id,
+      .table_size = snapshot_round(bytes),
+      .seed = info->seed,
+      .width = info->width,
+      .height = info->height,
+  };
+  const float *tables[4] = {acceleration_table, velocity_table,
+                            position_table, dimension_table};
+  int result = snapshot_write(fp, &h, sizeof(h));
+  for (int i = 0; i < 4 && result == 0; ++i) {
+    result = snapshot_write(fp, tables[i], bytes);
+  }
+  if (result == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) != 0)) {
+    result = -1;
+  }
+  int e = errno;
+  if (fclose(fp) != 0 && result == 0) {
+    e = errno;
+    result = -1;
+  }
+  if (result == 0 && rename(tmp, filename) != 0) {
+    e = errno;
+    result = -1;
+  }
+  if (result != 0) {
+    remove(tmp);
+    errno = e;
+  }
+  return result;
+}
+
+// Maps a snapshot copy on write and points the tables into it, without
+// reading or converting anything: pages are only loaded as the simulation
+// touches them, and its changes never reach the file. The tables hold
+// exactly the saved objects.
+int map_snapshot(const char *filename, snapshot_info *info) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(snapshot_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  char *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+
+  const snapshot_header *h = (const snapshot_header *)p;
+  size_t bytes = h->num_objects * 3 * sizeof(float);
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != SNAPSHOT_VERSION || h->components != 3 ||
+      h->num_objects > UINT32_MAX || h->table_size != snapshot_round(bytes) ||
+      snapshot_round(sizeof(*h)) + 4 * h->table_size > (size_t)st.st_size) {
+    munmap(p, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  unmap_snapshot();
+  *info = (snapshot_info){
+      .num_objects = h->num_objects,
+      .seed = h->seed,
+      .width = h->width,
+      .height = h->height,
+  };
+  float *tables = (float *)(p + snapshot_round(sizeof(*h)));
+  size_t stride = h->table_size / sizeof(float);
+  acceleration_table = tables;
+  velocity_table = tables + stride;
+  position_table = tables + 2 * stride;
+  dimension_table = tables + 3 * stride;
+  next_id = h->num_objects;
+  snapshot_map = p;
+  snapshot_size = st.st_size;
+  return 0;
+}
+
+void unmap_snapshot(void) {
+  if (snapshot_map == NULL) {
+    return;
+  }
+  munmap(snapshot_map, snapshot_size);
+  snapshot_map = NULL;
+  acceleration_table = velocity_table = NULL;
+  position_table = dimension_table = NULL;
+  next_id = 0;
+}
+
 #endif
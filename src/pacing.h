@@ -0,0 +1,152 @@
+#ifndef INCLUDE_PACING_H
+#define INCLUDE_PACING_H
+
+#include <stdint.h>
+
+typedef enum {
+  PACE_VSYNC,      // swap interval 1, the driver blocks in swap
+  PACE_UNCAPPED,   // swap interval 0, no waiting at all
+  PACE_LIMIT,      // frames start on a fixed period, hybrid sleep + spin
+  PACE_LATE_LATCH, // input is sampled as late as possible before the deadline
+  NUM_PACING_MODES,
+} pacing_mode;
+
+typedef struct {
+  pacing_mode mode;
+  uint64_t period;        // ns between frames
+  uint64_t deadline;      // ns, when the next frame must start or finish
+  uint64_t spin_margin;   // ns left to spin after sleeping, tracks overshoot
+  uint64_t work_estimate; // ns from input sample to swap, late latch only
+} pacer;
+
+const char *pacing_mode_name(pacing_mode mode);
+int parse_pacing_mode(const char *name, pacing_mode *mode);
+
+void pacer_init(pacer *p, pacing_mode mode, double fps);
+void pacer_wait(pacer *p);
+void pacer_frame_done(pacer *p, uint64_t work);
+uint64_t sleep_until(uint64_t deadline, uint64_t spin_margin);
+
+#endif
+
+#if defined(PACING_IMPLEMENTATION) && !defined(INCLUDE_PACING_IMPL)
+#define INCLUDE_PACING_IMPL
+
+#include <string.h>
+#include <time.h>
+
+#include <immintrin.h>
+
+#include "clock.h"
+
+#define PACE_MIN_SPIN 200000ull // 0.2 ms
+#define PACE_MAX_SPIN 4000000ull
+#define PACE_LATCH_SLACK 500000ull // keeps late latch off the deadline
+
+static const char *pacing_mode_names[NUM_PACING_MODES] = {
+    "vsync",
+    "uncapped",
+    "limit",
+    "late-latch",
+};
+
+const char *pacing_mode_name(pacing_mode mode) {
+  return pacing_mode_names[mode];
+}
+
+int parse_pacing_mode(const char *name, pacing_mode *mode) {
+  for (int m = 0; m < NUM_PACING_MODES; ++m) {
+    if (strcmp(name, pacing_mode_names[m]) == 0) {
+      *mode = m;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void pacer_init(pacer *p, pacing_mode mode, double fps) {
+  *p = (pacer){
+      .mode = mode,
+      .period = fps > 0 ? NS_PER_SEC / fps : 0,
+      .deadline = clock_ns(),
+      .spin_margin = 1000000,
+  };
+  p->work_estimate = p->period / 2;
+  // no usable period to pace against
+  if (mode != PACE_VSYNC && p->period <= PACE_LATCH_SLACK) {
+    p->mode = PACE_UNCAPPED;
+  }
+}
+
+// Sleeps until spin_margin before the deadline, then spins the rest of the
+// way, since nanosleep routinely overshoots by more than the margin we can
+// tolerate. Returns how late the sleep itself woke up.
+uint64_t sleep_until(uint64_t deadline, uint64_t spin_margin) {
+  uint64_t now = clock_ns();
+  uint64_t overshoot = 0;
+  if (deadline > now + spin_margin) {
+    uint64_t target = deadline - spin_margin;
+    uint64_t ns = target - now;
+    struct timespec req = {ns / NS_PER_SEC, ns % NS_PER_SEC};
+    nanosleep(&req, NULL);
+    now = clock_ns();
+    overshoot = now > target ? now - target : 0;
+  }
+  while (now < deadline) {
+    _mm_pause();
+    now = clock_ns();
+  }
+  return overshoot;
+}
+
+// Blocks until the next frame should sample input.
+void pacer_wait(pacer *p) {
+  uint64_t start = p->deadline;
+  switch (p->mode) {
+  case PACE_VSYNC:
+  case PACE_UNCAPPED:
+  case NUM_PACING_MODES:
+    return;
+  case PACE_LIMIT:
+    break;
+  case PACE_LATE_LATCH:
+    start -= p->work_estimate + PACE_LATCH_SLACK;
+    break;
+  }
+
+  uint64_t overshoot = sleep_until(start, p->spin_margin);
+
+  // widen the margin right away when a sleep runs late, narrow it slowly
+  if (overshoot + PACE_MIN_SPIN > p->spin_margin) {
+    p->spin_margin = overshoot + PACE_MIN_SPIN;
+  } else {
+    p->spin_margin -= (p->spin_margin - PACE_MIN_SPIN) / 32;
+  }
+  if (p->spin_margin > PACE_MAX_SPIN) {
+    p->spin_margin = PACE_MAX_SPIN;
+  }
+}
+
+// work is the time from sampling input to the end of the swap.
+void pacer_frame_done(pacer *p, uint64_t work) {
+  if (p->mode == PACE_LATE_LATCH) {
+    // track spikes immediately, decay towards cheaper frames
+    if (work > p->work_estimate) {
+      p->work_estimate = work;
+    } else {
+      p->work_estimate -= (p->work_estimate - work) / 16;
+    }
+    if (p->work_estimate + PACE_LATCH_SLACK > p->period) {
+      p->work_estimate = p->period - PACE_LATCH_SLACK;
+    }
+  }
+
+  p->deadline += p->period;
+  uint64_t now = clock_ns();
+  // fell more than a frame behind, resync instead of bursting to catch up
+  if (p->deadline + p->period < now) {
+    p->deadline = now;
+  }
+}
+
+#endif
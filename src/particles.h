@@ -0,0 +1,331 @@
+#ifndef INCLUDE_PARTICLES_H
+#define INCLUDE_PARTICLES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "draw.h"
+
+// Particles kept as separate arrays per attribute in a ring. Emitting
+// writes at the head and overwrites the oldest particle once the ring is
+// full; the tail follows the head past particles that have died. Update and
+// draw walk the live window eight particles at a time.
+//
+// Particles are splats of size x size pixels added onto the canvas with
+// saturation, fading out over their lifetime.
+#define PARTICLE_LANES 8
+#define PARTICLE_MAX_SIZE 4
+
+typedef struct {
+  float *x;
+  float *y;
+  float *vx;
+  float *vy;
+  float *life; // seconds left, dead at 0 or below
+  float *fade; // 1 / lifetime
+  color *color;
+  uint32_t capacity; // power of two, at least PARTICLE_LANES
+  uint32_t head;     // free running, the window is [head - count, head)
+  uint32_t count;
+  float gravity; // pixels per second squared, down
+  int size;      // 1 to PARTICLE_MAX_SIZE
+  float x0, y0, x1, y1; // bounds of the live particles
+} particles;
+
+size_t particles_size(uint32_t capacity);
+int particles_init(particles *ps, arena *a, uint32_t capacity);
+void particles_emit(particles *ps, float x, float y, float vx, float vy,
+                    float lifetime, color color);
+void particles_update(particles *ps, float dt);
+void particles_draw(const particles *ps, canvas canvas, float view_x,
+                    float view_y, float zoom);
+
+#endif
+
+#if defined(PARTICLES_IMPLEMENTATION) && !defined(INCLUDE_PARTICLES_IMPL)
+#define INCLUDE_PARTICLES_IMPL
+
+#include <math.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+// Arena bytes particles_init takes.
+size_t particles_size(uint32_t capacity) {
+  return (6 * sizeof(float) + sizeof(color)) * (size_t)capacity +
+         7 * WORD_SIZE;
+}
+
+int particles_init(particles *ps, arena *a, uint32_t capacity) {
+  if (capacity < PARTICLE_LANES || (capacity & (capacity - 1)) != 0) {
+    return -1;
+  }
+  size_t bytes = sizeof(float) * capacity;
+  *ps = (particles){
+      .x = arena_alloc(a, bytes),
+      .y = arena_alloc(a, bytes),
+      .vx = arena_alloc(a, bytes),
+      .vy = arena_alloc(a, bytes),
+      .life = arena_alloc(a, bytes),
+      .fade = arena_alloc(a, bytes),
+      .color = arena_alloc(a, sizeof(color) * capacity),
+      .capacity = capacity,
+      .size = 1,
+      .x0 = INFINITY,
+      .y0 = INFINITY,
+      .x1 = -INFINITY,
+      .y1 = -INFINITY,
+  };
+  if (ps->x == NULL || ps->y == NULL || ps->vx == NULL || ps->vy == NULL ||
+      ps->life == NULL || ps->fade == NULL || ps->color == NULL) {
+    return -1;
+  }
+  // lanes past the window are read, keep them finite
+  memset(ps->x, 0, bytes);
+  memset(ps->y, 0, bytes);
+  memset(ps->vx, 0, bytes);
+  memset(ps->vy, 0, bytes);
+  memset(ps->life, 0, bytes);
+  memset(ps->fade, 0, bytes);
+  memset(ps->color, 0, sizeof(color) * capacity);
+  return 0;
+}
+
+void particles_emit(particles *ps, float x, float y, float vx, float vy,
+                    float lifetime, color color) {
+  uint32_t i = ps->head++ & (ps->capacity - 1);
+  ps->x[i] = x;
+  ps->y[i] = y;
+  ps->vx[i] = vx;
+  ps->vy[i] = vy;
+  ps->life[i] = lifetime;
+  ps->fade[i] = 1.f / lifetime;
+  ps->color[i] = color;
+  if (ps->count < ps->capacity) {
+    ps->count++;
+  }
+  ps->x0 = fminf(ps->x0, x);
+  ps->y0 = fminf(ps->y0, y);
+  ps->x1 = fmaxf(ps->x1, x);
+  ps->y1 = fmaxf(ps->y1, y);
+}
+
+// Lanes of the block starting at ring position i that are in the window.
+// A full ring wraps the last block onto the first, which mustn't be
+// touched twice.
+static inline __m256 particles_window(const particles *ps, uint32_t i) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  // ps->head - 1 - (i + lane) in [0, count), as signed compares
+  __m256i age = _mm256_sub_epi32(_mm256_set1_epi32(ps->head - 1 - i), lanes);
+  __m256i in = _mm256_and_si256(
+      _mm256_cmpgt_epi32(_mm256_set1_epi32(ps->count), age),
+      _mm256_cmpgt_epi32(age, _mm256_set1_epi32(-1)));
+  return _mm256_castsi256_ps(in);
+}
+
+// First ring position of the block holding the oldest particle, and the
+// number of blocks covering the window.
+static inline uint32_t particles_blocks(const particles *ps,
+                                        uint32_t *first) {
+  uint32_t tail = ps->head - ps->count;
+  *first = tail & ~(uint32_t)(PARTICLE_LANES - 1);
+  uint32_t end = (ps->head + PARTICLE_LANES - 1) & ~(PARTICLE_LANES - 1);
+  return ps->count == 0 ? 0 : (end - *first) / PARTICLE_LANES;
+}
+
+// Semi-implicit Euler over the live window, then trims the particles that
+// died at the tail.
+void particles_update(particles *ps, float dt) {
+  TRACE_ZONE("particles_update");
+  const __m256 vdt = _mm256_set1_ps(dt);
+  const __m256 gdt = _mm256_set1_ps(ps->gravity * dt);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 inf = _mm256_set1_ps(INFINITY);
+  const __m256 neg_inf = _mm256_set1_ps(-INFINITY);
+  __m256 x0 = inf, y0 = inf, x1 = neg_inf, y1 = neg_inf;
+
+  uint32_t first;
+  uint32_t blocks = particles_blocks(ps, &first);
+  const uint32_t mask = ps->capacity - 1;
+  for (uint32_t b = 0; b < blocks; ++b) {
+    uint32_t i = first + b * PARTICLE_LANES;
+    uint32_t k = i & mask;
+    __m256 live = _mm256_and_ps(
+        particles_window(ps, i),
+        _mm256_cmp_ps(_mm256_loadu_ps(&ps->life[k]), zero, _CMP_GT_OQ));
+    if (_mm256_testz_ps(live, live)) {
+      continue;
+    }
+    __m256 x = _mm256_loadu_ps(&ps->x[k]);
+    __m256 y = _mm256_loadu_ps(&ps->y[k]);
+    __m256 vx = _mm256_loadu_ps(&ps->vx[k]);
+    __m256 vy = _mm256_loadu_ps(&ps->vy[k]);
+    __m256 life = _mm256_loadu_ps(&ps->life[k]);
+    // lanes outside the window keep their values
+    vy = _mm256_blendv_ps(vy, _mm256_add_ps(vy, gdt), live);
+    x = _mm256_blendv_ps(x, _mm256_add_ps(x, _mm256_mul_ps(vx, vdt)), live);
+    y = _mm256_blendv_ps(y, _mm256_add_ps(y, _mm256_mul_ps(vy, vdt)), live);
+    life = _mm256_blendv_ps(life, _mm256_sub_ps(life, vdt), live);
+    _mm256_storeu_ps(&ps->x[k], x);
+    _mm256_storeu_ps(&ps->y[k], y);
+    _mm256_storeu_ps(&ps->vy[k], vy);
+    _mm256_storeu_ps(&ps->life[k], life);
+
+    __m256 still = _mm256_and_ps(live, _mm256_cmp_ps(life, zero, _CMP_GT_OQ));
+    x0 = _mm256_min_ps(x0, _mm256_blendv_ps(inf, x, still));
+    y0 = _mm256_min_ps(y0, _mm256_blendv_ps(inf, y, still));
+    x1 = _mm256_max_ps(x1, _mm256_blendv_ps(neg_inf, x, still));
+    y1 = _mm256_max_ps(y1, _mm256_blendv_ps(neg_inf, y, still));
+  }
+
+  float lanes[4][PARTICLE_LANES];
+  _mm256_storeu_ps(lanes[0], x0);
+  _mm256_storeu_ps(lanes[1], y0);
+  _mm256_storeu_ps(lanes[2], x1);
+  _mm256_storeu_ps(lanes[3], y1);
+  ps->x0 = ps->y0 = INFINITY;
+  ps->x1 = ps->y1 = -INFINITY;
+  for (int l = 0; l < PARTICLE_LANES; ++l) {
+    ps->x0 = fminf(ps->x0, lanes[0][l]);
+    ps->y0 = fminf(ps->y0, lanes[1][l]);
+    ps->x1 = fmaxf(ps->x1, lanes[2][l]);
+    ps->y1 = fmaxf(ps->y1, lanes[3][l]);
+  }
+
+  while (ps->count > 0 && !(ps->life[(ps->head - ps->count) & mask] > 0.f)) {
+    ps->count--;
+  }
+}
+
+// Saturating add of c to n consecutive pixels, n <= 4. Masked moves are
+// slow, so only clipped and 3 pixel rows use them.
+static inline void particles_add(color *dst, int n, __m128i c) {
+  static const int32_t ones[8] = {-1, -1, -1, -1, 0, 0, 0, 0};
+  switch (n) {
+  case 1:
+    *dst = _mm_cvtsi128_si32(_mm_adds_epu8(_mm_cvtsi32_si128(*dst), c));
+    break;
+  case 2: {
+    __m128i d = _mm_loadl_epi64((const __m128i *)dst);
+    _mm_storel_epi64((__m128i *)dst, _mm_adds_epu8(d, c));
+    break;
+  }
+  case 4: {
+    __m128i d = _mm_loadu_si128((const __m128i *)dst);
+    _mm_storeu_si128((__m128i *)dst, _mm_adds_epu8(d, c));
+    break;
+  }
+  default: {
+    __m128i m = _mm_loadu_si128((const __m128i *)&ones[4 - n]);
+    __m128i d = _mm_maskload_epi32((const int *)dst, m);
+    _mm_maskstore_epi32((int *)dst, m, _mm_adds_epu8(d, c));
+    break;
+  }
+  }
+}
+
+static void particles_add_packed(canvas canvas, size_t i, int n, color c) {
+  for (int x = 0; x < n; ++x) {
+    __m128i d = _mm_cvtsi32_si128(canvas_load(canvas, i + x));
+    d = _mm_adds_epu8(d, _mm_cvtsi32_si128(c));
+    canvas_store(canvas, i + x, _mm_cvtsi128_si32(d));
+  }
+}
+
+// Splats every live particle whose top left pixel lands on the canvas,
+// canvas = (world - view) * zoom. Splats are clipped at the right and
+// bottom edges.
+void particles_draw(const particles *ps, canvas canvas, float view_x,
+                    float view_y, float zoom) {
+  TRACE_ZONE("particles_draw");
+  if (ps->count == 0 || !(ps->x0 <= ps->x1)) {
+    return;
+  }
+  const int size = ps->size;
+  if (canvas.tiles != NULL) {
+    float bx0 = fmaxf((ps->x0 - view_x) * zoom, 0.f);
+    float by0 = fmaxf((ps->y0 - view_y) * zoom, 0.f);
+    float bx1 = fminf((ps->x1 - view_x) * zoom + size, canvas.w);
+    float by1 = fminf((ps->y1 - view_y) * zoom + size, canvas.h);
+    if (!(bx0 < bx1 && by0 < by1)) {
+      return;
+    }
+    touch_tiles(canvas, bx0, by0, ceilf(bx1), ceilf(by1));
+  }
+
+  const bool packed = pixel_size(canvas.format) != sizeof(color);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 vx0 = _mm256_set1_ps(view_x), vy0 = _mm256_set1_ps(view_y);
+  const __m256 vzoom = _mm256_set1_ps(zoom);
+  // top left pixel in [0, w) x [0, h), compared as floats so far off-canvas
+  // particles can't overflow the conversion
+  const __m256 w = _mm256_set1_ps(canvas.w), h = _mm256_set1_ps(canvas.h);
+  const __m256 scale = _mm256_set1_ps(256.f);
+  const __m256i low = _mm256_set1_epi32(0x00ff00ff);
+
+  uint32_t first;
+  uint32_t blocks = particles_blocks(ps, &first);
+  const uint32_t mask = ps->capacity - 1;
+  for (uint32_t b = 0; b < blocks; ++b) {
+    uint32_t i = first + b * PARTICLE_LANES;
+    uint32_t k = i & mask;
+    __m256 life = _mm256_loadu_ps(&ps->life[k]);
+    __m256 px = _mm256_floor_ps(
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&ps->x[k]), vx0), vzoom));
+    __m256 py = _mm256_floor_ps(
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&ps->y[k]), vy0), vzoom));
+    __m256 on = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(px, zero, _CMP_GE_OQ),
+                      _mm256_cmp_ps(px, w, _CMP_LT_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(py, zero, _CMP_GE_OQ),
+                      _mm256_cmp_ps(py, h, _CMP_LT_OQ)));
+    on = _mm256_and_ps(on, _mm256_cmp_ps(life, zero, _CMP_GT_OQ));
+    on = _mm256_and_ps(on, particles_window(ps, i));
+    int bits = _mm256_movemask_ps(on);
+    if (bits == 0) {
+      continue;
+    }
+    px = _mm256_and_ps(px, on);
+    py = _mm256_and_ps(py, on);
+    __m256i ix = _mm256_cvtps_epi32(px);
+    __m256i iy = _mm256_cvtps_epi32(py);
+
+    // color * life / lifetime, two channels per 16 bits at a time
+    __m256 left = _mm256_mul_ps(life, _mm256_loadu_ps(&ps->fade[k]));
+    __m256i f = _mm256_cvttps_epi32(_mm256_mul_ps(left, scale));
+    __m256i c = _mm256_loadu_si256((const __m256i *)&ps->color[k]);
+    __m256i rb = _mm256_mullo_epi32(_mm256_and_si256(c, low), f);
+    __m256i ga =
+        _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 8), low), f);
+    c = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(rb, 8), low),
+                        _mm256_andnot_si256(low, ga));
+
+    int32_t xs[PARTICLE_LANES], ys[PARTICLE_LANES];
+    color cs[PARTICLE_LANES];
+    _mm256_storeu_si256((__m256i *)xs, ix);
+    _mm256_storeu_si256((__m256i *)ys, iy);
+    _mm256_storeu_si256((__m256i *)cs, c);
+    while (bits) {
+      int l = __builtin_ctz(bits);
+      bits &= bits - 1;
+      int n = canvas.w - xs[l] < size ? canvas.w - xs[l] : size;
+      int rows = canvas.h - ys[l] < size ? canvas.h - ys[l] : size;
+      size_t at = (size_t)ys[l] * canvas.stride + xs[l];
+      if (packed) {
+        for (int r = 0; r < rows; ++r, at += canvas.stride) {
+          particles_add_packed(canvas, at, n, cs[l]);
+        }
+        continue;
+      }
+      __m128i v = _mm_set1_epi32(cs[l]);
+      for (int r = 0; r < rows; ++r, at += canvas.stride) {
+        particles_add(&canvas.pixels[at], n, v);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,410 @@
+#ifndef INCLUDE_PATH_H
+#define INCLUDE_PATH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "draw.h"
+
+// Filled paths. A path is a list of subpaths made of lines and quadratic or
+// cubic Beziers. Filling flattens the curves into just enough lines to stay
+// within a tolerance of them, then walks the canvas rows once with an active
+// edge table, handing every run of inside pixels to a span_func.
+//
+// Pixels are sampled at their centers, so paths sharing an edge never both
+// fill a pixel. Open subpaths are closed with a straight line.
+
+#define PATH_TOLERANCE 0.25f  // pixels
+#define PATH_MAX_SEGMENTS 256 // lines per curve
+
+typedef enum {
+  PATH_MOVE,
+  PATH_LINE,
+  PATH_QUAD,
+  PATH_CUBIC,
+  PATH_CLOSE,
+} path_verb;
+
+typedef enum {
+  FILL_NONZERO,
+  FILL_EVEN_ODD,
+} fill_rule;
+
+typedef struct {
+  uint8_t *verbs;
+  float *points; // x, y pairs: one per move or line, two per quad, three per
+                 // cubic, none per close
+  uint32_t num_verbs;
+  uint32_t max_verbs;
+  uint32_t num_points;
+  uint32_t max_points;
+  fill_rule rule;
+  float x0, y0, x1, y1; // bounds of every point, control points included
+} path;
+
+// Called for every line of the flattened path, in path order.
+typedef void (*segment_func)(void *ctx, float x0, float y0, float x1,
+                             float y1);
+
+typedef struct {
+  float x, y; // top end
+  float dxdy;
+  int y0, y1; // rows whose centers it crosses, [y0, y1)
+  int dir;    // 1 if the path runs down it, -1 if up
+} path_edge;
+
+// Scratch for filling paths, sized for max_edges lines after flattening.
+typedef struct {
+  path_edge *edges;
+  int *active; // indices into edges, sorted by crossing
+  float *xs;   // crossing of each active edge on the current row
+  uint32_t num_edges;
+  uint32_t max_edges;
+  float tolerance;
+  int w, h;      // rows and columns kept while building
+  bool overflow; // more edges than max_edges
+} path_raster;
+
+int path_init(path *p, arena *a, uint32_t max_verbs, uint32_t max_points);
+void path_reset(path *p);
+int path_move_to(path *p, float x, float y);
+int path_line_to(path *p, float x, float y);
+int path_quad_to(path *p, float cx, float cy, float x, float y);
+int path_cubic_to(path *p, float c0x, float c0y, float c1x, float c1y,
+                  float x, float y);
+int path_close(path *p);
+
+// m is a 2x3 affine transform a, b, c, d, tx, ty mapping x, y to
+// a*x + c*y + tx, b*x + d*y + ty, or NULL for none.
+void path_flatten(const path *p, const float m[6], float tolerance,
+                  segment_func segment, void *ctx);
+
+int path_raster_init(path_raster *r, arena *a, uint32_t max_edges);
+int path_spans(path_raster *r, canvas canvas, const path *p,
+               const float m[6], span_func span, void *ctx);
+int fill_path(path_raster *r, canvas canvas, const path *p, const float m[6]);
+
+#endif
+
+#if defined(PATH_IMPLEMENTATION) && !defined(INCLUDE_PATH_IMPL)
+#define INCLUDE_PATH_IMPL
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+int path_init(path *p, arena *a, uint32_t max_verbs, uint32_t max_points) {
+  *p = (path){
+      .verbs = arena_alloc(a, max_verbs),
+      .points = arena_alloc(a, sizeof(float) * 2 * max_points),
+      .max_verbs = max_verbs,
+      .max_points = max_points,
+  };
+  if (p->verbs == NULL || p->points == NULL) {
+    return -1;
+  }
+  path_reset(p);
+  return 0;
+}
+
+void path_reset(path *p) {
+  p->num_verbs = 0;
+  p->num_points = 0;
+  p->x0 = p->y0 = INFINITY;
+  p->x1 = p->y1 = -INFINITY;
+}
+
+// Appends a verb and its points, or returns -1 leaving the path as it was.
+static int path_add(path *p, path_verb verb, const float *points, int n) {
+  if (p->num_verbs == p->max_verbs || p->num_points + n > p->max_points) {
+    return -1;
+  }
+  p->verbs[p->num_verbs++] = verb;
+  for (int i = 0; i < n; ++i) {
+    float x = points[2 * i], y = points[2 * i + 1];
+    p->points[2 * p->num_points] = x;
+    p->points[2 * p->num_points + 1] = y;
+    p->num_points++;
+    p->x0 = fminf(p->x0, x);
+    p->y0 = fminf(p->y0, y);
+    p->x1 = fmaxf(p->x1, x);
+    p->y1 = fmaxf(p->y1, y);
+  }
+  return 0;
+}
+
+int path_move_to(path *p, float x, float y) {
+  return path_add(p, PATH_MOVE, (float[2]){x, y}, 1);
+}
+
+// Segments before the first move start at the origin.
+int path_line_to(path *p, float x, float y) {
+  return path_add(p, PATH_LINE, (float[2]){x, y}, 1);
+}
+
+int path_quad_to(path *p, float cx, float cy, float x, float y) {
+  return path_add(p, PATH_QUAD, (float[4]){cx, cy, x, y}, 2);
+}
+
+int path_cubic_to(path *p, float c0x, float c0y, float c1x, float c1y,
+                  float x, float y) {
+  return path_add(p, PATH_CUBIC, (float[6]){c0x, c0y, c1x, c1y, x, y}, 3);
+}
+
+int path_close(path *p) { return path_add(p, PATH_CLOSE, NULL, 0); }
+
+// Wang's formula: the fewest uniform steps keeping the curve within
+// tolerance of its chords, given the largest second difference of its
+// control points. scale is 1/4 for quads and 3/4 for cubics.
+static int path_curve_segments(float ddx, float ddy, float scale,
+                               float tolerance) {
+  float n = ceilf(sqrtf(scale * sqrtf(ddx * ddx + ddy * ddy) / tolerance));
+  if (!(n >= 1.f)) {
+    return 1; // a straight curve, or NaN
+  }
+  return n > PATH_MAX_SEGMENTS ? PATH_MAX_SEGMENTS : n;
+}
+
+typedef struct {
+  segment_func segment;
+  void *ctx;
+  float x, y;   // current point
+  float sx, sy; // start of the subpath
+} path_walker;
+
+static inline void path_walk_line(path_walker *w, float x, float y) {
+  w->segment(w->ctx, w->x, w->y, x, y);
+  w->x = x;
+  w->y = y;
+}
+
+static inline void path_walk_close(path_walker *w) {
+  if (w->x != w->sx || w->y != w->sy) {
+    path_walk_line(w, w->sx, w->sy);
+  }
+}
+
+static void path_walk_quad(path_walker *w, const float *v, float tolerance) {
+  float x0 = w->x, y0 = w->y;
+  int n = path_curve_segments(x0 - 2 * v[0] + v[2], y0 - 2 * v[1] + v[3],
+                              0.25f, tolerance);
+  for (int i = 1; i < n; ++i) {
+    float t = (float)i / n, s = 1.f - t;
+    float a = s * s, b = 2 * s * t, c = t * t;
+    path_walk_line(w, a * x0 + b * v[0] + c * v[2],
+                   a * y0 + b * v[1] + c * v[3]);
+  }
+  path_walk_line(w, v[2], v[3]);
+}
+
+static void path_walk_cubic(path_walker *w, const float *v, float tolerance) {
+  float x0 = w->x, y0 = w->y;
+  float d0x = x0 - 2 * v[0] + v[2], d0y = y0 - 2 * v[1] + v[3];
+  float d1x = v[0] - 2 * v[2] + v[4], d1y = v[1] - 2 * v[3] + v[5];
+  bool first = d0x * d0x + d0y * d0y > d1x * d1x + d1y * d1y;
+  int n = path_curve_segments(first ? d0x : d1x, first ? d0y : d1y, 0.75f,
+                              tolerance);
+  for (int i = 1; i < n; ++i) {
+    float t = (float)i / n, s = 1.f - t;
+    float a = s * s * s, b = 3 * s * s * t, c = 3 * s * t * t, d = t * t * t;
+    path_walk_line(w, a * x0 + b * v[0] + c * v[2] + d * v[4],
+                   a * y0 + b * v[1] + c * v[3] + d * v[5]);
+  }
+  path_walk_line(w, v[4], v[5]);
+}
+
+// Control points are transformed before flattening, which is exact for
+// affine transforms and keeps the tolerance in output units.
+void path_flatten(const path *p, const float m[6], float tolerance,
+                  segment_func segment, void *ctx) {
+  path_walker w = {.segment = segment, .ctx = ctx};
+  const float *src = p->points;
+  for (uint32_t i = 0; i < p->num_verbs; ++i) {
+    static const int counts[] = {
+        [PATH_MOVE] = 1, [PATH_LINE] = 1, [PATH_QUAD] = 2,
+        [PATH_CUBIC] = 3, [PATH_CLOSE] = 0,
+    };
+    float v[6];
+    int n = counts[p->verbs[i]];
+    for (int k = 0; k < n; ++k, src += 2) {
+      v[2 * k] = m ? m[0] * src[0] + m[2] * src[1] + m[4] : src[0];
+      v[2 * k + 1] = m ? m[1] * src[0] + m[3] * src[1] + m[5] : src[1];
+    }
+
+    switch (p->verbs[i]) {
+    case PATH_MOVE:
+      path_walk_close(&w);
+      w.x = w.sx = v[0];
+      w.y = w.sy = v[1];
+      break;
+    case PATH_LINE:
+      path_walk_line(&w, v[0], v[1]);
+      break;
+    case PATH_QUAD:
+      path_walk_quad(&w, v, tolerance);
+      break;
+    case PATH_CUBIC:
+      path_walk_cubic(&w, v, tolerance);
+      break;
+    case PATH_CLOSE:
+      path_walk_close(&w);
+      break;
+    }
+  }
+  path_walk_close(&w);
+}
+
+int path_raster_init(path_raster *r, arena *a, uint32_t max_edges) {
+  *r = (path_raster){
+      .edges = arena_alloc(a, sizeof(path_edge) * max_edges),
+      .active = arena_alloc(a, sizeof(int) * max_edges),
+      .xs = arena_alloc(a, sizeof(float) * max_edges),
+      .max_edges = max_edges,
+      .tolerance = PATH_TOLERANCE,
+  };
+  if (r->edges == NULL || r->active == NULL || r->xs == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+// Keeps the lines that can change the winding of a pixel on the canvas:
+// anything crossing no pixel center of the visible rows, or lying entirely
+// right of the last column, is dropped.
+static void path_add_edge(void *ctx, float x0, float y0, float x1, float y1) {
+  path_raster *r = ctx;
+  int dir = 1;
+  if (y1 < y0) {
+    float t = x0;
+    x0 = x1;
+    x1 = t;
+    t = y0;
+    y0 = y1;
+    y1 = t;
+    dir = -1;
+  }
+  if (!(y0 < y1) || fminf(x0, x1) >= r->w) {
+    return; // horizontal or NaN, or right of the canvas
+  }
+  // clamp before converting so far off-canvas edges can't overflow
+  int first = ceilf(fmaxf(fminf(y0, r->h + 1), -1.f) - 0.5f);
+  int last = ceilf(fmaxf(fminf(y1, r->h + 1), -1.f) - 0.5f);
+  first = first < 0 ? 0 : first;
+  last = last > r->h ? r->h : last;
+  if (first >= last) {
+    return;
+  }
+  if (r->num_edges == r->max_edges) {
+    r->overflow = true;
+    return;
+  }
+  r->edges[r->num_edges++] = (path_edge){
+      .x = x0,
+      .y = y0,
+      .dxdy = (x1 - x0) / (y1 - y0),
+      .y0 = first,
+      .y1 = last,
+      .dir = dir,
+  };
+}
+
+static int path_edge_order(const void *a, const void *b) {
+  const path_edge *ea = a, *eb = b;
+  return (ea->y0 > eb->y0) - (ea->y0 < eb->y0);
+}
+
+// First pixel whose center is at or right of x, clamped to [0, w].
+static inline int path_column(float x, int w) {
+  int col = ceilf(fmaxf(fminf(x, w + 1), -1.f) - 0.5f);
+  return col < 0 ? 0 : col > w ? w : col;
+}
+
+// Calls span for every run of pixels inside the path, top to bottom. Fails
+// without drawing when the flattened path has more edges than r holds.
+int path_spans(path_raster *r, canvas canvas, const path *p,
+               const float m[6], span_func span, void *ctx) {
+  TRACE_ZONE("path_spans");
+  r->num_edges = 0;
+  r->w = canvas.w;
+  r->h = canvas.h;
+  r->overflow = false;
+  path_flatten(p, m, r->tolerance, path_add_edge, r);
+  if (r->overflow) {
+    return -1;
+  }
+  if (r->num_edges == 0) {
+    return 0;
+  }
+  qsort(r->edges, r->num_edges, sizeof(path_edge), path_edge_order);
+
+  const path_edge *edges = r->edges;
+  int *active = r->active;
+  float *xs = r->xs;
+  uint32_t next = 0;
+  int num_active = 0;
+  for (int y = edges[0].y0; y < canvas.h; ++y) {
+    // retire the edges ending above this row, then take in the new ones
+    int kept = 0;
+    for (int i = 0; i < num_active; ++i) {
+      if (edges[active[i]].y1 > y) {
+        active[kept++] = active[i];
+      }
+    }
+    num_active = kept;
+    while (next < r->num_edges && edges[next].y0 == y) {
+      active[num_active++] = next++;
+    }
+    if (num_active == 0) {
+      if (next == r->num_edges) {
+        break;
+      }
+      y = edges[next].y0 - 1;
+      continue;
+    }
+
+    // insertion sort by crossing, the order barely changes between rows
+    const float cy = y + 0.5f;
+    for (int i = 0; i < num_active; ++i) {
+      const path_edge *e = &edges[active[i]];
+      float x = e->x + (cy - e->y) * e->dxdy;
+      int index = active[i];
+      int j = i;
+      for (; j > 0 && xs[j - 1] > x; --j) {
+        xs[j] = xs[j - 1];
+        active[j] = active[j - 1];
+      }
+      xs[j] = x;
+      active[j] = index;
+    }
+
+    int winding = 0;
+    int start = 0;
+    bool inside = false;
+    for (int i = 0; i < num_active; ++i) {
+      bool was_inside = inside;
+      winding += edges[active[i]].dir;
+      inside = p->rule == FILL_EVEN_ODD ? winding & 1 : winding != 0;
+      if (inside && !was_inside) {
+        start = path_column(xs[i], canvas.w);
+      } else if (was_inside && !inside) {
+        int end = path_column(xs[i], canvas.w);
+        if (start < end) {
+          span(ctx, canvas, y, start, end);
+        }
+      }
+    }
+    // the edge leaving the path may have been dropped right of the canvas
+    if (inside && start < canvas.w) {
+      span(ctx, canvas, y, start, canvas.w);
+    }
+  }
+  return 0;
+}
+
+int fill_path(path_raster *r, canvas canvas, const path *p, const float m[6]) {
+  return path_spans(r, canvas, p, m, fill_canvas_span, NULL);
+}
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef INCLUDE_PROFILER_H
+#define INCLUDE_PROFILER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clock.h"
+
+// Number of frames kept in the ring, must be a power of two. Percentiles are
+// computed over this rolling window.
+#ifndef PROFILER_FRAMES
+#define PROFILER_FRAMES 1024
+#endif
+
+typedef enum {
+  STAGE_PACE,
+  STAGE_SIMULATE,
+  STAGE_CLEAR,
+  STAGE_RASTERIZE,
+  STAGE_PARTICLES,
+  STAGE_COMPOSITE,
+  STAGE_POST,
+  STAGE_HUD,
+  STAGE_RESOLVE,
+  STAGE_EXPORT,
+  STAGE_UPLOAD,
+  STAGE_BLIT,
+  STAGE_SWAP,
+  STAGE_FRAME,
+  STAGE_LATENCY, // input sample to end of swap, not part of the frame sum
+  NUM_STAGES,
+} stage;
+
+// Events counted per frame, beside the timings.
+typedef enum {
+  COUNTER_FALLBACK, // front to back frames drawn again in painter's order
+  NUM_COUNTERS,
+} counter;
+
+typedef struct {
+  uint64_t frame;
+  uint64_t start;                 // ns, clock_ns() at prof_begin_frame
+  uint32_t durations[NUM_STAGES]; // ns, saturated at UINT32_MAX (~4.3 s)
+  uint32_t counts[NUM_COUNTERS];
+} frame_record;
+
+typedef struct {
+  double p50;
+  double p95;
+  double p99;
+  double max;
+} stage_stats; // milliseconds
+
+const char *stage_name(stage s);
+const char *counter_name(counter c);
+
+void prof_begin_frame(void);
+void prof_begin(stage s);
+void prof_end(stage s);
+void prof_set(stage s, uint64_t ns);
+void prof_count(counter c);
+void prof_end_frame(void);
+
+size_t prof_snapshot(frame_record *out, size_t max_records);
+void prof_stats(stage s, stage_stats *stats);
+uint64_t prof_total(counter c);
+void prof_report(FILE *fp);
+int prof_dump_csv(const char *filename);
+
+#endif
+
+#if defined(PROFILER_IMPLEMENTATION) && !defined(INCLUDE_PROFILER_IMPL)
+#define INCLUDE_PROFILER_IMPL
+
+#define PROF_MASK (PROFILER_FRAMES - 1)
+
+// Log-linear buckets: values below PROF_SUB_BUCKETS map to themselves, after
+// that every power of two is split into PROF_SUB_BUCKETS slices (~6% error).
+#define PROF_SUB_BITS 4
+#define PROF_SUB_BUCKETS (1 << PROF_SUB_BITS)
+#define PROF_BUCKETS (PROF_SUB_BUCKETS * (33 - PROF_SUB_BITS))
+
+typedef struct {
+  _Atomic uint64_t seq;
+  frame_record record;
+} prof_slot;
+
+static prof_slot prof_ring[PROFILER_FRAMES];
+static _Atomic uint64_t prof_head;
+
+static frame_record prof_current;
+static uint64_t prof_stage_start[NUM_STAGES];
+static uint32_t prof_histogram[NUM_STAGES][PROF_BUCKETS];
+
+static const char *stage_names[NUM_STAGES] = {
+    "pace",      "simulate", "clear",   "rasterize", "particles",
+    "composite", "post",     "hud",     "resolve",   "export",
+    "upload",    "blit",     "swap",    "frame",     "latency",
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "fallback",
+};
+
+const char *stage_name(stage s) { return stage_names[s]; }
+const char *counter_name(counter c) { return counter_names[c]; }
+
+static inline size_t prof_bucket(uint32_t ns) {
+  if (ns < PROF_SUB_BUCKETS) {
+    return ns;
+  }
+  int e = 31 - __builtin_clz(ns);
+  size_t m = (ns >> (e - PROF_SUB_BITS)) & (PROF_SUB_BUCKETS - 1);
+  return PROF_SUB_BUCKETS * (e - PROF_SUB_BITS + 1) + m;
+}
+
+static inline uint32_t prof_bucket_value(size_t bucket) {
+  if (bucket < PROF_SUB_BUCKETS) {
+    return bucket;
+  }
+  int e = bucket / PROF_SUB_BUCKETS + PROF_SUB_BITS - 1;
+  uint64_t m = bucket & (PROF_SUB_BUCKETS - 1);
+  // upper edge of the bucket so percentiles never under-report
+  uint64_t v = ((PROF_SUB_BUCKETS | m) << (e - PROF_SUB_BITS)) +
+               (1ull << (e - PROF_SUB_BITS)) - 1;
+  return v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+void prof_begin_frame(void) {
+  uint64_t now = clock_ns();
+  prof_current = (frame_record){
+      .frame = atomic_load_explicit(&prof_head, memory_order_relaxed),
+      .start = now,
+  };
+  prof_stage_start[STAGE_FRAME] = now;
+}
+
+void prof_begin(stage s) { prof_stage_start[s] = clock_ns(); }
+
+// Stalls longer than a record holds stay at the top of the tail instead of
+// wrapping around to look fast.
+void prof_set(stage s, uint64_t ns) {
+  prof_current.durations[s] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+void prof_end(stage s) {
+  prof_set(s, prof_current.durations[s] + (clock_ns() - prof_stage_start[s]));
+}
+
+void prof_count(counter c) { prof_current.counts[c]++; }
+
+void prof_end_frame(void) {
+  prof_end(STAGE_FRAME);
+
+  uint64_t head = atomic_load_explicit(&prof_head, memory_order_relaxed);
+  prof_slot *slot = &prof_ring[head & PROF_MASK];
+
+  // evict the record falling out of the window from the histograms
+  if (head >= PROFILER_FRAMES) {
+    for (int s = 0; s < NUM_STAGES; ++s) {
+      prof_histogram[s][prof_bucket(slot->record.durations[s])]--;
+    }
+  }
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    prof_histogram[s][prof_bucket(prof_current.durations[s])]++;
+  }
+
+  // seqlock publish: odd while the slot is being written
+  atomic_store_explicit(&slot->seq, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->record = prof_current;
+  atomic_store_explicit(&slot->seq, 2 * head + 2, memory_order_release);
+  atomic_store_explicit(&prof_head, head + 1, memory_order_release);
+}
+
+// Copies the most recent completed frames, oldest first. Safe to call from
+// any thread while the render thread keeps publishing.
+size_t prof_snapshot(frame_record *out, size_t max_records) {
+  uint64_t head = atomic_load_explicit(&prof_head, memory_order_acquire);
+  uint64_t count = head < PROFILER_FRAMES ? head : PROFILER_FRAMES;
+  if (count > max_records) {
+    count = max_records;
+  }
+
+  size_t n = 0;
+  for (uint64_t i = head - count; i < head; ++i) {
+    prof_slot *slot = &prof_ring[i & PROF_MASK];
+    uint64_t s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    frame_record record = slot->record;
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (s1 != s2 || s1 != 2 * i + 2) {
+      continue; // overwritten while copying
+    }
+    out[n++] = record;
+  }
+  return n;
+}
+
+// Rolling percentiles over the last PROFILER_FRAMES frames. Reads the
+// histograms owned by the render thread, so call it from there.
+void prof_stats(stage s, stage_stats *stats) {
+  uint64_t head = atomic_load_explicit(&prof_head, memory_order_relaxed);
+  uint64_t count = head < PROFILER_FRAMES ? head : PROFILER_FRAMES;
+  *stats = (stage_stats){0};
+  if (count == 0) {
+    return;
+  }
+
+  const double ranks[3] = {0.50 * count, 0.95 * count, 0.99 * count};
+  double *values[3] = {&stats->p50, &stats->p95, &stats->p99};
+  uint64_t seen = 0;
+  int r = 0;
+  for (size_t b = 0; b < PROF_BUCKETS && r < 3; ++b) {
+    seen += prof_histogram[s][b];
+    while (r < 3 && seen > 0 && (double)seen >= ranks[r]) {
+      *values[r++] = prof_bucket_value(b) / NS_PER_MS;
+    }
+  }
+
+  uint32_t max = 0;
+  for (uint64_t i = head - count; i < head; ++i) {
+    uint32_t d = prof_ring[i & PROF_MASK].record.durations[s];
+    max = d > max ? d : max;
+  }
+  stats->max = max / NS_PER_MS;
+
+  // bucket upper edges can overshoot the largest sample
+  stats->p50 = stats->p50 > stats->max ? stats->max : stats->p50;
+  stats->p95 = stats->p95 > stats->max ? stats->max : stats->p95;
+  stats->p99 = stats->p99 > stats->max ? stats->max : stats->p99;
+}
+
+// Sum over the last PROFILER_FRAMES frames, from the render thread.
+uint64_t prof_total(counter c) {
+  uint64_t head = atomic_load_explicit(&prof_head, memory_order_relaxed);
+  uint64_t count = head < PROFILER_FRAMES ? head : PROFILER_FRAMES;
+  uint64_t total = 0;
+  for (uint64_t i = head - count; i < head; ++i) {
+    total += prof_ring[i & PROF_MASK].record.counts[c];
+  }
+  return total;
+}
+
+void prof_report(FILE *fp) {
+  fprintf(fp, "%-10s %9s %9s %9s %9s\n", "stage (ms)", "p50", "p95", "p99",
+          "max");
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    stage_stats stats;
+    prof_stats(s, &stats);
+    fprintf(fp, "%-10s %9.3f %9.3f %9.3f %9.3f\n", stage_name(s), stats.p50,
+            stats.p95, stats.p99, stats.max);
+  }
+  uint64_t head = atomic_load_explicit(&prof_head, memory_order_relaxed);
+  uint64_t frames = head < PROFILER_FRAMES ? head : PROFILER_FRAMES;
+  for (int c = 0; c < NUM_COUNTERS; ++c) {
+    fprintf(fp, "%-10s %9lu in %lu frames\n", counter_name(c),
+            (unsigned long)prof_total(c), (unsigned long)frames);
+  }
+}
+
+int prof_dump_csv(const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  static frame_record records[PROFILER_FRAMES];
+  size_t n = prof_snapshot(records, PROFILER_FRAMES);
+
+  fprintf(fp, "frame,start_ms");
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    fprintf(fp, ",%s_ms", stage_name(s));
+  }
+  for (int c = 0; c < NUM_COUNTERS; ++c) {
+    fprintf(fp, ",%s", counter_name(c));
+  }
+  fprintf(fp, "\n");
+
+  uint64_t origin = n > 0 ? records[0].start : 0;
+  for (size_t i = 0; i < n; ++i) {
+    fprintf(fp, "%lu,%.6f", (unsigned long)records[i].frame,
+            (records[i].start - origin) / NS_PER_MS);
+    for (int s = 0; s < NUM_STAGES; ++s) {
+      fprintf(fp, ",%.6f", records[i].durations[s] / NS_PER_MS);
+    }
+    for (int c = 0; c < NUM_COUNTERS; ++c) {
+      fprintf(fp, ",%u", records[i].counts[c]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  return fclose(fp);
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef INCLUDE_REPLAY_H
+#define INCLUDE_REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define REPLAY_MAGIC "DRWREC"
+#define REPLAY_VERSION 3
+#define MAX_FRAME_EVENTS 64
+#define INPUT_MOUSE_BUTTON 0x1000 // key of mouse button b is this plus b
+
+typedef struct {
+  int16_t key;
+  uint8_t action;
+  uint8_t mods;
+  float x; // cursor, as a fraction of the window's width and height
+  float y;
+} input_event;
+
+typedef struct {
+  FILE *fp;
+  uint32_t seed;
+  uint32_t modes; // how the caller drew, kept for it but not read here
+  int32_t width;
+  int32_t height;
+  uint64_t frames;
+} recording;
+
+typedef void *(*replay_init_func)(int width, int height);
+typedef void (*replay_step_func)(void *ctx, int width, int height, double dt);
+typedef void (*input_func)(void *ctx, const input_event *event);
+
+int record_open(recording *rec, const char *filename, uint32_t seed,
+                uint32_t modes, int width, int height);
+int record_frame(recording *rec, double dt, const input_event *events,
+                 uint16_t num_events);
+// Refuses recordings of a canvas larger than max_width by max_height, which
+// is what the caller sized its buffers for, with errno set to EINVAL.
+int replay_open(recording *rec, const char *filename, int max_width,
+                int max_height);
+int replay_frame(recording *rec, double *dt, input_event *events,
+                 uint16_t *num_events);
+int recording_close(recording *rec);
+
+void *replay(recording *rec, replay_init_func init_func,
+             replay_step_func step_func, input_func input_func);
+
+#endif
+
+#if defined(REPLAY_IMPLEMENTATION) && !defined(INCLUDE_REPLAY_IMPL)
+#define INCLUDE_REPLAY_IMPL
+
+#include <errno.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "trace.h"
+
+// File layout, native endianness:
+//   header: char magic[6], u16 version, u32 seed, u32 modes, i32 width,
+//           i32 height
+//   frame:  f64 dt, u16 num_events, input_event events[num_events]
+// The seed and every dt are stored exactly, so a replay reproduces the
+// recorded frame sequence bit for bit on the same build.
+
+int record_open(recording *rec, const char *filename, uint32_t seed,
+                uint32_t modes, int width, int height) {
+  *rec = (recording){
+      .fp = fopen(filename, "wb"),
+      .seed = seed,
+      .modes = modes,
+      .width = width,
+      .height = height,
+  };
+  if (rec->fp == NULL) {
+    return -1;
+  }
+
+  uint16_t version = REPLAY_VERSION;
+  if (fwrite(REPLAY_MAGIC, 6, 1, rec->fp) != 1 ||
+      fwrite(&version, sizeof(version), 1, rec->fp) != 1 ||
+      fwrite(&rec->seed, sizeof(rec->seed), 1, rec->fp) != 1 ||
+      fwrite(&rec->modes, sizeof(rec->modes), 1, rec->fp) != 1 ||
+      fwrite(&rec->width, sizeof(rec->width), 1, rec->fp) != 1 ||
+      fwrite(&rec->height, sizeof(rec->height), 1, rec->fp) != 1) {
+    fclose(rec->fp);
+    rec->fp = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int record_frame(recording *rec, double dt, const input_event *events,
+                 uint16_t num_events) {
+  if (fwrite(&dt, sizeof(dt), 1, rec->fp) != 1 ||
+      fwrite(&num_events, sizeof(num_events), 1, rec->fp) != 1 ||
+      fwrite(events, sizeof(input_event), num_events, rec->fp) != num_events) {
+    return -1;
+  }
+  rec->frames++;
+  return 0;
+}
+
+int replay_open(recording *rec, const char *filename, int max_width,
+                int max_height) {
+  *rec = (recording){.fp = fopen(filename, "rb")};
+  if (rec->fp == NULL) {
+    return -1;
+  }
+
+  char magic[6];
+  uint16_t version;
+  if (fread(magic, 6, 1, rec->fp) != 1 ||
+      memcmp(magic, REPLAY_MAGIC, 6) != 0 ||
+      fread(&version, sizeof(version), 1, rec->fp) != 1 ||
+      version != REPLAY_VERSION ||
+      fread(&rec->seed, sizeof(rec->seed), 1, rec->fp) != 1 ||
+      fread(&rec->modes, sizeof(rec->modes), 1, rec->fp) != 1 ||
+      fread(&rec->width, sizeof(rec->width), 1, rec->fp) != 1 ||
+      fread(&rec->height, sizeof(rec->height), 1, rec->fp) != 1 ||
+      rec->width <= 0 || rec->height <= 0 || rec->width > max_width ||
+      rec->height > max_height) {
+    if (!ferror(rec->fp)) {
+      errno = EINVAL; // a short or malformed header, not a failed read
+    }
+    fclose(rec->fp);
+    rec->fp = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Returns 1 when a frame was read, 0 at the end of the recording and -1 on a
+// truncated or corrupt frame. events must hold MAX_FRAME_EVENTS entries.
+int replay_frame(recording *rec, double *dt, input_event *events,
+                 uint16_t *num_events) {
+  if (fread(dt, sizeof(*dt), 1, rec->fp) != 1) {
+    return feof(rec->fp) ? 0 : -1;
+  }
+  if (fread(num_events, sizeof(*num_events), 1, rec->fp) != 1 ||
+      *num_events > MAX_FRAME_EVENTS ||
+      fread(events, sizeof(input_event), *num_events, rec->fp) !=
+          *num_events) {
+    return -1;
+  }
+  rec->frames++;
+  return 1;
+}
+
+int recording_close(recording *rec) {
+  int err = fclose(rec->fp);
+  rec->fp = NULL;
+  return err;
+}
+
+// Runs the recorded frames headless, as fast as possible.
+void *replay(recording *rec, replay_init_func init_func,
+             replay_step_func step_func, input_func input_func) {
+  TRACE_THREAD_NAME("replay");
+  void *ctx = init_func(rec->width, rec->height);
+
+  input_event events[MAX_FRAME_EVENTS];
+  uint16_t num_events;
+  double dt;
+  int status;
+
+  uint64_t start = clock_ns();
+  while ((status = replay_frame(rec, &dt, events, &num_events)) == 1) {
+    TRACE_ZONE("frame");
+    prof_begin_frame();
+    for (uint16_t i = 0; i < num_events; ++i) {
+      input_func(ctx, &events[i]);
+    }
+    step_func(ctx, rec->width, rec->height, dt);
+    prof_end_frame();
+  }
+  uint64_t elapsed = clock_ns() - start;
+
+  if (status < 0) {
+    fprintf(stderr, "replay: corrupt frame after %lu frames\n",
+            (unsigned long)rec->frames);
+  }
+  fprintf(stderr, "replay: %lu frames in %.3f s (%.3f ms/frame)\n",
+          (unsigned long)rec->frames, elapsed / (double)NS_PER_SEC,
+          rec->frames ? elapsed / NS_PER_MS / rec->frames : 0.0);
+  return ctx;
+}
+
+#endif
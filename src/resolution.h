@@ -0,0 +1,91 @@
+#ifndef INCLUDE_RESOLUTION_H
+#define INCLUDE_RESOLUTION_H
+
+#include <stdint.h>
+
+// Dynamic resolution. The canvas is drawn at step / RES_STEPS of its full
+// width and height, and the step is picked every frame to keep the measured
+// raster time under a budget. Raster time is taken to scale with the pixel
+// count, which holds well enough for clears, fills and the upload.
+#define RES_STEPS 32
+
+typedef struct {
+  uint64_t budget; // ns of raster time per frame
+  double estimate; // ns, smoothed raster time at the current step
+  int step;
+  int min_step;
+  int cooldown; // frames before the step may change again
+} resolution_scaler;
+
+void resolution_init(resolution_scaler *r, double budget_ms, float min_scale);
+float resolution_update(resolution_scaler *r, uint64_t cost);
+float resolution_scale(const resolution_scaler *r);
+
+#endif
+
+#if defined(RESOLUTION_IMPLEMENTATION) && !defined(INCLUDE_RESOLUTION_IMPL)
+#define INCLUDE_RESOLUTION_IMPL
+
+#include <math.h>
+
+#include "clock.h"
+
+#define RES_SMOOTHING 8 // frames, for the cost average
+#define RES_COOLDOWN 8  // frames, lets the average settle after a change
+#define RES_HEADROOM 0.85 // grow only when the next step fits with margin
+
+void resolution_init(resolution_scaler *r, double budget_ms, float min_scale) {
+  int min_step = min_scale * RES_STEPS + 0.5f;
+  min_step = min_step > RES_STEPS ? RES_STEPS : min_step;
+  *r = (resolution_scaler){
+      .budget = budget_ms * NS_PER_MS,
+      .step = RES_STEPS,
+      .min_step = min_step < 1 ? 1 : min_step,
+  };
+}
+
+float resolution_scale(const resolution_scaler *r) {
+  return r->step / (float)RES_STEPS;
+}
+
+// Feeds the raster time of the last frame and returns the scale to draw the
+// next one at. Drops straight to the step predicted to fit the budget but
+// only climbs back one step at a time, so a slow host settles on a lower
+// resolution instead of oscillating around it.
+float resolution_update(resolution_scaler *r, uint64_t cost) {
+  if (cost == 0) {
+    return resolution_scale(r);
+  }
+  if (r->estimate == 0) {
+    r->estimate = cost;
+  } else {
+    r->estimate += (cost - r->estimate) / RES_SMOOTHING;
+  }
+  if (r->cooldown > 0) {
+    r->cooldown--;
+    return resolution_scale(r);
+  }
+
+  int step = r->step;
+  if (r->estimate > r->budget) {
+    step = step * sqrt(r->budget / r->estimate);
+    step = step < r->step ? step : r->step - 1;
+  } else if (step < RES_STEPS) {
+    double grow = (step + 1.0) / step;
+    if (r->estimate * grow * grow < r->budget * RES_HEADROOM) {
+      step++;
+    }
+  }
+  step = step < r->min_step ? r->min_step : step;
+
+  if (step != r->step) {
+    // the average was measured at the old size
+    double ratio = step / (double)r->step;
+    r->estimate *= ratio * ratio;
+    r->step = step;
+    r->cooldown = RES_COOLDOWN;
+  }
+  return resolution_scale(r);
+}
+
+#endif
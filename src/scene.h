@@ -0,0 +1,534 @@
+#ifndef INCLUDE_SCENE_H
+#define INCLUDE_SCENE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "coverage.h"
+#include "draw.h"
+#include "msaa.h"
+#include "path.h"
+
+#define SCENE_ROOT 0
+#define SCENE_NONE UINT32_MAX
+#define SCENE_MAX_EDGES 1024 // lines per path after flattening
+
+typedef uint32_t node_id;
+
+typedef enum {
+  NODE_GROUP,
+  NODE_RECT,     // shape: x, y, w, h
+  NODE_TRIANGLE, // shape: three x, y points
+  NODE_LINE,     // shape: two x, y points
+  NODE_PATH,     // no shape, see scene_set_path
+} node_kind;
+
+enum {
+  NODE_DIRTY = 1 << 0,       // local transform changed
+  NODE_CHILD_DIRTY = 1 << 1, // something in the subtree needs an update
+  NODE_HIDDEN = 1 << 2,      // skipped with its whole subtree
+};
+
+typedef struct {
+  float x0, y0, x1, y1;
+} aabb;
+
+// 2x3 affine transform: x' = a*x + c*y + tx, y' = b*x + d*y + ty
+typedef struct {
+  float a, b, c, d, tx, ty;
+} xform;
+
+typedef struct {
+  node_kind kind;
+  uint32_t flags;
+  node_id parent;
+  node_id first_child;
+  node_id last_child;
+  node_id next_sibling;
+  node_id prev_sibling;
+  color color;
+  // local transform, applied as scale, then rotate, then translate
+  float x, y, rotation, scale;
+  float shape[6];
+  const path *path; // NODE_PATH, not owned
+  xform world;
+  aabb bounds; // world space, covers the whole subtree
+} scene_node;
+
+typedef struct {
+  uint32_t visited;
+  uint32_t culled;
+  uint32_t drawn;
+} scene_stats;
+
+typedef struct {
+  scene_node *nodes;
+  uint32_t num_nodes;
+  uint32_t max_nodes;
+  // canvas = (world - view) * zoom
+  float view_x, view_y, zoom;
+  scene_stats stats; // from the last scene_draw
+  path_raster raster;
+  int samples; // 4 or 8 anti-aliases rects and triangles in scene_draw
+} scene;
+
+int scene_init(scene *s, arena *a, uint32_t max_nodes);
+node_id scene_add(scene *s, node_id parent, node_kind kind, const float *shape,
+                  color color);
+
+void scene_set_position(scene *s, node_id id, float x, float y);
+void scene_set_rotation(scene *s, node_id id, float rotation);
+void scene_set_scale(scene *s, node_id id, float scale);
+void scene_set_hidden(scene *s, node_id id, bool hidden);
+void scene_set_path(scene *s, node_id id, const path *p);
+void scene_set_view(scene *s, float x, float y, float zoom);
+
+void scene_update(scene *s);
+void scene_draw(scene *s, canvas canvas, node_id root);
+int scene_draw_front_to_back(scene *s, canvas canvas, coverage *cov,
+                             node_id root);
+
+#endif
+
+#if defined(SCENE_IMPLEMENTATION) && !defined(INCLUDE_SCENE_IMPL)
+#define INCLUDE_SCENE_IMPL
+
+#include <math.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Transformed vertices are clamped to this many pixels off the canvas before
+// they are rounded, so absurd zoom levels can't overflow the rasterizer.
+#define SCENE_COORD_LIMIT 1048576.f
+
+// floats in each kind of shape
+static const int scene_shape_size[] = {
+    [NODE_GROUP] = 0,
+    [NODE_RECT] = 4,
+    [NODE_TRIANGLE] = 6,
+    [NODE_LINE] = 4,
+    [NODE_PATH] = 0,
+};
+
+static const aabb aabb_empty = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
+static inline aabb aabb_union(aabb a, aabb b) {
+  return (aabb){fminf(a.x0, b.x0), fminf(a.y0, b.y0), fmaxf(a.x1, b.x1),
+                fmaxf(a.y1, b.y1)};
+}
+
+static inline bool aabb_overlaps(aabb a, aabb b) {
+  return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+}
+
+static inline xform xform_mul(const xform *p, const xform *l) {
+  return (xform){
+      .a = p->a * l->a + p->c * l->b,
+      .b = p->b * l->a + p->d * l->b,
+      .c = p->a * l->c + p->c * l->d,
+      .d = p->b * l->c + p->d * l->d,
+      .tx = p->a * l->tx + p->c * l->ty + p->tx,
+      .ty = p->b * l->tx + p->d * l->ty + p->ty,
+  };
+}
+
+static inline void xform_apply(const xform *m, float x, float y, float out[2]) {
+  out[0] = m->a * x + m->c * y + m->tx;
+  out[1] = m->b * x + m->d * y + m->ty;
+}
+
+// Corners or points of the shape in its own space, returns how many.
+static int scene_shape_vertices(const scene_node *n, float v[8]) {
+  if (n->kind == NODE_RECT) {
+    float x = n->shape[0], y = n->shape[1];
+    float x1 = x + n->shape[2], y1 = y + n->shape[3];
+    memcpy(v, (float[8]){x, y, x1, y, x1, y1, x, y1}, sizeof(float) * 8);
+    return 4;
+  }
+  if (n->kind == NODE_PATH) {
+    // a curve never leaves the hull of its control points
+    const path *p = n->path;
+    if (p == NULL || p->num_points == 0) {
+      return 0;
+    }
+    memcpy(v, (float[8]){p->x0, p->y0, p->x1, p->y0, p->x1, p->y1, p->x0,
+                         p->y1},
+           sizeof(float) * 8);
+    return 4;
+  }
+  memcpy(v, n->shape, sizeof(float) * scene_shape_size[n->kind]);
+  return scene_shape_size[n->kind] / 2;
+}
+
+int scene_init(scene *s, arena *a, uint32_t max_nodes) {
+  *s = (scene){
+      .nodes = arena_alloc(a, sizeof(scene_node) * max_nodes),
+      .max_nodes = max_nodes,
+      .zoom = 1.f,
+  };
+  if (s->nodes == NULL || max_nodes == 0 ||
+      path_raster_init(&s->raster, a, SCENE_MAX_EDGES) != 0) {
+    return -1;
+  }
+  s->nodes[SCENE_ROOT] = (scene_node){
+      .kind = NODE_GROUP,
+      .flags = NODE_DIRTY,
+      .parent = SCENE_NONE,
+      .first_child = SCENE_NONE,
+      .last_child = SCENE_NONE,
+      .next_sibling = SCENE_NONE,
+      .prev_sibling = SCENE_NONE,
+      .scale = 1.f,
+      .bounds = aabb_empty,
+  };
+  s->num_nodes = 1;
+  return 0;
+}
+
+static void scene_mark_dirty(scene *s, node_id id) {
+  s->nodes[id].flags |= NODE_DIRTY;
+  for (node_id p = s->nodes[id].parent;
+       p != SCENE_NONE && !(s->nodes[p].flags & NODE_CHILD_DIRTY);
+       p = s->nodes[p].parent) {
+    s->nodes[p].flags |= NODE_CHILD_DIRTY;
+  }
+}
+
+// Children are drawn in the order they were added, after their parent.
+// Returns SCENE_NONE once max_nodes is reached.
+node_id scene_add(scene *s, node_id parent, node_kind kind, const float *shape,
+                  color color) {
+  if (s->num_nodes == s->max_nodes) {
+    return SCENE_NONE;
+  }
+
+  node_id id = s->num_nodes++;
+  scene_node *n = &s->nodes[id];
+  *n = (scene_node){
+      .kind = kind,
+      .parent = parent,
+      .first_child = SCENE_NONE,
+      .last_child = SCENE_NONE,
+      .next_sibling = SCENE_NONE,
+      .color = color,
+      .scale = 1.f,
+      .bounds = aabb_empty,
+  };
+  if (shape != NULL) {
+    memcpy(n->shape, shape, sizeof(float) * scene_shape_size[kind]);
+  }
+
+  scene_node *p = &s->nodes[parent];
+  n->prev_sibling = p->last_child;
+  if (p->last_child == SCENE_NONE) {
+    p->first_child = id;
+  } else {
+    s->nodes[p->last_child].next_sibling = id;
+  }
+  p->last_child = id;
+
+  scene_mark_dirty(s, id);
+  return id;
+}
+
+void scene_set_position(scene *s, node_id id, float x, float y) {
+  scene_node *n = &s->nodes[id];
+  if (n->x != x || n->y != y) {
+    n->x = x;
+    n->y = y;
+    scene_mark_dirty(s, id);
+  }
+}
+
+void scene_set_rotation(scene *s, node_id id, float rotation) {
+  if (s->nodes[id].rotation != rotation) {
+    s->nodes[id].rotation = rotation;
+    scene_mark_dirty(s, id);
+  }
+}
+
+void scene_set_scale(scene *s, node_id id, float scale) {
+  if (s->nodes[id].scale != scale) {
+    s->nodes[id].scale = scale;
+    scene_mark_dirty(s, id);
+  }
+}
+
+void scene_set_hidden(scene *s, node_id id, bool hidden) {
+  if (hidden) {
+    s->nodes[id].flags |= NODE_HIDDEN;
+  } else {
+    s->nodes[id].flags &= ~NODE_HIDDEN;
+  }
+}
+
+// The path is drawn in the node's space with its own fill rule. Call again
+// after editing it so the bounds are refreshed.
+void scene_set_path(scene *s, node_id id, const path *p) {
+  s->nodes[id].path = p;
+  scene_mark_dirty(s, id);
+}
+
+void scene_set_view(scene *s, float x, float y, float zoom) {
+  s->view_x = x;
+  s->view_y = y;
+  s->zoom = zoom;
+}
+
+static void scene_update_node(scene *s, node_id id, const xform *parent,
+                              bool parent_dirty) {
+  scene_node *n = &s->nodes[id];
+  bool dirty = parent_dirty || (n->flags & NODE_DIRTY);
+  if (!dirty && !(n->flags & NODE_CHILD_DIRTY)) {
+    return;
+  }
+  n->flags &= ~(NODE_DIRTY | NODE_CHILD_DIRTY);
+
+  if (dirty) {
+    float sn = n->scale * sinf(n->rotation);
+    float cs = n->scale * cosf(n->rotation);
+    xform local = {cs, sn, -sn, cs, n->x, n->y};
+    n->world = xform_mul(parent, &local);
+  }
+
+  float v[8];
+  aabb bounds = aabb_empty;
+  for (int i = 0, num = scene_shape_vertices(n, v); i < num; ++i) {
+    float p[2];
+    xform_apply(&n->world, v[2 * i], v[2 * i + 1], p);
+    bounds = aabb_union(bounds, (aabb){p[0], p[1], p[0], p[1]});
+  }
+
+  for (node_id c = n->first_child; c != SCENE_NONE;
+       c = s->nodes[c].next_sibling) {
+    scene_update_node(s, c, &n->world, dirty);
+    bounds = aabb_union(bounds, s->nodes[c].bounds);
+  }
+  n->bounds = bounds;
+}
+
+// Refreshes world transforms and bounds, only walking dirty subtrees.
+void scene_update(scene *s) {
+  TRACE_ZONE("scene_update");
+  const xform identity = {1.f, 0.f, 0.f, 1.f, 0.f, 0.f};
+  scene_update_node(s, SCENE_ROOT, &identity, false);
+}
+
+static inline Vector2d scene_to_point(const xform *m, float x, float y) {
+  float p[2];
+  xform_apply(m, x, y, p);
+  p[0] = fmaxf(fminf(p[0], SCENE_COORD_LIMIT), -SCENE_COORD_LIMIT);
+  p[1] = fmaxf(fminf(p[1], SCENE_COORD_LIMIT), -SCENE_COORD_LIMIT);
+  return (Vector2d){p[0], p[1]};
+}
+
+static inline Vector2 scene_to_pixel(const xform *m, float x, float y) {
+  Vector2d p = scene_to_point(m, x, y);
+  return (Vector2){(int)floor(p.x), (int)floor(p.y)};
+}
+
+// Anti-aliased rects and triangles, in float pixels.
+static void scene_draw_msaa(canvas canvas, const scene_node *n,
+                            const xform *m, int samples) {
+  const float *v = n->shape;
+  if (n->kind == NODE_TRIANGLE) {
+    draw_triangle_msaa(canvas, scene_to_point(m, v[0], v[1]),
+                       scene_to_point(m, v[2], v[3]),
+                       scene_to_point(m, v[4], v[5]), samples);
+  } else if (m->b == 0.f && m->c == 0.f) {
+    draw_rectangle_msaa(canvas, scene_to_point(m, v[0], v[1]),
+                        scene_to_point(m, v[0] + v[2], v[1] + v[3]),
+                        samples);
+  } else {
+    const Vector2d p[4] = {
+        scene_to_point(m, v[0], v[1]),
+        scene_to_point(m, v[0] + v[2], v[1]),
+        scene_to_point(m, v[0] + v[2], v[1] + v[3]),
+        scene_to_point(m, v[0], v[1] + v[3]),
+    };
+    draw_quad_msaa(canvas, p, samples);
+  }
+}
+
+// Draws straight to the canvas, or through the coverage mask when cov is set.
+static void scene_draw_shape(canvas canvas, coverage *cov, path_raster *r,
+                             const scene_node *n, const xform *m,
+                             int samples) {
+  canvas.color = n->color;
+  const float *v = n->shape;
+  if ((samples == 4 || samples == 8) &&
+      (n->kind == NODE_RECT || n->kind == NODE_TRIANGLE)) {
+    scene_draw_msaa(canvas, n, m, samples);
+    return;
+  }
+  switch (n->kind) {
+  case NODE_GROUP:
+    break;
+  case NODE_RECT:
+    if (m->b == 0.f && m->c == 0.f) {
+      // still axis aligned, use the span filler
+      Vector2 p0 = scene_to_pixel(m, v[0], v[1]);
+      Vector2 p1 = scene_to_pixel(m, v[0] + v[2], v[1] + v[3]);
+      Rectangle r = {
+          .x = p0.x < p1.x ? p0.x : p1.x,
+          .y = p0.y < p1.y ? p0.y : p1.y,
+          .w = abs(p1.x - p0.x),
+          .h = abs(p1.y - p0.y),
+      };
+      if (cov != NULL) {
+        coverage_rect(cov, canvas, &r);
+      } else {
+        draw_rectangle(canvas, &r);
+      }
+    } else {
+      Vector2 p0 = scene_to_pixel(m, v[0], v[1]);
+      Vector2 p1 = scene_to_pixel(m, v[0] + v[2], v[1]);
+      Vector2 p2 = scene_to_pixel(m, v[0] + v[2], v[1] + v[3]);
+      Vector2 p3 = scene_to_pixel(m, v[0], v[1] + v[3]);
+      if (cov != NULL) {
+        coverage_triangle(cov, canvas, p0, p1, p2);
+        coverage_triangle(cov, canvas, p0, p2, p3);
+      } else {
+        draw_triangle(canvas, p0, p1, p2);
+        draw_triangle(canvas, p0, p2, p3);
+      }
+    }
+    break;
+  case NODE_TRIANGLE: {
+    Vector2 p0 = scene_to_pixel(m, v[0], v[1]);
+    Vector2 p1 = scene_to_pixel(m, v[2], v[3]);
+    Vector2 p2 = scene_to_pixel(m, v[4], v[5]);
+    if (cov != NULL) {
+      coverage_triangle(cov, canvas, p0, p1, p2);
+    } else {
+      draw_triangle(canvas, p0, p1, p2);
+    }
+    break;
+  }
+  case NODE_LINE: {
+    Vector2 p0 = scene_to_pixel(m, v[0], v[1]);
+    Vector2 p1 = scene_to_pixel(m, v[2], v[3]);
+    if (cov != NULL) {
+      coverage_line(cov, canvas, p0, p1);
+    } else {
+      draw_line(canvas, p0, p1);
+    }
+    break;
+  }
+  case NODE_PATH: {
+    if (n->path == NULL) {
+      break;
+    }
+    const float pm[6] = {m->a, m->b, m->c, m->d, m->tx, m->ty};
+    if (cov != NULL) {
+      coverage_path(cov, canvas, r, n->path, pm);
+    } else {
+      fill_path(r, canvas, n->path, pm);
+    }
+    break;
+  }
+  }
+}
+
+typedef struct {
+  canvas canvas;
+  coverage *cov;
+  path_raster *raster;
+  int samples;
+  xform view;
+  aabb visible; // canvas rect in world space
+} scene_pass;
+
+static bool scene_visible(scene *s, const scene_pass *pass,
+                          const scene_node *n) {
+  s->stats.visited++;
+  if (n->flags & NODE_HIDDEN) {
+    return false;
+  }
+  if (!aabb_overlaps(n->bounds, pass->visible)) {
+    s->stats.culled++;
+    return false;
+  }
+  return true;
+}
+
+static void scene_draw_self(scene *s, const scene_pass *pass,
+                            const scene_node *n) {
+  if (n->kind != NODE_GROUP) {
+    xform m = xform_mul(&pass->view, &n->world);
+    scene_draw_shape(pass->canvas, pass->cov, pass->raster, n, &m,
+                     pass->samples);
+    s->stats.drawn++;
+  }
+}
+
+// Painter's order: a node, then its children in the order they were added.
+static void scene_draw_node(scene *s, const scene_pass *pass, node_id id) {
+  const scene_node *n = &s->nodes[id];
+  if (!scene_visible(s, pass, n)) {
+    return;
+  }
+  scene_draw_self(s, pass, n);
+  for (node_id c = n->first_child; c != SCENE_NONE;
+       c = s->nodes[c].next_sibling) {
+    scene_draw_node(s, pass, c);
+  }
+}
+
+// Exactly the reverse of scene_draw_node.
+static void scene_draw_node_reverse(scene *s, const scene_pass *pass,
+                                    node_id id) {
+  const scene_node *n = &s->nodes[id];
+  if (!scene_visible(s, pass, n)) {
+    return;
+  }
+  for (node_id c = n->last_child; c != SCENE_NONE;
+       c = s->nodes[c].prev_sibling) {
+    scene_draw_node_reverse(s, pass, c);
+  }
+  scene_draw_self(s, pass, n);
+}
+
+static scene_pass scene_begin_pass(scene *s, canvas canvas, coverage *cov) {
+  s->stats = (scene_stats){0};
+  // padded a pixel for line anti-aliasing
+  const float pad = 1.f / s->zoom;
+  return (scene_pass){
+      .canvas = canvas,
+      .cov = cov,
+      .raster = &s->raster,
+      // coverage blends can't be resolved front to back
+      .samples = cov == NULL ? s->samples : 1,
+      .view = {s->zoom, 0.f, 0.f, s->zoom, -s->view_x * s->zoom,
+               -s->view_y * s->zoom},
+      .visible = {s->view_x - pad, s->view_y - pad,
+                  s->view_x + canvas.w / s->zoom + pad,
+                  s->view_y + canvas.h / s->zoom + pad},
+  };
+}
+
+// Draws every node under root whose bounds reach the canvas. Call
+// scene_update first.
+void scene_draw(scene *s, canvas canvas, node_id root) {
+  TRACE_ZONE("scene_draw");
+  scene_pass pass = scene_begin_pass(s, canvas, NULL);
+  scene_draw_node(s, &pass, root);
+}
+
+// Same result as scene_draw, but nearest nodes go first and claim their
+// pixels in cov, so overlapped pixels are written once. Lines are only
+// recorded, follow with coverage_clear and coverage_flush. Returns -1 when
+// they overflowed cov, the canvas then has to be cleared and drawn with
+// scene_draw instead.
+int scene_draw_front_to_back(scene *s, canvas canvas, coverage *cov,
+                             node_id root) {
+  TRACE_ZONE("scene_draw_front_to_back");
+  scene_pass pass = scene_begin_pass(s, canvas, cov);
+  coverage_begin(cov);
+  scene_draw_node_reverse(s, &pass, root);
+  return cov->overflowed ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,332 @@
+#ifndef INCLUDE_SHADE_H
+#define INCLUDE_SHADE_H
+
+#include "depth.h"
+#include "draw.h"
+
+// Triangles with attributes. Colors or texture coordinates given per vertex
+// are blended across the triangle with barycentric weights evaluated eight
+// pixels at a time, the weights stepped along each row instead of
+// recomputed. With a w per vertex other than 1 they are interpolated over
+// w, perspective correct, as for a triangle projected with linmath.h.
+//
+// Unlike draw_triangle, vertices are float pixel positions and a pixel is
+// drawn when its center is inside. Rows and columns are split by the edges
+// computed the same way from both sides, so triangles sharing an edge never
+// overlap or leave a gap. Pixels are written, not blended.
+//
+// With a depth buffer attached to the canvas, pixels are depth tested
+// before they are shaded. z is interpolated linearly across the screen, as
+// a projected depth is.
+#define SHADE_MAX_ATTRIBUTES 4
+
+typedef struct {
+  float x;
+  float y;
+  float z;    // depth, only used with a depth buffer
+  float w;    // > 0, 1 for plain 2D
+  float u;    // texture coordinates, 0 to 1 across the texture
+  float v;
+  color color;
+} shade_vertex;
+
+typedef enum {
+  SAMPLE_NEAREST,
+  SAMPLE_BILINEAR,
+} sample_filter;
+
+void draw_gouraud_triangle(canvas canvas, const shade_vertex v[3]);
+void draw_textured_triangle(canvas dst, const shade_vertex v[3],
+                            canvas texture, sample_filter filter);
+
+#endif
+
+#if defined(SHADE_IMPLEMENTATION) && !defined(INCLUDE_SHADE_IMPL)
+#define INCLUDE_SHADE_IMPL
+
+#include <math.h>
+
+#include <immintrin.h>
+
+#include "trace.h"
+
+typedef struct {
+  // barycentric weights of vertices 1 and 2 as planes over pixel centers,
+  // b = bx * (x - ox) + by * (y - oy)
+  float b1x, b1y, o1x, o1y;
+  float b2x, b2y, o2x, o2y;
+  int num_attributes;
+  // vertex 0 and the differences to 1 and 2, all over w when perspective
+  float a0[SHADE_MAX_ATTRIBUTES], d1[SHADE_MAX_ATTRIBUTES],
+      d2[SHADE_MAX_ATTRIBUTES];
+  float q0, dq1, dq2; // 1 / w
+  bool perspective;
+  float z0, dz1, dz2;
+  depth_buffer *depth;
+  canvas texture;
+  sample_filter filter;
+} shade_setup;
+
+// False for a triangle without area, which covers no pixel centers.
+static bool shade_init(shade_setup *s, const shade_vertex v[3],
+                       const float attributes[3][SHADE_MAX_ATTRIBUTES],
+                       int n) {
+  float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+               (v[2].x - v[0].x) * (v[1].y - v[0].y);
+  if (area == 0.f || !isfinite(area)) {
+    return false;
+  }
+  s->b1x = (v[2].y - v[0].y) / area;
+  s->b1y = (v[0].x - v[2].x) / area;
+  s->o1x = v[2].x;
+  s->o1y = v[2].y;
+  s->b2x = (v[0].y - v[1].y) / area;
+  s->b2y = (v[1].x - v[0].x) / area;
+  s->o2x = v[0].x;
+  s->o2y = v[0].y;
+
+  s->perspective = v[0].w != v[1].w || v[1].w != v[2].w;
+  float q[3] = {1.f, 1.f, 1.f};
+  if (s->perspective) {
+    for (int i = 0; i < 3; ++i) {
+      q[i] = 1.f / v[i].w;
+    }
+  }
+  s->q0 = q[0];
+  s->dq1 = q[1] - q[0];
+  s->dq2 = q[2] - q[0];
+  s->z0 = v[0].z;
+  s->dz1 = v[1].z - v[0].z;
+  s->dz2 = v[2].z - v[0].z;
+  s->num_attributes = n;
+  for (int k = 0; k < n; ++k) {
+    s->a0[k] = attributes[0][k] * q[0];
+    s->d1[k] = attributes[1][k] * q[1] - s->a0[k];
+    s->d2[k] = attributes[2][k] * q[2] - s->a0[k];
+  }
+  return true;
+}
+
+// Index of texel (x, y) for eight lanes, see canvas_index.
+static inline __m256i texel_index8(canvas t, __m256i x, __m256i y) {
+  __m256i stride = _mm256_set1_epi32(t.stride);
+  if (t.layout == CANVAS_LINEAR) {
+    return _mm256_add_epi32(_mm256_mullo_epi32(y, stride), x);
+  }
+  __m256i low = _mm256_set1_epi32(BLOCK_W - 1);
+  __m256i band = _mm256_mullo_epi32(_mm256_srai_epi32(y, BLOCK_SHIFT), stride);
+  __m256i i = _mm256_add_epi32(band, _mm256_andnot_si256(low, x));
+  i = _mm256_add_epi32(i, _mm256_and_si256(y, low));
+  return _mm256_or_si256(_mm256_slli_epi32(i, BLOCK_SHIFT),
+                         _mm256_and_si256(x, low));
+}
+
+static inline __m256i fetch8(canvas t, __m256i x, __m256i y) {
+  __m256i i = texel_index8(t, x, y);
+  if (pixel_size(t.format) == 4) {
+    return _mm256_i32gather_epi32((const int *)t.pixels, i, 4);
+  }
+  uint32_t at[8], texels[8];
+  _mm256_storeu_si256((__m256i *)at, i);
+  for (int l = 0; l < 8; ++l) {
+    texels[l] = canvas_load(t, at[l]);
+  }
+  return _mm256_loadu_si256((__m256i *)texels);
+}
+
+// Texels at u, v clamped to the edge.
+static __m256i sample8(canvas t, sample_filter filter, __m256 u, __m256 v) {
+  __m256 tu = _mm256_mul_ps(u, _mm256_set1_ps(t.w));
+  __m256 tv = _mm256_mul_ps(v, _mm256_set1_ps(t.h));
+  __m256i zero = _mm256_setzero_si256();
+  __m256i max_x = _mm256_set1_epi32(t.w - 1);
+  __m256i max_y = _mm256_set1_epi32(t.h - 1);
+  // clamped as floats first, so far off coordinates can't overflow
+  __m256 lo = _mm256_set1_ps(-1.f);
+  tu = _mm256_min_ps(_mm256_max_ps(tu, lo), _mm256_set1_ps(t.w + 1));
+  tv = _mm256_min_ps(_mm256_max_ps(tv, lo), _mm256_set1_ps(t.h + 1));
+
+  if (filter == SAMPLE_NEAREST) {
+    __m256i x = _mm256_cvttps_epi32(_mm256_floor_ps(tu));
+    __m256i y = _mm256_cvttps_epi32(_mm256_floor_ps(tv));
+    x = _mm256_min_epi32(_mm256_max_epi32(x, zero), max_x);
+    y = _mm256_min_epi32(_mm256_max_epi32(y, zero), max_y);
+    return fetch8(t, x, y);
+  }
+
+  __m256 half = _mm256_set1_ps(0.5f);
+  __m256 one = _mm256_set1_ps(1 << LERP_WEIGHT_BITS);
+  tu = _mm256_sub_ps(tu, half);
+  tv = _mm256_sub_ps(tv, half);
+  __m256 fx = _mm256_floor_ps(tu), fy = _mm256_floor_ps(tv);
+  __m256i wx = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sub_ps(tu, fx), one));
+  __m256i wy = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sub_ps(tv, fy), one));
+  __m256i x0 = _mm256_cvttps_epi32(fx), y0 = _mm256_cvttps_epi32(fy);
+  __m256i x1 = _mm256_add_epi32(x0, _mm256_set1_epi32(1));
+  __m256i y1 = _mm256_add_epi32(y0, _mm256_set1_epi32(1));
+  x0 = _mm256_min_epi32(_mm256_max_epi32(x0, zero), max_x);
+  x1 = _mm256_min_epi32(_mm256_max_epi32(x1, zero), max_x);
+  y0 = _mm256_min_epi32(_mm256_max_epi32(y0, zero), max_y);
+  y1 = _mm256_min_epi32(_mm256_max_epi32(y1, zero), max_y);
+  __m256i top = lerp_colors8(fetch8(t, x0, y0), fetch8(t, x1, y0), wx);
+  __m256i bottom = lerp_colors8(fetch8(t, x0, y1), fetch8(t, x1, y1), wx);
+  return lerp_colors8(top, bottom, wy);
+}
+
+static inline __m256i pack_colors8(const __m256 *channels) {
+  __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.f);
+  __m256i out = _mm256_setzero_si256();
+  for (int k = 0; k < 4; ++k) {
+    __m256 c = _mm256_min_ps(_mm256_max_ps(channels[k], lo), hi);
+    out = _mm256_or_si256(out,
+                          _mm256_slli_epi32(_mm256_cvtps_epi32(c), 8 * k));
+  }
+  return out;
+}
+
+static void shade_span(const shade_setup *s, canvas canvas, int y, int x0,
+                       int x1) {
+  const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i lane_x = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  // groups start on a block, so tiled canvases get whole block rows
+  int gx = x0 & ~(BLOCK_W - 1);
+  float px = gx + 0.5f, py = y + 0.5f;
+  __m256 step1 = _mm256_set1_ps(8 * s->b1x), step2 = _mm256_set1_ps(8 * s->b2x);
+  __m256 b1 = _mm256_add_ps(
+      _mm256_set1_ps(s->b1x * (px - s->o1x) + s->b1y * (py - s->o1y)),
+      _mm256_mul_ps(lanes, _mm256_set1_ps(s->b1x)));
+  __m256 b2 = _mm256_add_ps(
+      _mm256_set1_ps(s->b2x * (px - s->o2x) + s->b2y * (py - s->o2y)),
+      _mm256_mul_ps(lanes, _mm256_set1_ps(s->b2x)));
+  __m256i first = _mm256_set1_epi32(x0 - 1), end = _mm256_set1_epi32(x1);
+
+  for (; gx < x1; gx += 8, b1 = _mm256_add_ps(b1, step1),
+                          b2 = _mm256_add_ps(b2, step2)) {
+    __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(gx), lane_x);
+    __m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(xs, first),
+                                    _mm256_cmpgt_epi32(end, xs));
+    if (s->depth != NULL) {
+      __m256 z = _mm256_add_ps(
+          _mm256_set1_ps(s->z0),
+          _mm256_add_ps(_mm256_mul_ps(b1, _mm256_set1_ps(s->dz1)),
+                        _mm256_mul_ps(b2, _mm256_set1_ps(s->dz2))));
+      mask = depth_test8(s->depth, gx, y, z, mask);
+      if (_mm256_testz_si256(mask, mask)) {
+        continue;
+      }
+    }
+    __m256 a[SHADE_MAX_ATTRIBUTES];
+    __m256 r = _mm256_set1_ps(1.f);
+    if (s->perspective) {
+      __m256 q = _mm256_add_ps(
+          _mm256_set1_ps(s->q0),
+          _mm256_add_ps(_mm256_mul_ps(b1, _mm256_set1_ps(s->dq1)),
+                        _mm256_mul_ps(b2, _mm256_set1_ps(s->dq2))));
+      r = _mm256_div_ps(r, q);
+    }
+    for (int k = 0; k < s->num_attributes; ++k) {
+      a[k] = _mm256_add_ps(
+          _mm256_set1_ps(s->a0[k]),
+          _mm256_add_ps(_mm256_mul_ps(b1, _mm256_set1_ps(s->d1[k])),
+                        _mm256_mul_ps(b2, _mm256_set1_ps(s->d2[k]))));
+      if (s->perspective) {
+        a[k] = _mm256_mul_ps(a[k], r);
+      }
+    }
+    __m256i colors = s->num_attributes == 4
+                         ? pack_colors8(a)
+                         : sample8(s->texture, s->filter, a[0], a[1]);
+    canvas_store8(canvas, gx, y, mask, colors);
+  }
+}
+
+static inline bool vertex_above(const shade_vertex *a, const shade_vertex *b) {
+  return a->y < b->y || (a->y == b->y && a->x < b->x);
+}
+
+// x where the edge from a to b, a above b, crosses height y. Both
+// triangles sharing the edge see it from a to b, so they get the same x.
+static inline float shade_edge_x(const shade_vertex *a, const shade_vertex *b,
+                                 float y) {
+  return a->x + (y - a->y) * (b->x - a->x) / (b->y - a->y);
+}
+
+// First pixel whose center is at or past c, clamped to [0, n].
+static inline int center_at(float c, int n) {
+  c = ceilf(c - 0.5f);
+  return c < 0 ? 0 : c > n ? n : (int)c;
+}
+
+static void shade_triangle(const shade_setup *s, canvas canvas,
+                           const shade_vertex v[3]) {
+  const shade_vertex *top = &v[0], *mid = &v[1], *bot = &v[2], *t;
+  if (vertex_above(mid, top)) {
+    t = top, top = mid, mid = t;
+  }
+  if (vertex_above(bot, top)) {
+    t = top, top = bot, bot = t;
+  }
+  if (vertex_above(bot, mid)) {
+    t = mid, mid = bot, bot = t;
+  }
+
+  int y0 = center_at(top->y, canvas.h), y1 = center_at(bot->y, canvas.h);
+  int band_x0 = canvas.w, band_x1 = 0; // spanned by the rows of the band
+  for (int y = y0; y < y1; ++y) {
+    float py = y + 0.5f;
+    float a = shade_edge_x(top, bot, py);
+    float b = py < mid->y ? shade_edge_x(top, mid, py)
+                          : shade_edge_x(mid, bot, py);
+    int x0 = center_at(fminf(a, b), canvas.w);
+    int x1 = center_at(fmaxf(a, b), canvas.w);
+    if (x0 < x1) {
+      touch_tiles(canvas, x0, y, x1, y + 1);
+      shade_span(s, canvas, y, x0, x1);
+      band_x0 = x0 < band_x0 ? x0 : band_x0;
+      band_x1 = x1 > band_x1 ? x1 : band_x1;
+    }
+    // bounds of the blocks drawn into, once the band is done
+    if (s->depth != NULL && band_x0 < band_x1 &&
+        ((y & (BLOCK_W - 1)) == BLOCK_W - 1 || y == y1 - 1)) {
+      depth_refresh(s->depth, y >> BLOCK_SHIFT, band_x0 >> BLOCK_SHIFT,
+                    block_align(band_x1) >> BLOCK_SHIFT);
+      band_x0 = canvas.w, band_x1 = 0;
+    }
+  }
+}
+
+void draw_gouraud_triangle(canvas canvas, const shade_vertex v[3]) {
+  TRACE_ZONE("draw_gouraud_triangle");
+  float channels[3][SHADE_MAX_ATTRIBUTES];
+  for (int i = 0; i < 3; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      channels[i][k] = (v[i].color >> 8 * k) & 0xff;
+    }
+  }
+  shade_setup s = {.depth = canvas.depth};
+  if (shade_init(&s, v, channels, 4)) {
+    shade_triangle(&s, canvas, v);
+  }
+}
+
+// The texture may have any format or layout but has to be resolved, and
+// can't be dst.
+void draw_textured_triangle(canvas dst, const shade_vertex v[3],
+                            canvas texture, sample_filter filter) {
+  TRACE_ZONE("draw_textured_triangle");
+  if (texture.w <= 0 || texture.h <= 0) {
+    return;
+  }
+  float uvs[3][SHADE_MAX_ATTRIBUTES];
+  for (int i = 0; i < 3; ++i) {
+    uvs[i][0] = v[i].u;
+    uvs[i][1] = v[i].v;
+  }
+  shade_setup s = {
+      .depth = dst.depth, .texture = texture, .filter = filter};
+  if (shade_init(&s, v, uvs, 2)) {
+    shade_triangle(&s, dst, v);
+  }
+}
+
+#endif
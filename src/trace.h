@@ -0,0 +1,212 @@
+#ifndef INCLUDE_TRACE_H
+#define INCLUDE_TRACE_H
+
+#include <stdint.h>
+
+#include "clock.h"
+
+// Build with -DTRACE_ENABLED=0 to compile every zone macro out.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Events kept per thread, must be a power of two. Older events are
+// overwritten so the buffer always holds the most recent frames.
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 65536
+#endif
+
+#ifndef TRACE_MAX_DEPTH
+#define TRACE_MAX_DEPTH 32
+#endif
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+} trace_zone;
+
+void trace_begin(const char *name);
+void trace_end(void);
+void trace_complete(const char *name, uint64_t start, uint64_t end);
+void trace_thread_name(const char *name);
+int trace_write_json(const char *filename);
+
+static inline void trace_zone_end(trace_zone *zone) {
+  trace_complete(zone->name, zone->start, clock_ns());
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if TRACE_ENABLED
+// Zone closed automatically when the enclosing block exits.
+#define TRACE_ZONE(name)                                                       \
+  trace_zone TRACE_CONCAT(_trace_zone_, __LINE__)                              \
+      __attribute__((cleanup(trace_zone_end), unused)) = {(name), clock_ns()}
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END() trace_end()
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_ZONE(name)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#endif
+
+#endif
+
+#if defined(TRACE_IMPLEMENTATION) && !defined(INCLUDE_TRACE_IMPL)
+#define INCLUDE_TRACE_IMPL
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+  uint64_t dur;
+} trace_event;
+
+typedef struct trace_buffer {
+  struct trace_buffer *next;
+  const char *thread_name;
+  int tid;
+  int depth;
+  trace_zone stack[TRACE_MAX_DEPTH];
+  _Atomic uint64_t head;
+  trace_event events[TRACE_EVENTS];
+} trace_buffer;
+
+static _Atomic(trace_buffer *) trace_buffers;
+static atomic_int trace_next_tid;
+static _Thread_local trace_buffer *trace_local;
+
+static trace_buffer *trace_thread_buffer(void) {
+  if (trace_local != NULL) {
+    return trace_local;
+  }
+
+  trace_buffer *buf = calloc(1, sizeof(trace_buffer));
+  if (buf == NULL) {
+    return NULL;
+  }
+  buf->tid = atomic_fetch_add(&trace_next_tid, 1);
+
+  // lock-free push onto the global list, buffers live until exit
+  trace_buffer *head = atomic_load(&trace_buffers);
+  do {
+    buf->next = head;
+  } while (!atomic_compare_exchange_weak(&trace_buffers, &head, buf));
+
+  trace_local = buf;
+  return buf;
+}
+
+void trace_complete(const char *name, uint64_t start, uint64_t end) {
+  trace_buffer *buf = trace_thread_buffer();
+  if (buf == NULL) {
+    return;
+  }
+  uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+  buf->events[head & (TRACE_EVENTS - 1)] = (trace_event){
+      .name = name,
+      .start = start,
+      .dur = end - start,
+  };
+  atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+void trace_begin(const char *name) {
+  trace_buffer *buf = trace_thread_buffer();
+  if (buf == NULL) {
+    return;
+  }
+  if (buf->depth < TRACE_MAX_DEPTH) {
+    buf->stack[buf->depth] = (trace_zone){name, clock_ns()};
+  }
+  buf->depth++;
+}
+
+void trace_end(void) {
+  trace_buffer *buf = trace_local;
+  if (buf == NULL || buf->depth == 0) {
+    return;
+  }
+  buf->depth--;
+  if (buf->depth < TRACE_MAX_DEPTH) {
+    trace_zone *zone = &buf->stack[buf->depth];
+    trace_complete(zone->name, zone->start, clock_ns());
+  }
+}
+
+void trace_thread_name(const char *name) {
+  trace_buffer *buf = trace_thread_buffer();
+  if (buf != NULL) {
+    buf->thread_name = name;
+  }
+}
+
+static void trace_write_string(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+// Chrome trace-event JSON, loadable in chrome://tracing and Perfetto. Events
+// still being written by other threads may be skipped or torn, so call this
+// once worker threads are idle.
+int trace_write_json(const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  uint64_t origin = UINT64_MAX;
+  for (trace_buffer *buf = atomic_load(&trace_buffers); buf != NULL;
+       buf = buf->next) {
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; ++i) {
+      uint64_t start = buf->events[i & (TRACE_EVENTS - 1)].start;
+      origin = start < origin ? start : origin;
+    }
+  }
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  const char *sep = "";
+  for (trace_buffer *buf = atomic_load(&trace_buffers); buf != NULL;
+       buf = buf->next) {
+    if (buf->thread_name != NULL) {
+      fprintf(fp,
+              "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+              "\"args\":{\"name\":",
+              sep, buf->tid);
+      trace_write_string(fp, buf->thread_name);
+      fprintf(fp, "}}");
+      sep = ",\n";
+    }
+
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; ++i) {
+      trace_event *e = &buf->events[i & (TRACE_EVENTS - 1)];
+      fprintf(fp, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":", sep,
+              buf->tid);
+      trace_write_string(fp, e->name);
+      fprintf(fp, ",\"ts\":%.3f,\"dur\":%.3f}", (e->start - origin) / 1e3,
+              e->dur / 1e3);
+      sep = ",\n";
+    }
+  }
+  fprintf(fp, "\n]}\n");
+
+  return fclose(fp);
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef INCLUDE_WORKERS_H
+#define INCLUDE_WORKERS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Work-stealing pool. Every worker owns a deque of index ranges: it splits
+// the range it runs in halves, pushing the upper half to the bottom of its
+// deque until what is left fits the grain, and pops from the bottom once
+// done. Idle workers steal from the top, where the largest ranges are. The
+// calling thread is worker 0 and helps while it waits, so a pool without
+// threads runs every loop inline.
+//
+// Tasks may start and wait for loops of their own. Outside the pool only
+// one thread at a time may use it.
+#define MAX_WORKERS 15
+#define POOL_DEQUE_SIZE 256 // ranges queued per worker, a power of two
+
+// worker is in [0, pool_size), for indexing per thread scratch.
+typedef void (*task_func)(void *ctx, int task, int worker);
+typedef void (*range_func)(void *ctx, int begin, int end, int worker);
+
+// A loop to wait for, started by pool_spawn.
+typedef struct {
+  range_func func;
+  void *ctx;
+  int grain;
+  atomic_int pending; // indices not run yet
+} pool_group;
+
+typedef struct {
+  _Atomic(pool_group *) group;
+  atomic_uint_least64_t range; // begin in the low half, end in the high
+} pool_entry;
+
+// Chase-Lev deque. The owner pushes and pops at the bottom, thieves take
+// from the top; the padding keeps the two ends on separate cache lines.
+typedef struct {
+  atomic_llong top;
+  char pad0[64 - sizeof(atomic_llong)];
+  atomic_llong bottom;
+  char pad1[64 - sizeof(atomic_llong)];
+  pool_entry entries[POOL_DEQUE_SIZE];
+} pool_deque;
+
+struct worker_pool;
+
+typedef struct {
+  struct worker_pool *pool;
+  int index;
+} worker_slot;
+
+typedef struct worker_pool {
+  pthread_t threads[MAX_WORKERS];
+  worker_slot slots[MAX_WORKERS];
+  pool_deque deques[MAX_WORKERS + 1];
+  int num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // work was pushed, or the pool is shutting down
+  atomic_int sleepers;
+  bool shutdown;
+} worker_pool;
+
+int pool_init(worker_pool *p, int num_threads);
+void pool_destroy(worker_pool *p);
+int pool_size(const worker_pool *p);
+int pool_default_threads(void);
+
+void pool_spawn(worker_pool *p, pool_group *g, int begin, int end, int grain,
+                range_func func, void *ctx);
+void pool_wait(worker_pool *p, pool_group *g);
+void parallel_for(worker_pool *p, int begin, int end, int grain,
+                  range_func func, void *ctx);
+void pool_run(worker_pool *p, task_func func, void *ctx, int num_tasks);
+
+#endif
+
+#if defined(WORKERS_IMPLEMENTATION) && !defined(INCLUDE_WORKERS_IMPL)
+#define INCLUDE_WORKERS_IMPL
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Failed rounds of stealing before a worker goes to sleep.
+#define POOL_SPINS 64
+
+// The pool and index of the worker running on this thread, if any.
+static _Thread_local const worker_slot *pool_self;
+
+int pool_size(const worker_pool *p) { return p->num_threads + 1; }
+
+// One thread per core beside the caller's.
+int pool_default_threads(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 1) {
+    return 0;
+  }
+  return cores - 1 > MAX_WORKERS ? MAX_WORKERS : cores - 1;
+}
+
+static inline int pool_index(const worker_pool *p) {
+  return pool_self != NULL && pool_self->pool == p ? pool_self->index : 0;
+}
+
+static bool pool_push(worker_pool *p, int worker, pool_group *g, int begin,
+                      int end) {
+  pool_deque *d = &p->deques[worker];
+  long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= POOL_DEQUE_SIZE) {
+    return false;
+  }
+  pool_entry *e = &d->entries[b & (POOL_DEQUE_SIZE - 1)];
+  atomic_store_explicit(&e->group, g, memory_order_relaxed);
+  atomic_store_explicit(&e->range, (uint32_t)begin | (uint64_t)end << 32,
+                        memory_order_relaxed);
+  // sequentially consistent, to pair with the check a worker makes before
+  // it sleeps
+  atomic_store(&d->bottom, b + 1);
+  if (atomic_load(&p->sleepers) > 0) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return true;
+}
+
+static bool pool_pop(worker_pool *p, int worker, pool_group **g, int *begin,
+                     int *end) {
+  pool_deque *d = &p->deques[worker];
+  long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store(&d->bottom, b);
+  long long t = atomic_load(&d->top);
+  if (t > b) {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return false;
+  }
+
+  pool_entry *e = &d->entries[b & (POOL_DEQUE_SIZE - 1)];
+  *g = atomic_load_explicit(&e->group, memory_order_relaxed);
+  uint64_t range = atomic_load_explicit(&e->range, memory_order_relaxed);
+  bool ok = true;
+  if (t == b) {
+    // the last entry, race the thieves for it
+    ok = atomic_compare_exchange_strong_explicit(
+        &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  *begin = (int32_t)range;
+  *end = (int32_t)(range >> 32);
+  return ok;
+}
+
+static bool pool_steal(worker_pool *p, int victim, pool_group **g,
+                       int *begin, int *end) {
+  pool_deque *d = &p->deques[victim];
+  long long t = atomic_load(&d->top);
+  long long b = atomic_load(&d->bottom);
+  if (t >= b) {
+    return false;
+  }
+
+  // may be overwritten meanwhile, in which case the exchange fails
+  pool_entry *e = &d->entries[t & (POOL_DEQUE_SIZE - 1)];
+  pool_group *group = atomic_load_explicit(&e->group, memory_order_relaxed);
+  uint64_t range = atomic_load_explicit(&e->range, memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(
+          &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return false;
+  }
+  *g = group;
+  *begin = (int32_t)range;
+  *end = (int32_t)(range >> 32);
+  return true;
+}
+
+// Own work first, then the other deques round robin.
+static bool pool_find(worker_pool *p, int worker, pool_group **g, int *begin,
+                      int *end) {
+  if (pool_pop(p, worker, g, begin, end)) {
+    return true;
+  }
+  int n = pool_size(p);
+  for (int i = 1; i < n; ++i) {
+    if (pool_steal(p, (worker + i) % n, g, begin, end)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool pool_has_work(worker_pool *p) {
+  for (int i = 0; i < pool_size(p); ++i) {
+    pool_deque *d = &p->deques[i];
+    if (atomic_load(&d->top) < atomic_load(&d->bottom)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs [begin, end) of g, leaving all but the first grain of it for others
+// to steal.
+static void pool_exec(worker_pool *p, int worker, pool_group *g, int begin,
+                      int end) {
+  while (end - begin > g->grain) {
+    int mid = begin + (end - begin) / 2;
+    if (!pool_push(p, worker, g, mid, end)) {
+      break;
+    }
+    end = mid;
+  }
+  g->func(g->ctx, begin, end, worker);
+  atomic_fetch_sub_explicit(&g->pending, end - begin, memory_order_release);
+}
+
+static void *pool_thread(void *arg) {
+  worker_slot *slot = arg;
+  worker_pool *p = slot->pool;
+  pool_self = slot;
+  TRACE_THREAD_NAME("worker");
+
+  int idle = 0;
+  for (;;) {
+    pool_group *g;
+    int begin, end;
+    if (pool_find(p, slot->index, &g, &begin, &end)) {
+      pool_exec(p, slot->index, g, begin, end);
+      idle = 0;
+      continue;
+    }
+    if (++idle < POOL_SPINS) {
+      sched_yield();
+      continue;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->sleepers, 1);
+    while (!p->shutdown && !pool_has_work(p)) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    atomic_fetch_sub(&p->sleepers, 1);
+    bool shutdown = p->shutdown;
+    pthread_mutex_unlock(&p->lock);
+    if (shutdown) {
+      break;
+    }
+    idle = 0;
+  }
+  return NULL;
+}
+
+// Stops and joins the first num_started threads.
+static void pool_stop(worker_pool *p, int num_started) {
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < num_started; ++i) {
+    pthread_join(p->threads[i], NULL);
+  }
+  p->num_threads = 0;
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+}
+
+int pool_init(worker_pool *p, int num_threads) {
+  *p = (worker_pool){0};
+  if (pthread_mutex_init(&p->lock, NULL) != 0 ||
+      pthread_cond_init(&p->wake, NULL) != 0) {
+    return -1;
+  }
+  // workers steal from every deque, so the count is fixed before they start
+  p->num_threads = num_threads > MAX_WORKERS ? MAX_WORKERS : num_threads;
+  for (int i = 0; i < p->num_threads; ++i) {
+    p->slots[i] = (worker_slot){.pool = p, .index = i + 1};
+    if (pthread_create(&p->threads[i], NULL, pool_thread, &p->slots[i]) !=
+        0) {
+      pool_stop(p, i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void pool_destroy(worker_pool *p) { pool_stop(p, p->num_threads); }
+
+// Starts running func over [begin, end) in ranges of at most grain indices
+// and returns, possibly before any of it ran. g must stay alive until
+// pool_wait returns for it.
+void pool_spawn(worker_pool *p, pool_group *g, int begin, int end, int grain,
+                range_func func, void *ctx) {
+  *g = (pool_group){
+      .func = func,
+      .ctx = ctx,
+      .grain = grain < 1 ? 1 : grain,
+  };
+  atomic_init(&g->pending, end > begin ? end - begin : 0);
+  if (end <= begin) {
+    return;
+  }
+  int worker = pool_index(p);
+  if (p->num_threads == 0 || !pool_push(p, worker, g, begin, end)) {
+    pool_exec(p, worker, g, begin, end);
+  }
+}
+
+// Returns once all of g has run, running queued ranges of any loop
+// meanwhile.
+void pool_wait(worker_pool *p, pool_group *g) {
+  int worker = pool_index(p);
+  while (atomic_load_explicit(&g->pending, memory_order_acquire) > 0) {
+    pool_group *other;
+    int begin, end;
+    if (pool_find(p, worker, &other, &begin, &end)) {
+      pool_exec(p, worker, other, begin, end);
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+void parallel_for(worker_pool *p, int begin, int end, int grain,
+                  range_func func, void *ctx) {
+  TRACE_ZONE("parallel_for");
+  pool_group g;
+  pool_spawn(p, &g, begin, end, grain, func, ctx);
+  pool_wait(p, &g);
+}
+
+typedef struct {
+  task_func func;
+  void *ctx;
+} pool_tasks;
+
+static void pool_task_range(void *ctx, int begin, int end, int worker) {
+  pool_tasks *t = ctx;
+  for (int i = begin; i < end; ++i) {
+    t->func(t->ctx, i, worker);
+  }
+}
+
+// Runs func for every task in [0, num_tasks), one at a time, and returns
+// once all of them are done.
+void pool_run(worker_pool *p, task_func func, void *ctx, int num_tasks) {
+  pool_tasks t = {.func = func, .ctx = ctx};
+  parallel_for(p, 0, num_tasks, 1, pool_task_range, &t);
+}
+
+#endif
@@ -1,3 +1,2995 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_IMPLEMENTATION
+#include "src/arena.h"
+
+#define IOUTILS_IMPLEMENTATION
+#include "src/io-utils.h"
+
+#define PROFILER_IMPLEMENTATION
+#include "src/profiler.h"
+
+#define RESOLUTION_IMPLEMENTATION
+#include "src/resolution.h"
+
+#define TRACE_IMPLEMENTATION
+#include "src/trace.h"
+
+#define REPLAY_IMPLEMENTATION
+#include "src/replay.h"
+
+#define DRAW_IMPLEMENTATION
+#include "src/draw.h"
+
+#define BLIT_IMPLEMENTATION
+#include "src/blit.h"
+
+#define HUD_IMPLEMENTATION
+#include "src/hud.h"
+
+#define PATH_IMPLEMENTATION
+#include "src/path.h"
+
+#define COVERAGE_IMPLEMENTATION
+#include "src/coverage.h"
+
+#define MSAA_IMPLEMENTATION
+#include "src/msaa.h"
+
+#define SCENE_IMPLEMENTATION
+#include "src/scene.h"
+
+#define LAYERS_IMPLEMENTATION
+#include "src/layers.h"
+
+#define WORKERS_IMPLEMENTATION
+#include "src/workers.h"
+
+#define PARTICLES_IMPLEMENTATION
+#include "src/particles.h"
+
+#define FILTERS_IMPLEMENTATION
+#include "src/filters.h"
+
+#define FRAMERING_IMPLEMENTATION
+#include "src/framering.h"
+
+#define OBJECTS_IMPLEMENTATION
+#include "src/objects.h"
+
+#define BVH_IMPLEMENTATION
+#include "src/bvh.h"
+
+#define DEPTH_IMPLEMENTATION
+#include "src/depth.h"
+
+#define SHADE_IMPLEMENTATION
+#include "src/shade.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "src/third_party/stb/stb_image_write.h"
+
+#define LINMATH_IMPLEMENTATION
+#include "src/linmath.h"
+
+// Conformance checks for every vectorized kernel against a scalar
+// reference. Sizes, strides and buffer offsets are randomized so tails,
+// unaligned addresses and padded rows all get exercised; guard pixels
+// around each buffer catch overruns.
+
+#define ITERATIONS 500
+#define GUARD 16
+#define GUARD_VALUE 0xdeadbeef
+#define EPSILON 1e-4f
+
+static int failures;
+static uint64_t rng_state;
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, __func__);            \
+      fprintf(stderr, __VA_ARGS__);                                            \
+      fputc('\n', stderr);                                                     \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static uint32_t rng(void) {
+  // xorshift64*, independent of the libc rand() the demo scene uses
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static int rng_range(int min, int max) { return min + rng() % (max - min + 1); }
+
+static float rng_float(void) { return (rng() / (float)UINT32_MAX) * 20.f - 10.f; }
+
+typedef struct {
+  color *buffer; // guard, pixels, guard
+  size_t size;   // pixels, without guards
+  canvas canvas;
+} test_canvas;
+
+// Canvas of random size and stride whose first pixel sits at a random
+// (usually unaligned) offset in the allocation. Only the pixels are random,
+// the padding at the end of each row holds GUARD_VALUE like the guards.
+static test_canvas make_canvas(int max_w, int max_h) {
+  int w = rng_range(1, max_w);
+  int h = rng_range(1, max_h);
+  int stride = w + (rng() % 2 ? rng_range(0, 13) : 0);
+  int offset = rng_range(0, 7);
+  size_t size = (size_t)stride * (h - 1) + w;
+
+  color *buffer = malloc(sizeof(color) * (size + offset + 2 * GUARD));
+  for (size_t i = 0; i < size + offset + 2 * GUARD; ++i) {
+    buffer[i] = GUARD_VALUE;
+  }
+  color *pixels = buffer + GUARD + offset;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      pixels[(size_t)y * stride + x] = rng();
+    }
+  }
+
+  return (test_canvas){
+      .buffer = buffer,
+      .size = size + offset,
+      .canvas = {.pixels = pixels, .w = w, .h = h, .stride = stride},
+  };
+}
+
+static test_canvas copy_canvas(const test_canvas *src) {
+  size_t total = src->size + 2 * GUARD;
+  color *buffer = malloc(sizeof(color) * total);
+  memcpy(buffer, src->buffer, sizeof(color) * total);
+  test_canvas dst = *src;
+  dst.buffer = buffer;
+  dst.canvas.pixels = buffer + (src->canvas.pixels - src->buffer);
+  return dst;
+}
+
+static bool guards_intact(const test_canvas *c) {
+  for (size_t i = 0; i < GUARD; ++i) {
+    if (c->buffer[i] != GUARD_VALUE ||
+        c->buffer[GUARD + c->size + i] != GUARD_VALUE) {
+      return false;
+    }
+  }
+  // as do the words before the first pixel and the padding between rows
+  const canvas *g = &c->canvas;
+  for (color *p = c->buffer + GUARD; p < g->pixels; ++p) {
+    if (*p != GUARD_VALUE) {
+      return false;
+    }
+  }
+  for (int y = 0; y + 1 < g->h; ++y) {
+    for (int x = g->w; x < g->stride; ++x) {
+      if (g->pixels[(size_t)y * g->stride + x] != GUARD_VALUE) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool pixels_equal(const test_canvas *a, const test_canvas *b) {
+  return memcmp(a->buffer, b->buffer,
+                sizeof(color) * (a->size + 2 * GUARD)) == 0;
+}
+
+static void free_canvas(test_canvas *c) { free(c->buffer); }
+
+static bool near(float a, float b) {
+  return fabsf(a - b) <= EPSILON * fmaxf(1.f, fmaxf(fabsf(a), fabsf(b)));
+}
+
+static void ref_clear_canvas(canvas g, color c) {
+  for (int y = 0; y < g.h; ++y) {
+    for (int x = 0; x < g.w; ++x) {
+      g.pixels[y * g.stride + x] = c;
+    }
+  }
+}
+
+static void ref_draw_rectangle(canvas g, const Rectangle *r) {
+  for (int y = r->y; y < r->y + r->h; ++y) {
+    for (int x = r->x; x < r->x + r->w; ++x) {
+      g.pixels[y * g.stride + x] = g.color;
+    }
+  }
+}
+
+static void ref_flip_image(unsigned int *image, int w, int h) {
+  for (int y = 0; y < h / 2; ++y) {
+    for (int x = 0; x < w; ++x) {
+      unsigned int tmp = image[y * w + x];
+      image[y * w + x] = image[(h - 1 - y) * w + x];
+      image[(h - 1 - y) * w + x] = tmp;
+    }
+  }
+}
+
+static void ref_hud_panel(canvas g, const Rectangle *r) {
+  for (int y = r->y; y < r->y + r->h; ++y) {
+    for (int x = r->x; x < r->x + r->w; ++x) {
+      color *p = &g.pixels[y * g.stride + x];
+      *p = ((*p >> 1) & 0x007f7f7f) | 0xff000000;
+    }
+  }
+}
+
+static Rectangle random_rect(const canvas *g) {
+  Rectangle r;
+  r.x = rng_range(0, g->w - 1);
+  r.y = rng_range(0, g->h - 1);
+  r.w = rng_range(0, g->w - r.x);
+  r.h = rng_range(0, g->h - r.y);
+  return r;
+}
+
+static void test_clear_canvas(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    test_canvas a = make_canvas(67, 9);
+    test_canvas b = copy_canvas(&a);
+    color c = rng();
+
+    clear_canvas(a.canvas, c);
+    ref_clear_canvas(b.canvas, c);
+
+    CHECK(guards_intact(&a), "overrun w=%d h=%d stride=%d", a.canvas.w,
+          a.canvas.h, a.canvas.stride);
+    CHECK(pixels_equal(&a, &b), "mismatch w=%d h=%d stride=%d", a.canvas.w,
+          a.canvas.h, a.canvas.stride);
+    free_canvas(&a);
+    free_canvas(&b);
+  }
+}
+
+static void test_draw_rectangle(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    test_canvas a = make_canvas(67, 9);
+    test_canvas b = copy_canvas(&a);
+    Rectangle r = random_rect(&a.canvas);
+    a.canvas.color = b.canvas.color = rng();
+
+    draw_rectangle(a.canvas, &r);
+    ref_draw_rectangle(b.canvas, &r);
+
+    CHECK(guards_intact(&a), "overrun rect %d,%d %dx%d", r.x, r.y, r.w, r.h);
+    CHECK(pixels_equal(&a, &b), "mismatch rect %d,%d %dx%d stride=%d", r.x,
+          r.y, r.w, r.h, a.canvas.stride);
+    free_canvas(&a);
+    free_canvas(&b);
+  }
+}
+
+// Shapes hanging off every side of the canvas must be clipped, not written
+// past it.
+static void test_clipping(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    test_canvas a = make_canvas(67, 9);
+    test_canvas b = copy_canvas(&a);
+    const canvas *g = &a.canvas;
+    a.canvas.color = b.canvas.color = rng();
+
+    Rectangle r = {
+        rng_range(-2 * g->w, 2 * g->w), rng_range(-2 * g->h, 2 * g->h),
+        rng_range(0, 3 * g->w), rng_range(0, 3 * g->h),
+    };
+    draw_rectangle(a.canvas, &r);
+    Rectangle clipped = r;
+    clipped.x = r.x < 0 ? 0 : r.x;
+    clipped.y = r.y < 0 ? 0 : r.y;
+    clipped.w = (r.x + r.w > g->w ? g->w : r.x + r.w) - clipped.x;
+    clipped.h = (r.y + r.h > g->h ? g->h : r.y + r.h) - clipped.y;
+    if (clipped.w > 0 && clipped.h > 0) {
+      ref_draw_rectangle(b.canvas, &clipped);
+    }
+    CHECK(guards_intact(&a), "rect overrun %d,%d %dx%d", r.x, r.y, r.w, r.h);
+    CHECK(pixels_equal(&a, &b), "rect mismatch %d,%d %dx%d", r.x, r.y, r.w,
+          r.h);
+
+    Vector2 p[3];
+    for (int k = 0; k < 3; ++k) {
+      p[k] = (Vector2){rng_range(-3 * g->w, 3 * g->w),
+                       rng_range(-3 * g->h, 3 * g->h)};
+    }
+    draw_triangle(a.canvas, p[0], p[1], p[2]);
+    CHECK(guards_intact(&a), "triangle overrun %d,%d %d,%d %d,%d", p[0].x,
+          p[0].y, p[1].x, p[1].y, p[2].x, p[2].y);
+    draw_line(a.canvas, p[0], p[1]);
+    CHECK(guards_intact(&a), "line overrun %d,%d %d,%d", p[0].x, p[0].y,
+          p[1].x, p[1].y);
+
+    free_canvas(&a);
+    free_canvas(&b);
+  }
+}
+
+static void test_flip_image(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    test_canvas a = make_canvas(67, 9);
+    // flip_image only understands packed rows
+    a.canvas.stride = a.canvas.w;
+    a.size = (size_t)a.canvas.w * a.canvas.h + (a.canvas.pixels - a.buffer) -
+             GUARD;
+    for (size_t p = GUARD + a.size; p < GUARD + a.size + GUARD; ++p) {
+      a.buffer[p] = GUARD_VALUE;
+    }
+    test_canvas b = copy_canvas(&a);
+
+    flip_image(a.canvas.pixels, a.canvas.w, a.canvas.h);
+    ref_flip_image(b.canvas.pixels, b.canvas.w, b.canvas.h);
+
+    CHECK(guards_intact(&a), "overrun w=%d h=%d", a.canvas.w, a.canvas.h);
+    CHECK(pixels_equal(&a, &b), "mismatch w=%d h=%d", a.canvas.w, a.canvas.h);
+    free_canvas(&a);
+    free_canvas(&b);
+  }
+}
+
+// Allocations that do not fit fail instead of growing and moving the arena.
+static void test_arena(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    arena a;
+    size_t capacity = WORD_SIZE * rng_range(1, 64);
+    init_arena(&a, capacity);
+    char *first = arena_alloc(&a, 1);
+    size_t used = WORD_SIZE;
+    while (used < capacity) {
+      size_t s = rng_range(1, 3 * WORD_SIZE);
+      char *p = arena_alloc(&a, s);
+      size_t aligned = (s + WORD_SIZE - 1) / WORD_SIZE * WORD_SIZE;
+      if (used + aligned > capacity) {
+        CHECK(p == NULL, "%zu bytes past %zu of %zu", s, used, capacity);
+        break;
+      }
+      CHECK(p == first + used, "%zu bytes at %td, not %zu", s, p - first,
+            used);
+      used += aligned;
+    }
+    // a full arena refuses everything but keeps what it handed out
+    CHECK(arena_alloc(&a, capacity) == NULL && a.data == first &&
+              a.size == used,
+          "arena of %zu moved or grew", capacity);
+    arena_free(&a);
+  }
+}
+
+// A stage longer than a record holds saturates rather than wrapping.
+static void test_profiler(void) {
+  uint64_t ns = (1ull << 32) + rng_range(0, 1000);
+  uint64_t fallbacks = prof_total(COUNTER_FALLBACK);
+  int count = rng_range(1, 3);
+  prof_begin_frame();
+  for (int i = 0; i < count; ++i) {
+    prof_count(COUNTER_FALLBACK);
+  }
+  prof_set(STAGE_PACE, ns);
+  prof_begin(STAGE_SIMULATE);
+  prof_set(STAGE_SIMULATE, UINT32_MAX - 1);
+  prof_end(STAGE_SIMULATE);
+  prof_end_frame();
+
+  frame_record r;
+  CHECK(prof_snapshot(&r, 1) == 1, "no record");
+  CHECK(r.durations[STAGE_PACE] == UINT32_MAX, "pace %u",
+        r.durations[STAGE_PACE]);
+  CHECK(r.durations[STAGE_SIMULATE] == UINT32_MAX, "simulate %u",
+        r.durations[STAGE_SIMULATE]);
+  CHECK(r.counts[COUNTER_FALLBACK] == (uint32_t)count &&
+            prof_total(COUNTER_FALLBACK) == fallbacks + count,
+        "%u fallbacks counted of %d", r.counts[COUNTER_FALLBACK], count);
+  stage_stats stats;
+  prof_stats(STAGE_PACE, &stats);
+  CHECK(stats.max > 4000, "max %f ms", stats.max);
+}
+
+// The step drops straight to the one predicted to fit, holds for a few
+// frames after every change and climbs back one step at a time, only while
+// the next step fits with headroom.
+static void test_resolution(void) {
+  for (int i = 0; i < ITERATIONS / 10; ++i) {
+    resolution_scaler r;
+    resolution_init(&r, rng_range(1, 16), rng_range(1, 16) / (float)RES_STEPS);
+
+    uint64_t cost = r.budget + rng_range(1, 3 * r.budget);
+    int want = RES_STEPS * sqrt((double)r.budget / cost);
+    want = want < RES_STEPS ? want : RES_STEPS - 1;
+    want = want < r.min_step ? r.min_step : want;
+    resolution_update(&r, cost);
+    CHECK(r.step == want, "step %d at %.2fx the budget, not %d", r.step,
+          cost / (double)r.budget, want);
+
+    // frames without a measurement count for nothing
+    for (int f = 1; f <= RES_COOLDOWN; ++f) {
+      resolution_scaler before = r;
+      float scale = resolution_update(&r, 0);
+      CHECK(scale == resolution_scale(&r) && r.step == before.step &&
+                r.estimate == before.estimate &&
+                r.cooldown == before.cooldown,
+            "cost 0 changed the scaler");
+      resolution_update(&r, 10000 * r.budget);
+      CHECK(r.step == want, "step %d %d frames after a change", r.step, f);
+    }
+    resolution_update(&r, 10000 * r.budget);
+    CHECK(r.step == r.min_step, "step %d under the min %d", r.step,
+          r.min_step);
+
+    // frames cost in proportion to their pixels
+    double full = r.budget * rng_range(20, 150) / 100.0;
+    int changed = 0;
+    for (int f = 1; f <= 1000; ++f) {
+      int step = r.step;
+      double scale = step / (double)RES_STEPS;
+      resolution_update(&r, full * scale * scale);
+      if (r.step == step) {
+        continue;
+      }
+      double next = r.step / (double)RES_STEPS;
+      CHECK(r.step == step + 1, "step %d climbed to %d", step, r.step);
+      CHECK(full * next * next < r.budget * RES_HEADROOM * (1 + 1e-5),
+            "climbed to %d past the headroom", r.step);
+      CHECK(f - changed > RES_COOLDOWN, "step %d %d frames after a change",
+            r.step, f - changed);
+      changed = f;
+    }
+    double next = (r.step + 1) / (double)RES_STEPS;
+    CHECK(r.step == RES_STEPS ||
+              full * next * next >= r.budget * RES_HEADROOM * (1 - 1e-5),
+          "settled at %d with room for %d", r.step, r.step + 1);
+  }
+}
+
+static void test_hud_panel(void) {
+  arena a;
+  init_arena(&a, 1 << 16);
+  for (int i = 0; i < ITERATIONS; ++i) {
+    a.size = 0;
+    bool tiled = rng() % 2;
+    test_canvas c = tiled ? make_canvas(200, 50) : make_canvas(67, 9);
+    test_canvas d = copy_canvas(&c);
+    Rectangle r = random_rect(&c.canvas);
+
+    // a fast clear, resolved or not, with something drawn over part of it
+    canvas_tiles tiles;
+    if (tiled) {
+      canvas_tiles_init(&tiles, &a, c.canvas.w, c.canvas.h);
+      c.canvas.tiles = &tiles;
+      color bg = rng();
+      fast_clear_canvas(c.canvas, bg);
+      if (rng() % 2) {
+        resolve_canvas(c.canvas);
+        fast_clear_canvas(c.canvas, bg);
+      }
+      clear_canvas(d.canvas, bg);
+      Rectangle s = random_rect(&c.canvas);
+      c.canvas.color = d.canvas.color = rng();
+      draw_rectangle(c.canvas, &s);
+      draw_rectangle(d.canvas, &s);
+    }
+
+    hud_panel(c.canvas, &r);
+    ref_hud_panel(d.canvas, &r);
+    if (tiled) {
+      resolve_canvas(c.canvas);
+    }
+
+    CHECK(guards_intact(&c), "overrun rect %d,%d %dx%d", r.x, r.y, r.w, r.h);
+    CHECK(pixels_equal(&c, &d), "mismatch rect %d,%d %dx%d%s", r.x, r.y, r.w,
+          r.h, tiled ? " over tiles" : "");
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+static void test_hud_text(void) {
+  static hud_font font;
+
+  for (int i = 0; i < ITERATIONS / 10; ++i) {
+    // half the time translucent, which the store mask must not key on
+    color fg = i % 2 ? 0xff000000 | rng() : (rng() & 0x7fffffff) | 1;
+    hud_font_init(&font, fg);
+    test_canvas a = make_canvas(97, 2 * HUD_CELL_H);
+    test_canvas b = copy_canvas(&a);
+    char text[8];
+    for (size_t c = 0; c < sizeof(text) - 1; ++c) {
+      text[c] = rng_range(32, 126);
+    }
+    text[sizeof(text) - 1] = '\0';
+    int x0 = rng_range(-HUD_ADVANCE, a.canvas.w);
+    int y0 = rng_range(-2, a.canvas.h);
+
+    hud_text(a.canvas, &font, x0, y0, text);
+
+    // scalar reference straight from the 5x7 bitmaps
+    if (y0 >= 0 && y0 + HUD_CELL_H <= b.canvas.h) {
+      for (int c = 0; text[c]; ++c) {
+        int gx = x0 + c * HUD_ADVANCE;
+        if (gx < 0 || gx + HUD_GLYPH_W * HUD_SCALE > b.canvas.w) {
+          continue;
+        }
+        const unsigned char *bits = hud_font_5x7[hud_glyph_index(text[c])];
+        for (int y = 0; y < HUD_CELL_H; ++y) {
+          for (int x = 0; x < HUD_GLYPH_W * HUD_SCALE; ++x) {
+            int col = x / HUD_SCALE;
+            if ((bits[y / HUD_SCALE] >> (HUD_GLYPH_W - 1 - col)) & 1) {
+              b.canvas.pixels[(y0 + y) * b.canvas.stride + gx + x] = fg;
+            }
+          }
+        }
+      }
+    }
+
+    CHECK(guards_intact(&a), "overrun at %d,%d", x0, y0);
+    CHECK(pixels_equal(&a, &b), "mismatch '%s' at %d,%d", text, x0, y0);
+    free_canvas(&a);
+    free_canvas(&b);
+  }
+}
+
+// Every pixel a node writes must fall inside its cached bounds, otherwise
+// culling could drop something that is on screen.
+static void test_scene_bounds(void) {
+  arena a;
+  init_arena(&a, 1 << 16);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    scene s;
+    scene_init(&s, &a, 4);
+    test_canvas c = make_canvas(97, 61);
+    canvas *g = &c.canvas;
+
+    float shape[6];
+    for (int k = 0; k < 6; ++k) {
+      shape[k] = rng_float() * 4.f;
+    }
+    shape[2] = fabsf(shape[2]);
+    shape[3] = fabsf(shape[3]);
+    node_id group = scene_add(&s, SCENE_ROOT, NODE_GROUP, NULL, 0);
+    node_id id = scene_add(&s, group, rng_range(NODE_RECT, NODE_LINE), shape,
+                           0xffffffff);
+    scene_set_position(&s, group, rng_range(0, g->w), rng_range(0, g->h));
+    scene_set_rotation(&s, group, rng_float());
+    scene_set_position(&s, id, rng_float() * 2.f, rng_float() * 2.f);
+    scene_set_rotation(&s, id, rng_float());
+    scene_set_scale(&s, id, fabsf(rng_float()) * 0.5f + 0.1f);
+    scene_set_view(&s, rng_float() * 4.f, rng_float() * 4.f,
+                   fabsf(rng_float()) * 0.3f + 0.5f);
+    scene_update(&s);
+
+    ref_clear_canvas(*g, 0);
+    scene_draw(&s, *g, SCENE_ROOT);
+
+    // bounds in canvas space, a pixel of slack for rounding and the
+    // anti-aliased neighbour lines write
+    aabb b = s.nodes[SCENE_ROOT].bounds;
+    float x0 = (b.x0 - s.view_x) * s.zoom - 2;
+    float x1 = (b.x1 - s.view_x) * s.zoom + 1;
+    float y0 = (b.y0 - s.view_y) * s.zoom - 2;
+    float y1 = (b.y1 - s.view_y) * s.zoom + 1;
+    int outside = 0;
+    for (int y = 0; y < g->h; ++y) {
+      for (int x = 0; x < g->w; ++x) {
+        if (g->pixels[y * g->stride + x] != 0 &&
+            (x < x0 || x > x1 || y < y0 || y > y1)) {
+          outside++;
+        }
+      }
+    }
+    CHECK(outside == 0, "kind %d drew %d pixels outside its bounds",
+          s.nodes[id].kind, outside);
+    CHECK(s.stats.culled == 0 || outside == 0, "culled node was drawn");
+    CHECK(guards_intact(&c), "scene overrun");
+    free_canvas(&c);
+  }
+  arena_free(&a);
+}
+
+#define MAX_SUBPATHS 3
+#define MAX_POLY_POINTS 8
+
+typedef struct {
+  float v[MAX_SUBPATHS][MAX_POLY_POINTS][2];
+  int counts[MAX_SUBPATHS];
+  int num;
+} polygon;
+
+// Subpaths of straight lines reaching a little past every edge of the
+// canvas, some left open and some with a single point.
+static void random_polygon(polygon *poly, path *p, int w, int h) {
+  path_reset(p);
+  p->rule = rng() % 2 ? FILL_EVEN_ODD : FILL_NONZERO;
+  poly->num = rng_range(1, MAX_SUBPATHS);
+  for (int s = 0; s < poly->num; ++s) {
+    poly->counts[s] = rng_range(1, MAX_POLY_POINTS);
+    for (int k = 0; k < poly->counts[s]; ++k) {
+      float x = rng_range(-20 * 64, (w + 20) * 64) / 64.f;
+      float y = rng_range(-20 * 64, (h + 20) * 64) / 64.f;
+      poly->v[s][k][0] = x;
+      poly->v[s][k][1] = y;
+      k == 0 ? path_move_to(p, x, y) : path_line_to(p, x, y);
+    }
+    if (rng() % 2) {
+      path_close(p);
+    }
+  }
+}
+
+// Front to back with coverage must give exactly the painter's order result,
+// including lines blended over shapes drawn before and under shapes after.
+static void test_front_to_back(void) {
+  arena a;
+  init_arena(&a, 1 << 20);
+  int overflows = 0;
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    test_canvas c = make_canvas(150, 61);
+    test_canvas d = copy_canvas(&c);
+    canvas *g = &c.canvas;
+
+    scene s;
+    scene_init(&s, &a, 33);
+    coverage cov;
+    // a few hundred blends are too few for most scenes' lines
+    size_t max_blends = rng() % 2 ? 1 << 14 : rng_range(0, 300);
+    coverage_init(&cov, &a, g->w, g->h, max_blends);
+    path paths[2];
+    for (int k = 0; k < 2; ++k) {
+      polygon poly;
+      path_init(&paths[k], &a, 32, 32);
+      random_polygon(&poly, &paths[k], g->w, g->h);
+      path_quad_to(&paths[k], rng_range(0, g->w), rng_range(0, g->h),
+                   rng_range(0, g->w), rng_range(0, g->h));
+    }
+
+    node_id group = SCENE_ROOT;
+    for (int n = 0; n < 32; ++n) {
+      if (n % 8 == 0) {
+        group = scene_add(&s, SCENE_ROOT, NODE_GROUP, NULL, 0);
+        continue;
+      }
+      float shape[6];
+      for (int k = 0; k < 6; ++k) {
+        shape[k] = rng_range(-10, 2 * (k % 2 ? g->h : g->w));
+      }
+      shape[2] = fabsf(shape[2] - shape[0]);
+      shape[3] = fabsf(shape[3] - shape[1]);
+      node_id id = scene_add(&s, group, rng_range(NODE_RECT, NODE_PATH), shape,
+                             0xff000000 | rng());
+      if (s.nodes[id].kind == NODE_PATH) {
+        scene_set_path(&s, id, &paths[rng() % 2]);
+      }
+      if (rng() % 4 == 0) {
+        scene_set_rotation(&s, id, rng_float());
+      }
+      scene_set_position(&s, id, rng_range(-g->w / 2, g->w / 2),
+                         rng_range(-g->h / 2, g->h / 2));
+    }
+    scene_update(&s);
+
+    color bg = rng();
+    clear_canvas(d.canvas, bg);
+    scene_draw(&s, d.canvas, SCENE_ROOT);
+
+    if (scene_draw_front_to_back(&s, *g, &cov, SCENE_ROOT) == 0) {
+      coverage_clear(&cov, *g, bg);
+      coverage_flush(&cov, *g);
+    } else {
+      // the blends filled up, the frame is drawn again in painter's order
+      CHECK(cov.overflowed && cov.num_blends == max_blends,
+            "%zu of %zu blends on overflow", cov.num_blends, max_blends);
+      ++overflows;
+      clear_canvas(*g, bg);
+      scene_draw(&s, *g, SCENE_ROOT);
+    }
+
+    CHECK(guards_intact(&c), "overrun w=%d h=%d", g->w, g->h);
+    CHECK(pixels_equal(&c, &d), "mismatch w=%d h=%d stride=%d", g->w, g->h,
+          g->stride);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  CHECK(overflows > 0 && overflows < ITERATIONS / 5,
+        "%d of %d scenes overflowed", overflows, ITERATIONS / 5);
+  arena_free(&a);
+}
+
+typedef struct {
+  int kind;
+  color color;
+  Rectangle rect;
+  Vector2 p[3];
+} draw_op;
+
+static void apply_draw_ops(canvas g, coverage *cov, const draw_op *ops,
+                           int n) {
+  for (int i = 0; i < n; ++i) {
+    const draw_op *op = &ops[i];
+    g.color = op->color;
+    switch (op->kind) {
+    case 0:
+      cov ? coverage_rect(cov, g, &op->rect) : draw_rectangle(g, &op->rect);
+      break;
+    case 1:
+      cov ? coverage_triangle(cov, g, op->p[0], op->p[1], op->p[2])
+          : draw_triangle(g, op->p[0], op->p[1], op->p[2]);
+      break;
+    case 2:
+      cov ? coverage_line(cov, g, op->p[0], op->p[1])
+          : draw_line(g, op->p[0], op->p[1]);
+      break;
+    default:
+      hud_panel(g, &op->rect);
+      break;
+    }
+  }
+}
+
+// A fast cleared canvas must resolve to exactly what a full clear gives,
+// across frames that reuse resolved tiles, skip the resolve, change color,
+// go through the coverage path or shrink to a corner of the canvas.
+static void test_fast_clear(void) {
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    test_canvas c = make_canvas(300, 70);
+    test_canvas d = copy_canvas(&c);
+    canvas *g = &c.canvas;
+    canvas_tiles tiles;
+    canvas_tiles_init(&tiles, &a, g->w, g->h);
+    g->tiles = &tiles;
+    coverage cov;
+    coverage_init(&cov, &a, g->w, g->h, 1 << 14);
+
+    color bg = rng();
+    canvas f = *g, e = d.canvas;
+    for (int frame = 0; frame < 4; ++frame) {
+      if (rng() % 2) {
+        bg = rng();
+      }
+      if (rng() % 3 == 0) {
+        f.w = e.w = rng() % 2 ? g->w : rng_range(1, g->w);
+        f.h = e.h = rng() % 2 ? g->h : rng_range(1, g->h);
+      }
+      bool front_to_back = rng() % 3 == 0;
+      draw_op ops[6];
+      int n = rng_range(0, 6);
+      for (int k = 0; k < n; ++k) {
+        ops[k] = (draw_op){
+            .kind = rng_range(0, front_to_back ? 2 : 3),
+            .color = 0xff000000 | rng(),
+            .rect = random_rect(&f),
+        };
+        for (int v = 0; v < 3; ++v) {
+          ops[k].p[v] = (Vector2){rng_range(-20, f.w + 20),
+                                  rng_range(-20, f.h + 20)};
+        }
+      }
+
+      fast_clear_canvas(f, bg);
+      if (front_to_back) {
+        // painter's order is already checked against this path
+        coverage_begin(&cov);
+        apply_draw_ops(f, &cov, ops, n);
+        coverage_clear(&cov, f, bg);
+        coverage_flush(&cov, f);
+        coverage_begin(&cov);
+        apply_draw_ops(e, &cov, ops, n);
+        coverage_clear(&cov, e, bg);
+        coverage_flush(&cov, e);
+      } else {
+        apply_draw_ops(f, NULL, ops, n);
+        clear_canvas(e, bg);
+        apply_draw_ops(e, NULL, ops, n);
+      }
+      if (rng() % 4 != 0) {
+        resolve_canvas(f);
+      }
+    }
+    resolve_canvas(f);
+
+    // outside the last frame's corner the contents are undefined
+    int mismatches = 0;
+    for (int y = 0; y < f.h; ++y) {
+      mismatches += memcmp(&f.pixels[y * f.stride], &e.pixels[y * e.stride],
+                           sizeof(color) * f.w) != 0;
+    }
+    CHECK(guards_intact(&c), "overrun w=%d h=%d", g->w, g->h);
+    CHECK(mismatches == 0, "mismatch w=%d/%d h=%d/%d stride=%d", f.w, g->w,
+          f.h, g->h, g->stride);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+static color ref_blend_over(color s, color d) {
+  int inv = 255 - (s >> 24);
+  color out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int p = ((d >> shift) & 0xff) * inv;
+    int v = ((s >> shift) & 0xff) + (2 * p + 255) / 510; // rounded
+    out |= (color)(v > 255 ? 255 : v) << shift;
+  }
+  return out;
+}
+
+static void ref_composite_over(canvas dst, canvas src) {
+  for (int y = 0; y < dst.h && y < src.h; ++y) {
+    for (int x = 0; x < dst.w && x < src.w; ++x) {
+      color *d = &dst.pixels[y * dst.stride + x];
+      *d = ref_blend_over(src.pixels[y * src.stride + x], *d);
+    }
+  }
+}
+
+// Premultiplied pixels in runs long enough to hit the transparent and
+// opaque shortcuts as well as the blend.
+static void fill_premultiplied(canvas g) {
+  for (int y = 0; y < g.h; ++y) {
+    int kind = 0, run = 0;
+    for (int x = 0; x < g.w; ++x, --run) {
+      if (run <= 0) {
+        kind = rng_range(0, 2);
+        run = rng_range(1, 20);
+      }
+      color a = kind == 0 ? 0 : kind == 1 ? 255 : rng() % 256;
+      color p = a << 24;
+      for (int shift = 0; shift < 24; shift += 8) {
+        p |= (rng() % (a + 1)) << shift;
+      }
+      g.pixels[y * g.stride + x] = p;
+    }
+  }
+}
+
+static void test_composite_over(void) {
+  for (int i = 0; i < ITERATIONS; ++i) {
+    test_canvas c = make_canvas(67, 19);
+    test_canvas d = copy_canvas(&c);
+    test_canvas src = make_canvas(67, 19);
+    fill_premultiplied(src.canvas);
+
+    composite_over(c.canvas, src.canvas);
+    ref_composite_over(d.canvas, src.canvas);
+
+    CHECK(guards_intact(&c), "overrun w=%d h=%d", c.canvas.w, c.canvas.h);
+    CHECK(pixels_equal(&c, &d), "mismatch w=%d h=%d src w=%d h=%d",
+          c.canvas.w, c.canvas.h, src.canvas.w, src.canvas.h);
+    free_canvas(&c);
+    free_canvas(&d);
+    free_canvas(&src);
+  }
+}
+
+typedef struct {
+  draw_op ops[6];
+  int n;
+} layer_ops;
+
+static void draw_layer_ops(void *ctx, canvas g) {
+  layer_ops *l = ctx;
+  apply_draw_ops(g, NULL, l->ops, l->n);
+}
+
+// A cached layer has to composite exactly like the same shapes drawn into
+// a fresh transparent canvas, until it is invalidated or resized.
+static void test_layers(void) {
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    test_canvas c = make_canvas(300, 70);
+    test_canvas d = copy_canvas(&c);
+    canvas *g = &c.canvas;
+    layer_ops ops = {0};
+    layer l;
+    layer_init(&l, &a, g->w, g->h, draw_layer_ops, &ops);
+    color *ref = malloc(sizeof(color) * g->w * g->h);
+
+    canvas f = *g, e = d.canvas;
+    for (int frame = 0; frame < 3; ++frame) {
+      if (frame == 0 || rng() % 2) {
+        ops.n = rng_range(0, 6);
+        for (int k = 0; k < ops.n; ++k) {
+          ops.ops[k] = (draw_op){
+              .kind = rng_range(0, 2),
+              .color = 0xff000000 | rng(),
+              .rect = random_rect(g),
+          };
+          for (int v = 0; v < 3; ++v) {
+            ops.ops[k].p[v] = (Vector2){rng_range(-20, g->w + 20),
+                                        rng_range(-20, g->h + 20)};
+          }
+        }
+        layer_invalidate(&l);
+      }
+      if (rng() % 3 == 0) {
+        f.w = e.w = rng_range(1, g->w);
+        f.h = e.h = rng_range(1, g->h);
+      }
+
+      layer_composite(&l, f);
+
+      canvas r = {.pixels = ref, .w = e.w, .h = e.h, .stride = e.w};
+      clear_canvas(r, 0);
+      draw_layer_ops(&ops, r);
+      ref_composite_over(e, r);
+    }
+
+    CHECK(guards_intact(&c), "overrun w=%d h=%d", g->w, g->h);
+    CHECK(pixels_equal(&c, &d), "mismatch w=%d/%d h=%d/%d stride=%d", f.w,
+          g->w, f.h, g->h, g->stride);
+    free(ref);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+// Every op on a compact canvas has to leave exactly the packed result of
+// the same op on an RGBA canvas holding the unpacked pixels. Ops are single
+// primitives, so no pixel is blended over one written by the same op and
+// the two never round differently.
+static void test_pixel_formats(void) {
+  static hud_font font;
+  hud_font_init(&font, 0xff000000 | rng());
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    test_canvas c = make_canvas(300, 70);
+    canvas *ref = &c.canvas;
+    pixel_format format = rng() % 2 ? PIXEL_RGB565 : PIXEL_GRAY8;
+    int size = pixel_size(format);
+    size_t offset = (ref->pixels - c.buffer - GUARD) * size;
+    size_t bytes = c.size * size + 2 * GUARD;
+    uint8_t *packed = malloc(bytes), *expect = malloc(bytes);
+    for (size_t b = 0; b < bytes; ++b) {
+      packed[b] = rng();
+    }
+    memcpy(expect, packed, bytes);
+    canvas g = *ref;
+    g.pixels8 = packed + GUARD + offset;
+    g.format = format;
+    canvas_tiles tiles;
+    if (rng() % 2) {
+      canvas_tiles_init(&tiles, &a, g.w, g.h);
+      g.tiles = &tiles;
+    }
+    coverage cov;
+    coverage_init(&cov, &a, g.w, g.h, 1 << 14);
+    color *src = malloc(sizeof(color) * g.w * g.h);
+    canvas layer = {.pixels = src,
+                    .w = g.w,
+                    .h = g.h,
+                    .stride = g.w,
+                    .format = PIXEL_RGBA8888_PREMUL};
+
+    int mismatches = 0;
+    for (int op = 0; op < 8; ++op) {
+      for (int y = 0; y < g.h; ++y) {
+        for (int x = 0; x < g.w; ++x) {
+          ref->pixels[y * g.stride + x] = canvas_load(g, y * g.stride + x);
+        }
+      }
+      draw_op d = {
+          .kind = rng_range(0, 7),
+          .color = rng(),
+          .rect = random_rect(&g),
+      };
+      for (int v = 0; v < 3; ++v) {
+        d.p[v] = (Vector2){rng_range(-20, g.w + 20), rng_range(-20, g.h + 20)};
+      }
+      ref->color = d.color;
+
+      switch (d.kind) {
+      case 4:
+        clear_canvas(g, d.color);
+        clear_canvas(*ref, d.color);
+        break;
+      case 5: {
+        d.kind = rng() % 2 ? 0 : 3; // a rectangle or the HUD panel
+        color bg = rng();
+        fast_clear_canvas(g, bg);
+        apply_draw_ops(g, NULL, &d, 1);
+        resolve_canvas(g);
+        // the panel halves what the canvas holds, bg as packed
+        clear_canvas(*ref, unpack_pixel(format, pack_pixel(format, bg)));
+        apply_draw_ops(*ref, NULL, &d, 1);
+        break;
+      }
+      case 6: {
+        d.kind = rng_range(0, 1);
+        color bg = rng();
+        fast_clear_canvas(g, bg);
+        coverage_begin(&cov);
+        apply_draw_ops(g, &cov, &d, 1);
+        coverage_clear(&cov, g, bg);
+        coverage_flush(&cov, g);
+        clear_canvas(*ref, bg);
+        apply_draw_ops(*ref, NULL, &d, 1);
+        break;
+      }
+      case 7:
+        fill_premultiplied(layer);
+        composite_over(g, layer);
+        ref_composite_over(*ref, layer);
+        break;
+      default:
+        apply_draw_ops(g, NULL, &d, 1);
+        apply_draw_ops(*ref, NULL, &d, 1);
+        hud_text(g, &font, d.rect.x, d.rect.y, "0123");
+        hud_text(*ref, &font, d.rect.x, d.rect.y, "0123");
+        break;
+      }
+      resolve_canvas(g);
+
+      for (int y = 0; y < g.h; ++y) {
+        for (int x = 0; x < g.w; ++x) {
+          size_t p = (size_t)y * g.stride + x;
+          uint32_t v = pack_pixel(format, ref->pixels[p]);
+          memcpy(expect + GUARD + offset + p * size, &v, size);
+        }
+      }
+      if (memcmp(packed, expect, bytes) != 0) {
+        mismatches++;
+        memcpy(expect, packed, bytes);
+      }
+    }
+
+    CHECK(mismatches == 0, "%d mismatches format=%d w=%d h=%d stride=%d",
+          mismatches, format, g.w, g.h, g.stride);
+    free(src);
+    free(packed);
+    free(expect);
+    free_canvas(&c);
+  }
+  arena_free(&a);
+}
+
+// Whatever is drawn into a tiled canvas, with or without fast clear, must
+// detile to exactly what the same drawing gives in rows, in every format,
+// without writing past the last band of blocks.
+static void test_tiled(void) {
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    worker_pool pool;
+    pool_init(&pool, rng_range(0, 2));
+    int w = rng_range(1, 300), h = rng_range(1, 70);
+    pixel_format format = rng_range(0, NUM_PIXEL_FORMATS - 1);
+    int size = pixel_size(format);
+    int stride = block_align(w) + BLOCK_W * rng_range(0, 2);
+    size_t bytes = (size_t)size * stride * block_align(h);
+    size_t row_bytes = (size_t)size * w * h;
+    uint8_t *blocks = malloc(bytes + 2 * GUARD);
+    uint8_t *rows = malloc(row_bytes), *out = malloc(row_bytes + GUARD);
+    memset(blocks, 0xa5, bytes + 2 * GUARD);
+    memset(out + row_bytes, 0xa5, GUARD);
+    for (size_t b = 0; b < bytes; ++b) {
+      blocks[GUARD + b] = rng();
+    }
+
+    canvas t = {.pixels8 = blocks + GUARD,
+                .w = w,
+                .h = h,
+                .stride = stride,
+                .format = format,
+                .layout = CANVAS_TILED};
+    canvas e = {.pixels8 = rows, .w = w, .h = h, .stride = w, .format = format};
+    canvas o = e;
+    o.pixels8 = out;
+    canvas_tiles tiles[2];
+    bool fast = rng() % 2;
+    if (fast) {
+      canvas_tiles_init(&tiles[0], &a, w, h);
+      canvas_tiles_init(&tiles[1], &a, w, h);
+      t.tiles = &tiles[0];
+      e.tiles = &tiles[1];
+    }
+
+    for (int frame = 0; frame < 3; ++frame) {
+      color bg = rng();
+      switch (fast ? rng_range(0, 2) : rng_range(0, 1)) {
+      case 0:
+        clear_canvas(t, bg);
+        break;
+      case 1:
+        parallel_clear_canvas(&pool, t, bg);
+        break;
+      default:
+        fast_clear_canvas(t, bg);
+        break;
+      }
+      clear_canvas(e, bg);
+
+      for (int k = rng_range(0, 8); k > 0; --k) {
+        draw_op d = {
+            .kind = rng_range(0, 2),
+            .color = rng(),
+            .rect = random_rect(&t),
+        };
+        for (int v = 0; v < 3; ++v) {
+          d.p[v] = (Vector2){rng_range(-20, w + 20), rng_range(-20, h + 20)};
+        }
+        apply_draw_ops(t, NULL, &d, 1);
+        apply_draw_ops(e, NULL, &d, 1);
+      }
+      if (rng() % 3 == 0) {
+        resolve_canvas(t);
+      }
+    }
+    resolve_canvas(e);
+
+    for (size_t b = 0; b < row_bytes; ++b) {
+      out[b] = rng();
+    }
+    if (rng() % 2) {
+      detile_canvas(o, t);
+    } else {
+      parallel_detile_canvas(&pool, o, t);
+    }
+    bool intact = true;
+    for (size_t b = 0; b < GUARD; ++b) {
+      intact &= blocks[b] == 0xa5 && blocks[GUARD + bytes + b] == 0xa5 &&
+                out[row_bytes + b] == 0xa5;
+    }
+    CHECK(intact, "overrun format=%d w=%d h=%d stride=%d", format, w, h,
+          stride);
+    CHECK(memcmp(out, rows, row_bytes) == 0,
+          "mismatch format=%d w=%d h=%d stride=%d fast=%d", format, w, h,
+          stride, fast);
+
+    free(blocks);
+    free(rows);
+    free(out);
+    pool_destroy(&pool);
+  }
+  arena_free(&a);
+}
+
+// Signed distance of (x, y) from the edge a to b, positive on the side of
+// c.
+static double edge_distance(const shade_vertex *a, const shade_vertex *b,
+                            const shade_vertex *c, double x, double y) {
+  double ex = b->x - a->x, ey = b->y - a->y;
+  double d = (ex * (y - a->y) - ey * (x - a->x)) / hypot(ex, ey);
+  return ex * (c->y - a->y) - ey * (c->x - a->x) < 0 ? -d : d;
+}
+
+// Perspective correct barycentric weights of (x, y).
+static void ref_weights(const shade_vertex v[3], double x, double y,
+                        double b[3]) {
+  double area = ((double)v[1].x - v[0].x) * ((double)v[2].y - v[0].y) -
+                ((double)v[2].x - v[0].x) * ((double)v[1].y - v[0].y);
+  double sum = 0;
+  for (int i = 0; i < 3; ++i) {
+    const shade_vertex *p = &v[(i + 1) % 3], *q = &v[(i + 2) % 3];
+    double e = ((double)q->x - p->x) * (y - p->y) -
+               ((double)q->y - p->y) * (x - p->x);
+    b[i] = e / area / v[i].w;
+    sum += b[i];
+  }
+  for (int i = 0; i < 3; ++i) {
+    b[i] /= sum;
+  }
+}
+
+static color ref_gouraud(const shade_vertex v[3], double x, double y) {
+  double b[3];
+  ref_weights(v, x, y, b);
+  color c = 0;
+  for (int k = 0; k < 4; ++k) {
+    double s = 0;
+    for (int i = 0; i < 3; ++i) {
+      s += b[i] * ((v[i].color >> 8 * k) & 0xff);
+    }
+    s = s < 0 ? 0 : s > 255 ? 255 : s;
+    c |= (color)lrint(s) << 8 * k;
+  }
+  return c;
+}
+
+static color ref_texel(canvas t, int x, int y) {
+  x = x < 0 ? 0 : x >= t.w ? t.w - 1 : x;
+  y = y < 0 ? 0 : y >= t.h ? t.h - 1 : y;
+  return canvas_load(t, canvas_index(t, x, y));
+}
+
+static color ref_bilinear(canvas t, double u, double v) {
+  double tu = u * t.w - 0.5, tv = v * t.h - 0.5;
+  int x = floor(tu), y = floor(tv);
+  double fx = tu - x, fy = tv - y;
+  color c = 0;
+  for (int k = 0; k < 4; ++k) {
+    double s = 0;
+    for (int i = 0; i < 4; ++i) {
+      double w = (i & 1 ? fx : 1 - fx) * (i & 2 ? fy : 1 - fy);
+      s += w * ((ref_texel(t, x + (i & 1), y + (i >> 1)) >> 8 * k) & 0xff);
+    }
+    c |= (color)lrint(s) << 8 * k;
+  }
+  return c;
+}
+
+static bool colors_near(color a, color b, int tolerance) {
+  for (int k = 0; k < 32; k += 8) {
+    if (abs((int)((a >> k) & 0xff) - (int)((b >> k) & 0xff)) > tolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static shade_vertex random_vertex(int w, int h, bool perspective) {
+  return (shade_vertex){
+      .x = rng_range(-20, w + 20) + rng() % 256 / 256.f,
+      .y = rng_range(-20, h + 20) + rng() % 256 / 256.f,
+      .w = perspective ? 0.5f + rng() % 1024 / 256.f : 1.f,
+      .u = rng() % 1024 / 1024.f,
+      .v = rng() % 1024 / 1024.f,
+      .color = rng(),
+  };
+}
+
+static canvas alloc_canvas(int w, int h, pixel_format format,
+                           canvas_layout layout) {
+  int stride = layout == CANVAS_TILED ? block_align(w) : w;
+  int rows = layout == CANVAS_TILED ? block_align(h) : h;
+  canvas g = {.w = w, .h = h, .stride = stride, .format = format,
+              .layout = layout};
+  g.pixels8 = calloc((size_t)stride * rows, pixel_size(format));
+  return g;
+}
+
+// Two triangles on either side of an edge cover it without overlap or gap,
+// and what they cover is interpolated or sampled like a reference in
+// doubles, perspective or not, in any canvas and texture format.
+static void test_shade(void) {
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    int w = rng_range(1, 120), h = rng_range(1, 70);
+    canvas_layout layout = rng() % 2 ? CANVAS_TILED : CANVAS_LINEAR;
+    canvas g[2] = {alloc_canvas(w, h, PIXEL_RGBA8888, layout),
+                   alloc_canvas(w, h, PIXEL_RGBA8888, layout)};
+    bool perspective = rng() % 2;
+    shade_vertex t[2][3];
+    t[0][0] = t[1][0] = random_vertex(w, h, perspective);
+    t[0][1] = t[1][1] = random_vertex(w, h, perspective);
+    t[0][2] = random_vertex(w, h, perspective);
+    // the mirror image of the third vertex across the shared edge
+    shade_vertex *a = &t[0][0], *b = &t[0][1], *c = &t[0][2];
+    float ex = b->x - a->x, ey = b->y - a->y;
+    float k = ((c->x - a->x) * ex + (c->y - a->y) * ey) / (ex * ex + ey * ey);
+    t[1][2] = *c;
+    t[1][2].x = 2 * (a->x + k * ex) - c->x + rng_range(-5, 5);
+    t[1][2].y = 2 * (a->y + k * ey) - c->y + rng_range(-5, 5);
+    t[1][2].color = rng();
+    bool across = edge_distance(a, b, c, t[1][2].x, t[1][2].y) < -1 &&
+                  edge_distance(a, b, c, c->x, c->y) > 1;
+    if (!across) {
+      t[1][2] = *a; // drawn as nothing
+    }
+
+    int bad_cover = 0, bad_color = 0;
+    double m = 1e-3;
+    for (int s = 0; s < 2; ++s) {
+      clear_canvas(g[s], 0);
+      draw_gouraud_triangle(g[s], t[s]);
+    }
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        double px = x + 0.5, py = y + 0.5;
+        bool covered[2], others_inside = true;
+        for (int s = 0; s < 2; ++s) {
+          const shade_vertex *v = t[s];
+          color got = canvas_load(g[s], canvas_index(g[s], x, y));
+          covered[s] = got != 0;
+          double shared = edge_distance(&v[0], &v[1], &v[2], px, py);
+          double rest = fmin(edge_distance(&v[1], &v[2], &v[0], px, py),
+                             edge_distance(&v[2], &v[0], &v[1], px, py));
+          double d = fmin(shared, rest);
+          others_inside &= rest > m;
+          bad_cover += (d > m && !covered[s]) || (d < -m && covered[s]);
+          if (covered[s] && d > m) {
+            // an exact zero color reads as uncovered, that's fine
+            bad_color += !colors_near(got, ref_gouraud(v, px, py), 2);
+          }
+        }
+        bad_cover += covered[0] && covered[1];
+        bad_cover += across && others_inside && !covered[0] && !covered[1];
+      }
+    }
+    CHECK(bad_cover == 0 && bad_color == 0,
+          "gouraud %d coverage, %d color errors w=%d h=%d tiled=%d "
+          "perspective=%d",
+          bad_cover, bad_color, w, h, layout, perspective);
+
+    // compact formats store what RGBA would, packed
+    pixel_format format = rng_range(1, NUM_PIXEL_FORMATS - 1);
+    canvas packed = alloc_canvas(w, h, format, layout);
+    clear_canvas(packed, 0);
+    draw_gouraud_triangle(packed, t[0]);
+    int bad_format = 0;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        color c = canvas_load(g[0], canvas_index(g[0], x, y));
+        bad_format += canvas_load(packed, canvas_index(packed, x, y)) !=
+                      unpack_pixel(format, pack_pixel(format, c));
+      }
+    }
+    CHECK(bad_format == 0, "gouraud format=%d %d mismatches", format,
+          bad_format);
+    free(packed.pixels8);
+
+    // a texture mapped one to one onto pixels comes out unchanged
+    int tw = rng_range(1, 40), th = rng_range(1, 40);
+    canvas tex = alloc_canvas(tw, th, rng_range(0, NUM_PIXEL_FORMATS - 1),
+                              rng() % 2 ? CANVAS_TILED : CANVAS_LINEAR);
+    for (int y = 0; y < th; ++y) {
+      for (int x = 0; x < tw; ++x) {
+        canvas_store(tex, canvas_index(tex, x, y), rng());
+      }
+    }
+    sample_filter filter = rng() % 2 ? SAMPLE_BILINEAR : SAMPLE_NEAREST;
+    int ox = rng_range(-10, w), oy = rng_range(-10, h);
+    shade_vertex q[4];
+    for (int v = 0; v < 4; ++v) {
+      q[v] = (shade_vertex){.x = ox + (v & 1) * tw,
+                            .y = oy + (v >> 1) * th,
+                            .w = 1.f,
+                            .u = v & 1,
+                            .v = v >> 1};
+    }
+    clear_canvas(g[0], 0);
+    draw_textured_triangle(g[0], (shade_vertex[3]){q[0], q[1], q[2]}, tex,
+                           filter);
+    draw_textured_triangle(g[0], (shade_vertex[3]){q[2], q[1], q[3]}, tex,
+                           filter);
+    int bad_copy = 0;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        bool inside = x >= ox && x < ox + tw && y >= oy && y < oy + th;
+        color expect = inside ? ref_texel(tex, x - ox, y - oy) : 0;
+        bad_copy += canvas_load(g[0], canvas_index(g[0], x, y)) != expect;
+      }
+    }
+    CHECK(bad_copy == 0, "texture copy filter=%d format=%d tiled=%d, %d "
+          "mismatches", filter, tex.format, tex.layout, bad_copy);
+
+    // and mapped any other way matches the reference sampling
+    clear_canvas(g[0], 0);
+    draw_textured_triangle(g[0], t[0], tex, filter);
+    int bad_texel = 0;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        double px = x + 0.5, py = y + 0.5, bw[3];
+        const shade_vertex *v = t[0];
+        if (fmin(edge_distance(&v[0], &v[1], &v[2], px, py),
+                 fmin(edge_distance(&v[1], &v[2], &v[0], px, py),
+                      edge_distance(&v[2], &v[0], &v[1], px, py))) <= m) {
+          continue;
+        }
+        ref_weights(v, px, py, bw);
+        double u = 0, tv = 0;
+        for (int n = 0; n < 3; ++n) {
+          u += bw[n] * v[n].u;
+          tv += bw[n] * v[n].v;
+        }
+        color got = canvas_load(g[0], canvas_index(g[0], x, y));
+        if (filter == SAMPLE_BILINEAR) {
+          bad_texel += !colors_near(got, ref_bilinear(tex, u, tv), 3);
+          continue;
+        }
+        // texel edges may round either way
+        bool any = false;
+        for (int n = 0; n < 4; ++n) {
+          double e = 1e-3 * (n & 1 ? 1 : -1), f = 1e-3 * (n & 2 ? 1 : -1);
+          any |= got == ref_texel(tex, floor((u + e) * tw),
+                                  floor((tv + f) * th));
+        }
+        bad_texel += !any;
+      }
+    }
+    CHECK(bad_texel == 0, "texture filter=%d format=%d perspective=%d, %d "
+          "mismatches", filter, tex.format, perspective, bad_texel);
+
+    free(tex.pixels8);
+    free(g[0].pixels8);
+    free(g[1].pixels8);
+  }
+}
+
+// Overlapping triangles drawn in any order show the nearest one at every
+// pixel and leave its depth, even when cleared to something other than 1,
+// and every block drawn into ends up with exact bounds.
+static void test_depth(void) {
+  enum { MAX_TRIANGLES = 12 };
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    int w = rng_range(1, 100), h = rng_range(1, 70);
+    canvas g = alloc_canvas(w, h, PIXEL_RGBA8888,
+                            rng() % 2 ? CANVAS_TILED : CANVAS_LINEAR);
+    depth_buffer d;
+    a.size = 0;
+    CHECK(depth_init(&d, &a, w, h) == 0, "depth_init %dx%d", w, h);
+    g.depth = &d;
+
+    for (int pass = 0; pass < 2; ++pass) {
+      float far = 1.f;
+      if (pass > 0) {
+        far = rng() % 1024 / 1024.f;
+        depth_clear(&d, far);
+      }
+      clear_canvas(g, 0);
+      int n = rng_range(1, MAX_TRIANGLES);
+      shade_vertex t[MAX_TRIANGLES][3];
+      for (int k = 0; k < n; ++k) {
+        color c = 0xff000000 | (k + 1);
+        for (int v = 0; v < 3; ++v) {
+          t[k][v] = random_vertex(w, h, false);
+          t[k][v].z = rng() % 1200 / 1000.f;
+          t[k][v].color = c;
+        }
+        draw_gouraud_triangle(g, t[k]);
+      }
+
+      int bad_color = 0, bad_depth = 0;
+      double m = 1e-3, dz = 1e-4;
+      for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+          double px = x + 0.5, py = y + 0.5, best = far, second = INFINITY;
+          color expect = 0;
+          bool unsure = false;
+          for (int k = 0; k < n; ++k) {
+            const shade_vertex *v = t[k];
+            double e = fmin(edge_distance(&v[0], &v[1], &v[2], px, py),
+                            fmin(edge_distance(&v[1], &v[2], &v[0], px, py),
+                                 edge_distance(&v[2], &v[0], &v[1], px, py)));
+            if (e < -m) {
+              continue;
+            }
+            double b[3];
+            ref_weights(v, px, py, b);
+            double z = b[0] * v[0].z + b[1] * v[1].z + b[2] * v[2].z;
+            unsure |= e <= m && z < best + dz;
+            if (z < best) {
+              second = best;
+              best = z;
+              expect = v[0].color;
+            } else {
+              second = fmin(second, z);
+            }
+          }
+          if (unsure || second - best < dz) {
+            continue;
+          }
+          bad_color += canvas_load(g, canvas_index(g, x, y)) != expect;
+          bad_depth += fabs(depth_at(&d, x, y) - best) > dz;
+        }
+      }
+      CHECK(bad_color == 0 && bad_depth == 0,
+            "depth %d color, %d depth errors w=%d h=%d n=%d far=%g",
+            bad_color, bad_depth, w, h, n, far);
+
+      int bad_bounds = 0;
+      for (int b = 0; b < d.cols * d.rows; ++b) {
+        if (d.state[b] == DEPTH_CLEAR) {
+          continue;
+        }
+        float lo = INFINITY, hi = -INFINITY;
+        for (int p = 0; p < BLOCK_W * BLOCK_W; ++p) {
+          float z = d.z[(size_t)b * BLOCK_W * BLOCK_W + p];
+          lo = fminf(lo, z);
+          hi = fmaxf(hi, z);
+        }
+        bad_bounds += d.state[b] != DEPTH_EXACT || d.near[b] != lo ||
+                      d.far[b] != hi;
+      }
+      CHECK(bad_bounds == 0, "depth %d blocks with wrong bounds",
+            bad_bounds);
+    }
+    free(g.pixels8);
+  }
+  arena_free(&a);
+}
+
+// Sample s of pixel (x, y), at the center when samples isn't 4 or 8.
+static void ref_sample(int samples, int s, int x, int y, double *sx,
+                       double *sy) {
+  *sx = x + 0.5;
+  *sy = y + 0.5;
+  if (samples == 4 || samples == 8) {
+    const int8_t *o = samples == 4 ? msaa_offsets4[s] : msaa_offsets8[s];
+    *sx += o[0] / 16.0;
+    *sy += o[1] / 16.0;
+  }
+}
+
+// Distance of (x, y) into the convex polygon p, negative outside.
+static double polygon_distance(const Vector2d *p, int n, double x,
+                               double y) {
+  double d = INFINITY;
+  for (int i = 0; i < n; ++i) {
+    shade_vertex a = {.x = p[i].x, .y = p[i].y};
+    shade_vertex b = {.x = p[(i + 1) % n].x, .y = p[(i + 1) % n].y};
+    shade_vertex c = {.x = p[(i + 2) % n].x, .y = p[(i + 2) % n].y};
+    d = fmin(d, edge_distance(&a, &b, &c, x, y));
+  }
+  return d;
+}
+
+// Samples of pixel (x, y) inside p, -1 if one is too near an edge to tell.
+static int ref_coverage(const Vector2d *p, int n, int samples, int x, int y) {
+  int count = 0;
+  for (int s = 0; s < (samples == 4 || samples == 8 ? samples : 1); ++s) {
+    double sx, sy;
+    ref_sample(samples, s, x, y, &sx, &sy);
+    double d = polygon_distance(p, n, sx, sy);
+    if (fabs(d) < 1e-3) {
+      return -1;
+    }
+    count += d > 0;
+  }
+  return count;
+}
+
+// bg moved towards c by count of samples, the way lerp_colors8 rounds.
+static color ref_blend(color bg, color c, int count, int samples) {
+  int n = samples == 4 || samples == 8 ? samples : 1;
+  color out = 0;
+  for (int k = 0; k < 32; k += 8) {
+    int a = (bg >> k) & 0xff, b = (c >> k) & 0xff;
+    int v = a + (int)floor((b - a) * (count * 128 / n) / 128.0);
+    out |= (color)v << k;
+  }
+  return out;
+}
+
+// Counts how many pixels of g differ from ref_coverage of p blended over bg.
+static int check_coverage(canvas g, color bg, const Vector2d *p, int n,
+                          int samples) {
+  int bad = 0;
+  color packed_bg = unpack_pixel(g.format, pack_pixel(g.format, bg));
+  for (int y = 0; y < g.h; ++y) {
+    for (int x = 0; x < g.w; ++x) {
+      int count = ref_coverage(p, n, samples, x, y);
+      if (count < 0) {
+        continue;
+      }
+      color expect = ref_blend(packed_bg, g.color, count, samples);
+      expect = unpack_pixel(g.format, pack_pixel(g.format, expect));
+      bad += canvas_load(g, canvas_index(g, x, y)) != expect;
+    }
+  }
+  return bad;
+}
+
+// Triangles, quads and rectangles blend every pixel by the share of its
+// samples inside, in any format and layout; whole pixels are plain fills,
+// and triangles sharing an edge split its samples exactly.
+static void test_msaa(void) {
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    int w = rng_range(1, 100), h = rng_range(1, 70);
+    int samples = (int[]){1, 4, 8}[rng() % 3];
+    canvas g = alloc_canvas(w, h, rng_range(0, NUM_PIXEL_FORMATS - 1),
+                            rng() % 2 ? CANVAS_TILED : CANVAS_LINEAR);
+    color bg = rng();
+    g.color = rng();
+
+    Vector2d t[4];
+    for (int k = 0; k < 4; ++k) {
+      shade_vertex v = random_vertex(w, h, false);
+      t[k] = (Vector2d){v.x, v.y};
+    }
+    clear_canvas(g, bg);
+    draw_triangle_msaa(g, t[0], t[1], t[2], samples);
+    int bad = check_coverage(g, bg, t, 3, samples);
+    CHECK(bad == 0, "msaa triangle %d mismatches samples=%d format=%d "
+          "tiled=%d", bad, samples, g.format, g.layout);
+
+    // a rotated rectangle
+    double cx = rng_range(-10, w + 10), cy = rng_range(-10, h + 10);
+    double hx = rng_range(1, 300) / 10.0, hy = rng_range(1, 300) / 10.0;
+    double angle = rng() % 6283 / 1000.0;
+    Vector2d q[4];
+    for (int k = 0; k < 4; ++k) {
+      double x = (k == 1 || k == 2) ? hx : -hx, y = k >= 2 ? hy : -hy;
+      q[k] = (Vector2d){cx + x * cos(angle) - y * sin(angle),
+                        cy + x * sin(angle) + y * cos(angle)};
+    }
+    clear_canvas(g, bg);
+    draw_quad_msaa(g, q, samples);
+    bad = check_coverage(g, bg, q, 4, samples);
+    CHECK(bad == 0, "msaa quad %d mismatches samples=%d", bad, samples);
+
+    double x0 = rng_range(-10, w) + rng() % 256 / 256.0;
+    double y0 = rng_range(-10, h) + rng() % 256 / 256.0;
+    double x1 = x0 + rng_range(0, 50) + rng() % 256 / 256.0 + 0.01;
+    double y1 = y0 + rng_range(0, 50) + rng() % 256 / 256.0 + 0.01;
+    Vector2d r[4] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+    clear_canvas(g, bg);
+    draw_rectangle_msaa(g, r[2], r[0], samples);
+    bad = check_coverage(g, bg, r, 4, samples);
+    CHECK(bad == 0, "msaa rectangle %d mismatches samples=%d", bad,
+          samples);
+
+    // on whole pixels it is draw_rectangle
+    Rectangle whole = {rng_range(-10, w), rng_range(-10, h),
+                       rng_range(0, 50), rng_range(0, 50)};
+    canvas plain = alloc_canvas(w, h, g.format, g.layout);
+    plain.color = g.color;
+    clear_canvas(g, bg);
+    clear_canvas(plain, bg);
+    draw_rectangle(plain, &whole);
+    draw_rectangle_msaa(g, (Vector2d){whole.x, whole.y},
+                        (Vector2d){whole.x + whole.w, whole.y + whole.h},
+                        samples);
+    CHECK(memcmp(g.pixels8, plain.pixels8,
+                 (size_t)pixel_size(g.format) * g.stride *
+                     (g.layout == CANVAS_TILED ? block_align(h) : h)) ==
+              0,
+          "msaa whole pixel rectangle differs from draw_rectangle");
+    free(plain.pixels8);
+    free(g.pixels8);
+
+    // two triangles on either side of an edge take each of its samples
+    // once between them
+    int n = samples == 4 || samples == 8 ? samples : 1;
+    int shift = LERP_WEIGHT_BITS - (n == 8 ? 3 : n == 4 ? 2 : 0);
+    shade_vertex e[4];
+    for (int k = 0; k < 4; ++k) {
+      e[k] = (shade_vertex){.x = t[k].x, .y = t[k].y};
+    }
+    if (edge_distance(&e[0], &e[1], &e[2], e[3].x, e[3].y) > -1 ||
+        edge_distance(&e[0], &e[1], &e[2], e[2].x, e[2].y) < 1) {
+      continue;
+    }
+    canvas halves[2] = {alloc_canvas(w, h, PIXEL_RGBA8888, CANVAS_LINEAR),
+                        alloc_canvas(w, h, PIXEL_RGBA8888, CANVAS_LINEAR)};
+    for (int s = 0; s < 2; ++s) {
+      halves[s].color = 0xffffffff;
+      clear_canvas(halves[s], 0);
+      draw_triangle_msaa(halves[s], t[0], t[1], t[2 + s], samples);
+    }
+    int bad_split = 0;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        int got = 0, expect = 0;
+        for (int s = 0; s < 2; ++s) {
+          int v = halves[s].pixels[y * w + x] & 0xff;
+          int k = 0;
+          while (k < n && (255 * (k << shift)) >> 7 != v) {
+            ++k;
+          }
+          got += k;
+        }
+        bool unsure = false;
+        for (int s = 0; s < n; ++s) {
+          double sx, sy;
+          ref_sample(samples, s, x, y, &sx, &sy);
+          // the side of the shared edge decides which triangle to test
+          const shade_vertex *c =
+              edge_distance(&e[0], &e[1], &e[2], sx, sy) >= 0 ? &e[2]
+                                                              : &e[3];
+          double d = fmin(edge_distance(&e[1], c, &e[0], sx, sy),
+                          edge_distance(c, &e[0], &e[1], sx, sy));
+          unsure |= fabs(d) < 1e-3;
+          expect += d > 0;
+        }
+        bad_split += !unsure && got != expect;
+      }
+    }
+    CHECK(bad_split == 0, "msaa shared edge %d mismatches samples=%d",
+          bad_split, samples);
+    free(halves[0].pixels8);
+    free(halves[1].pixels8);
+  }
+}
+
+// Sprites come out as a scalar loop over destination pixels taking the
+// atlas pixel under each center draws them, in every mode, format and
+// layout. Every tenth round is an unscaled copy large enough to stream.
+static void test_blit(void) {
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    bool big = i % 10 == 0;
+    int w = big ? rng_range(600, 700) : rng_range(1, 100);
+    int h = big ? rng_range(200, 300) : rng_range(1, 70);
+    blit_mode mode = big ? BLIT_COPY : rng_range(0, 2);
+    canvas g = alloc_canvas(
+        w, h, big ? PIXEL_RGBA8888 : rng_range(0, NUM_PIXEL_FORMATS - 1),
+        big || rng() % 2 ? CANVAS_LINEAR : CANVAS_TILED);
+    canvas atlas = alloc_canvas(big ? w : rng_range(1, 64),
+                                big ? h : rng_range(1, 64),
+                                PIXEL_RGBA8888_PREMUL, CANVAS_LINEAR);
+    color key = rng();
+    if (mode == BLIT_OVER) {
+      fill_premultiplied(atlas);
+    } else {
+      for (int k = 0; k < atlas.w * atlas.h; ++k) {
+        atlas.pixels[k] = rng() % 4 ? rng() : key;
+      }
+    }
+    color *expect = malloc(sizeof(color) * w * h);
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        canvas_store(g, canvas_index(g, x, y), rng());
+        expect[y * w + x] = canvas_load(g, canvas_index(g, x, y));
+      }
+    }
+
+    sprite s[8];
+    int n = big ? 1 : rng_range(1, 8);
+    for (int k = 0; k < n; ++k) {
+      Rectangle *from = &s[k].src, *to = &s[k].dst;
+      from->x = rng_range(0, atlas.w - 1);
+      from->y = rng_range(0, atlas.h - 1);
+      from->w = rng_range(1, atlas.w - from->x);
+      from->h = rng_range(1, atlas.h - from->y);
+      if (rng() % 8 == 0) {
+        from->x = rng_range(-2, atlas.w); // may hang off the atlas
+      }
+      *to = (Rectangle){rng_range(-20, w), rng_range(-20, h),
+                        rng() % 2 ? from->w : rng_range(0, 3 * from->w),
+                        rng() % 2 ? from->h : rng_range(0, 3 * from->h)};
+      if (big) {
+        *from = (Rectangle){0, 0, atlas.w, atlas.h};
+        *to = (Rectangle){rng_range(-5, 5), rng_range(-5, 5), w, h};
+      }
+    }
+    if (n == 1 && rng() % 2) {
+      blit(g, atlas, s, mode, key);
+    } else {
+      blit_sprites(g, atlas, s, n, mode, key);
+    }
+
+    for (int k = 0; k < n; ++k) {
+      Rectangle from = s[k].src, to = s[k].dst;
+      if (from.x < 0 || from.x + from.w > atlas.w) {
+        continue;
+      }
+      for (int y = to.y < 0 ? 0 : to.y; y < to.y + to.h && y < h; ++y) {
+        for (int x = to.x < 0 ? 0 : to.x; x < to.x + to.w && x < w; ++x) {
+          int sx = from.x + (2 * (x - to.x) + 1) * from.w / (2 * to.w);
+          int sy = from.y + (2 * (y - to.y) + 1) * from.h / (2 * to.h);
+          color p = atlas.pixels[sy * atlas.stride + sx];
+          color *d = &expect[y * w + x];
+          if (mode == BLIT_KEY && p == key) {
+            continue;
+          }
+          p = mode == BLIT_OVER ? ref_blend_over(p, *d) : p;
+          *d = unpack_pixel(g.format, pack_pixel(g.format, p));
+        }
+      }
+    }
+    int bad = 0;
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        bad += canvas_load(g, canvas_index(g, x, y)) != expect[y * w + x];
+      }
+    }
+    CHECK(bad == 0, "blit %d mismatches mode=%d format=%d tiled=%d", bad,
+          mode, g.format, g.layout);
+    free(expect);
+    free(atlas.pixels8);
+    free(g.pixels8);
+  }
+}
+
+static color ref_convolve(const color *p, size_t step,
+                          const filter_kernel *k) {
+  color out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t sum = 128;
+    for (int t = 0; t <= 2 * k->radius; ++t) {
+      sum += ((p[t * step] >> shift) & 0xff) * k->weights[t];
+    }
+    out |= (sum >> 8) << shift;
+  }
+  return out;
+}
+
+// Horizontal then vertical, both through edge-clamped copies.
+static void ref_blur(canvas dst, canvas src, const filter_kernel *k) {
+  int r = k->radius;
+  color *line = malloc(sizeof(color) * (src.w > src.h ? src.w : src.h) +
+                       sizeof(color) * 2 * r);
+  color *tmp = malloc(sizeof(color) * src.w * src.h);
+  for (int y = 0; y < src.h; ++y) {
+    for (int i = -r; i < src.w + r; ++i) {
+      int x = i < 0 ? 0 : i >= src.w ? src.w - 1 : i;
+      line[i + r] = src.pixels[y * src.stride + x];
+    }
+    for (int x = 0; x < src.w; ++x) {
+      tmp[y * src.w + x] = ref_convolve(&line[x], 1, k);
+    }
+  }
+  for (int x = 0; x < dst.w && x < src.w; ++x) {
+    for (int i = -r; i < src.h + r; ++i) {
+      int y = i < 0 ? 0 : i >= src.h ? src.h - 1 : i;
+      line[i + r] = tmp[y * src.w + x];
+    }
+    for (int y = 0; y < dst.h && y < src.h; ++y) {
+      dst.pixels[y * dst.stride + x] = ref_convolve(&line[y], 1, k);
+    }
+  }
+  free(tmp);
+  free(line);
+}
+
+static void ref_downsample(canvas dst, canvas src) {
+  for (int y = 0; y < dst.h && y < src.h / 2; ++y) {
+    for (int x = 0; x < dst.w && x < src.w / 2; ++x) {
+      const color *a = &src.pixels[2 * y * src.stride + 2 * x];
+      const color *b = a + src.stride;
+      color out = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        int l = (((a[0] >> shift) & 0xff) + ((b[0] >> shift) & 0xff) + 1) / 2;
+        int r = (((a[1] >> shift) & 0xff) + ((b[1] >> shift) & 0xff) + 1) / 2;
+        out |= (color)((l + r + 1) / 2) << shift;
+      }
+      dst.pixels[y * dst.stride + x] = out;
+    }
+  }
+}
+
+// Source position of a sample center in 1/256 of a pixel.
+static int ref_resize_pos(int i, int dst_n, int src_n) {
+  int pos = (int)(((2 * (int64_t)i + 1) * src_n * 256) / (2 * dst_n)) - 128;
+  pos = pos < 0 ? 0 : pos;
+  return pos >= (src_n - 1) * 256 ? (src_n - 1) * 256 : pos;
+}
+
+static color ref_lerp(color a, color b, int f) {
+  color out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int v = ((a >> shift) & 0xff) * (256 - f) + ((b >> shift) & 0xff) * f;
+    out |= (color)((v + 128) >> 8) << shift;
+  }
+  return out;
+}
+
+// Rows first, then columns, each rounded to 8 bits.
+static void ref_resize(canvas dst, canvas src) {
+  for (int y = 0; y < dst.h; ++y) {
+    int py = ref_resize_pos(y, dst.h, src.h);
+    int y0 = py >> 8, y1 = y0 + 1 < src.h ? y0 + 1 : y0;
+    for (int x = 0; x < dst.w; ++x) {
+      int px = ref_resize_pos(x, dst.w, src.w);
+      int x0 = px >> 8, x1 = x0 + 1 < src.w ? x0 + 1 : x0;
+      color l = ref_lerp(src.pixels[y0 * src.stride + x0],
+                         src.pixels[y1 * src.stride + x0], py & 255);
+      color r = ref_lerp(src.pixels[y0 * src.stride + x1],
+                         src.pixels[y1 * src.stride + x1], py & 255);
+      dst.pixels[y * dst.stride + x] = ref_lerp(l, r, px & 255);
+    }
+  }
+}
+
+// Every filter has to match its scalar reference bit for bit on any number
+// of threads, whatever the band boundaries cut through.
+typedef struct {
+  worker_pool *pool;
+  atomic_int *counts; // runs of every index
+  int grain;
+  int nested; // inner loop length, 0 for none
+  atomic_bool bad; // a range over the grain, or a bad worker index
+} count_job;
+
+static void count_range(void *ctx, int begin, int end, int worker) {
+  count_job *job = ctx;
+  if (end - begin > job->grain || worker < 0 ||
+      worker >= pool_size(job->pool)) {
+    atomic_store(&job->bad, true);
+  }
+  for (int i = begin; i < end; ++i) {
+    if (job->nested == 0) {
+      atomic_fetch_add(&job->counts[i], 1);
+      continue;
+    }
+    count_job inner = {
+        .pool = job->pool,
+        .counts = &job->counts[i * job->nested],
+        .grain = i % 8 + 1, // rng() is not thread safe
+    };
+    parallel_for(job->pool, 0, job->nested, inner.grain, count_range,
+                 &inner);
+    if (atomic_load(&inner.bad)) {
+      atomic_store(&job->bad, true);
+    }
+  }
+}
+
+static bool counts_once(atomic_int *counts, int begin, int end) {
+  bool ok = true;
+  for (int i = begin; i < end; ++i) {
+    ok = ok && atomic_load(&counts[i]) == 1;
+  }
+  return ok;
+}
+
+static void test_workers(void) {
+  arena a;
+  init_arena(&a, 1 << 20);
+  for (int i = 0; i < ITERATIONS / 10; ++i) {
+    a.size = 0;
+    worker_pool pool;
+    pool_init(&pool, rng_range(0, 3));
+
+    // every index exactly once, in ranges no longer than the grain
+    int n = rng_range(0, 5000);
+    atomic_int *counts = calloc(n + 1, sizeof(atomic_int));
+    int begin = rng_range(0, n);
+    count_job job = {.pool = &pool, .counts = counts, .grain = 1};
+    job.grain = rng() % 2 ? rng_range(1, 8) : rng_range(1, n + 1);
+    parallel_for(&pool, begin, n, job.grain, count_range, &job);
+    CHECK(!atomic_load(&job.bad) && counts_once(counts, begin, n) &&
+              counts_once(counts, 0, 0) &&
+              (begin == 0 || atomic_load(&counts[begin - 1]) == 0),
+          "parallel_for [%d, %d) grain %d, %d workers", begin, n,
+          job.grain, pool_size(&pool));
+    free(counts);
+
+    // loops started from tasks, and two groups waited for together
+    int outer = rng_range(1, 40), inner = rng_range(1, 40);
+    counts = calloc(2 * outer * inner, sizeof(atomic_int));
+    count_job jobs[2];
+    pool_group groups[2];
+    for (int k = 0; k < 2; ++k) {
+      jobs[k] = (count_job){
+          .pool = &pool,
+          .counts = &counts[k * outer * inner],
+          .grain = rng_range(1, 4),
+          .nested = inner,
+      };
+      pool_spawn(&pool, &groups[k], 0, outer, jobs[k].grain, count_range,
+                 &jobs[k]);
+    }
+    pool_wait(&pool, &groups[1]);
+    pool_wait(&pool, &groups[0]);
+    CHECK(!atomic_load(&jobs[0].bad) && !atomic_load(&jobs[1].bad) &&
+              counts_once(counts, 0, 2 * outer * inner),
+          "nested %dx%d, %d workers", outer, inner, pool_size(&pool));
+    free(counts);
+
+    // the converted passes match their serial versions
+    test_canvas c = make_canvas(300, 70);
+    test_canvas d = copy_canvas(&c);
+    color bg = rng();
+    parallel_clear_canvas(&pool, c.canvas, bg);
+    ref_clear_canvas(d.canvas, bg);
+    CHECK(guards_intact(&c) && pixels_equal(&c, &d),
+          "parallel_clear_canvas %dx%d stride %d", c.canvas.w, c.canvas.h,
+          c.canvas.stride);
+
+    canvas_tiles tiles[2];
+    canvas *g[2] = {&c.canvas, &d.canvas};
+    for (int k = 0; k < 2; ++k) {
+      canvas_tiles_init(&tiles[k], &a, g[k]->w, g[k]->h);
+      g[k]->tiles = &tiles[k];
+      fast_clear_canvas(*g[k], ~bg);
+    }
+    for (int k = rng_range(0, 10); k > 0; --k) {
+      Rectangle r = random_rect(g[0]);
+      touch_tiles(*g[0], r.x, r.y, r.x + r.w, r.y + r.h);
+      touch_tiles(*g[1], r.x, r.y, r.x + r.w, r.y + r.h);
+    }
+    parallel_resolve_canvas(&pool, *g[0]);
+    resolve_canvas(*g[1]);
+    CHECK(guards_intact(&c) && pixels_equal(&c, &d),
+          "parallel_resolve_canvas %dx%d", c.canvas.w, c.canvas.h);
+    free_canvas(&c);
+    free_canvas(&d);
+
+    int w = rng_range(1, 67), h = rng_range(1, 90);
+    unsigned int *image = malloc(sizeof(unsigned int) * w * h);
+    unsigned int *expected = malloc(sizeof(unsigned int) * w * h);
+    for (int k = 0; k < w * h; ++k) {
+      image[k] = expected[k] = rng();
+    }
+    parallel_flip_image(&pool, image, w, h);
+    ref_flip_image(expected, w, h);
+    CHECK(memcmp(image, expected, sizeof(unsigned int) * w * h) == 0,
+          "parallel_flip_image %dx%d", w, h);
+    free(image);
+    free(expected);
+
+    pool_destroy(&pool);
+  }
+  arena_free(&a);
+}
+
+static void test_filters(void) {
+  arena a;
+  init_arena(&a, 1 << 22);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    worker_pool pool;
+    pool_init(&pool, rng_range(0, 3));
+    filters f;
+    filters_init(&f, &a, &pool, 300);
+    test_canvas src = make_canvas(300, 120);
+    test_canvas c = make_canvas(300, 120);
+    test_canvas d = copy_canvas(&c);
+
+    int kind = rng_range(0, 2);
+    if (kind == 0) {
+      filter_kernel k;
+      if (rng() % 2) {
+        box_kernel(&k, rng_range(0, FILTER_MAX_RADIUS));
+      } else {
+        gaussian_kernel(&k, rng_range(1, 50) / 10.f);
+      }
+      blur_canvas(&f, c.canvas, src.canvas, &k);
+      ref_blur(d.canvas, src.canvas, &k);
+    } else if (kind == 1) {
+      downsample_canvas(&f, c.canvas, src.canvas);
+      ref_downsample(d.canvas, src.canvas);
+    } else {
+      resize_canvas(&f, c.canvas, src.canvas);
+      ref_resize(d.canvas, src.canvas);
+    }
+
+    CHECK(guards_intact(&c), "overrun kind=%d w=%d h=%d", kind, c.canvas.w,
+          c.canvas.h);
+    CHECK(pixels_equal(&c, &d),
+          "mismatch kind=%d threads=%d %dx%d from %dx%d", kind,
+          pool_size(&pool), c.canvas.w, c.canvas.h, src.canvas.w,
+          src.canvas.h);
+    pool_destroy(&pool);
+    free_canvas(&src);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+// Winding at pixel centers from every edge crossing the row left of them.
+static void ref_fill_polygon(canvas g, const polygon *poly, const float *m,
+                             fill_rule rule, color c) {
+  for (int y = 0; y < g.h; ++y) {
+    float cy = y + 0.5f;
+    for (int x = 0; x < g.w; ++x) {
+      int winding = 0;
+      for (int s = 0; s < poly->num; ++s) {
+        int n = poly->counts[s];
+        for (int k = 0; k < n; ++k) {
+          const float *a = poly->v[s][k], *b = poly->v[s][(k + 1) % n];
+          float x0 = m ? m[0] * a[0] + m[2] * a[1] + m[4] : a[0];
+          float y0 = m ? m[1] * a[0] + m[3] * a[1] + m[5] : a[1];
+          float x1 = m ? m[0] * b[0] + m[2] * b[1] + m[4] : b[0];
+          float y1 = m ? m[1] * b[0] + m[3] * b[1] + m[5] : b[1];
+          int dir = 1;
+          if (y1 < y0) {
+            float t = x0;
+            x0 = x1, x1 = t;
+            t = y0;
+            y0 = y1, y1 = t;
+            dir = -1;
+          }
+          if (y0 <= cy && cy < y1 &&
+              x0 + (cy - y0) * ((x1 - x0) / (y1 - y0)) <= x + 0.5f) {
+            winding += dir;
+          }
+        }
+      }
+      if (rule == FILL_EVEN_ODD ? winding & 1 : winding != 0) {
+        g.pixels[y * g.stride + x] = c;
+      }
+    }
+  }
+}
+
+typedef struct {
+  float v[PATH_MAX_SEGMENTS + 1][2];
+  int n;
+} polyline;
+
+static void add_polyline_point(void *ctx, float x0, float y0, float x1,
+                               float y1) {
+  polyline *l = ctx;
+  if (l->n == 0) {
+    l->v[l->n][0] = x0;
+    l->v[l->n++][1] = y0;
+  }
+  CHECK(x0 == l->v[l->n - 1][0] && y0 == l->v[l->n - 1][1],
+        "flattened segments are not connected");
+  if (l->n <= PATH_MAX_SEGMENTS) {
+    l->v[l->n][0] = x1;
+    l->v[l->n++][1] = y1;
+  }
+}
+
+static float segment_distance(const float *a, const float *b, float x,
+                              float y) {
+  float dx = b[0] - a[0], dy = b[1] - a[1];
+  float len = dx * dx + dy * dy;
+  float t = len > 0 ? ((x - a[0]) * dx + (y - a[1]) * dy) / len : 0;
+  t = fmaxf(0.f, fminf(1.f, t));
+  return hypotf(a[0] + t * dx - x, a[1] + t * dy - y);
+}
+
+// Filled polygons have to match the winding at every pixel center exactly,
+// and flattened curves have to stay within the tolerance of the curve.
+static void test_paths(void) {
+  arena a;
+  init_arena(&a, 1 << 16);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    path p;
+    path_init(&p, &a, MAX_SUBPATHS * (MAX_POLY_POINTS + 1),
+              MAX_SUBPATHS * MAX_POLY_POINTS);
+    path_raster r;
+    path_raster_init(&r, &a, 256);
+    test_canvas c = make_canvas(97, 61);
+    test_canvas d = copy_canvas(&c);
+    canvas *g = &c.canvas;
+
+    polygon poly;
+    random_polygon(&poly, &p, g->w, g->h);
+    float m[6];
+    for (int k = 0; k < 6; ++k) {
+      m[k] = rng_float() / 10.f;
+    }
+    m[0] += 1.f;
+    m[3] += 1.f;
+    const float *xf = rng() % 2 ? m : NULL;
+    g->color = 0xff000000 | rng();
+    CHECK(fill_path(&r, *g, &p, xf) == 0, "edges overflowed");
+    ref_fill_polygon(d.canvas, &poly, xf, p.rule, g->color);
+    CHECK(guards_intact(&c), "overrun w=%d h=%d", g->w, g->h);
+    CHECK(pixels_equal(&c, &d), "mismatch rule=%d w=%d h=%d stride=%d",
+          p.rule, g->w, g->h, g->stride);
+
+    // a full raster draws nothing
+    path_raster small;
+    path_raster_init(&small, &a, 1);
+    path_reset(&p);
+    path_move_to(&p, -5, -5);
+    path_line_to(&p, g->w + 5, g->h / 2.f);
+    path_line_to(&p, -5, g->h + 5);
+    memcpy(d.buffer, c.buffer, sizeof(color) * (c.size + 2 * GUARD));
+    CHECK(fill_path(&small, *g, &p, NULL) == -1, "overflow not reported");
+    CHECK(pixels_equal(&c, &d), "overflowing path was drawn");
+
+    float v[8];
+    for (int k = 0; k < 8; ++k) {
+      v[k] = rng_float() * 10.f;
+    }
+    bool cubic = rng() % 2;
+    float tolerance = rng_range(5, 200) / 100.f;
+    path_reset(&p);
+    path_move_to(&p, v[0], v[1]);
+    if (cubic) {
+      path_cubic_to(&p, v[2], v[3], v[4], v[5], v[6], v[7]);
+    } else {
+      path_quad_to(&p, v[2], v[3], v[4], v[5]);
+    }
+    polyline line = {.n = 0};
+    path_flatten(&p, NULL, tolerance, add_polyline_point, &line);
+    float *end = cubic ? &v[6] : &v[4];
+    bool closed = line.n > 1 && line.v[line.n - 1][0] == v[0] &&
+                  line.v[line.n - 1][1] == v[1];
+    CHECK(line.n >= 2 && line.v[0][0] == v[0] && line.v[0][1] == v[1],
+          "curve does not start at its first point");
+    CHECK(line.n >= 3 && closed && line.v[line.n - 2][0] == end[0] &&
+              line.v[line.n - 2][1] == end[1],
+          "curve does not end at its last point or is not closed");
+    float worst = 0;
+    for (int k = 0; k <= 1000; ++k) {
+      float t = k / 1000.f, s = 1.f - t, x, y;
+      if (cubic) {
+        x = s * s * s * v[0] + 3 * s * s * t * v[2] + 3 * s * t * t * v[4] +
+            t * t * t * v[6];
+        y = s * s * s * v[1] + 3 * s * s * t * v[3] + 3 * s * t * t * v[5] +
+            t * t * t * v[7];
+      } else {
+        x = s * s * v[0] + 2 * s * t * v[2] + t * t * v[4];
+        y = s * s * v[1] + 2 * s * t * v[3] + t * t * v[5];
+      }
+      float best = INFINITY;
+      for (int j = 0; j + 2 < line.n; ++j) {
+        best = fminf(best, segment_distance(line.v[j], line.v[j + 1], x, y));
+      }
+      worst = fmaxf(worst, best);
+    }
+    CHECK(worst <= tolerance + 1e-3f,
+          "%s is %g from its lines, tolerance %g", cubic ? "cubic" : "quad",
+          worst, tolerance);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+typedef struct {
+  float x, y, vx, vy, life, fade;
+  color color;
+} ref_particle;
+
+// Emission order, with the same window the ring keeps.
+typedef struct {
+  ref_particle *all;
+  uint32_t num;
+  uint32_t count;
+} ref_particles;
+
+static void ref_particles_update(ref_particles *r, float gravity, float dt) {
+  for (uint32_t j = r->num - r->count; j < r->num; ++j) {
+    ref_particle *q = &r->all[j];
+    if (q->life > 0) {
+      q->vy = q->vy + gravity * dt;
+      q->x = q->x + q->vx * dt;
+      q->y = q->y + q->vy * dt;
+      q->life = q->life - dt;
+    }
+  }
+  while (r->count > 0 && !(r->all[r->num - r->count].life > 0)) {
+    r->count--;
+  }
+}
+
+static void ref_particles_draw(const ref_particles *r, canvas g, int size,
+                               float view_x, float view_y, float zoom) {
+  for (uint32_t j = r->num - r->count; j < r->num; ++j) {
+    const ref_particle *q = &r->all[j];
+    float px = floorf((q->x - view_x) * zoom);
+    float py = floorf((q->y - view_y) * zoom);
+    if (!(q->life > 0) || !(px >= 0 && px < g.w && py >= 0 && py < g.h)) {
+      continue;
+    }
+    uint32_t f = q->life * q->fade * 256.f;
+    for (int y = py; y < py + size && y < g.h; ++y) {
+      for (int x = px; x < px + size && x < g.w; ++x) {
+        color *d = &g.pixels[y * g.stride + x];
+        color out = 0;
+        for (int s = 0; s < 32; s += 8) {
+          uint32_t v = (((q->color >> s) & 0xff) * f >> 8) + ((*d >> s) & 0xff);
+          out |= (v > 255 ? 255 : v) << s;
+        }
+        *d = out;
+      }
+    }
+  }
+}
+
+// The ring has to keep exactly the particles and motion of a plain list of
+// everything emitted, and splat them like a scalar loop, through wrap
+// around, deaths in the middle of the window and lazily cleared tiles.
+static void test_particles(void) {
+  arena a;
+  init_arena(&a, 1 << 16);
+  for (int i = 0; i < ITERATIONS / 5; ++i) {
+    a.size = 0;
+    uint32_t capacity = 8u << rng_range(0, 5);
+    particles ps;
+    particles_init(&ps, &a, capacity);
+    ps.gravity = rng_float() * 10.f;
+    ps.size = rng_range(1, PARTICLE_MAX_SIZE);
+    ref_particles ref = {.all = malloc(sizeof(ref_particle) * capacity * 8)};
+
+    test_canvas c = make_canvas(97, 61);
+    test_canvas d = copy_canvas(&c);
+    canvas *g = &c.canvas;
+    canvas_tiles tiles;
+    if (rng() % 2) {
+      canvas_tiles_init(&tiles, &a, g->w, g->h);
+      g->tiles = &tiles;
+    }
+    float view_x = rng_float(), view_y = rng_float();
+    float zoom = rng_range(5, 30) / 10.f;
+
+    bool ok = true;
+    for (int frame = 0; frame < 8; ++frame) {
+      int n = rng_range(0, capacity * 3 / 4);
+      for (int k = 0; k < n; ++k) {
+        ref_particle q = {
+            .x = rng_range(-10, g->w / zoom + 10) + rng_float() / 10.f,
+            .y = rng_range(-10, g->h / zoom + 10) + rng_float() / 10.f,
+            .vx = rng_float() * 2.f,
+            .vy = rng_float() * 2.f,
+            .life = rng_range(1, 40) / 10.f,
+            .color = rng(),
+        };
+        q.fade = 1.f / q.life;
+        particles_emit(&ps, q.x, q.y, q.vx, q.vy, q.life, q.color);
+        ref.all[ref.num++] = q;
+        ref.count = ref.count < capacity ? ref.count + 1 : capacity;
+      }
+      float dt = rng_range(0, 50) / 100.f;
+      particles_update(&ps, dt);
+      ref_particles_update(&ref, ps.gravity, dt);
+
+      ok = ok && ps.count == ref.count && ps.head == ref.num;
+      for (uint32_t j = ref.num - ref.count; ok && j < ref.num; ++j) {
+        uint32_t k = j & (capacity - 1);
+        const ref_particle *q = &ref.all[j];
+        ok = ps.x[k] == q->x && ps.y[k] == q->y && ps.vy[k] == q->vy &&
+             ps.life[k] == q->life;
+      }
+    }
+    CHECK(ok, "ring differs from the list, capacity %u count %u/%u",
+          capacity, ps.count, ref.count);
+
+    color bg = rng();
+    if (g->tiles != NULL) {
+      fast_clear_canvas(*g, bg);
+    } else {
+      ref_clear_canvas(*g, bg);
+    }
+    ref_clear_canvas(d.canvas, bg);
+    particles_draw(&ps, *g, view_x, view_y, zoom);
+    resolve_canvas(*g);
+    ref_particles_draw(&ref, d.canvas, ps.size, view_x, view_y, zoom);
+    CHECK(guards_intact(&c), "overrun w=%d h=%d size=%d", g->w, g->h,
+          ps.size);
+    CHECK(pixels_equal(&c, &d), "mismatch w=%d h=%d size=%d tiles=%d", g->w,
+          g->h, ps.size, g->tiles != NULL);
+
+    free(ref.all);
+    free_canvas(&c);
+    free_canvas(&d);
+  }
+  arena_free(&a);
+}
+
+// Whether a view shows the canvas c, whose pixels are a private copy of
+// what was published.
+static bool frame_matches(const frame_view *v, canvas c, uint64_t frame,
+                          uint64_t timestamp) {
+  int size = pixel_size(c.format);
+  if (v->frame != frame || v->timestamp != timestamp || v->width != c.w ||
+      v->height != c.h || v->stride != c.stride * size ||
+      v->format != c.format) {
+    return false;
+  }
+  const uint8_t *pixels = v->pixels;
+  for (int y = 0; y < c.h; ++y) {
+    if (memcmp(pixels + (size_t)y * v->stride,
+               c.pixels8 + (size_t)y * c.stride * size,
+               (size_t)c.w * size) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_frame_ring(void) {
+  char name[64];
+  snprintf(name, sizeof(name), "/drawing-tests-%d", (int)getpid());
+  for (int i = 0; i < ITERATIONS / 25; ++i) {
+    int slots = rng_range(2, 5);
+    int max_w = rng_range(1, 67), max_h = rng_range(1, 19);
+    frame_ring w, r;
+    if (frame_ring_create(&w, name, slots, sizeof(color) * max_w * max_h) !=
+            0 ||
+        frame_ring_open(&r, name) != 0) {
+      CHECK(false, "ring %s: %s", name, strerror(errno));
+      frame_ring_close(&w);
+      return;
+    }
+
+    frame_view v;
+    CHECK(frame_ring_head(&r) == 0 && frame_ring_acquire(&r, 0, &v) != 0,
+          "empty ring has a frame");
+
+    int frames = rng_range(slots, 4 * slots);
+    canvas *sent = malloc(sizeof(canvas) * frames);
+    uint64_t *times = malloc(sizeof(uint64_t) * frames);
+    frame_view *views = malloc(sizeof(frame_view) * frames);
+    bool ok = true;
+    for (int n = 0; n < frames; ++n) {
+      uint8_t *slot = frame_ring_begin(&w);
+      // a frame is gone as soon as its slot is claimed again
+      if (n >= slots) {
+        ok = ok && !frame_ring_check(&views[n - slots]) &&
+             frame_ring_acquire(&r, n - slots, &v) != 0;
+      }
+
+      canvas c = {
+          .w = rng_range(1, max_w),
+          .h = rng_range(1, max_h),
+          .format = rng_range(0, NUM_PIXEL_FORMATS - 1),
+      };
+      c.stride = c.w + rng_range(0, max_w - c.w);
+      int size = pixel_size(c.format);
+      size_t bytes = (size_t)c.stride * size * c.h;
+      sent[n] = c;
+      sent[n].pixels8 = calloc(bytes, 1);
+      // drawn in place, or published from a buffer of its own
+      uint8_t *own = rng() % 2 ? malloc(bytes) : NULL;
+      c.pixels8 = own != NULL ? own : slot;
+      for (int y = 0; y < c.h; ++y) {
+        for (int x = 0; x < c.w * size; ++x) {
+          size_t k = (size_t)y * c.stride * size + x;
+          c.pixels8[k] = sent[n].pixels8[k] = rng();
+        }
+      }
+
+      times[n] = rng();
+      ok = frame_ring_publish(&w, c, times[n]) == 0 && ok &&
+           frame_ring_head(&r) == (uint64_t)n + 1 &&
+           frame_ring_acquire(&r, n, &views[n]) == 0 &&
+           frame_matches(&views[n], sent[n], n, times[n]) &&
+           frame_ring_acquire(&r, n + 1, &v) != 0;
+      free(own);
+    }
+    // the last slots frames are all still readable in place
+    for (int n = frames - slots; n < frames; ++n) {
+      ok = ok && frame_ring_check(&views[n]) &&
+           frame_matches(&views[n], sent[n], n, times[n]);
+    }
+    CHECK(ok, "frames differ, %d slots of %dx%d, %d frames", slots, max_w,
+          max_h, frames);
+
+    color pixel = 0;
+    canvas big = {.pixels = &pixel, .h = 1};
+    big.w = big.stride = w.header->pixel_capacity / sizeof(color) + 1;
+    frame_ring_begin(&w);
+    CHECK(frame_ring_publish(&w, big, 0) != 0 &&
+              frame_ring_head(&r) == (uint64_t)frames,
+          "frame larger than a slot published");
+
+    frame_ring_close(&r);
+    frame_ring_close(&w);
+    CHECK(frame_ring_open(&r, name) != 0, "ring %s not removed", name);
+    for (int n = 0; n < frames; ++n) {
+      free(sent[n].pixels8);
+    }
+    free(sent);
+    free(times);
+    free(views);
+  }
+}
+
+static void random_floats(float *v, int n) {
+  for (int i = 0; i < n; ++i) {
+    v[i] = rng_float();
+  }
+}
+
+// Every table entry of object id, as new_object takes them.
+static void object_values(objid id, float v[12]) {
+  float values[15];
+  calc_next_pos(id, 0, values);
+  memcpy(v, values, sizeof(float) * 9);
+  memcpy(&v[9], &values[12], sizeof(float) * 3);
+}
+
+static bool objects_equal(const float *expected, size_t n) {
+  for (size_t id = 0; id < n; ++id) {
+    float v[12];
+    object_values(id, v);
+    if (memcmp(v, &expected[id * 12], sizeof(v)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_replay(void) {
+  char file[64];
+  snprintf(file, sizeof(file), "/tmp/drawing-tests-%d.rec", (int)getpid());
+  for (int i = 0; i < ITERATIONS / 25; ++i) {
+    // around a 64x48 canvas, including sizes that are not positive
+    int width = rng_range(-2, 70), height = rng_range(-2, 52);
+    uint32_t seed = rng(), modes = rng();
+    double dts[4];
+    input_event events[MAX_FRAME_EVENTS];
+    int frames = rng_range(0, 4);
+    recording rec;
+    if (record_open(&rec, file, seed, modes, width, height) != 0) {
+      CHECK(false, "record %s: %s", file, strerror(errno));
+      break;
+    }
+    for (int f = 0; f < frames; ++f) {
+      dts[f] = rng() / (double)UINT32_MAX;
+      record_frame(&rec, dts[f], events, 0);
+    }
+    CHECK(recording_close(&rec) == 0, "close %s: %s", file, strerror(errno));
+
+    bool fits = width > 0 && height > 0 && width <= 64 && height <= 48;
+    errno = 0;
+    int err = replay_open(&rec, file, 64, 48);
+    CHECK((err == 0) == fits && (err == 0 || errno == EINVAL),
+          "%dx%d recording %s", width, height, err == 0 ? "opened" : "refused");
+    if (err != 0) {
+      continue;
+    }
+    CHECK(rec.seed == seed && rec.modes == modes && rec.width == width &&
+              rec.height == height,
+          "header read back as seed %u, modes %x, %dx%d", (unsigned)rec.seed,
+          (unsigned)rec.modes, (int)rec.width, (int)rec.height);
+    uint16_t num_events;
+    double dt;
+    for (int f = 0; f < frames; ++f) {
+      CHECK(replay_frame(&rec, &dt, events, &num_events) == 1 &&
+                dt == dts[f] && num_events == 0,
+            "frame %d of %d", f, frames);
+    }
+    CHECK(replay_frame(&rec, &dt, events, &num_events) == 0,
+          "frames past the %d recorded", frames);
+    recording_close(&rec);
+  }
+  remove(file);
+}
+
+static void test_snapshot(void) {
+  char file[64], tmp[80];
+  snprintf(file, sizeof(file), "/tmp/drawing-tests-%d.snap", (int)getpid());
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  arena a;
+  init_arena(&a, 1 << 20); // room for the largest tables
+  for (int i = 0; i < ITERATIONS / 25; ++i) {
+    a.size = 0;
+    size_t n = rng_range(0, 1500);
+    float *expected = malloc(sizeof(float) * 12 * (n + 1));
+    init_motion_tables(&a, n);
+    for (size_t id = 0; id < n; ++id) {
+      random_floats(&expected[id * 12], 12);
+      new_object(&expected[id * 12]);
+    }
+    snapshot_info info = {.seed = rng(), .width = rng(), .height = rng()};
+    if (save_snapshot(file, &info) != 0) {
+      CHECK(false, "save %s: %s", file, strerror(errno));
+      free(expected);
+      break;
+    }
+    CHECK(access(tmp, F_OK) != 0, "%s left behind", tmp);
+
+    // the tables in memory are replaced, not merged
+    a.size = 0;
+    init_motion_tables(&a, n + 1);
+    float other[12];
+    random_floats(other, 12);
+    for (size_t id = 0; id <= n; ++id) {
+      new_object(other);
+    }
+
+    snapshot_info loaded;
+    CHECK(map_snapshot(file, &loaded) == 0 && loaded.num_objects == n &&
+              loaded.seed == info.seed && loaded.width == info.width &&
+              loaded.height == info.height && num_objects() == n &&
+              objects_equal(expected, n),
+          "%zu objects differ after mapping", n);
+
+    // changes stay in memory
+    if (n > 0) {
+      update_position(rng() % n, other);
+      unmap_snapshot();
+      CHECK(map_snapshot(file, &loaded) == 0 && objects_equal(expected, n),
+            "mapped tables written back, %zu objects", n);
+    }
+
+    // a truncated copy is refused and leaves the mapped tables alone
+    FILE *fp = fopen(file, "rb");
+    size_t size = 4096 * (n > 0 ? rng_range(1, 4) : 0) + rng_range(0, 100);
+    char *bytes = malloc(size);
+    size = fread(bytes, 1, size, fp);
+    fclose(fp);
+    fp = fopen(tmp, "wb");
+    fwrite(bytes, 1, size, fp);
+    fclose(fp);
+    CHECK(map_snapshot(tmp, &loaded) != 0 && errno == EINVAL &&
+              num_objects() == n && objects_equal(expected, n),
+          "snapshot of %zu objects mapped from %zu bytes", n, size);
+    remove(tmp);
+    free(bytes);
+
+    unmap_snapshot();
+    free(expected);
+  }
+  remove(file);
+  arena_free(&a);
+}
+
+static float rng_between(float min, float max) {
+  return min + (max - min) * (rng() / (float)UINT32_MAX);
+}
+
+// One tick of one coordinate, written out plainly.
+static void ref_step_fixed(fixed a, fixed *v, fixed *p, fixed size,
+                           fixed bound) {
+  fixed nv = *v + (fixed)floor((a + 128) / 256.0);
+  fixed np = *p + (fixed)floor((nv + 128) / 256.0);
+  bool out = np < 0 || np + size > bound;
+  *v = out ? -nv : nv;
+  *p = out ? *p : np;
+}
+
+typedef struct {
+  int ticks;
+  fixed w, h;
+} fixed_job;
+
+static void fixed_range(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  fixed_job *job = ctx;
+  step_fixed(begin, end, job->ticks, job->w, job->h);
+}
+
+static void test_fixed(void) {
+  arena a;
+  init_arena(&a, 1 << 20); // room for the largest tables
+  fixed *ref[NUM_FX], *start[NUM_FX];
+  for (int i = 0; i < ITERATIONS / 10; ++i) {
+    a.size = 0;
+    size_t n = rng_range(0, 300);
+    int w = rng_range(60, 2000), h = rng_range(60, 2000);
+    init_motion_tables(&a, n);
+    for (size_t id = 0; id < n; ++id) {
+      // a pixel of slack for rounding to fixed point
+      float sx = rng_between(1, 50), sy = rng_between(1, 50);
+      new_object((float[12]){
+          rng_between(-500, 500), rng_between(-500, 500), 0,
+          rng_between(-250, 250), rng_between(-250, 250), 0,
+          rng_between(0, w - sx - 1), rng_between(0, h - sy - 1), 0,
+          sx, sy, 0,
+      });
+    }
+    init_fixed_tables(&a, n);
+    load_fixed_tables();
+    for (int t = 0; t < NUM_FX; ++t) {
+      ref[t] = malloc(sizeof(fixed) * (n + 1));
+      start[t] = malloc(sizeof(fixed) * (n + 1));
+      memcpy(ref[t], fixed_tables[t], sizeof(fixed) * n);
+      memcpy(start[t], fixed_tables[t], sizeof(fixed) * n);
+    }
+
+    // a random range against the reference, the rest left alone
+    size_t begin = rng_range(0, n), end = rng_range(begin, n);
+    int ticks = rng_range(0, 40);
+    fixed fw = w << FIXED_SHIFT, fh = h << FIXED_SHIFT;
+    step_fixed(begin, end, ticks, fw, fh);
+    for (size_t id = begin; id < end; ++id) {
+      for (int k = 0; k < ticks; ++k) {
+        ref_step_fixed(ref[FX_AX][id], &ref[FX_VX][id], &ref[FX_PX][id],
+                       ref[FX_W][id], fw);
+        ref_step_fixed(ref[FX_AY][id], &ref[FX_VY][id], &ref[FX_PY][id],
+                       ref[FX_H][id], fh);
+      }
+    }
+    bool ok = true;
+    for (int t = 0; t < NUM_FX; ++t) {
+      ok = ok && memcmp(ref[t], fixed_tables[t], sizeof(fixed) * n) == 0;
+    }
+    CHECK(ok, "%d ticks of [%zu, %zu) of %zu objects differ", ticks, begin,
+          end, n);
+
+    // objects stay inside the world
+    ok = true;
+    for (size_t id = 0; id < n; ++id) {
+      ok = ok && fixed_tables[FX_PX][id] >= 0 &&
+           fixed_tables[FX_PX][id] + fixed_tables[FX_W][id] <= fw &&
+           fixed_tables[FX_PY][id] >= 0 &&
+           fixed_tables[FX_PY][id] + fixed_tables[FX_H][id] <= fh;
+    }
+    CHECK(ok, "objects left the %d x %d world", w, h);
+
+    // however the objects are split over threads, the bits are the same
+    for (int t = 0; t < NUM_FX; ++t) {
+      memcpy(fixed_tables[t], start[t], sizeof(fixed) * n);
+    }
+    step_fixed(0, n, ticks, fw, fh);
+    for (int t = 0; t < NUM_FX; ++t) {
+      memcpy(ref[t], fixed_tables[t], sizeof(fixed) * n);
+      memcpy(fixed_tables[t], start[t], sizeof(fixed) * n);
+    }
+    worker_pool pool;
+    pool_init(&pool, rng_range(0, 3));
+    fixed_job job = {.ticks = ticks, .w = fw, .h = fh};
+    parallel_for(&pool, 0, n, rng_range(1, 20), fixed_range, &job);
+    pool_destroy(&pool);
+    ok = true;
+    for (int t = 0; t < NUM_FX; ++t) {
+      ok = ok && memcmp(ref[t], fixed_tables[t], sizeof(fixed) * n) == 0;
+    }
+    CHECK(ok, "%zu objects split over threads differ", n);
+
+    // velocities and positions make it back to the float tables
+    store_fixed_tables();
+    ok = true;
+    for (size_t id = 0; id < n; ++id) {
+      float v[12];
+      object_values(id, v);
+      ok = ok && v[3] * FIXED_ONE == fixed_tables[FX_VX][id] &&
+           v[7] * FIXED_ONE == fixed_tables[FX_PY][id];
+    }
+    CHECK(ok, "%zu objects stored back differ", n);
+
+    for (int t = 0; t < NUM_FX; ++t) {
+      free(ref[t]);
+      free(start[t]);
+    }
+  }
+  arena_free(&a);
+}
+
+// Boxes in a 1000 x 1000 world, some of them points or slivers.
+static aabb random_box(void) {
+  float x = rng() % 100000 / 100.f;
+  float y = rng() % 100000 / 100.f;
+  float w = rng() % 4 == 0 ? 0 : rng() % 5000 / 100.f;
+  float h = rng() % 4 == 0 ? 0 : rng() % 5000 / 100.f;
+  return (aabb){x, y, x + w, y + h};
+}
+
+// Where the ray enters box, or INFINITY when it misses it.
+static float ref_ray_box(aabb box, float x, float y, float dx, float dy,
+                         float max_t) {
+  float ix = 1.f / (fabsf(dx) > 1e-30f ? dx : copysignf(1e-30f, dx));
+  float iy = 1.f / (fabsf(dy) > 1e-30f ? dy : copysignf(1e-30f, dy));
+  float tx0 = (box.x0 - x) * ix, tx1 = (box.x1 - x) * ix;
+  float ty0 = (box.y0 - y) * iy, ty1 = (box.y1 - y) * iy;
+  float near = fmaxf(fmaxf(fminf(tx0, tx1), 0), fminf(ty0, ty1));
+  float far = fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1));
+  return near <= far && near <= max_t ? near : INFINITY;
+}
+
+// The items a query reported against a scan over every box.
+static void check_hits(const aabb *boxes, uint32_t n, aabb query,
+                       const uint32_t *items, uint32_t count, bool *seen,
+                       const char *what) {
+  memset(seen, 0, n);
+  bool ok = true;
+  for (uint32_t i = 0; i < count; ++i) {
+    ok = ok && items[i] < n && !seen[items[i]];
+    if (items[i] < n) {
+      seen[items[i]] = true;
+    }
+  }
+  uint32_t expected = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    bool hit = aabb_overlaps(boxes[i], query);
+    expected += hit;
+    ok = ok && hit == seen[i];
+  }
+  CHECK(ok && count == expected,
+        "%s (%g, %g, %g, %g) over %u boxes: %u hits, expected %u", what,
+        query.x0, query.y0, query.x1, query.y1, n, count, expected);
+}
+
+static void test_bvh(void) {
+  const uint32_t max_items = 3000;
+  arena a;
+  init_arena(&a, bvh_size(max_items) + WORD_SIZE);
+  bvh b;
+  CHECK(bvh_init(&b, &a, max_items) == 0, "init %u items", max_items);
+  aabb *boxes = malloc(sizeof(aabb) * max_items);
+  uint32_t *items = malloc(sizeof(uint32_t) * max_items);
+  bool *seen = malloc(max_items);
+
+  for (int i = 0; i < ITERATIONS / 10; ++i) {
+    uint32_t n = rng() % 4 == 0 ? rng_range(0, 6) : rng_range(0, max_items);
+    for (uint32_t j = 0; j < n; ++j) {
+      boxes[j] = random_box();
+    }
+    CHECK(bvh_build(&b, boxes, n) == 0, "build %u boxes", n);
+    CHECK(b.num_nodes <= (n > 1 ? n : 1), "%u nodes for %u boxes",
+          b.num_nodes, n);
+
+    // the same queries again once the boxes moved and the tree was refit
+    for (int pass = 0; pass < 2; ++pass) {
+      for (int q = 0; q < 20; ++q) {
+        // points on box corners hit the closed edges
+        float x = rng() % 100000 / 100.f;
+        float y = rng() % 100000 / 100.f;
+        if (n > 0 && rng() % 2) {
+          x = boxes[rng() % n].x1;
+          y = boxes[rng() % n].y0;
+        }
+        uint32_t max_out = rng() % 8 == 0 ? rng_range(0, 3) : max_items;
+        uint32_t count = bvh_query_point(&b, x, y, items, max_out);
+        if (max_out == max_items) {
+          check_hits(boxes, n, (aabb){x, y, x, y}, items, count, seen,
+                     "point");
+        } else {
+          // only the count is known when the output is cut short
+          uint32_t full = bvh_query_point(&b, x, y, items, max_items);
+          CHECK(count == full, "%u hits with %u slots, %u with all", count,
+                max_out, full);
+        }
+
+        aabb r = random_box();
+        count = bvh_query_rect(&b, r, items, max_items);
+        check_hits(boxes, n, r, items, count, seen, "rect");
+
+        float dx = rng() % 3 == 0 ? 0 : rng_float();
+        float dy = dx == 0 || rng() % 3 ? rng_float() : 0;
+        float max_t = rng() % 2 ? INFINITY : rng_range(1, 200);
+        float t = -1;
+        uint32_t hit = bvh_raycast(&b, x, y, dx, dy, max_t, &t);
+        float nearest = INFINITY;
+        for (uint32_t j = 0; j < n; ++j) {
+          nearest = fminf(nearest, ref_ray_box(boxes[j], x, y, dx, dy, max_t));
+        }
+        CHECK(hit == BVH_NONE ? nearest == INFINITY
+                              : hit < n && t == nearest &&
+                                    ref_ray_box(boxes[hit], x, y, dx, dy,
+                                                max_t) == t,
+              "ray (%g, %g) + t (%g, %g) up to %g: item %u at %g, expected "
+              "%g",
+              x, y, dx, dy, max_t, hit, t, nearest);
+      }
+
+      for (uint32_t j = 0; j < n; ++j) {
+        float dx = rng_float() * 10, dy = rng_float() * 10;
+        boxes[j] = (aabb){boxes[j].x0 + dx, boxes[j].y0 + dy,
+                          boxes[j].x1 + dx, boxes[j].y1 + dy};
+      }
+      bvh_refit(&b, boxes);
+    }
+  }
+
+  // scattering the boxes loosens the tree until it asks to be rebuilt
+  uint32_t n = 2000;
+  for (uint32_t j = 0; j < n; ++j) {
+    boxes[j] = random_box();
+  }
+  bvh_build(&b, boxes, n);
+  CHECK(!bvh_degraded(&b), "degraded right after the build");
+  for (uint32_t j = 0; j < n; ++j) {
+    boxes[j] = random_box();
+  }
+  bvh_refit(&b, boxes);
+  CHECK(bvh_degraded(&b), "cost %g, %g at the build", b.cost, b.built_cost);
+  bvh_build(&b, boxes, n);
+  CHECK(!bvh_degraded(&b), "degraded after the rebuild");
+  CHECK(bvh_build(&b, boxes, max_items + 1) != 0, "built past capacity");
+
+  free(seen);
+  free(items);
+  free(boxes);
+  arena_free(&a);
+}
+
+static void test_linmath(void) {
+  // one float of slack on each side keeps the loads unaligned and checked
+  float buf_a[18], buf_b[18], buf_r[18];
+  for (int i = 0; i < ITERATIONS; ++i) {
+    int off = rng_range(0, 1);
+    float *A = buf_a + off, *B = buf_b + off, *R = buf_r + off;
+    random_floats(buf_a, 18);
+    random_floats(buf_b, 18);
+    buf_r[off + 16] = buf_r[0] = 12345.f;
+
+    // R = B * A with row-major storage
+    matrix_multiply_4x4(R, A, B);
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        float expected = 0;
+        for (int k = 0; k < 4; ++k) {
+          expected += B[r * 4 + k] * A[k * 4 + c];
+        }
+        CHECK(near(R[r * 4 + c], expected), "matrix_multiply_4x4 [%d][%d]",
+              r, c);
+      }
+    }
+    CHECK(buf_r[off + 16] == 12345.f && (off == 0 || buf_r[0] == 12345.f),
+          "matrix_multiply_4x4 overrun");
+
+    matmult_vec_4x4(A, B, R);
+    for (int r = 0; r < 4; ++r) {
+      float expected = 0;
+      for (int k = 0; k < 4; ++k) {
+        expected += A[r * 4 + k] * B[k];
+      }
+      CHECK(near(R[r], expected), "matmult_vec_4x4 [%d]", r);
+    }
+
+    matrix_multiply_1x4_4x4(A, B, R);
+    for (int c = 0; c < 4; ++c) {
+      float expected = 0;
+      for (int k = 0; k < 4; ++k) {
+        expected += A[k] * B[k * 4 + c];
+      }
+      CHECK(near(R[c], expected), "matrix_multiply_1x4_4x4 [%d]", c);
+    }
+
+    float s = rng_float();
+    mat4_scale(R, A, s);
+    for (int k = 0; k < 16; ++k) {
+      CHECK(R[k] == A[k] * s, "mat4_scale [%d]", k);
+    }
+
+    mat4x4_dup(R, A);
+    CHECK(memcmp(R, A, sizeof(mat4)) == 0, "mat4x4_dup");
+
+    mat4_from_vec4_mul_outer(R, A, B);
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        CHECK(R[r * 4 + c] == A[r] * B[c], "mat4_from_vec4_mul_outer");
+      }
+    }
+
+    // normalize in place as well as into a separate vector
+    vec4 src, dest;
+    memcpy(src, A, sizeof(vec4));
+    float len = sqrtf(src[0] * src[0] + src[1] * src[1] + src[2] * src[2] +
+                      src[3] * src[3]);
+    normalize_vec4(dest, src);
+    normalize_vec4(src, src);
+    for (int k = 0; k < 4; ++k) {
+      CHECK(near(dest[k], A[k] / len), "normalize_vec4 [%d]", k);
+      CHECK(src[k] == dest[k], "normalize_vec4 in place [%d]", k);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  rng_state = argc > 1 ? strtoull(argv[1], NULL, 10) : 0x9e3779b97f4a7c15ull;
+  if (rng_state == 0) {
+    rng_state = 1;
+  }
+  printf("tests: seed %llu\n", (unsigned long long)rng_state);
+
+  struct {
+    const char *name;
+    void (*func)(void);
+  } tests[] = {
+      {"clear_canvas", test_clear_canvas},
+      {"draw_rectangle", test_draw_rectangle},
+      {"clipping", test_clipping},
+      {"flip_image", test_flip_image},
+      {"arena", test_arena},
+      {"profiler", test_profiler},
+      {"resolution", test_resolution},
+      {"hud_panel", test_hud_panel},
+      {"hud_text", test_hud_text},
+      {"scene_bounds", test_scene_bounds},
+      {"front_to_back", test_front_to_back},
+      {"fast_clear", test_fast_clear},
+      {"composite_over", test_composite_over},
+      {"layers", test_layers},
+      {"pixel_formats", test_pixel_formats},
+      {"tiled", test_tiled},
+      {"shade", test_shade},
+      {"depth", test_depth},
+      {"msaa", test_msaa},
+      {"blit", test_blit},
+      {"workers", test_workers},
+      {"filters", test_filters},
+      {"paths", test_paths},
+      {"particles", test_particles},
+      {"frame_ring", test_frame_ring},
+      {"replay", test_replay},
+      {"snapshot", test_snapshot},
+      {"fixed", test_fixed},
+      {"bvh", test_bvh},
+      {"linmath", test_linmath},
+  };
+
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+    int before = failures;
+    tests[i].func();
+    printf("%-16s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+  }
+
+  if (failures > 0) {
+    printf("tests: %d failures\n", failures);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
+// Matrix demos kept from before the conformance suite, not run by main.
+
 int main2() {
   int size = 4; // Matrix size is fixed to 4x4
   mat4 A, B, C;